@@ -0,0 +1,177 @@
+/*
+ *
+ * Copyright (c) 2018 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "benchmarks/bench_util.h"
+
+int create_loopback_listener(uint16_t *port) {
+    struct sockaddr_in sa;
+    socklen_t salen = sizeof(sa);
+    int fd, one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = 0;
+
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+            listen(fd, 16) < 0 ||
+            getsockname(fd, (struct sockaddr *)&sa, &salen) < 0) {
+        close(fd);
+        return -1;
+    }
+    *port = ntohs(sa.sin_port);
+    return fd;
+}
+
+pid_t start_bench_process(char *binary, char *config, char *logfile) {
+    pid_t pid;
+    int fd;
+
+    pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+
+    fd = open(logfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+    }
+    execl(binary, binary, "-c", config, (char *)NULL);
+    fprintf(stderr, "unable to run %s: %s\n", binary, strerror(errno));
+    _exit(1);
+}
+
+int measure_thread_cpu(pid_t pid, thread_cpu_t *groups, int maxgroups) {
+
+    char path[256], comm[64], stat[1024];
+    char *p;
+    DIR *dir;
+    struct dirent *ent;
+    FILE *f;
+    unsigned long utime, stime;
+    long ticks = sysconf(_SC_CLK_TCK);
+    int ngroups = 0, i, len;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+    dir = opendir(path);
+    if (dir == NULL) {
+        return 0;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "/proc/%d/task/%s/comm", (int)pid,
+                ent->d_name);
+        f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        if (fgets(comm, sizeof(comm), f) == NULL) {
+            fclose(f);
+            continue;
+        }
+        fclose(f);
+        comm[strcspn(comm, "\n")] = '\0';
+
+        /* strip the thread index, e.g. "encoder-3" -> "encoder" */
+        len = strlen(comm);
+        while (len > 0 && comm[len - 1] >= '0' && comm[len - 1] <= '9') {
+            len --;
+        }
+        if (len > 0 && len < (int)strlen(comm) &&
+                (comm[len - 1] == '-' || comm[len - 1] == '_')) {
+            len --;
+        }
+        if (len > 0) {
+            comm[len] = '\0';
+        }
+
+        snprintf(path, sizeof(path), "/proc/%d/task/%s/stat", (int)pid,
+                ent->d_name);
+        f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        if (fgets(stat, sizeof(stat), f) == NULL) {
+            fclose(f);
+            continue;
+        }
+        fclose(f);
+
+        /* Skip past the thread name, which may contain spaces */
+        p = strrchr(stat, ')');
+        if (p == NULL || sscanf(p + 2,
+                "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                &utime, &stime) != 2) {
+            continue;
+        }
+
+        for (i = 0; i < ngroups; i++) {
+            if (strcmp(groups[i].name, comm) == 0) {
+                break;
+            }
+        }
+        if (i == ngroups) {
+            if (ngroups == maxgroups) {
+                continue;
+            }
+            snprintf(groups[i].name, sizeof(groups[i].name), "%s", comm);
+            groups[i].cpu = 0;
+            groups[i].threads = 0;
+            ngroups ++;
+        }
+        groups[i].cpu += (double)(utime + stime) / ticks;
+        groups[i].threads ++;
+    }
+    closedir(dir);
+    return ngroups;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,81 @@
+/*
+ *
+ * Copyright (c) 2018 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef OPENLI_BENCH_UTIL_H_
+#define OPENLI_BENCH_UTIL_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Helpers shared by the benchmarks that drive a real OpenLI component
+ * (e.g. openlicollbench and openlimedbench).
+ */
+
+/** CPU time used by a group of threads within a process */
+typedef struct thread_cpu {
+    /** The thread name, minus any trailing thread index */
+    char name[32];
+
+    /** Total user and system CPU time used by the group, in seconds */
+    double cpu;
+
+    /** Number of threads in the group */
+    int threads;
+} thread_cpu_t;
+
+/** Creates a TCP socket listening on an unused port on 127.0.0.1.
+ *
+ *  @param port         Set to the port that was chosen
+ *
+ *  @return the listening socket, or -1 if an error occurs.
+ */
+int create_loopback_listener(uint16_t *port);
+
+/** Starts an OpenLI component in a child process, using the given
+ *  configuration file.
+ *
+ *  @param binary       The path to the component's executable
+ *  @param config       The configuration file to pass using -c
+ *  @param logfile      The file to write the component's output to
+ *
+ *  @return the process ID of the child, or -1 if the fork failed.
+ */
+pid_t start_bench_process(char *binary, char *config, char *logfile);
+
+/** Sums the CPU time used by each group of threads in a process. Threads
+ *  are grouped by name, ignoring any trailing thread index.
+ *
+ *  @param pid          The process to measure
+ *  @param groups       Array to populate with the per-group CPU time
+ *  @param maxgroups    The number of entries in the groups array
+ *
+ *  @return the number of groups found.
+ */
+int measure_thread_cpu(pid_t pid, thread_cpu_t *groups, int maxgroups);
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
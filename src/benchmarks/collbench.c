@@ -0,0 +1,1602 @@
+/*
+ *
+ * Copyright (c) 2018 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* End-to-end throughput benchmark for the OpenLI collector.
+ *
+ * A synthetic pcap workload is generated containing traffic for a set of
+ * IP intercept targets (whose sessions are started and stopped using
+ * RADIUS accounting), SIP calls with RTP media for a set of VoIP targets,
+ * SMTP sessions for a set of email targets and untargeted background
+ * traffic. The collector is then started with a pcapfile: input reading
+ * that workload, and is connected to a stand-in provisioner (which
+ * announces the intercepts) and a stand-in mediator (which receives and
+ * validates every ETSI record that the collector exports).
+ *
+ * Once the collector has finished processing the workload, we report the
+ * packet and record rates achieved, the CPU time used by each group of
+ * collector threads and any packets or records that were lost.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <libwandder_etsili.h>
+
+#include "logger.h"
+#include "util.h"
+#include "intercept.h"
+#include "coreserver.h"
+#include "netcomms.h"
+#include "export_buffer.h"
+#include "benchmarks/bench_util.h"
+
+#define BENCH_AUTHCC "NZ"
+#define BENCH_AGENCY "benchlea"
+#define BENCH_REALM "bench.example.org"
+#define BENCH_MAILDOMAIN "example.org"
+
+#define BENCH_RADIUS_SERVER 0xC0000202      /* 192.0.2.2 */
+#define BENCH_RADIUS_NAS 0xC0000201         /* 192.0.2.1 */
+#define BENCH_SIP_SERVER 0xC000020A         /* 192.0.2.10 */
+#define BENCH_SMTP_SERVER 0xC0000219        /* 192.0.2.25 */
+#define BENCH_SUBSCRIBER_BASE 0x0A400000    /* 10.64.0.0 */
+#define BENCH_PHONE_BASE 0x0A800000         /* 10.128.0.0 */
+#define BENCH_CALLER_BASE 0xC6336400        /* 198.51.100.0 */
+#define BENCH_MAILCLIENT_BASE 0xC6120000    /* 198.18.0.0 */
+#define BENCH_REMOTE_BASE 0xCB007100        /* 203.0.113.0 */
+#define BENCH_BACKGROUND_BASE 0xAC100000    /* 172.16.0.0 */
+
+#define BENCH_RTP_PPS 50
+#define BENCH_RTP_SIZE 172
+
+/* LIID prefixes, used by the mediator stand-in to work out which kind of
+ * intercept each record belongs to */
+#define LIID_PREFIX_IP "BENCHIP"
+#define LIID_PREFIX_VOIP "BENCHVOIP"
+#define LIID_PREFIX_EMAIL "BENCHMAIL"
+
+enum {
+    RECORD_CLASS_IP,
+    RECORD_CLASS_VOIP,
+    RECORD_CLASS_EMAIL,
+    RECORD_CLASS_LAST
+};
+
+static const char *record_class_names[] = {
+    "ip", "voip", "email"
+};
+
+typedef struct workload_config {
+    uint32_t iptargets;
+    uint32_t voiptargets;
+    uint32_t mailtargets;
+    uint32_t churn;
+    uint32_t datarate;
+    uint32_t bgpercent;
+    uint32_t callrate;
+    uint32_t calllength;
+    uint32_t mailrate;
+    uint32_t duration;
+    uint16_t minsize;
+    uint16_t maxsize;
+} workload_config_t;
+
+typedef struct workload_summary {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t radius;
+    uint64_t ipcc;
+    uint64_t sip;
+    uint64_t rtp;
+    uint64_t smtp;
+    uint64_t background;
+} workload_summary_t;
+
+typedef struct pcap_writer {
+    FILE *f;
+    uint32_t sec;
+    uint32_t usec;
+    workload_summary_t *summary;
+} pcap_writer_t;
+
+typedef struct radius_session {
+    uint32_t ip;
+    uint32_t sessid;
+} radius_session_t;
+
+typedef struct sip_call {
+    uint32_t target;
+    uint32_t callid;
+    uint32_t callerip;
+    uint32_t calleeip;
+    uint16_t callerport;
+    uint16_t calleeport;
+    uint32_t endsec;
+    uint16_t rtpseq;
+    uint32_t rtpts;
+} sip_call_t;
+
+typedef struct tcp_flow {
+    uint32_t clientip;
+    uint32_t serverip;
+    uint16_t clientport;
+    uint16_t serverport;
+    uint32_t clientseq;
+    uint32_t serverseq;
+} tcp_flow_t;
+
+/* State shared with the stand-in provisioner thread */
+typedef struct fake_provisioner {
+    int listenfd;
+    uint16_t port;
+    uint16_t mediatorport;
+    workload_config_t *work;
+    volatile int halt;
+    int connected;
+} fake_provisioner_t;
+
+/* State shared with the stand-in mediator thread */
+typedef struct fake_mediator {
+    int listenfd;
+    uint16_t port;
+    volatile int halt;
+    int validate;
+
+    pthread_mutex_t mutex;
+    uint64_t records[RECORD_CLASS_LAST][2];
+    uint64_t invalid;
+    uint64_t recordbytes;
+    uint64_t connections;
+    double firstrecord;
+    double lastrecord;
+} fake_mediator_t;
+
+static inline double timespec_to_secs(struct timespec *ts) {
+    return ts->tv_sec + (ts->tv_nsec / 1000000000.0);
+}
+
+static double wall_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return timespec_to_secs(&ts);
+}
+
+static uint16_t ip_checksum(uint8_t *buf, int len, uint32_t sum) {
+    int i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += (buf[i] << 8) | buf[i + 1];
+    }
+    if (len & 1) {
+        sum += buf[len - 1] << 8;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return htons(~sum & 0xffff);
+}
+
+static int write_pcap_header(pcap_writer_t *w) {
+    struct {
+        uint32_t magic;
+        uint16_t major;
+        uint16_t minor;
+        int32_t thiszone;
+        uint32_t sigfigs;
+        uint32_t snaplen;
+        uint32_t linktype;
+    } hdr;
+
+    hdr.magic = 0xa1b2c3d4;
+    hdr.major = 2;
+    hdr.minor = 4;
+    hdr.thiszone = 0;
+    hdr.sigfigs = 0;
+    hdr.snaplen = 65535;
+    hdr.linktype = 1;       /* Ethernet */
+
+    if (fwrite(&hdr, sizeof(hdr), 1, w->f) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Writes a single Ethernet / IPv4 packet to the workload file, with the
+ * given transport header and payload.
+ */
+static void write_ipv4_packet(pcap_writer_t *w, uint8_t proto,
+        uint32_t srcip, uint32_t dstip, uint8_t *transport,
+        uint16_t translen, uint8_t *payload, uint16_t paylen) {
+
+    uint8_t pkt[14 + 20 + 60 + 65535];
+    uint32_t reclen = 14 + 20 + translen + paylen;
+    uint32_t pseudo = 0;
+    uint8_t *ip = pkt + 14;
+    uint8_t *l4 = ip + 20;
+    struct {
+        uint32_t sec;
+        uint32_t usec;
+        uint32_t caplen;
+        uint32_t wirelen;
+    } rechdr;
+
+    if (reclen > 65535) {
+        reclen = 65535;
+        paylen = reclen - (14 + 20 + translen);
+    }
+
+    memset(pkt, 0, 14 + 20);
+    pkt[0] = 0x02; pkt[5] = 0x01;
+    pkt[6] = 0x02; pkt[11] = 0x02;
+    pkt[12] = 0x08; pkt[13] = 0x00;
+
+    ip[0] = 0x45;
+    *((uint16_t *)(ip + 2)) = htons(20 + translen + paylen);
+    *((uint16_t *)(ip + 4)) = htons((uint16_t)(w->summary->packets & 0xffff));
+    ip[6] = 0x40;
+    ip[8] = 64;
+    ip[9] = proto;
+    *((uint32_t *)(ip + 12)) = htonl(srcip);
+    *((uint32_t *)(ip + 16)) = htonl(dstip);
+    *((uint16_t *)(ip + 10)) = ip_checksum(ip, 20, 0);
+
+    memcpy(l4, transport, translen);
+    if (paylen > 0) {
+        memcpy(l4 + translen, payload, paylen);
+    }
+
+    if (proto == IPPROTO_UDP) {
+        *((uint16_t *)(l4 + 4)) = htons(translen + paylen);
+    } else if (proto == IPPROTO_TCP) {
+        pseudo = (srcip >> 16) + (srcip & 0xffff) + (dstip >> 16) +
+                (dstip & 0xffff) + proto + translen + paylen;
+        *((uint16_t *)(l4 + 16)) = 0;
+        *((uint16_t *)(l4 + 16)) = ip_checksum(l4, translen + paylen,
+                pseudo);
+    }
+
+    /* Keep timestamps increasing within each second of the workload */
+    rechdr.sec = w->sec;
+    rechdr.usec = w->usec;
+    if (w->usec < 999999) {
+        w->usec ++;
+    }
+    rechdr.caplen = reclen;
+    rechdr.wirelen = reclen;
+
+    fwrite(&rechdr, sizeof(rechdr), 1, w->f);
+    fwrite(pkt, reclen, 1, w->f);
+
+    w->summary->packets ++;
+    w->summary->bytes += reclen;
+}
+
+static void write_udp_packet(pcap_writer_t *w, uint32_t srcip,
+        uint16_t sport, uint32_t dstip, uint16_t dport, uint8_t *payload,
+        uint16_t paylen) {
+
+    uint8_t udp[8];
+
+    *((uint16_t *)(udp)) = htons(sport);
+    *((uint16_t *)(udp + 2)) = htons(dport);
+    *((uint16_t *)(udp + 4)) = 0;
+    *((uint16_t *)(udp + 6)) = 0;
+
+    write_ipv4_packet(w, IPPROTO_UDP, srcip, dstip, udp, 8, payload, paylen);
+}
+
+static void write_tcp_packet(pcap_writer_t *w, tcp_flow_t *flow,
+        int fromclient, uint8_t flags, uint8_t *payload, uint16_t paylen) {
+
+    uint8_t tcp[20];
+    uint32_t *myseq, *theirseq;
+
+    if (fromclient) {
+        myseq = &(flow->clientseq);
+        theirseq = &(flow->serverseq);
+    } else {
+        myseq = &(flow->serverseq);
+        theirseq = &(flow->clientseq);
+    }
+
+    memset(tcp, 0, sizeof(tcp));
+    *((uint16_t *)(tcp)) = htons(fromclient ? flow->clientport :
+            flow->serverport);
+    *((uint16_t *)(tcp + 2)) = htons(fromclient ? flow->serverport :
+            flow->clientport);
+    *((uint32_t *)(tcp + 4)) = htonl(*myseq);
+    if (flags & 0x10) {
+        *((uint32_t *)(tcp + 8)) = htonl(*theirseq);
+    }
+    tcp[12] = 5 << 4;
+    tcp[13] = flags;
+    *((uint16_t *)(tcp + 14)) = htons(65535);
+
+    if (fromclient) {
+        write_ipv4_packet(w, IPPROTO_TCP, flow->clientip, flow->serverip,
+                tcp, 20, payload, paylen);
+    } else {
+        write_ipv4_packet(w, IPPROTO_TCP, flow->serverip, flow->clientip,
+                tcp, 20, payload, paylen);
+    }
+
+    *myseq += paylen;
+    if (flags & (0x01 | 0x02)) {
+        /* SYN and FIN each consume a sequence number */
+        *myseq += 1;
+    }
+}
+
+static uint16_t put_radius_attr(uint8_t *buf, uint8_t type, void *val,
+        uint8_t len) {
+    buf[0] = type;
+    buf[1] = len + 2;
+    memcpy(buf + 2, val, len);
+    return len + 2;
+}
+
+static void write_radius_accounting(pcap_writer_t *w, uint32_t target, radius_session_t *sess, uint32_t statustype,
+        uint8_t *ident) {
+
+    uint8_t buf[512];
+    uint16_t len = 20;
+    char username[64], sessid[32];
+    uint32_t val;
+
+    snprintf(username, sizeof(username), "benchuser%u", target);
+    snprintf(sessid, sizeof(sessid), "%08x", sess->sessid);
+
+    memset(buf, 0, 20);
+    buf[0] = 4;         /* Accounting-Request */
+    buf[1] = *ident;
+    len += put_radius_attr(buf + len, 1, username, strlen(username));
+    val = htonl(BENCH_RADIUS_NAS);
+    len += put_radius_attr(buf + len, 4, &val, 4);
+    val = htonl(target);
+    len += put_radius_attr(buf + len, 5, &val, 4);
+    val = htonl(sess->ip);
+    len += put_radius_attr(buf + len, 8, &val, 4);
+    val = htonl(statustype);
+    len += put_radius_attr(buf + len, 40, &val, 4);
+    len += put_radius_attr(buf + len, 44, sessid, strlen(sessid));
+    if (statustype == 2) {
+        val = htonl(1);     /* User-Request */
+        len += put_radius_attr(buf + len, 49, &val, 4);
+    }
+    *((uint16_t *)(buf + 2)) = htons(len);
+
+    write_udp_packet(w, BENCH_RADIUS_NAS, 40000, BENCH_RADIUS_SERVER, 1813,
+            buf, len);
+
+    /* Accounting-Response */
+    memset(buf, 0, 20);
+    buf[0] = 5;
+    buf[1] = *ident;
+    *((uint16_t *)(buf + 2)) = htons(20);
+    write_udp_packet(w, BENCH_RADIUS_SERVER, 1813, BENCH_RADIUS_NAS, 40000,
+            buf, 20);
+
+    *ident = *ident + 1;
+    w->summary->radius += 2;
+}
+
+static void write_sip_message(pcap_writer_t *w, sip_call_t *call,
+        const char *firstline, const char *method, int fromcaller,
+        int withsdp) {
+
+    char msg[2048], sdp[512];
+    struct in_addr addr;
+    char callerip[INET_ADDRSTRLEN], calleeip[INET_ADDRSTRLEN];
+    int sdplen = 0, len;
+
+    addr.s_addr = htonl(call->callerip);
+    inet_ntop(AF_INET, &addr, callerip, sizeof(callerip));
+    addr.s_addr = htonl(call->calleeip);
+    inet_ntop(AF_INET, &addr, calleeip, sizeof(calleeip));
+
+    if (withsdp) {
+        sdplen = snprintf(sdp, sizeof(sdp),
+                "v=0\r\n"
+                "o=- %u 1 IN IP4 %s\r\n"
+                "s=-\r\n"
+                "c=IN IP4 %s\r\n"
+                "t=0 0\r\n"
+                "m=audio %u RTP/AVP 0\r\n"
+                "a=rtpmap:0 PCMU/8000\r\n",
+                call->callid, fromcaller ? callerip : calleeip,
+                fromcaller ? callerip : calleeip,
+                fromcaller ? call->callerport : call->calleeport);
+    }
+
+    len = snprintf(msg, sizeof(msg),
+            "%s\r\n"
+            "Via: SIP/2.0/UDP %s:5060;branch=z9hG4bK%08x\r\n"
+            "From: <sip:caller%u@%s>;tag=%08x\r\n"
+            "To: <sip:benchvoip%u@%s>\r\n"
+            "Call-ID: benchcall%08x@%s\r\n"
+            "CSeq: 1 %s\r\n"
+            "Contact: <sip:caller%u@%s:5060>\r\n"
+            "Max-Forwards: 70\r\n"
+            "Content-Type: application/sdp\r\n"
+            "Content-Length: %d\r\n\r\n%s",
+            firstline, callerip, call->callid, call->callid, BENCH_REALM,
+            call->callid, call->target, BENCH_REALM, call->callid,
+            callerip, method, call->callid, callerip, sdplen,
+            withsdp ? sdp : "");
+
+    if (fromcaller) {
+        write_udp_packet(w, call->callerip, 5060, BENCH_SIP_SERVER, 5060,
+                (uint8_t *)msg, len);
+    } else {
+        write_udp_packet(w, BENCH_SIP_SERVER, 5060, call->callerip, 5060,
+                (uint8_t *)msg, len);
+    }
+    w->summary->sip ++;
+}
+
+static void write_rtp_packets(pcap_writer_t *w, sip_call_t *call,
+        uint8_t *payload) {
+
+    int i;
+
+    for (i = 0; i < BENCH_RTP_PPS; i++) {
+        payload[0] = 0x80;
+        payload[1] = 0x00;
+        *((uint16_t *)(payload + 2)) = htons(call->rtpseq);
+        *((uint32_t *)(payload + 4)) = htonl(call->rtpts);
+        *((uint32_t *)(payload + 8)) = htonl(call->callid);
+        write_udp_packet(w, call->callerip, call->callerport,
+                call->calleeip, call->calleeport, payload, BENCH_RTP_SIZE);
+        *((uint32_t *)(payload + 8)) = htonl(~call->callid);
+        write_udp_packet(w, call->calleeip, call->calleeport,
+                call->callerip, call->callerport, payload, BENCH_RTP_SIZE);
+        call->rtpseq ++;
+        call->rtpts += 160;
+        w->summary->rtp += 2;
+    }
+}
+
+static void write_smtp_session(pcap_writer_t *w, uint32_t target,
+        uint32_t sessnum, uint8_t *body, uint16_t bodylen) {
+
+    tcp_flow_t flow;
+    char line[256];
+    int i, len;
+    uint64_t before = w->summary->packets;
+    const char *server[] = {
+        "220 mail." BENCH_MAILDOMAIN " ESMTP\r\n",
+        "250 mail." BENCH_MAILDOMAIN "\r\n",
+        "250 OK\r\n",
+        "250 OK\r\n",
+        "354 End data with <CR><LF>.<CR><LF>\r\n",
+        "250 OK queued\r\n",
+        "221 Bye\r\n",
+    };
+
+    flow.clientip = BENCH_MAILCLIENT_BASE + (sessnum % 65000) + 1;
+    flow.serverip = BENCH_SMTP_SERVER;
+    flow.clientport = 1024 + (sessnum % 60000);
+    flow.serverport = 25;
+    flow.clientseq = sessnum * 7919;
+    flow.serverseq = sessnum * 104729;
+
+    write_tcp_packet(w, &flow, 1, 0x02, NULL, 0);
+    write_tcp_packet(w, &flow, 0, 0x12, NULL, 0);
+    write_tcp_packet(w, &flow, 1, 0x10, NULL, 0);
+
+    for (i = 0; i < 7; i++) {
+        write_tcp_packet(w, &flow, 0, 0x18, (uint8_t *)server[i],
+                strlen(server[i]));
+
+        switch(i) {
+            case 0:
+                len = snprintf(line, sizeof(line), "EHLO client%u\r\n",
+                        sessnum);
+                break;
+            case 1:
+                len = snprintf(line, sizeof(line),
+                        "MAIL FROM:<benchmail%u@%s>\r\n", target,
+                        BENCH_MAILDOMAIN);
+                break;
+            case 2:
+                len = snprintf(line, sizeof(line),
+                        "RCPT TO:<someone%u@elsewhere.example.com>\r\n",
+                        sessnum);
+                break;
+            case 3:
+                len = snprintf(line, sizeof(line), "DATA\r\n");
+                break;
+            case 4:
+                len = snprintf(line, sizeof(line),
+                        "From: benchmail%u@%s\r\nSubject: bench %u\r\n\r\n",
+                        target, BENCH_MAILDOMAIN, sessnum);
+                write_tcp_packet(w, &flow, 1, 0x18, (uint8_t *)line, len);
+                write_tcp_packet(w, &flow, 1, 0x18, body, bodylen);
+                len = snprintf(line, sizeof(line), "\r\n.\r\n");
+                break;
+            case 5:
+                len = snprintf(line, sizeof(line), "QUIT\r\n");
+                break;
+            default:
+                len = 0;
+                break;
+        }
+        if (len > 0) {
+            write_tcp_packet(w, &flow, 1, 0x18, (uint8_t *)line, len);
+        }
+    }
+
+    write_tcp_packet(w, &flow, 0, 0x11, NULL, 0);
+    write_tcp_packet(w, &flow, 1, 0x11, NULL, 0);
+    write_tcp_packet(w, &flow, 0, 0x10, NULL, 0);
+
+    w->summary->smtp += (w->summary->packets - before);
+}
+
+static void start_sip_call(pcap_writer_t *w, workload_config_t *work,
+        sip_call_t *call, uint32_t callnum, uint32_t now) {
+
+    call->target = callnum % work->voiptargets;
+    call->callid = callnum + 1;
+    call->callerip = BENCH_CALLER_BASE + (callnum % 250) + 1;
+    call->calleeip = BENCH_PHONE_BASE + call->target + 1;
+    call->callerport = 10000 + ((callnum * 2) % 50000);
+    call->calleeport = 20000 + ((callnum * 2) % 40000);
+    call->endsec = now + work->calllength;
+    call->rtpseq = 0;
+    call->rtpts = 0;
+
+    write_sip_message(w, call, "INVITE sip:benchvoip@" BENCH_REALM " SIP/2.0",
+            "INVITE", 1, 1);
+    write_sip_message(w, call, "SIP/2.0 200 OK", "INVITE", 0, 1);
+    write_sip_message(w, call, "ACK sip:benchvoip@" BENCH_REALM " SIP/2.0",
+            "ACK", 1, 0);
+}
+
+static void end_sip_call(pcap_writer_t *w, sip_call_t *call) {
+    write_sip_message(w, call, "BYE sip:benchvoip@" BENCH_REALM " SIP/2.0",
+            "BYE", 1, 0);
+    write_sip_message(w, call, "SIP/2.0 200 OK", "BYE", 0, 0);
+    call->endsec = 0;
+}
+
+static int generate_workload(char *fname, workload_config_t *work,
+        workload_summary_t *summary) {
+
+    pcap_writer_t w;
+    radius_session_t *sessions;
+    sip_call_t *calls;
+    uint32_t maxcalls, callnum = 0, mailnum = 0, nextip = 1, nextsess = 1;
+    uint32_t churnptr = 0, dataptr = 0, sec, i, j;
+    uint8_t payload[65535];
+    uint8_t ident = 0;
+    uint16_t paylen;
+    uint32_t remote, bgip;
+
+    memset(summary, 0, sizeof(workload_summary_t));
+    memset(&w, 0, sizeof(w));
+    w.summary = summary;
+    w.f = fopen(fname, "w");
+    if (w.f == NULL) {
+        fprintf(stderr, "unable to create workload file %s: %s\n", fname,
+                strerror(errno));
+        return -1;
+    }
+    if (write_pcap_header(&w) < 0) {
+        fclose(w.f);
+        return -1;
+    }
+
+    for (i = 0; i < sizeof(payload); i++) {
+        payload[i] = (uint8_t)(rand() & 0xff);
+    }
+
+    sessions = calloc(work->iptargets, sizeof(radius_session_t));
+    maxcalls = work->callrate * (work->calllength + 1);
+    calls = calloc(maxcalls + 1, sizeof(sip_call_t));
+
+    w.sec = 1500000000;
+    w.usec = 0;
+
+    /* Bring every IP target online before any of their traffic appears */
+    for (i = 0; i < work->iptargets; i++) {
+        sessions[i].ip = BENCH_SUBSCRIBER_BASE + nextip++;
+        sessions[i].sessid = nextsess++;
+        write_radius_accounting(&w, i, &(sessions[i]), 1, &ident);
+    }
+
+    for (sec = 0; sec < work->duration; sec++) {
+        w.sec ++;
+        w.usec = 0;
+
+        /* RADIUS session churn: a target goes offline and comes straight
+         * back with a new address and session ID */
+        for (j = 0; j < work->churn && work->iptargets > 0; j++) {
+            i = churnptr % work->iptargets;
+            churnptr ++;
+            write_radius_accounting(&w, i, &(sessions[i]), 2, &ident);
+            sessions[i].ip = BENCH_SUBSCRIBER_BASE + nextip++;
+            sessions[i].sessid = nextsess++;
+            write_radius_accounting(&w, i, &(sessions[i]), 1, &ident);
+        }
+
+        /* New SIP calls, followed by RTP for every call in progress */
+        for (j = 0; j < work->callrate && work->voiptargets > 0; j++) {
+            for (i = 0; i < maxcalls; i++) {
+                if (calls[i].endsec == 0) {
+                    start_sip_call(&w, work, &(calls[i]), callnum, sec);
+                    callnum ++;
+                    break;
+                }
+            }
+        }
+        for (i = 0; i < maxcalls; i++) {
+            if (calls[i].endsec == 0) {
+                continue;
+            }
+            if (calls[i].endsec <= sec) {
+                end_sip_call(&w, &(calls[i]));
+                continue;
+            }
+            write_rtp_packets(&w, &(calls[i]), payload);
+        }
+
+        for (j = 0; j < work->mailrate && work->mailtargets > 0; j++) {
+            write_smtp_session(&w, mailnum % work->mailtargets, mailnum,
+                    payload, 512 + (rand() % 1024));
+            mailnum ++;
+        }
+
+        /* Traffic for the IP targets, interleaved with background traffic
+         * that the collector should ignore */
+        for (j = 0; j < work->datarate && work->iptargets > 0; j++) {
+            i = dataptr % work->iptargets;
+            dataptr ++;
+            paylen = work->minsize +
+                    (rand() % (work->maxsize - work->minsize + 1));
+            remote = BENCH_REMOTE_BASE + (j % 250) + 1;
+            if (j & 1) {
+                write_udp_packet(&w, sessions[i].ip, 40000 + (j % 20000),
+                        remote, 443, payload, paylen);
+            } else {
+                write_udp_packet(&w, remote, 443, sessions[i].ip,
+                        40000 + (j % 20000), payload, paylen);
+            }
+            summary->ipcc ++;
+
+            if ((j % 100) < work->bgpercent) {
+                bgip = BENCH_BACKGROUND_BASE + (j % 65000) + 1;
+                write_udp_packet(&w, bgip, 50000, remote, 443, payload,
+                        paylen);
+                summary->background ++;
+            }
+        }
+    }
+
+    /* Finish the calls that are still in progress */
+    for (i = 0; i < maxcalls; i++) {
+        if (calls[i].endsec != 0) {
+            end_sip_call(&w, &(calls[i]));
+        }
+    }
+
+    free(calls);
+    free(sessions);
+    if (fclose(w.f) != 0) {
+        fprintf(stderr, "error while writing workload file %s: %s\n", fname,
+                strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void init_bench_common(intercept_common_t *common, const char *prefix,
+        uint32_t index) {
+
+    char liid[64];
+
+    memset(common, 0, sizeof(intercept_common_t));
+    snprintf(liid, sizeof(liid), "%s%05u", prefix, index);
+    common->liid = strdup(liid);
+    common->liid_len = strlen(liid);
+    common->authcc = strdup(BENCH_AUTHCC);
+    common->authcc_len = strlen(BENCH_AUTHCC);
+    common->delivcc = strdup(BENCH_AUTHCC);
+    common->delivcc_len = strlen(BENCH_AUTHCC);
+    common->targetagency = strdup(BENCH_AGENCY);
+    common->destid = 1;
+    common->tomediate = OPENLI_INTERCEPT_OUTPUTS_ALL;
+    common->encrypt = OPENLI_PAYLOAD_ENCRYPTION_NONE;
+}
+
+static void free_bench_common(intercept_common_t *common) {
+    free(common->liid);
+    free(common->authcc);
+    free(common->delivcc);
+    free(common->targetagency);
+}
+
+static int push_coreserver(net_buffer_t *nb, uint32_t ip, char *port,
+        uint8_t cstype) {
+
+    coreserver_t cs;
+    char ipstr[INET_ADDRSTRLEN];
+    struct in_addr addr;
+
+    addr.s_addr = htonl(ip);
+    inet_ntop(AF_INET, &addr, ipstr, sizeof(ipstr));
+
+    memset(&cs, 0, sizeof(cs));
+    cs.ipstr = ipstr;
+    cs.portstr = port;
+    return push_coreserver_onto_net_buffer(nb, &cs, cstype);
+}
+
+/* Queues everything that the provisioner would send to a newly
+ * authenticated collector.
+ */
+static int push_bench_config(fake_provisioner_t *prov, net_buffer_t *nb) {
+
+    openli_mediator_t med;
+    char portstr[16];
+    uint32_t i;
+    int ret = 0;
+
+    snprintf(portstr, sizeof(portstr), "%u", prov->mediatorport);
+    med.mediatorid = 1;
+    med.ipstr = "127.0.0.1";
+    med.portstr = portstr;
+
+    if (push_mediator_onto_net_buffer(nb, &med) < 0) {
+        return -1;
+    }
+
+    if (push_coreserver(nb, BENCH_RADIUS_SERVER, "1813",
+                OPENLI_CORE_SERVER_RADIUS) < 0 ||
+            push_coreserver(nb, BENCH_SIP_SERVER, "5060",
+                OPENLI_CORE_SERVER_SIP) < 0 ||
+            push_coreserver(nb, BENCH_SMTP_SERVER, "25",
+                OPENLI_CORE_SERVER_SMTP) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < prov->work->iptargets && ret >= 0; i++) {
+        ipintercept_t ipint;
+        char username[64];
+
+        memset(&ipint, 0, sizeof(ipint));
+        init_bench_common(&(ipint.common), LIID_PREFIX_IP, i);
+        snprintf(username, sizeof(username), "benchuser%u", i);
+        ipint.username = username;
+        ipint.username_len = strlen(username);
+        ipint.accesstype = INTERNET_ACCESS_TYPE_UNDEFINED;
+        ipint.vendmirrorid = OPENLI_VENDOR_MIRROR_NONE;
+
+        ret = push_ipintercept_onto_net_buffer(nb, &ipint);
+        free_bench_common(&(ipint.common));
+    }
+
+    for (i = 0; i < prov->work->voiptargets && ret >= 0; i++) {
+        voipintercept_t vint;
+        openli_sip_identity_t sipid;
+        char username[64];
+
+        memset(&vint, 0, sizeof(vint));
+        init_bench_common(&(vint.common), LIID_PREFIX_VOIP, i);
+        vint.internalid = i + 1;
+        vint.active = 1;
+
+        snprintf(username, sizeof(username), "benchvoip%u", i);
+        memset(&sipid, 0, sizeof(sipid));
+        sipid.username = username;
+        sipid.username_len = strlen(username);
+        sipid.realm = BENCH_REALM;
+        sipid.realm_len = strlen(BENCH_REALM);
+        sipid.active = 1;
+
+        ret = push_voipintercept_onto_net_buffer(nb, &vint);
+        if (ret >= 0) {
+            ret = push_sip_target_onto_net_buffer(nb, &sipid, &vint);
+        }
+        free_bench_common(&(vint.common));
+    }
+
+    for (i = 0; i < prov->work->mailtargets && ret >= 0; i++) {
+        emailintercept_t mailint;
+        email_target_t tgt;
+        char address[128];
+
+        memset(&mailint, 0, sizeof(mailint));
+        init_bench_common(&(mailint.common), LIID_PREFIX_EMAIL, i);
+        mailint.delivercompressed = OPENLI_EMAILINT_DELIVER_COMPRESSED_DEFAULT;
+
+        snprintf(address, sizeof(address), "benchmail%u@%s", i,
+                BENCH_MAILDOMAIN);
+        memset(&tgt, 0, sizeof(tgt));
+        tgt.address = address;
+
+        ret = push_emailintercept_onto_net_buffer(nb, &mailint);
+        if (ret >= 0) {
+            ret = push_email_target_onto_net_buffer(nb, &tgt, &mailint);
+        }
+        free_bench_common(&(mailint.common));
+    }
+
+    if (ret < 0) {
+        return -1;
+    }
+    return push_nomore_intercepts(nb);
+}
+
+/* Handles a single connection from the collector: waits for it to
+ * authenticate, sends it our intercepts and then keeps the connection open
+ * until the benchmark is over.
+ */
+static void serve_collector(fake_provisioner_t *prov, int fd) {
+
+    net_buffer_t *incoming, *outgoing;
+    openli_proto_msgtype_t msgtype, err;
+    uint8_t *msgbody;
+    uint32_t msglen;
+    uint64_t internalid;
+    struct pollfd pfd;
+    int authed = 0, pending = 0;
+
+    fd_set_nonblock(fd);
+    incoming = create_net_buffer(NETBUF_RECV, fd, NULL);
+    outgoing = create_net_buffer(NETBUF_SEND, fd, NULL);
+
+    while (!prov->halt) {
+        pfd.fd = fd;
+        pfd.events = POLLIN | (pending ? POLLOUT : 0);
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 100) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (pfd.revents & POLLIN) {
+            do {
+                msgtype = receive_net_buffer(incoming, &msgbody, &msglen,
+                        &internalid);
+                if (msgtype < 0 || msgtype == OPENLI_PROTO_DISCONNECT) {
+                    goto endcollector;
+                }
+                if (msgtype == OPENLI_PROTO_COLLECTOR_AUTH && !authed) {
+                    if (internalid != OPENLI_COLLECTOR_MAGIC) {
+                        fprintf(stderr, "collector sent bad auth message\n");
+                        goto endcollector;
+                    }
+                    if (push_bench_config(prov, outgoing) < 0) {
+                        fprintf(stderr,
+                                "unable to queue intercepts for collector\n");
+                        goto endcollector;
+                    }
+                    authed = 1;
+                    pending = 1;
+                    prov->connected ++;
+                }
+            } while (msgtype != OPENLI_PROTO_NO_MESSAGE);
+        }
+
+        if (pending) {
+            pending = transmit_net_buffer(outgoing, &err);
+            if (pending < 0) {
+                nb_log_transmit_error(err);
+                break;
+            }
+        }
+    }
+
+endcollector:
+    destroy_net_buffer(incoming);
+    destroy_net_buffer(outgoing);
+    close(fd);
+}
+
+static void *run_fake_provisioner(void *arg) {
+    fake_provisioner_t *prov = (fake_provisioner_t *)arg;
+    struct pollfd pfd;
+    int fd;
+
+    while (!prov->halt) {
+        pfd.fd = prov->listenfd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        fd = accept(prov->listenfd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        serve_collector(prov, fd);
+    }
+    return NULL;
+}
+
+#define MAX_SINK_CONNS 64
+
+typedef struct sink_counts {
+    uint64_t records[RECORD_CLASS_LAST][2];
+    uint64_t invalid;
+    uint64_t bytes;
+} sink_counts_t;
+
+static int classify_liid(char *liid, uint16_t liidlen) {
+    if (liidlen >= strlen(LIID_PREFIX_VOIP) &&
+            memcmp(liid, LIID_PREFIX_VOIP, strlen(LIID_PREFIX_VOIP)) == 0) {
+        return RECORD_CLASS_VOIP;
+    }
+    if (liidlen >= strlen(LIID_PREFIX_EMAIL) &&
+            memcmp(liid, LIID_PREFIX_EMAIL, strlen(LIID_PREFIX_EMAIL)) == 0) {
+        return RECORD_CLASS_EMAIL;
+    }
+    if (liidlen >= strlen(LIID_PREFIX_IP) &&
+            memcmp(liid, LIID_PREFIX_IP, strlen(LIID_PREFIX_IP)) == 0) {
+        return RECORD_CLASS_IP;
+    }
+    return -1;
+}
+
+/* Checks that a record from the collector is a complete ETSI PS-PDU for
+ * the LIID that it has been labelled with.
+ */
+static void sink_record(fake_mediator_t *med, wandder_etsispec_t *dec,
+        uint8_t *msgbody, uint32_t msglen, openli_proto_msgtype_t msgtype,
+        sink_counts_t *counts) {
+
+    unsigned char liid[256];
+    char decliid[256];
+    uint16_t liidlen = 0;
+    uint32_t pdulen;
+    int cls;
+
+    extract_liid_from_exported_msg(msgbody, msglen, liid, sizeof(liid),
+            &liidlen);
+    if (liidlen <= 2 || liidlen > msglen) {
+        counts->invalid ++;
+        return;
+    }
+
+    cls = classify_liid((char *)liid, liidlen - 2);
+    if (cls < 0) {
+        counts->invalid ++;
+        return;
+    }
+
+    if (med->validate) {
+        wandder_attach_etsili_buffer(dec, msgbody + liidlen,
+                msglen - liidlen, false);
+        pdulen = wandder_etsili_get_pdu_length(dec);
+        if (pdulen != msglen - liidlen ||
+                wandder_etsili_get_liid(dec, decliid,
+                        sizeof(decliid)) == NULL ||
+                strlen(decliid) != liidlen - 2 ||
+                memcmp(decliid, liid, liidlen - 2) != 0) {
+            counts->invalid ++;
+            return;
+        }
+    }
+
+    counts->records[cls][msgtype == OPENLI_PROTO_ETSI_IRI ? 1 : 0] ++;
+    counts->bytes += msglen;
+}
+
+static void *run_fake_mediator(void *arg) {
+    fake_mediator_t *med = (fake_mediator_t *)arg;
+    struct pollfd pfds[MAX_SINK_CONNS + 1];
+    net_buffer_t *bufs[MAX_SINK_CONNS + 1];
+    wandder_etsispec_t *dec;
+    sink_counts_t counts;
+    openli_proto_msgtype_t msgtype;
+    uint8_t *msgbody;
+    uint32_t msglen;
+    uint64_t internalid, total;
+    int nfds = 1, i, c, fd;
+    double now;
+
+    dec = wandder_create_etsili_decoder();
+    pfds[0].fd = med->listenfd;
+    pfds[0].events = POLLIN;
+
+    while (!med->halt) {
+        for (i = 0; i < nfds; i++) {
+            pfds[i].revents = 0;
+        }
+        if (poll(pfds, nfds, 100) <= 0) {
+            continue;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            fd = accept(med->listenfd, NULL, NULL);
+            if (fd >= 0 && nfds <= MAX_SINK_CONNS) {
+                fd_set_nonblock(fd);
+                /* Act like a current mediator so that large records
+                 * are exercised too */
+                transmit_framing_caps(fd, NULL, OPENLI_PROTO_FRAMING_EXTLEN);
+                pfds[nfds].fd = fd;
+                pfds[nfds].events = POLLIN;
+                bufs[nfds] = create_net_buffer(NETBUF_RECV, fd, NULL);
+                net_buffer_allow_extlen(bufs[nfds]);
+                nfds ++;
+                pthread_mutex_lock(&(med->mutex));
+                med->connections ++;
+                pthread_mutex_unlock(&(med->mutex));
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+
+        memset(&counts, 0, sizeof(counts));
+        for (i = 1; i < nfds; i++) {
+            if ((pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) == 0) {
+                continue;
+            }
+            do {
+                msgtype = receive_net_buffer(bufs[i], &msgbody, &msglen,
+                        &internalid);
+                if (msgtype == OPENLI_PROTO_ETSI_CC ||
+                        msgtype == OPENLI_PROTO_ETSI_IRI) {
+                    sink_record(med, dec, msgbody, msglen, msgtype, &counts);
+                }
+            } while (msgtype > OPENLI_PROTO_NO_MESSAGE);
+
+            if (msgtype < 0 || msgtype == OPENLI_PROTO_DISCONNECT) {
+                destroy_net_buffer(bufs[i]);
+                close(pfds[i].fd);
+                pfds[i] = pfds[nfds - 1];
+                bufs[i] = bufs[nfds - 1];
+                nfds --;
+                i --;
+            }
+        }
+
+        total = counts.invalid;
+        for (c = 0; c < RECORD_CLASS_LAST; c++) {
+            total += counts.records[c][0] + counts.records[c][1];
+        }
+        if (total == 0) {
+            continue;
+        }
+
+        now = wall_seconds();
+        pthread_mutex_lock(&(med->mutex));
+        for (c = 0; c < RECORD_CLASS_LAST; c++) {
+            med->records[c][0] += counts.records[c][0];
+            med->records[c][1] += counts.records[c][1];
+        }
+        med->invalid += counts.invalid;
+        med->recordbytes += counts.bytes;
+        if (med->firstrecord == 0) {
+            med->firstrecord = now;
+        }
+        med->lastrecord = now;
+        pthread_mutex_unlock(&(med->mutex));
+    }
+
+    for (i = 1; i < nfds; i++) {
+        destroy_net_buffer(bufs[i]);
+        close(pfds[i].fd);
+    }
+    wandder_free_etsili_decoder(dec);
+    return NULL;
+}
+
+static uint64_t mediator_total_records(fake_mediator_t *med) {
+    uint64_t total = 0;
+    int c;
+
+    pthread_mutex_lock(&(med->mutex));
+    for (c = 0; c < RECORD_CLASS_LAST; c++) {
+        total += med->records[c][0] + med->records[c][1];
+    }
+    total += med->invalid;
+    pthread_mutex_unlock(&(med->mutex));
+    return total;
+}
+
+static int write_collector_config(char *fname, char *pcapname,
+        uint16_t provport, uint16_t metricsport, int inputthreads,
+        int encoders, int forwarders) {
+
+    FILE *f = fopen(fname, "w");
+
+    if (f == NULL) {
+        fprintf(stderr, "unable to create collector config %s: %s\n", fname,
+                strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "provisioneraddr: 127.0.0.1\n");
+    fprintf(f, "provisionerport: %u\n", provport);
+    fprintf(f, "operatorid: WAND\n");
+    fprintf(f, "networkelementid: bench\n");
+    fprintf(f, "interceptpointid: bench01\n");
+    fprintf(f, "seqtrackerthreads: 1\n");
+    fprintf(f, "encoderthreads: %d\n", encoders);
+    fprintf(f, "forwardingthreads: %d\n", forwarders);
+    fprintf(f, "sipallowfromident: yes\n");
+    fprintf(f, "defaultemaildomain: %s\n", BENCH_MAILDOMAIN);
+    fprintf(f, "logstatfrequency: 0\n");
+    fprintf(f, "metricsaddr: 127.0.0.1\n");
+    fprintf(f, "metricsport: %u\n", metricsport);
+    fprintf(f, "inputs:\n");
+    fprintf(f, " - uri: pcapfile:%s\n", pcapname);
+    fprintf(f, "   threads: %d\n", inputthreads);
+    if (inputthreads > 1) {
+        fprintf(f, "   hasher: radius\n");
+    }
+
+    if (fclose(f) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Fetches the collector's metrics page and sums the values of every time
+ * series for each of the requested metrics.
+ */
+static int scrape_metrics(uint16_t port, const char **names, int count,
+        double *values) {
+
+    struct sockaddr_in sa;
+    char req[128], buf[65536];
+    char *page = NULL, *line, *save = NULL;
+    size_t pagelen = 0;
+    int fd, ret, i;
+    size_t nlen;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    snprintf(req, sizeof(req),
+            "GET /metrics HTTP/1.0\r\nHost: 127.0.0.1\r\n\r\n");
+    if (send(fd, req, strlen(req), 0) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    while ((ret = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        page = realloc(page, pagelen + ret + 1);
+        memcpy(page + pagelen, buf, ret);
+        pagelen += ret;
+    }
+    close(fd);
+    if (page == NULL) {
+        return -1;
+    }
+    page[pagelen] = '\0';
+
+    for (i = 0; i < count; i++) {
+        values[i] = 0;
+    }
+
+    for (line = strtok_r(page, "\n", &save); line != NULL;
+            line = strtok_r(NULL, "\n", &save)) {
+        if (line[0] == '#') {
+            continue;
+        }
+        for (i = 0; i < count; i++) {
+            nlen = strlen(names[i]);
+            if (strncmp(line, names[i], nlen) != 0 ||
+                    (line[nlen] != ' ' && line[nlen] != '{')) {
+                continue;
+            }
+            values[i] += strtod(strrchr(line, ' ') + 1, NULL);
+        }
+    }
+    free(page);
+    return 0;
+}
+
+enum {
+    METRIC_ACCEPTED,
+    METRIC_DROPPED,
+    METRIC_INTERCEPTED,
+    METRIC_RECORDS,
+    METRIC_BADPKTS,
+    METRIC_LAST
+};
+
+static const char *metric_names[] = {
+    "openli_collector_packets_accepted_total",
+    "openli_collector_packets_dropped_total",
+    "openli_collector_packets_intercepted_total",
+    "openli_collector_records_created_total",
+    "openli_collector_bad_packets_total",
+};
+
+static void report_results(workload_config_t *work,
+        workload_summary_t *summary, fake_mediator_t *med,
+        double *metrics, double started, double finished,
+        thread_cpu_t *groups, int ngroups) {
+
+    double elapsed = finished - started;
+    double totalcpu = 0;
+    uint64_t records = 0, expectcc;
+    int c, i;
+
+    for (c = 0; c < RECORD_CLASS_LAST; c++) {
+        records += med->records[c][0] + med->records[c][1];
+    }
+
+    printf("\nworkload: %lu packets (%.1f MB) -- %lu radius, %lu ip target, "
+            "%lu sip, %lu rtp, %lu smtp, %lu background\n",
+            (unsigned long)summary->packets,
+            summary->bytes / (1024.0 * 1024.0),
+            (unsigned long)summary->radius, (unsigned long)summary->ipcc,
+            (unsigned long)summary->sip, (unsigned long)summary->rtp,
+            (unsigned long)summary->smtp,
+            (unsigned long)summary->background);
+
+    printf("processing time: %.2f s\n", elapsed);
+    printf("throughput: %12.0f packets/s %12.0f records/s %10.1f Mbit/s\n",
+            elapsed > 0 ? metrics[METRIC_ACCEPTED] / elapsed : 0,
+            elapsed > 0 ? records / elapsed : 0,
+            elapsed > 0 ? (summary->bytes * 8.0) / 1000000.0 / elapsed : 0);
+
+    printf("\nrecords received by mediator:\n");
+    for (c = 0; c < RECORD_CLASS_LAST; c++) {
+        printf("  %-6s %10lu CC %10lu IRI\n", record_class_names[c],
+                (unsigned long)med->records[c][0],
+                (unsigned long)med->records[c][1]);
+    }
+
+    printf("\nloss:\n");
+    printf("  packets dropped by capture:    %10.0f\n",
+            metrics[METRIC_DROPPED]);
+    printf("  packets not read by collector: %10.0f\n",
+            summary->packets > metrics[METRIC_ACCEPTED] ?
+            summary->packets - metrics[METRIC_ACCEPTED] : 0);
+    printf("  bad packets:                   %10.0f\n",
+            metrics[METRIC_BADPKTS]);
+    printf("  records created:               %10.0f\n",
+            metrics[METRIC_RECORDS]);
+    printf("  records not delivered:         %10.0f\n",
+            metrics[METRIC_RECORDS] > records ?
+            metrics[METRIC_RECORDS] - records : 0);
+    printf("  invalid records:               %10lu\n",
+            (unsigned long)med->invalid);
+
+    /* Every IP target packet and every RTP packet should produce exactly
+     * one CC record */
+    expectcc = summary->ipcc;
+    printf("  missing IP CCs:                %10ld\n",
+            (long)expectcc - (long)med->records[RECORD_CLASS_IP][0]);
+    expectcc = summary->rtp;
+    printf("  missing RTP CCs:               %10ld\n",
+            (long)expectcc - (long)med->records[RECORD_CLASS_VOIP][0]);
+
+    printf("\ncollector CPU by thread group:\n");
+    for (i = 0; i < ngroups; i++) {
+        totalcpu += groups[i].cpu;
+    }
+    for (i = 0; i < ngroups; i++) {
+        printf("  %-20s %3d threads %8.2f s %6.1f%%\n", groups[i].name,
+                groups[i].threads, groups[i].cpu,
+                totalcpu > 0 ? (100.0 * groups[i].cpu) / totalcpu : 0);
+    }
+    printf("  %-20s             %8.2f s (%.0f packets per CPU-second)\n",
+            "total", totalcpu,
+            totalcpu > 0 ? metrics[METRIC_ACCEPTED] / totalcpu : 0);
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    fprintf(stderr, "\nWorkload options:\n");
+    fprintf(stderr, "  -n <count>     number of IP intercept targets (default: 100)\n");
+    fprintf(stderr, "  -r <rate>      RADIUS sessions restarted per second (default: 10)\n");
+    fprintf(stderr, "  -t <rate>      IP target packets per second (default: 20000)\n");
+    fprintf(stderr, "  -b <percent>   background packets per 100 target packets (default: 50)\n");
+    fprintf(stderr, "  -s <min:max>   IP target payload size range (default: 64:1400)\n");
+    fprintf(stderr, "  -v <count>     number of VoIP targets (default: 10)\n");
+    fprintf(stderr, "  -a <rate>      SIP calls started per second (default: 2)\n");
+    fprintf(stderr, "  -l <seconds>   SIP call length (default: 10)\n");
+    fprintf(stderr, "  -m <count>     number of email targets (default: 10)\n");
+    fprintf(stderr, "  -e <rate>      SMTP sessions per second (default: 5)\n");
+    fprintf(stderr, "  -d <seconds>   workload duration (default: 30)\n");
+    fprintf(stderr, "\nCollector options:\n");
+    fprintf(stderr, "  -C <path>      collector binary (default: ./openlicollector)\n");
+    fprintf(stderr, "  -w <dir>       directory for the workload, config and log (default: /tmp)\n");
+    fprintf(stderr, "  -i <count>     collector input threads (default: 1)\n");
+    fprintf(stderr, "  -E <count>     collector encoder threads (default: 2)\n");
+    fprintf(stderr, "  -F <count>     collector forwarding threads (default: 1)\n");
+    fprintf(stderr, "  -T <seconds>   give up if processing takes longer than this (default: 600)\n");
+    fprintf(stderr, "  -g             generate the workload only, do not run the collector\n");
+    fprintf(stderr, "  -N             do not decode records in the stand-in mediator\n");
+}
+
+int main(int argc, char *argv[]) {
+    workload_config_t work;
+    workload_summary_t summary;
+    fake_provisioner_t prov;
+    fake_mediator_t med;
+    pthread_t provtid, medtid;
+    thread_cpu_t groups[32];
+    char *binary = "./openlicollector", *workdir = "/tmp";
+    char pcapname[1024], confname[1024], logname[1024];
+    unsigned int minsize = 64, maxsize = 1400;
+    int inputthreads = 1, encoders = 2, forwarders = 1, timeout = 600;
+    int genonly = 0, validate = 1, ngroups = 0, c, ret = 0, status;
+    uint16_t metricsport;
+    int metricsfd;
+    double metrics[METRIC_LAST], lastmetrics[METRIC_LAST];
+    double started = 0, finished = 0, deadline, idlesince = 0, now;
+    uint64_t lastrecords = 0, records;
+    pid_t pid;
+
+    memset(&work, 0, sizeof(work));
+    work.iptargets = 100;
+    work.churn = 10;
+    work.datarate = 20000;
+    work.bgpercent = 50;
+    work.voiptargets = 10;
+    work.callrate = 2;
+    work.calllength = 10;
+    work.mailtargets = 10;
+    work.mailrate = 5;
+    work.duration = 30;
+
+    while ((c = getopt(argc, argv, "n:r:t:b:s:v:a:l:m:e:d:C:w:i:E:F:T:gNh"))
+            != -1) {
+        switch (c) {
+            case 'n':
+                work.iptargets = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                work.churn = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                work.datarate = strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                work.bgpercent = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                if (sscanf(optarg, "%u:%u", &minsize, &maxsize) != 2) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'v':
+                work.voiptargets = strtoul(optarg, NULL, 10);
+                break;
+            case 'a':
+                work.callrate = strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                work.calllength = strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                work.mailtargets = strtoul(optarg, NULL, 10);
+                break;
+            case 'e':
+                work.mailrate = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                work.duration = strtoul(optarg, NULL, 10);
+                break;
+            case 'C':
+                binary = optarg;
+                break;
+            case 'w':
+                workdir = optarg;
+                break;
+            case 'i':
+                inputthreads = atoi(optarg);
+                break;
+            case 'E':
+                encoders = atoi(optarg);
+                break;
+            case 'F':
+                forwarders = atoi(optarg);
+                break;
+            case 'T':
+                timeout = atoi(optarg);
+                break;
+            case 'g':
+                genonly = 1;
+                break;
+            case 'N':
+                validate = 0;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (work.duration == 0 || minsize == 0 || maxsize < minsize ||
+            maxsize > 1472 || work.bgpercent > 100 || inputthreads <= 0 ||
+            encoders <= 0 || forwarders <= 0 || work.calllength == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    work.minsize = minsize;
+    work.maxsize = maxsize;
+
+    snprintf(pcapname, sizeof(pcapname), "%s/openli-collbench.pcap", workdir);
+    snprintf(confname, sizeof(confname), "%s/openli-collbench.yaml", workdir);
+    snprintf(logname, sizeof(logname), "%s/openli-collbench.log", workdir);
+
+    srand(1);
+    printf("generating workload in %s\n", pcapname);
+    if (generate_workload(pcapname, &work, &summary) < 0) {
+        return 1;
+    }
+    printf("wrote %lu packets (%.1f MB)\n", (unsigned long)summary.packets,
+            summary.bytes / (1024.0 * 1024.0));
+    if (genonly) {
+        return 0;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&prov, 0, sizeof(prov));
+    memset(&med, 0, sizeof(med));
+    pthread_mutex_init(&(med.mutex), NULL);
+    med.validate = validate;
+    prov.work = &work;
+
+    /* Grab a free port for the collector's metrics server */
+    metricsfd = create_loopback_listener(&metricsport);
+    if (metricsfd < 0) {
+        fprintf(stderr, "unable to find a free port for metrics\n");
+        return 1;
+    }
+    close(metricsfd);
+
+    prov.listenfd = create_loopback_listener(&(prov.port));
+    med.listenfd = create_loopback_listener(&(med.port));
+    if (prov.listenfd < 0 || med.listenfd < 0) {
+        fprintf(stderr, "unable to create listening sockets: %s\n",
+                strerror(errno));
+        return 1;
+    }
+    prov.mediatorport = med.port;
+
+    if (write_collector_config(confname, pcapname, prov.port, metricsport,
+                inputthreads, encoders, forwarders) < 0) {
+        return 1;
+    }
+
+    pthread_create(&medtid, NULL, run_fake_mediator, &med);
+    pthread_create(&provtid, NULL, run_fake_provisioner, &prov);
+
+    printf("starting %s (log: %s)\n", binary, logname);
+    pid = start_bench_process(binary, confname, logname);
+    if (pid < 0) {
+        fprintf(stderr, "unable to start collector: %s\n", strerror(errno));
+        ret = 1;
+        goto endbench;
+    }
+
+    /* Wait until the collector has read the whole workload and no more
+     * records have arrived for a couple of seconds.
+     */
+    memset(lastmetrics, 0, sizeof(lastmetrics));
+    deadline = wall_seconds() + timeout;
+    while ((now = wall_seconds()) < deadline) {
+        usleep(100000);
+
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            fprintf(stderr, "collector exited unexpectedly, see %s\n",
+                    logname);
+            pid = -1;
+            ret = 1;
+            goto endbench;
+        }
+
+        if (scrape_metrics(metricsport, metric_names, METRIC_LAST,
+                    metrics) < 0) {
+            continue;
+        }
+        records = mediator_total_records(&med);
+
+        if (started == 0 && metrics[METRIC_ACCEPTED] > 0) {
+            started = now;
+        }
+        if (started == 0) {
+            continue;
+        }
+
+        if (records != lastrecords ||
+                metrics[METRIC_ACCEPTED] != lastmetrics[METRIC_ACCEPTED]) {
+            lastrecords = records;
+            memcpy(lastmetrics, metrics, sizeof(metrics));
+            idlesince = now;
+            /* Sample CPU while the threads are still running */
+            ngroups = measure_thread_cpu(pid, groups, 32);
+            continue;
+        }
+
+        if (now - idlesince >= 2.0 &&
+                metrics[METRIC_ACCEPTED] + metrics[METRIC_DROPPED] >=
+                summary.packets) {
+            break;
+        }
+    }
+
+    if (now >= deadline) {
+        fprintf(stderr, "collector did not finish within %d seconds\n",
+                timeout);
+        ret = 1;
+    }
+
+    ngroups = measure_thread_cpu(pid, groups, 32);
+    pthread_mutex_lock(&(med.mutex));
+    finished = med.lastrecord > 0 ? med.lastrecord : idlesince;
+    if (med.firstrecord > 0 && med.firstrecord < started) {
+        started = med.firstrecord;
+    }
+    pthread_mutex_unlock(&(med.mutex));
+
+    report_results(&work, &summary, &med, metrics, started, finished,
+            groups, ngroups);
+
+endbench:
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, &status, 0);
+    }
+    prov.halt = 1;
+    med.halt = 1;
+    pthread_join(provtid, NULL);
+    pthread_join(medtid, NULL);
+    close(prov.listenfd);
+    close(med.listenfd);
+    pthread_mutex_destroy(&(med.mutex));
+    return ret;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
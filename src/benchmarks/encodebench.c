@@ -0,0 +1,545 @@
+/*
+ *
+ * Copyright (c) 2018-2022 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* Microbenchmark for the collector's ETSI encoder.
+ *
+ * Synthetic encoding jobs are fed straight into encode_etsi(), the same
+ * function that the encoder threads call for every record, so the
+ * templated header and body paths (and the encryption container, if
+ * enabled) are measured without any of the surrounding ZMQ plumbing.
+ *
+ * Each combination of record type, payload size, number of CINs and
+ * encryption setting is run separately with a fresh encoder, so template
+ * creation happens during an untimed warm-up pass. We report the time
+ * taken and the number of heap allocations made per record.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <libwandder_etsili.h>
+
+#include "logger.h"
+#include "etsili_core.h"
+#include "collector/collector_base.h"
+#include "collector/collector_publish.h"
+#include "collector/internetaccess.h"
+#include "collector/ipiri.h"
+#include "collector/encoder_worker.h"
+
+#define BENCH_BATCH 1024
+#define BENCH_LIID "BENCHENC0001"
+#define BENCH_ENCRYPTKEY "0123456789abcdefghijklmn"
+
+#define MAX_BENCH_SIZES 16
+#define MAX_BENCH_CINS 16
+#define MAX_CINS_PER_LIID 1000000
+
+/* Count every heap allocation made while a batch is being encoded. This
+ * relies on glibc exporting its allocator under the __libc_ names, so that
+ * we can interpose on malloc() and friends (including calls made inside
+ * libwandder and OpenSSL).
+ */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static int count_allocs = 0;
+static uint64_t alloc_count = 0;
+
+void *malloc(size_t size) {
+    if (count_allocs) {
+        alloc_count ++;
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (count_allocs) {
+        alloc_count ++;
+    }
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (count_allocs) {
+        alloc_count ++;
+    }
+    return __libc_realloc(ptr, size);
+}
+#define ALLOCS_COUNTED 1
+#else
+static int count_allocs = 0;
+static uint64_t alloc_count = 0;
+#define ALLOCS_COUNTED 0
+#endif
+
+enum {
+    BENCH_RECORD_IPCC,
+    BENCH_RECORD_IPIRI,
+    BENCH_RECORD_IPMMCC,
+    BENCH_RECORD_IPMMIRI,
+    BENCH_RECORD_EMAILCC,
+    BENCH_RECORD_LAST
+};
+
+static const char *record_type_names[] = {
+    "ipcc", "ipiri", "ipmmcc", "ipmmiri", "emailcc"
+};
+
+static const uint8_t record_export_types[] = {
+    OPENLI_EXPORT_IPCC, OPENLI_EXPORT_IPIRI, OPENLI_EXPORT_IPMMCC,
+    OPENLI_EXPORT_IPMMIRI, OPENLI_EXPORT_EMAILCC
+};
+
+typedef struct bench_case {
+    int rectype;
+    uint16_t size;
+    uint32_t cins;
+    uint8_t encrypt;
+} bench_case_t;
+
+/* Per-CIN state, as tracked by a sequence tracker thread */
+typedef struct bench_cin {
+    char cinstr[16];
+    uint32_t seqno;
+} bench_cin_t;
+
+typedef struct bench_result {
+    double nsperrec;
+    double allocsperrec;
+    double bytesperrec;
+} bench_result_t;
+
+static double wall_nanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000.0) + ts.tv_nsec;
+}
+
+static void fill_payload(uint8_t *payload, int rectype, uint16_t size) {
+    const char *sip = "INVITE sip:bench@example.org SIP/2.0\r\n"
+            "Via: SIP/2.0/UDP 192.0.2.10:5060\r\n"
+            "Call-ID: encodebench@example.org\r\n"
+            "X-Padding: ";
+    uint16_t i;
+
+    for (i = 0; i < size; i++) {
+        payload[i] = (uint8_t)(rand() & 0xff);
+    }
+
+    if (rectype == BENCH_RECORD_IPMMIRI) {
+        memset(payload, 'a', size);
+        memcpy(payload, sip, strlen(sip) < size ? strlen(sip) : size);
+    } else if (size > 0) {
+        payload[0] = 0x45;
+    }
+}
+
+/* Sets up the request for a record, in the same way as the packet
+ * processing and sync threads would.
+ */
+static void init_request(openli_export_recv_t *req, int rectype,
+        uint32_t cin, uint8_t *payload, uint16_t size,
+        internetaccess_ip_t *ip) {
+
+    uint32_t src = htonl(0xC0000201), dst = htonl(0xC633640A);
+
+    memset(req, 0, sizeof(openli_export_recv_t));
+    req->type = record_export_types[rectype];
+
+    switch(rectype) {
+        case BENCH_RECORD_IPCC:
+        case BENCH_RECORD_IPMMCC:
+            req->data.ipcc.liid = BENCH_LIID;
+            req->data.ipcc.ipcontent = payload;
+            req->data.ipcc.ipclen = size;
+            req->data.ipcc.cin = cin;
+            req->data.ipcc.dir = (cin & 1) ? ETSI_DIR_TO_TARGET :
+                    ETSI_DIR_FROM_TARGET;
+            break;
+        case BENCH_RECORD_IPIRI:
+            req->data.ipiri.liid = BENCH_LIID;
+            req->data.ipiri.cin = cin;
+            req->data.ipiri.username = "bench@example.org";
+            req->data.ipiri.assignedips = ip;
+            req->data.ipiri.ipcount = 1;
+            req->data.ipiri.ipversioning = SESSION_IP_VERSION_V4;
+            req->data.ipiri.access_tech = INTERNET_ACCESS_TYPE_FIBER;
+            req->data.ipiri.special = OPENLI_IPIRI_STANDARD;
+            req->data.ipiri.ipassignmentmethod =
+                    OPENLI_IPIRI_IPMETHOD_DYNAMIC;
+            req->data.ipiri.iritype = ETSILI_IRI_REPORT;
+            break;
+        case BENCH_RECORD_IPMMIRI:
+            req->data.ipmmiri.liid = BENCH_LIID;
+            req->data.ipmmiri.cin = cin;
+            req->data.ipmmiri.iritype = ETSILI_IRI_REPORT;
+            req->data.ipmmiri.content = (char *)payload;
+            req->data.ipmmiri.contentlen = size;
+            memcpy(req->data.ipmmiri.ipsrc, &src, sizeof(src));
+            memcpy(req->data.ipmmiri.ipdest, &dst, sizeof(dst));
+            req->data.ipmmiri.ipfamily = AF_INET;
+            break;
+        case BENCH_RECORD_EMAILCC:
+            req->data.emailcc.liid = BENCH_LIID;
+            req->data.emailcc.cin = cin;
+            req->data.emailcc.format = ETSILI_EMAIL_CC_FORMAT_APP;
+            req->data.emailcc.dir = (cin & 1) ? ETSI_DIR_TO_TARGET :
+                    ETSI_DIR_FROM_TARGET;
+            req->data.emailcc.cc_content = payload;
+            req->data.emailcc.cc_content_len = size;
+            break;
+    }
+}
+
+/* Encodes a batch of records, returning the time taken in nanoseconds.
+ * Only the encoding itself is timed -- creating the jobs and freeing the
+ * results is left to the sequence tracker and forwarder in the collector.
+ */
+static double encode_batch(openli_encoder_t *enc, bench_case_t *bc,
+        wandder_encode_job_t *preencoded, bench_cin_t *cins,
+        uint8_t *payload, internetaccess_ip_t *ip, uint64_t *recno,
+        uint64_t *outbytes) {
+
+    openli_export_recv_t reqs[BENCH_BATCH];
+    openli_encoding_job_t jobs[BENCH_BATCH];
+    openli_encoded_result_t results[BENCH_BATCH];
+    bench_cin_t *c;
+    double start, elapsed;
+    int i, ret;
+
+    for (i = 0; i < BENCH_BATCH; i++) {
+        c = &(cins[(*recno) % bc->cins]);
+
+        init_request(&(reqs[i]), bc->rectype, (*recno) % bc->cins,
+                payload, bc->size, ip);
+        gettimeofday(&(reqs[i].ts), NULL);
+
+        memset(&(jobs[i]), 0, sizeof(openli_encoding_job_t));
+        jobs[i].preencoded = preencoded;
+        jobs[i].seqno = c->seqno;
+        jobs[i].cin = (*recno) % bc->cins;
+        jobs[i].cinstr = c->cinstr;
+        jobs[i].origreq = &(reqs[i]);
+        jobs[i].liid = BENCH_LIID;
+        jobs[i].cept_version = 0;
+        if (bc->encrypt) {
+            jobs[i].encryptmethod = OPENLI_PAYLOAD_ENCRYPTION_AES_192_CBC;
+            jobs[i].encryptkey = BENCH_ENCRYPTKEY;
+        } else {
+            jobs[i].encryptmethod = OPENLI_PAYLOAD_ENCRYPTION_NONE;
+            jobs[i].encryptkey = NULL;
+        }
+        c->seqno ++;
+        (*recno) ++;
+    }
+    memset(results, 0, sizeof(results));
+
+    count_allocs = 1;
+    start = wall_nanoseconds();
+    for (i = 0; i < BENCH_BATCH; i++) {
+        ret = encode_etsi(enc, &(jobs[i]), &(results[i]));
+        if (ret <= 0) {
+            count_allocs = 0;
+            fprintf(stderr, "failed to encode %s record\n",
+                    record_type_names[bc->rectype]);
+            return -1;
+        }
+    }
+    /* Encrypted records are only finished once the pending batch of
+     * payloads has been encrypted */
+    if (etsili_flush_encryption_batch(enc) < 0) {
+        count_allocs = 0;
+        fprintf(stderr, "failed to encrypt %s records\n",
+                record_type_names[bc->rectype]);
+        return -1;
+    }
+    elapsed = wall_nanoseconds() - start;
+    count_allocs = 0;
+
+    for (i = 0; i < BENCH_BATCH; i++) {
+        if (results[i].msgbody) {
+            *outbytes += results[i].msgbody->len;
+            free(results[i].msgbody->encoded);
+            free(results[i].msgbody);
+        }
+    }
+    return elapsed;
+}
+
+static int run_case(bench_case_t *bc, uint32_t count,
+        bench_result_t *result) {
+
+    openli_encoder_t enc;
+    wandder_encode_job_t *preencoded;
+    etsili_intercept_details_t details;
+    bench_cin_t *cins;
+    internetaccess_ip_t ip;
+    struct sockaddr_in *in;
+    uint8_t payload[65536];
+    uint64_t recno = 0, outbytes = 0, allocs;
+    uint32_t i, batches;
+    double elapsed = 0, ns;
+
+    memset(&enc, 0, sizeof(enc));
+    enc.encoder = init_wandder_encoder();
+    enc.freegenerics = create_etsili_generic_freelist(0);
+
+    details.liid = BENCH_LIID;
+    details.authcc = "NZ";
+    details.delivcc = "NZ";
+    details.operatorid = "WAND";
+    details.networkelemid = "encodebench";
+    details.intpointid = NULL;
+    preencoded = calloc(OPENLI_PREENCODE_LAST, sizeof(wandder_encode_job_t));
+    etsili_preencode_static_fields(preencoded, &details);
+
+    cins = calloc(bc->cins, sizeof(bench_cin_t));
+    for (i = 0; i < bc->cins; i++) {
+        snprintf(cins[i].cinstr, sizeof(cins[i].cinstr), "%u", i);
+        cins[i].seqno = 0;
+    }
+
+    memset(&ip, 0, sizeof(ip));
+    ip.ipfamily = AF_INET;
+    ip.prefixbits = 32;
+    in = (struct sockaddr_in *)&(ip.assignedip);
+    in->sin_family = AF_INET;
+    in->sin_addr.s_addr = htonl(0x0A400001);
+
+    fill_payload(payload, bc->rectype, bc->size);
+
+    /* Warm up, so that every template has been created before we start
+     * timing */
+    if (encode_batch(&enc, bc, preencoded, cins, payload, &ip, &recno,
+            &outbytes) < 0) {
+        goto failcase;
+    }
+
+    batches = (count + BENCH_BATCH - 1) / BENCH_BATCH;
+    outbytes = 0;
+    alloc_count = 0;
+    for (i = 0; i < batches; i++) {
+        ns = encode_batch(&enc, bc, preencoded, cins, payload, &ip, &recno,
+                &outbytes);
+        if (ns < 0) {
+            goto failcase;
+        }
+        elapsed += ns;
+    }
+    allocs = alloc_count;
+
+    result->nsperrec = elapsed / (batches * BENCH_BATCH);
+    result->allocsperrec = (double)allocs / (batches * BENCH_BATCH);
+    result->bytesperrec = (double)outbytes / (batches * BENCH_BATCH);
+
+    destroy_encoder_worker(&enc);
+    etsili_clear_preencoded_fields(preencoded);
+    free(preencoded);
+    free(cins);
+    return 0;
+
+failcase:
+    destroy_encoder_worker(&enc);
+    etsili_clear_preencoded_fields(preencoded);
+    free(preencoded);
+    free(cins);
+    return -1;
+}
+
+/* Parses a comma-separated list of numbers */
+static int parse_list(char *str, uint32_t *vals, int maxvals,
+        uint32_t minval, uint32_t maxval) {
+
+    char *tok, *saveptr = NULL;
+    int n = 0;
+
+    for (tok = strtok_r(str, ",", &saveptr); tok != NULL;
+            tok = strtok_r(NULL, ",", &saveptr)) {
+        if (n >= maxvals) {
+            return -1;
+        }
+        vals[n] = strtoul(tok, NULL, 10);
+        if (vals[n] < minval || vals[n] > maxval) {
+            return -1;
+        }
+        n ++;
+    }
+    return n;
+}
+
+static int parse_record_types(char *str, uint8_t *enabled) {
+    char *tok, *saveptr = NULL;
+    int i, found;
+
+    memset(enabled, 0, BENCH_RECORD_LAST);
+    for (tok = strtok_r(str, ",", &saveptr); tok != NULL;
+            tok = strtok_r(NULL, ",", &saveptr)) {
+        found = 0;
+        for (i = 0; i < BENCH_RECORD_LAST; i++) {
+            if (strcmp(tok, record_type_names[i]) == 0) {
+                enabled[i] = 1;
+                found = 1;
+            }
+        }
+        if (!found) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  -t <types>     record types to encode (default: ipcc,ipiri,ipmmcc,ipmmiri,emailcc)\n");
+    fprintf(stderr, "  -s <sizes>     payload sizes, comma-separated (default: 64,512,1400)\n");
+    fprintf(stderr, "  -c <counts>    CINs per LIID, comma-separated (default: 1,100,10000)\n");
+    fprintf(stderr, "  -e <mode>      payload encryption: off, on or both (default: both)\n");
+    fprintf(stderr, "  -n <count>     records to encode for each combination (default: 200000)\n");
+}
+
+int main(int argc, char *argv[]) {
+    uint8_t rectypes[BENCH_RECORD_LAST];
+    uint32_t sizes[MAX_BENCH_SIZES] = {64, 512, 1400};
+    uint32_t cincounts[MAX_BENCH_CINS] = {1, 100, 10000};
+    int nsizes = 3, ncins = 3, encmin = 0, encmax = 1;
+    uint32_t count = 200000;
+    bench_case_t bc;
+    bench_result_t res;
+    int c, t, s, n, e, ret = 0;
+
+    memset(rectypes, 1, sizeof(rectypes));
+
+    while ((c = getopt(argc, argv, "t:s:c:e:n:h")) != -1) {
+        switch (c) {
+            case 't':
+                if (parse_record_types(optarg, rectypes) < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 's':
+                nsizes = parse_list(optarg, sizes, MAX_BENCH_SIZES, 1,
+                        65000);
+                if (nsizes <= 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'c':
+                ncins = parse_list(optarg, cincounts, MAX_BENCH_CINS, 1,
+                        MAX_CINS_PER_LIID);
+                if (ncins <= 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'e':
+                if (strcmp(optarg, "off") == 0) {
+                    encmin = encmax = 0;
+                } else if (strcmp(optarg, "on") == 0) {
+                    encmin = encmax = 1;
+                } else if (strcmp(optarg, "both") == 0) {
+                    encmin = 0;
+                    encmax = 1;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'n':
+                count = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (count == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    srand(1);
+    printf("%-8s %6s %7s %8s %12s %14s %12s\n", "type", "size", "cins",
+            "encrypt", "ns/record", "allocs/record", "bytes/record");
+
+    for (t = 0; t < BENCH_RECORD_LAST; t++) {
+        if (!rectypes[t]) {
+            continue;
+        }
+        for (s = 0; s < nsizes; s++) {
+            /* IPIRI content does not depend on a payload size */
+            if (t == BENCH_RECORD_IPIRI && s > 0) {
+                break;
+            }
+            for (n = 0; n < ncins; n++) {
+                for (e = encmin; e <= encmax; e++) {
+                    bc.rectype = t;
+                    bc.size = sizes[s];
+                    bc.cins = cincounts[n];
+                    bc.encrypt = e;
+
+                    if (run_case(&bc, count, &res) < 0) {
+                        ret = 1;
+                        continue;
+                    }
+
+                    printf("%-8s ", record_type_names[t]);
+                    if (t == BENCH_RECORD_IPIRI) {
+                        printf("%6s ", "-");
+                    } else {
+                        printf("%6u ", bc.size);
+                    }
+                    printf("%7u %8s %12.1f ", bc.cins, e ? "aes192" : "none",
+                            res.nsperrec);
+                    if (ALLOCS_COUNTED) {
+                        printf("%14.2f ", res.allocsperrec);
+                    } else {
+                        printf("%14s ", "n/a");
+                    }
+                    printf("%12.0f\n", res.bytesperrec);
+                }
+            }
+        }
+    }
+
+    return ret;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
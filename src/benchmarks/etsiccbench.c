@@ -0,0 +1,365 @@
+/*
+ *
+ * Copyright (c) 2018 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* Decode throughput benchmark for the ETSI CC records that the mediator
+ * writes to pcap. A synthetic stream of IPCC records is built using the
+ * collector's templated encoder, then decoded repeatedly with both the
+ * generic libwandder ETSI decoder and the mediator's IPCC fast path. The
+ * fast path results are checked against the generic decoder before timing.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/time.h>
+#include <libwandder_etsili.h>
+
+#include "logger.h"
+#include "etsili_core.h"
+#include "mediator/etsicc_fastpath.h"
+
+typedef struct synthetic_stream {
+    uint8_t *buf;
+    uint64_t len;
+    uint64_t alloced;
+    uint32_t records;
+    uint64_t ipbytes;
+} synthetic_stream_t;
+
+static double wall_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+static void append_to_stream(synthetic_stream_t *stream, uint8_t *data,
+        uint32_t len) {
+
+    while (stream->len + len > stream->alloced) {
+        stream->alloced = stream->alloced ? stream->alloced * 2 : 1048576;
+        stream->buf = realloc(stream->buf, stream->alloced);
+    }
+    memcpy(stream->buf + stream->len, data, len);
+    stream->len += len;
+}
+
+/* Writes the outer PS-PDU sequence header, as done by the collector's
+ * encode_pspdu_sequence() (minus the LIID prefix, which the mediator
+ * strips before the record reaches the pcap thread).
+ */
+static uint8_t encode_pspdu_header(uint8_t *space, uint32_t contentsize) {
+    uint8_t lenspace = DERIVE_INTEGER_LENGTH(contentsize);
+    int i;
+
+    space[0] = 0x30;
+    if (lenspace == 1) {
+        space[1] = (uint8_t)contentsize;
+        return 2;
+    }
+    space[1] = 0x80 | lenspace;
+    for (i = lenspace - 1; i >= 0; i--) {
+        space[2 + i] = contentsize & 0xff;
+        contentsize = contentsize >> 8;
+    }
+    return 2 + lenspace;
+}
+
+static int build_stream(synthetic_stream_t *stream, uint32_t count,
+        uint16_t minsize, uint16_t maxsize, int liidcount) {
+
+    wandder_encoder_t *encoder;
+    wandder_encode_job_t preencoded[OPENLI_PREENCODE_LAST];
+    etsili_intercept_details_t details;
+    encoded_header_template_t hdr;
+    encoded_global_template_t *ipcc;
+    uint8_t pspdu[8], pkt[65535];
+    uint8_t pspdulen;
+    struct timeval tv;
+    char liid[32];
+    uint32_t i;
+    uint16_t iplen;
+    int l;
+
+    encoder = init_wandder_encoder();
+    ipcc = calloc(65536, sizeof(encoded_global_template_t));
+
+    for (i = 0; i < sizeof(pkt); i++) {
+        pkt[i] = (uint8_t)(rand() & 0xff);
+    }
+
+    for (l = 0; l < liidcount; l++) {
+        snprintf(liid, sizeof(liid), "BENCHLIID%04d", l);
+        memset(&details, 0, sizeof(details));
+        details.liid = liid;
+        details.authcc = "NZ";
+        details.delivcc = "NZ";
+        details.operatorid = "WAND";
+        details.networkelemid = "bench";
+        details.intpointid = NULL;
+
+        memset(preencoded, 0, sizeof(preencoded));
+        etsili_preencode_static_fields(preencoded, &details);
+
+        /* Fixed-width sequence numbers and timestamps, so that the header
+         * template can be updated in place as the collector does */
+        gettimeofday(&tv, NULL);
+        tv.tv_usec = 500000;
+        memset(&hdr, 0, sizeof(hdr));
+        if (etsili_create_header_template(encoder, preencoded, 1, 100000,
+                &tv, &hdr) < 0) {
+            fprintf(stderr, "unable to create ETSI header template\n");
+            return -1;
+        }
+
+        for (i = l; i < count; i += liidcount) {
+            iplen = minsize + (rand() % (maxsize - minsize + 1));
+            pkt[0] = 0x45;
+
+            if (ipcc[iplen].cc_content.cc_wrap == NULL) {
+                if (etsili_create_ipcc_template(encoder, preencoded,
+                        0, iplen, &(ipcc[iplen])) < 0) {
+                    fprintf(stderr, "unable to create IPCC template\n");
+                    return -1;
+                }
+            }
+
+            tv.tv_usec = 100000 + (i % 800000);
+            etsili_update_header_template(&hdr, 100000 + (i % 1000), &tv);
+
+            /* The IPCC template reserves space for the packet at the end
+             * of the wrap, so the packet replaces the last iplen bytes */
+            pspdulen = encode_pspdu_header(pspdu, hdr.header_len +
+                    ipcc[iplen].cc_content.cc_wrap_len);
+            append_to_stream(stream, pspdu, pspdulen);
+            append_to_stream(stream, hdr.header, hdr.header_len);
+            append_to_stream(stream, ipcc[iplen].cc_content.cc_wrap,
+                    ipcc[iplen].cc_content.cc_wrap_len - iplen);
+            append_to_stream(stream, pkt, iplen);
+            stream->records ++;
+            stream->ipbytes += iplen;
+        }
+
+        free(hdr.header);
+        etsili_clear_preencoded_fields(preencoded);
+    }
+
+    /* The IPCC body templates do not depend on the LIID, so they were
+     * shared by every LIID above */
+    for (i = 0; i < 65536; i++) {
+        if (ipcc[i].cc_content.cc_wrap) {
+            free(ipcc[i].cc_content.cc_wrap);
+        }
+    }
+    free(ipcc);
+    free_wandder_encoder(encoder);
+    return 0;
+}
+
+static uint64_t decode_generic(synthetic_stream_t *stream,
+        wandder_etsispec_t *dec) {
+
+    uint64_t off = 0, total = 0;
+    uint32_t pdulen, cclen;
+    char liid[2048], ccname[128];
+    uint8_t *rawip;
+
+    while (off < stream->len) {
+        wandder_attach_etsili_buffer(dec, stream->buf + off,
+                stream->len - off, false);
+        pdulen = wandder_etsili_get_pdu_length(dec);
+        if (pdulen == 0) {
+            return 0;
+        }
+        if (wandder_etsili_get_liid(dec, liid, sizeof(liid)) == NULL) {
+            return 0;
+        }
+        rawip = wandder_etsili_get_cc_contents(dec, &cclen, ccname,
+                sizeof(ccname));
+        if (rawip == NULL) {
+            return 0;
+        }
+        total += cclen + liid[0];
+        off += pdulen;
+    }
+    return total;
+}
+
+static uint64_t decode_fastpath(synthetic_stream_t *stream) {
+    uint64_t off = 0, total = 0;
+    openli_etsicc_fields_t fields;
+
+    while (off < stream->len) {
+        if (!openli_extract_etsi_ipcc_fields(stream->buf + off,
+                stream->len - off, &fields)) {
+            return 0;
+        }
+        total += fields.iplen + fields.liid[0];
+        off += fields.pdulen;
+    }
+    return total;
+}
+
+/* Checks that the fast path agrees with the generic decoder on every
+ * record in the stream.
+ */
+static int verify_stream(synthetic_stream_t *stream,
+        wandder_etsispec_t *dec) {
+
+    uint64_t off = 0;
+    uint32_t pdulen, cclen;
+    char liid[2048], ccname[128];
+    uint8_t *rawip;
+    openli_etsicc_fields_t fields;
+
+    while (off < stream->len) {
+        wandder_attach_etsili_buffer(dec, stream->buf + off,
+                stream->len - off, false);
+        pdulen = wandder_etsili_get_pdu_length(dec);
+        wandder_etsili_get_liid(dec, liid, sizeof(liid));
+        rawip = wandder_etsili_get_cc_contents(dec, &cclen, ccname,
+                sizeof(ccname));
+
+        if (!openli_extract_etsi_ipcc_fields(stream->buf + off,
+                stream->len - off, &fields)) {
+            fprintf(stderr, "fast path rejected record at offset %lu\n",
+                    (unsigned long)off);
+            return -1;
+        }
+        if (fields.pdulen != pdulen || fields.ipcontent != rawip ||
+                fields.iplen != cclen || fields.liidlen != strlen(liid) ||
+                memcmp(fields.liid, liid, fields.liidlen) != 0) {
+            fprintf(stderr, "fast path disagrees with generic decoder at offset %lu\n",
+                    (unsigned long)off);
+            return -1;
+        }
+        off += pdulen;
+    }
+    return 0;
+}
+
+static void report(const char *name, synthetic_stream_t *stream,
+        int iterations, double elapsed) {
+
+    double recs = (double)stream->records * iterations;
+
+    printf("%-10s %12.0f records/s %10.1f MB/s (IP payload)\n", name,
+            elapsed > 0 ? recs / elapsed : 0,
+            elapsed > 0 ? (stream->ipbytes * (double)iterations) /
+                    (1024.0 * 1024.0) / elapsed : 0);
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  -n <count>     number of records in the stream (default: 100000)\n");
+    fprintf(stderr, "  -s <min:max>   IP packet size range (default: 64:1500)\n");
+    fprintf(stderr, "  -l <count>     number of distinct LIIDs (default: 16)\n");
+    fprintf(stderr, "  -i <count>     passes over the stream per decoder (default: 20)\n");
+}
+
+int main(int argc, char *argv[]) {
+    synthetic_stream_t stream;
+    wandder_etsispec_t *dec;
+    uint32_t count = 100000;
+    unsigned int minsize = 64, maxsize = 1500;
+    int liidcount = 16, iterations = 20;
+    int c, i, ret = 0;
+    double start, elapsed;
+    uint64_t check = 0;
+
+    while ((c = getopt(argc, argv, "n:s:l:i:h")) != -1) {
+        switch (c) {
+            case 'n':
+                count = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                if (sscanf(optarg, "%u:%u", &minsize, &maxsize) != 2) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'l':
+                liidcount = atoi(optarg);
+                break;
+            case 'i':
+                iterations = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (count == 0 || liidcount <= 0 || iterations <= 0 || minsize == 0 ||
+            maxsize < minsize || maxsize > 65535) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    memset(&stream, 0, sizeof(stream));
+    srand(1);
+    if (build_stream(&stream, count, minsize, maxsize, liidcount) < 0) {
+        return 1;
+    }
+    printf("built %u IPCC records (%.1f MB)\n", stream.records,
+            stream.len / (1024.0 * 1024.0));
+
+    dec = wandder_create_etsili_decoder();
+    if (verify_stream(&stream, dec) < 0) {
+        ret = 1;
+        goto endbench;
+    }
+
+    start = wall_seconds();
+    for (i = 0; i < iterations; i++) {
+        check += decode_generic(&stream, dec);
+    }
+    elapsed = wall_seconds() - start;
+    report("libwandder", &stream, iterations, elapsed);
+
+    start = wall_seconds();
+    for (i = 0; i < iterations; i++) {
+        check -= decode_fastpath(&stream);
+    }
+    elapsed = wall_seconds() - start;
+    report("fastpath", &stream, iterations, elapsed);
+
+    if (check != 0) {
+        fprintf(stderr, "decoders produced different results\n");
+        ret = 1;
+    }
+
+endbench:
+    wandder_free_etsili_decoder(dec);
+    free(stream.buf);
+    return ret;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,1190 @@
+/*
+ *
+ * Copyright (c) 2018-2022 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* End-to-end throughput and latency benchmark for the OpenLI mediator.
+ *
+ * The mediator is started with a generated config and connected to three
+ * stand-ins that all run inside this process:
+ *
+ *  - a provisioner, which announces a single LEA and maps each of the
+ *    benchmark LIIDs to it.
+ *  - a collector, which pushes pre-encoded ETSI IRI and CC records for
+ *    those LIIDs to the mediator at a target rate, using the same framing
+ *    as a real collector.
+ *  - an LEA, which accepts the HI2 and HI3 handovers from the mediator,
+ *    answers keepalives and counts every record that is delivered.
+ *
+ * Each record carries its send time in the PS header timestamp, so the LEA
+ * can measure the delay added by the mediator (including the internal
+ * RabbitMQ queues). Once delivery has stopped, we report the record rates
+ * achieved, the latency distribution, any records that were lost and the
+ * CPU time used by each group of mediator threads.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <libwandder_etsili.h>
+
+#include "logger.h"
+#include "util.h"
+#include "agency.h"
+#include "netcomms.h"
+#include "etsili_core.h"
+#include "collector/ipiri.h"
+#include "mediator/etsicc_fastpath.h"
+#include "benchmarks/bench_util.h"
+
+#define BENCH_AGENCY "benchlea"
+#define BENCH_LIID_PREFIX "BENCHMED"
+
+/* Only every Nth delivered record is timestamped, to keep the LEA from
+ * becoming the bottleneck */
+#define LATENCY_SAMPLE_FREQ 16
+#define MAX_LATENCY_SAMPLES 1000000
+
+#define MAX_HANDOVER_CONNS 16
+#define HANDOVER_BUFSIZE (4 * 1024 * 1024)
+#define COLLECTOR_BATCH_SIZE (256 * 1024)
+
+enum {
+    BENCH_HI2 = 0,
+    BENCH_HI3 = 1,
+};
+
+/* Everything needed to send records for one LIID */
+typedef struct bench_liid {
+    char liid[32];
+    uint16_t liidlen;
+    encoded_header_template_t hdr;
+    uint8_t *iribody;
+    uint32_t iribodylen;
+    uint32_t seqno;
+} bench_liid_t;
+
+/* State shared with the stand-in provisioner thread */
+typedef struct fake_provisioner {
+    int listenfd;
+    uint16_t port;
+    uint16_t hi2port;
+    uint16_t hi3port;
+    uint32_t keepalivefreq;
+    uint32_t keepalivewait;
+    bench_liid_t *liids;
+    int liidcount;
+    volatile int halt;
+    volatile int connected;
+} fake_provisioner_t;
+
+/* State shared with the stand-in collector thread */
+typedef struct fake_collector {
+    uint16_t mediatorport;
+    bench_liid_t *liids;
+    int liidcount;
+    encoded_global_template_t *ipcc;
+    uint8_t *pkt;
+    uint16_t minsize;
+    uint16_t maxsize;
+    uint32_t rate;
+    uint32_t duration;
+    uint32_t iripercent;
+    volatile int halt;
+    volatile int go;
+
+    pthread_mutex_t mutex;
+    uint64_t sent[2];
+    uint64_t sentbytes;
+    double started;
+    double finished;
+    int failed;
+} fake_collector_t;
+
+/* State shared with the stand-in LEA thread */
+typedef struct lea_sink {
+    int listenfd[2];
+    uint16_t port[2];
+    volatile int halt;
+
+    pthread_mutex_t mutex;
+    uint64_t records[2];
+    uint64_t bytes;
+    uint64_t keepalives;
+    uint64_t invalid;
+    int connected[2];
+    double firstrecord;
+    double lastrecord;
+    double *latency;
+    uint32_t samples;
+} lea_sink_t;
+
+typedef struct handover_conn {
+    int fd;
+    int hitype;
+    uint8_t *buf;
+    uint32_t buflen;
+} handover_conn_t;
+
+static inline double timespec_to_secs(struct timespec *ts) {
+    return ts->tv_sec + (ts->tv_nsec / 1000000000.0);
+}
+
+static double wall_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return timespec_to_secs(&ts);
+}
+
+static double tv_to_secs(struct timeval *tv) {
+    return tv->tv_sec + (tv->tv_usec / 1000000.0);
+}
+
+/* Writes the outer PS-PDU sequence header, as done by the collector's
+ * encode_pspdu_sequence() (the LIID prefix is added separately).
+ */
+static uint8_t encode_pspdu_header(uint8_t *space, uint32_t contentsize) {
+    uint8_t lenspace = DERIVE_INTEGER_LENGTH(contentsize);
+    int i;
+
+    space[0] = 0x30;
+    if (lenspace == 1) {
+        space[1] = (uint8_t)contentsize;
+        return 2;
+    }
+    space[1] = 0x80 | lenspace;
+    for (i = lenspace - 1; i >= 0; i--) {
+        space[2 + i] = contentsize & 0xff;
+        contentsize = contentsize >> 8;
+    }
+    return 2 + lenspace;
+}
+
+/* Pre-encodes the PS header template and an IP IRI body for each LIID,
+ * plus the IPCC body templates for each packet size, so that sending a
+ * record only involves updating the header and copying bytes.
+ */
+static int prepare_records(bench_liid_t *liids, int liidcount,
+        fake_collector_t *coll) {
+
+    wandder_encoder_t *encoder;
+    wandder_encode_job_t preencoded[OPENLI_PREENCODE_LAST];
+    etsili_intercept_details_t details;
+    etsili_generic_freelist_t *freegenerics;
+    etsili_generic_t *params, *np, *tmp;
+    wandder_encoded_result_t *body;
+    struct timeval tv;
+    uint32_t evtype = IPIRI_START_WHILE_ACTIVE;
+    uint32_t accesstype = 3;    /* xDSL */
+    char username[64];
+    uint32_t i;
+    int l;
+
+    encoder = init_wandder_encoder();
+    freegenerics = create_etsili_generic_freelist(0);
+    coll->ipcc = calloc(65536, sizeof(encoded_global_template_t));
+    coll->pkt = malloc(65536);
+
+    for (i = 0; i < 65536; i++) {
+        coll->pkt[i] = (uint8_t)(rand() & 0xff);
+    }
+    coll->pkt[0] = 0x45;
+
+    for (l = 0; l < liidcount; l++) {
+        snprintf(liids[l].liid, sizeof(liids[l].liid), "%s%05d",
+                BENCH_LIID_PREFIX, l);
+        liids[l].liidlen = strlen(liids[l].liid);
+
+        memset(&details, 0, sizeof(details));
+        details.liid = liids[l].liid;
+        details.authcc = "NZ";
+        details.delivcc = "NZ";
+        details.operatorid = "WAND";
+        details.networkelemid = "medbench";
+        details.intpointid = NULL;
+
+        memset(preencoded, 0, sizeof(preencoded));
+        etsili_preencode_static_fields(preencoded, &details);
+
+        /* Fixed-width sequence numbers and timestamps, so that the header
+         * template can be updated in place for every record */
+        gettimeofday(&tv, NULL);
+        tv.tv_usec = 500000;
+        memset(&(liids[l].hdr), 0, sizeof(encoded_header_template_t));
+        if (etsili_create_header_template(encoder, preencoded, 1, 100000,
+                &tv, &(liids[l].hdr)) < 0) {
+            fprintf(stderr, "unable to create ETSI header template\n");
+            return -1;
+        }
+        liids[l].seqno = 0;
+
+        params = NULL;
+        snprintf(username, sizeof(username), "user%05d@bench.example.org",
+                l);
+        np = create_etsili_generic(freegenerics,
+                IPIRI_CONTENTS_ACCESS_EVENT_TYPE, sizeof(uint32_t),
+                (uint8_t *)(&evtype));
+        HASH_ADD_KEYPTR(hh, params, &(np->itemnum), sizeof(np->itemnum),
+                np);
+        np = create_etsili_generic(freegenerics,
+                IPIRI_CONTENTS_INTERNET_ACCESS_TYPE, sizeof(uint32_t),
+                (uint8_t *)(&accesstype));
+        HASH_ADD_KEYPTR(hh, params, &(np->itemnum), sizeof(np->itemnum),
+                np);
+        np = create_etsili_generic(freegenerics,
+                IPIRI_CONTENTS_TARGET_USERNAME, strlen(username),
+                (uint8_t *)username);
+        HASH_ADD_KEYPTR(hh, params, &(np->itemnum), sizeof(np->itemnum),
+                np);
+
+        body = encode_ipiri_body(encoder, preencoded, ETSILI_IRI_REPORT,
+                &params);
+        if (body == NULL) {
+            fprintf(stderr, "unable to encode IP IRI body\n");
+            return -1;
+        }
+        liids[l].iribody = malloc(body->len);
+        memcpy(liids[l].iribody, body->encoded, body->len);
+        liids[l].iribodylen = body->len;
+        wandder_release_encoded_result(encoder, body);
+
+        HASH_ITER(hh, params, np, tmp) {
+            HASH_DELETE(hh, params, np);
+            release_etsili_generic(np);
+        }
+
+        /* The IPCC body templates do not depend on the LIID, so build
+         * them using the first LIID's fields and share them */
+        if (l == 0) {
+            for (i = coll->minsize; i <= coll->maxsize; i++) {
+                if (etsili_create_ipcc_template(encoder, preencoded, 0,
+                        i, &(coll->ipcc[i])) < 0) {
+                    fprintf(stderr, "unable to create IPCC template\n");
+                    return -1;
+                }
+            }
+        }
+        etsili_clear_preencoded_fields(preencoded);
+    }
+
+    free_etsili_generics(freegenerics);
+    free_wandder_encoder(encoder);
+    return 0;
+}
+
+static void free_records(bench_liid_t *liids, int liidcount,
+        fake_collector_t *coll) {
+    int i;
+
+    for (i = 0; i < liidcount; i++) {
+        free(liids[i].hdr.header);
+        free(liids[i].iribody);
+    }
+    if (coll->ipcc) {
+        for (i = 0; i < 65536; i++) {
+            if (coll->ipcc[i].cc_content.cc_wrap) {
+                free(coll->ipcc[i].cc_content.cc_wrap);
+            }
+        }
+        free(coll->ipcc);
+    }
+    free(coll->pkt);
+}
+
+/* Handles a single connection from the mediator: waits for it to
+ * authenticate, tells it about our LEA and LIIDs and then keeps the
+ * connection open until the benchmark is over.
+ */
+static void serve_mediator(fake_provisioner_t *prov, int fd) {
+
+    net_buffer_t *incoming, *outgoing;
+    openli_proto_msgtype_t msgtype, err;
+    liagency_t lea;
+    char hi2port[16], hi3port[16];
+    uint8_t *msgbody;
+    uint32_t msglen;
+    uint64_t internalid;
+    struct pollfd pfd;
+    int authed = 0, pending = 0, i;
+
+    snprintf(hi2port, sizeof(hi2port), "%u", prov->hi2port);
+    snprintf(hi3port, sizeof(hi3port), "%u", prov->hi3port);
+    lea.hi2_ipstr = "127.0.0.1";
+    lea.hi2_portstr = hi2port;
+    lea.hi3_ipstr = "127.0.0.1";
+    lea.hi3_portstr = hi3port;
+    lea.agencyid = BENCH_AGENCY;
+    lea.keepalivefreq = prov->keepalivefreq;
+    lea.keepalivewait = prov->keepalivewait;
+
+    fd_set_nonblock(fd);
+    incoming = create_net_buffer(NETBUF_RECV, fd, NULL);
+    outgoing = create_net_buffer(NETBUF_SEND, fd, NULL);
+
+    while (!prov->halt) {
+        pfd.fd = fd;
+        pfd.events = POLLIN | (pending ? POLLOUT : 0);
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 100) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (pfd.revents & POLLIN) {
+            do {
+                msgtype = receive_net_buffer(incoming, &msgbody, &msglen,
+                        &internalid);
+                if (msgtype < 0 || msgtype == OPENLI_PROTO_DISCONNECT) {
+                    goto endmediator;
+                }
+                if (msgtype != OPENLI_PROTO_MEDIATOR_AUTH || authed) {
+                    continue;
+                }
+                if (internalid != OPENLI_MEDIATOR_MAGIC) {
+                    fprintf(stderr, "mediator sent bad auth message\n");
+                    goto endmediator;
+                }
+                if (push_lea_onto_net_buffer(outgoing, &lea) < 0) {
+                    fprintf(stderr, "unable to queue LEA for mediator\n");
+                    goto endmediator;
+                }
+                for (i = 0; i < prov->liidcount; i++) {
+                    if (push_liid_mapping_onto_net_buffer(outgoing,
+                            BENCH_AGENCY, prov->liids[i].liid) < 0) {
+                        fprintf(stderr,
+                                "unable to queue LIID mapping for mediator\n");
+                        goto endmediator;
+                    }
+                }
+                authed = 1;
+                pending = 1;
+            } while (msgtype != OPENLI_PROTO_NO_MESSAGE);
+        }
+
+        if (pending) {
+            pending = transmit_net_buffer(outgoing, &err);
+            if (pending < 0) {
+                nb_log_transmit_error(err);
+                break;
+            }
+            if (pending == 0) {
+                prov->connected ++;
+            }
+        }
+    }
+
+endmediator:
+    destroy_net_buffer(incoming);
+    destroy_net_buffer(outgoing);
+    close(fd);
+}
+
+static void *run_fake_provisioner(void *arg) {
+    fake_provisioner_t *prov = (fake_provisioner_t *)arg;
+    struct pollfd pfd;
+    int fd;
+
+    while (!prov->halt) {
+        pfd.fd = prov->listenfd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        fd = accept(prov->listenfd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        serve_mediator(prov, fd);
+    }
+    return NULL;
+}
+
+/* Appends one framed record to the outgoing batch, in the same layout
+ * that the collector uses: the OpenLI header, the LIID (prefixed by its
+ * length) and then the ETSI PS-PDU.
+ */
+static uint32_t frame_record(fake_collector_t *coll, bench_liid_t *bl,
+        int iri, uint8_t *space) {
+
+    ii_header_t *hdr = (ii_header_t *)space;
+    uint8_t *ptr = space + sizeof(ii_header_t);
+    uint8_t *body;
+    uint32_t bodylen, contentlen;
+    uint16_t iplen = 0, l;
+    struct timeval tv;
+
+    if (iri) {
+        body = bl->iribody;
+        bodylen = bl->iribodylen;
+    } else {
+        iplen = coll->minsize;
+        if (coll->maxsize > coll->minsize) {
+            iplen += rand() % (coll->maxsize - coll->minsize + 1);
+        }
+        /* The template reserves space for the packet at the end of the
+         * wrap, which we fill in below */
+        body = coll->ipcc[iplen].cc_content.cc_wrap;
+        bodylen = coll->ipcc[iplen].cc_content.cc_wrap_len - iplen;
+    }
+
+    gettimeofday(&tv, NULL);
+    etsili_update_header_template(&(bl->hdr),
+            100000 + (bl->seqno % 1000000), &tv);
+    bl->seqno ++;
+
+    l = htons(bl->liidlen);
+    memcpy(ptr, &l, sizeof(uint16_t));
+    memcpy(ptr + 2, bl->liid, bl->liidlen);
+    ptr += 2 + bl->liidlen;
+
+    contentlen = bl->hdr.header_len + bodylen + iplen;
+    ptr += encode_pspdu_header(ptr, contentlen);
+    memcpy(ptr, bl->hdr.header, bl->hdr.header_len);
+    ptr += bl->hdr.header_len;
+    memcpy(ptr, body, bodylen);
+    ptr += bodylen;
+    if (iplen > 0) {
+        memcpy(ptr, coll->pkt, iplen);
+        ptr += iplen;
+    }
+
+    hdr->magic = htonl(OPENLI_PROTO_MAGIC);
+    hdr->bodylen = htons((ptr - space) - sizeof(ii_header_t));
+    hdr->intercepttype = htons(iri ? OPENLI_PROTO_ETSI_IRI :
+            OPENLI_PROTO_ETSI_CC);
+    hdr->internalid = 0;
+
+    return ptr - space;
+}
+
+static int send_batch(int fd, uint8_t *buf, uint32_t len) {
+    uint32_t off = 0;
+    int ret;
+
+    while (off < len) {
+        ret = send(fd, buf + off, len - off, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        off += ret;
+    }
+    return 0;
+}
+
+static void *run_fake_collector(void *arg) {
+    fake_collector_t *coll = (fake_collector_t *)arg;
+    uint8_t *batch, scratch[1024];
+    uint32_t batchlen = 0, batchrecs[2];
+    uint64_t total = 0, target;
+    char portstr[16];
+    double start, now;
+    int fd = 0, iri, l = 0;
+
+    snprintf(portstr, sizeof(portstr), "%u", coll->mediatorport);
+    while (!coll->halt && fd == 0) {
+        fd = connect_socket("127.0.0.1", portstr, 1, 0);
+        if (fd == 0) {
+            usleep(100000);
+        }
+    }
+    if (fd <= 0) {
+        coll->failed = 1;
+        return NULL;
+    }
+
+    /* Don't start until the mediator knows about our LIIDs and has
+     * connected to the LEA */
+    while (!coll->halt && !coll->go) {
+        usleep(10000);
+    }
+
+    batch = malloc(COLLECTOR_BATCH_SIZE);
+    start = wall_seconds();
+    pthread_mutex_lock(&(coll->mutex));
+    coll->started = start;
+    pthread_mutex_unlock(&(coll->mutex));
+
+    while (!coll->halt) {
+        now = wall_seconds();
+        if (now - start >= coll->duration) {
+            break;
+        }
+
+        if (coll->rate > 0) {
+            target = (uint64_t)((now - start) * coll->rate);
+            if (total >= target) {
+                usleep(500);
+                continue;
+            }
+        } else {
+            target = total + 1024;
+        }
+
+        batchlen = 0;
+        batchrecs[0] = batchrecs[1] = 0;
+        while (total < target &&
+                batchlen + 70000 < COLLECTOR_BATCH_SIZE) {
+            iri = ((total % 100) < coll->iripercent);
+            batchlen += frame_record(coll, &(coll->liids[l]), iri,
+                    batch + batchlen);
+            batchrecs[iri ? 0 : 1] ++;
+            total ++;
+            l = (l + 1) % coll->liidcount;
+        }
+
+        if (send_batch(fd, batch, batchlen) < 0) {
+            fprintf(stderr, "lost connection to mediator: %s\n",
+                    strerror(errno));
+            coll->failed = 1;
+            break;
+        }
+
+        /* Throw away anything the mediator sends us (framing caps) */
+        while (recv(fd, scratch, sizeof(scratch), MSG_DONTWAIT) > 0);
+
+        pthread_mutex_lock(&(coll->mutex));
+        coll->sent[BENCH_HI2] += batchrecs[0];
+        coll->sent[BENCH_HI3] += batchrecs[1];
+        coll->sentbytes += batchlen;
+        pthread_mutex_unlock(&(coll->mutex));
+    }
+
+    pthread_mutex_lock(&(coll->mutex));
+    coll->finished = wall_seconds();
+    pthread_mutex_unlock(&(coll->mutex));
+
+    /* Keep the connection open until the benchmark is over, otherwise the
+     * mediator may log errors about the collector going away */
+    while (!coll->halt) {
+        while (recv(fd, scratch, sizeof(scratch), MSG_DONTWAIT) > 0);
+        usleep(100000);
+    }
+    free(batch);
+    close(fd);
+    return NULL;
+}
+
+/* Turns a keepalive into a keepalive response by replacing the keepAlive
+ * [3] NULL field in the TRIPayload with keepAliveResponse [4] NULL.
+ */
+static int answer_keepalive(int fd, uint8_t *pdu, uint32_t pdulen) {
+    uint8_t resp[512];
+    int i;
+
+    if (pdulen > sizeof(resp)) {
+        return -1;
+    }
+    memcpy(resp, pdu, pdulen);
+    for (i = pdulen - 2; i >= 0; i--) {
+        if (resp[i] == 0x83 && resp[i + 1] == 0x00) {
+            resp[i] = 0x84;
+            return send_batch(fd, resp, pdulen);
+        }
+    }
+    return -1;
+}
+
+typedef struct lea_counts {
+    uint64_t records[2];
+    uint64_t bytes;
+    uint64_t keepalives;
+    uint64_t invalid;
+    double latency[256];
+    int samples;
+} lea_counts_t;
+
+/* Processes every complete PS-PDU in the receive buffer for a handover.
+ *
+ * CC records are parsed with the mediator's IPCC fast path; anything else
+ * (IRIs and keepalives) goes through the generic libwandder decoder.
+ */
+static int consume_handover(handover_conn_t *conn, wandder_etsispec_t *dec,
+        lea_counts_t *counts) {
+
+    openli_etsicc_fields_t fields;
+    uint32_t off = 0, pdulen;
+    struct timeval ts, now;
+    int havets;
+
+    while (off < conn->buflen) {
+        havets = 0;
+        if (conn->hitype == BENCH_HI3 &&
+                openli_extract_etsi_ipcc_fields(conn->buf + off,
+                        conn->buflen - off, &fields)) {
+            pdulen = fields.pdulen;
+            if ((counts->records[0] + counts->records[1]) %
+                    LATENCY_SAMPLE_FREQ == 0) {
+                /* The fast path doesn't bother with the timestamp, as
+                 * the mediator never needs it */
+                wandder_attach_etsili_buffer(dec, conn->buf + off,
+                        pdulen, false);
+                ts = wandder_etsili_get_header_timestamp(dec);
+                havets = 1;
+            }
+        } else {
+            wandder_attach_etsili_buffer(dec, conn->buf + off,
+                    conn->buflen - off, false);
+            pdulen = wandder_etsili_get_pdu_length(dec);
+            if (pdulen == 0 || pdulen > conn->buflen - off) {
+                break;
+            }
+            if (wandder_etsili_is_keepalive(dec)) {
+                if (answer_keepalive(conn->fd, conn->buf + off,
+                        pdulen) < 0) {
+                    return -1;
+                }
+                counts->keepalives ++;
+                off += pdulen;
+                continue;
+            }
+            if ((counts->records[0] + counts->records[1]) %
+                    LATENCY_SAMPLE_FREQ == 0) {
+                ts = wandder_etsili_get_header_timestamp(dec);
+                havets = 1;
+            }
+        }
+
+        if (havets && counts->samples < 256 &&
+                (counts->records[0] + counts->records[1]) %
+                LATENCY_SAMPLE_FREQ == 0) {
+            gettimeofday(&now, NULL);
+            counts->latency[counts->samples] = tv_to_secs(&now) -
+                    tv_to_secs(&ts);
+            counts->samples ++;
+        }
+
+        counts->records[conn->hitype] ++;
+        counts->bytes += pdulen;
+        off += pdulen;
+    }
+
+    if (off == 0 && conn->buflen == HANDOVER_BUFSIZE) {
+        /* Buffer is full but we couldn't find a complete record */
+        counts->invalid ++;
+        return -1;
+    }
+
+    if (off > 0) {
+        memmove(conn->buf, conn->buf + off, conn->buflen - off);
+        conn->buflen -= off;
+    }
+    return 0;
+}
+
+static void close_handover(lea_sink_t *lea, handover_conn_t *conn) {
+    pthread_mutex_lock(&(lea->mutex));
+    lea->connected[conn->hitype] --;
+    pthread_mutex_unlock(&(lea->mutex));
+    close(conn->fd);
+    free(conn->buf);
+}
+
+static void *run_lea_sink(void *arg) {
+    lea_sink_t *lea = (lea_sink_t *)arg;
+    struct pollfd pfds[MAX_HANDOVER_CONNS + 2];
+    handover_conn_t conns[MAX_HANDOVER_CONNS + 2];
+    wandder_etsispec_t *dec;
+    lea_counts_t counts;
+    int nfds = 2, i, j, fd, ret;
+    double now;
+
+    dec = wandder_create_etsili_decoder();
+    for (i = 0; i < 2; i++) {
+        pfds[i].fd = lea->listenfd[i];
+        pfds[i].events = POLLIN;
+    }
+
+    while (!lea->halt) {
+        for (i = 0; i < nfds; i++) {
+            pfds[i].revents = 0;
+        }
+        if (poll(pfds, nfds, 100) <= 0) {
+            continue;
+        }
+
+        for (i = 0; i < 2; i++) {
+            if ((pfds[i].revents & POLLIN) == 0) {
+                continue;
+            }
+            fd = accept(lea->listenfd[i], NULL, NULL);
+            if (fd < 0) {
+                continue;
+            }
+            if (nfds >= MAX_HANDOVER_CONNS + 2) {
+                close(fd);
+                continue;
+            }
+            pfds[nfds].fd = fd;
+            pfds[nfds].events = POLLIN;
+            conns[nfds].fd = fd;
+            conns[nfds].hitype = i;
+            conns[nfds].buf = malloc(HANDOVER_BUFSIZE);
+            conns[nfds].buflen = 0;
+            nfds ++;
+            pthread_mutex_lock(&(lea->mutex));
+            lea->connected[i] ++;
+            pthread_mutex_unlock(&(lea->mutex));
+        }
+
+        memset(&counts, 0, sizeof(counts));
+        for (i = 2; i < nfds; i++) {
+            if ((pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) == 0) {
+                continue;
+            }
+            ret = recv(conns[i].fd, conns[i].buf + conns[i].buflen,
+                    HANDOVER_BUFSIZE - conns[i].buflen, MSG_DONTWAIT);
+            if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            if (ret > 0) {
+                conns[i].buflen += ret;
+                if (consume_handover(&(conns[i]), dec, &counts) == 0) {
+                    continue;
+                }
+            }
+
+            close_handover(lea, &(conns[i]));
+            pfds[i] = pfds[nfds - 1];
+            conns[i] = conns[nfds - 1];
+            nfds --;
+            i --;
+        }
+
+        if (counts.records[0] + counts.records[1] + counts.keepalives +
+                counts.invalid == 0) {
+            continue;
+        }
+
+        now = wall_seconds();
+        pthread_mutex_lock(&(lea->mutex));
+        lea->records[0] += counts.records[0];
+        lea->records[1] += counts.records[1];
+        lea->bytes += counts.bytes;
+        lea->keepalives += counts.keepalives;
+        lea->invalid += counts.invalid;
+        for (j = 0; j < counts.samples; j++) {
+            if (lea->samples >= MAX_LATENCY_SAMPLES) {
+                break;
+            }
+            lea->latency[lea->samples] = counts.latency[j];
+            lea->samples ++;
+        }
+        if (counts.records[0] + counts.records[1] > 0) {
+            if (lea->firstrecord == 0) {
+                lea->firstrecord = now;
+            }
+            lea->lastrecord = now;
+        }
+        pthread_mutex_unlock(&(lea->mutex));
+    }
+
+    for (i = 2; i < nfds; i++) {
+        close_handover(lea, &(conns[i]));
+    }
+    wandder_free_etsili_decoder(dec);
+    return NULL;
+}
+
+static uint64_t lea_total_records(lea_sink_t *lea) {
+    uint64_t total;
+
+    pthread_mutex_lock(&(lea->mutex));
+    total = lea->records[0] + lea->records[1] + lea->invalid;
+    pthread_mutex_unlock(&(lea->mutex));
+    return total;
+}
+
+static int write_mediator_config(char *fname, uint16_t provport,
+        uint16_t listenport, char *rmqpass) {
+
+    FILE *f = fopen(fname, "w");
+
+    if (f == NULL) {
+        fprintf(stderr, "unable to create mediator config %s: %s\n", fname,
+                strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "operatorid: WAND\n");
+    fprintf(f, "mediatorid: 6001\n");
+    fprintf(f, "provisioneraddr: 127.0.0.1\n");
+    fprintf(f, "provisionerport: %u\n", provport);
+    fprintf(f, "listenaddr: 127.0.0.1\n");
+    fprintf(f, "listenport: %u\n", listenport);
+    if (rmqpass) {
+        fprintf(f, "RMQlocalpass: \"%s\"\n", rmqpass);
+    }
+
+    if (fclose(f) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    if (x < y) {
+        return -1;
+    }
+    return (x > y);
+}
+
+static double percentile(double *sorted, uint32_t count, double pct) {
+    uint32_t ind;
+
+    if (count == 0) {
+        return 0;
+    }
+    ind = (uint32_t)((pct / 100.0) * (count - 1));
+    return sorted[ind];
+}
+
+static void report_results(fake_collector_t *coll, lea_sink_t *lea,
+        thread_cpu_t *groups, int ngroups) {
+
+    double sendtime, delivtime, totalcpu = 0;
+    uint64_t sent, delivered;
+    int i;
+
+    pthread_mutex_lock(&(coll->mutex));
+    pthread_mutex_lock(&(lea->mutex));
+
+    sent = coll->sent[BENCH_HI2] + coll->sent[BENCH_HI3];
+    delivered = lea->records[BENCH_HI2] + lea->records[BENCH_HI3];
+    sendtime = coll->finished - coll->started;
+    delivtime = lea->lastrecord - coll->started;
+
+    printf("\nsent %lu records (%lu IRI, %lu CC, %.1f MB) in %.2f s: %.0f records/s\n",
+            (unsigned long)sent, (unsigned long)coll->sent[BENCH_HI2],
+            (unsigned long)coll->sent[BENCH_HI3],
+            coll->sentbytes / (1024.0 * 1024.0), sendtime,
+            sendtime > 0 ? sent / sendtime : 0);
+    printf("delivered %lu records (%lu HI2, %lu HI3, %.1f MB) in %.2f s: %.0f records/s\n",
+            (unsigned long)delivered, (unsigned long)lea->records[BENCH_HI2],
+            (unsigned long)lea->records[BENCH_HI3],
+            lea->bytes / (1024.0 * 1024.0), delivtime,
+            delivtime > 0 ? delivered / delivtime : 0);
+    printf("lost: HI2 %ld, HI3 %ld  undecodable: %lu  keepalives answered: %lu\n",
+            (long)(coll->sent[BENCH_HI2] - lea->records[BENCH_HI2]),
+            (long)(coll->sent[BENCH_HI3] - lea->records[BENCH_HI3]),
+            (unsigned long)lea->invalid, (unsigned long)lea->keepalives);
+
+    if (lea->samples > 0) {
+        qsort(lea->latency, lea->samples, sizeof(double), compare_double);
+        printf("\nlatency (%u samples): p50 %.3f ms  p90 %.3f ms  p99 %.3f ms  max %.3f ms\n",
+                lea->samples,
+                percentile(lea->latency, lea->samples, 50) * 1000.0,
+                percentile(lea->latency, lea->samples, 90) * 1000.0,
+                percentile(lea->latency, lea->samples, 99) * 1000.0,
+                lea->latency[lea->samples - 1] * 1000.0);
+    }
+
+    printf("\nmediator CPU time by thread:\n");
+    for (i = 0; i < ngroups; i++) {
+        printf("  %-20s %3d thread%s %8.2f s\n", groups[i].name,
+                groups[i].threads, groups[i].threads == 1 ? " " : "s",
+                groups[i].cpu);
+        totalcpu += groups[i].cpu;
+    }
+    printf("  %-20s             %8.2f s (%.0f records per CPU second)\n",
+            "total", totalcpu, totalcpu > 0 ? delivered / totalcpu : 0);
+
+    pthread_mutex_unlock(&(lea->mutex));
+    pthread_mutex_unlock(&(coll->mutex));
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    fprintf(stderr, "\nLoad options:\n");
+    fprintf(stderr, "  -n <count>     number of LIIDs (default: 100)\n");
+    fprintf(stderr, "  -r <rate>      records sent per second, 0 for unlimited (default: 50000)\n");
+    fprintf(stderr, "  -i <percent>   percentage of records that are IRIs (default: 10)\n");
+    fprintf(stderr, "  -s <min:max>   CC IP packet size range (default: 64:1400)\n");
+    fprintf(stderr, "  -d <seconds>   how long to send records for (default: 30)\n");
+    fprintf(stderr, "  -k <f:w>       LEA keepalive frequency and wait, in seconds (default: 30:10)\n");
+    fprintf(stderr, "\nMediator options:\n");
+    fprintf(stderr, "  -M <path>      mediator binary (default: ./openlimediator)\n");
+    fprintf(stderr, "  -w <dir>       directory for the config and log (default: /tmp)\n");
+    fprintf(stderr, "  -R <password>  password for the local RabbitMQ server (RMQlocalpass)\n");
+    fprintf(stderr, "  -T <seconds>   give up if delivery takes longer than this (default: 600)\n");
+}
+
+int main(int argc, char *argv[]) {
+    fake_provisioner_t prov;
+    fake_collector_t coll;
+    lea_sink_t lea;
+    bench_liid_t *liids;
+    pthread_t provtid, colltid, leatid;
+    thread_cpu_t groups[32];
+    char *binary = "./openlimediator", *workdir = "/tmp", *rmqpass = NULL;
+    char confname[1024], logname[1024];
+    unsigned int minsize = 64, maxsize = 1400, kafreq = 30, kawait = 10;
+    int liidcount = 100, timeout = 600, ngroups = 0, c, ret = 0, status;
+    int listenfd, ready;
+    uint16_t listenport;
+    uint32_t rate = 50000, iripercent = 10, duration = 30;
+    double deadline, idlesince = 0, now;
+    uint64_t lastrecords = 0, records;
+    pid_t pid;
+
+    while ((c = getopt(argc, argv, "n:r:i:s:d:k:M:w:R:T:h")) != -1) {
+        switch (c) {
+            case 'n':
+                liidcount = atoi(optarg);
+                break;
+            case 'r':
+                rate = strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                iripercent = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                if (sscanf(optarg, "%u:%u", &minsize, &maxsize) != 2) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'd':
+                duration = strtoul(optarg, NULL, 10);
+                break;
+            case 'k':
+                if (sscanf(optarg, "%u:%u", &kafreq, &kawait) != 2) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'M':
+                binary = optarg;
+                break;
+            case 'w':
+                workdir = optarg;
+                break;
+            case 'R':
+                rmqpass = optarg;
+                break;
+            case 'T':
+                timeout = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (liidcount <= 0 || duration == 0 || iripercent > 100 ||
+            minsize == 0 || maxsize < minsize || maxsize > 65000) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    snprintf(confname, sizeof(confname), "%s/openli-medbench.yaml", workdir);
+    snprintf(logname, sizeof(logname), "%s/openli-medbench.log", workdir);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&prov, 0, sizeof(prov));
+    memset(&coll, 0, sizeof(coll));
+    memset(&lea, 0, sizeof(lea));
+    pthread_mutex_init(&(coll.mutex), NULL);
+    pthread_mutex_init(&(lea.mutex), NULL);
+
+    liids = calloc(liidcount, sizeof(bench_liid_t));
+    coll.liids = liids;
+    coll.liidcount = liidcount;
+    coll.minsize = minsize;
+    coll.maxsize = maxsize;
+    coll.rate = rate;
+    coll.duration = duration;
+    coll.iripercent = iripercent;
+
+    srand(1);
+    if (prepare_records(liids, liidcount, &coll) < 0) {
+        return 1;
+    }
+
+    /* Grab a free port for the mediator to listen for collectors on */
+    listenfd = create_loopback_listener(&listenport);
+    if (listenfd < 0) {
+        fprintf(stderr, "unable to find a free port for the mediator\n");
+        return 1;
+    }
+    close(listenfd);
+    coll.mediatorport = listenport;
+
+    prov.listenfd = create_loopback_listener(&(prov.port));
+    lea.listenfd[BENCH_HI2] = create_loopback_listener(&(lea.port[BENCH_HI2]));
+    lea.listenfd[BENCH_HI3] = create_loopback_listener(&(lea.port[BENCH_HI3]));
+    if (prov.listenfd < 0 || lea.listenfd[BENCH_HI2] < 0 ||
+            lea.listenfd[BENCH_HI3] < 0) {
+        fprintf(stderr, "unable to create listening sockets: %s\n",
+                strerror(errno));
+        return 1;
+    }
+    prov.hi2port = lea.port[BENCH_HI2];
+    prov.hi3port = lea.port[BENCH_HI3];
+    prov.keepalivefreq = kafreq;
+    prov.keepalivewait = kawait;
+    prov.liids = liids;
+    prov.liidcount = liidcount;
+    lea.latency = calloc(MAX_LATENCY_SAMPLES, sizeof(double));
+
+    if (write_mediator_config(confname, prov.port, listenport,
+                rmqpass) < 0) {
+        return 1;
+    }
+
+    pthread_create(&leatid, NULL, run_lea_sink, &lea);
+    pthread_create(&provtid, NULL, run_fake_provisioner, &prov);
+    pthread_create(&colltid, NULL, run_fake_collector, &coll);
+
+    printf("starting %s (log: %s)\n", binary, logname);
+    pid = start_bench_process(binary, confname, logname);
+    if (pid < 0) {
+        fprintf(stderr, "unable to start mediator: %s\n", strerror(errno));
+        ret = 1;
+        goto endbench;
+    }
+
+    /* Wait for the mediator to be told about the LEA and to connect both
+     * handovers before we start sending records.
+     */
+    deadline = wall_seconds() + timeout;
+    ready = 0;
+    while (!ready && (now = wall_seconds()) < deadline) {
+        usleep(100000);
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            fprintf(stderr, "mediator exited unexpectedly, see %s\n",
+                    logname);
+            pid = -1;
+            ret = 1;
+            goto endbench;
+        }
+        pthread_mutex_lock(&(lea.mutex));
+        ready = (prov.connected > 0 && lea.connected[BENCH_HI2] > 0 &&
+                lea.connected[BENCH_HI3] > 0);
+        pthread_mutex_unlock(&(lea.mutex));
+    }
+    if (!ready) {
+        fprintf(stderr, "mediator did not connect to the LEA within %d seconds\n",
+                timeout);
+        ret = 1;
+        goto endbench;
+    }
+
+    printf("sending %u records/s for %u LIIDs over %u seconds\n", rate,
+            liidcount, duration);
+    coll.go = 1;
+
+    /* Wait until the collector has finished and no more records have been
+     * delivered for a couple of seconds.
+     */
+    idlesince = wall_seconds();
+    while ((now = wall_seconds()) < deadline) {
+        usleep(100000);
+
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            fprintf(stderr, "mediator exited unexpectedly, see %s\n",
+                    logname);
+            pid = -1;
+            ret = 1;
+            goto endbench;
+        }
+        if (coll.failed) {
+            ret = 1;
+            break;
+        }
+
+        records = lea_total_records(&lea);
+        if (records != lastrecords) {
+            lastrecords = records;
+            idlesince = now;
+            /* Sample CPU while the threads are still running */
+            ngroups = measure_thread_cpu(pid, groups, 32);
+            continue;
+        }
+
+        pthread_mutex_lock(&(coll.mutex));
+        if (coll.finished > 0 && now - idlesince >= 2.0 &&
+                now - coll.finished >= 2.0) {
+            pthread_mutex_unlock(&(coll.mutex));
+            break;
+        }
+        pthread_mutex_unlock(&(coll.mutex));
+    }
+
+    if (now >= deadline) {
+        fprintf(stderr, "mediator did not finish within %d seconds\n",
+                timeout);
+        ret = 1;
+    }
+
+    ngroups = measure_thread_cpu(pid, groups, 32);
+    report_results(&coll, &lea, groups, ngroups);
+
+endbench:
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, &status, 0);
+    }
+    prov.halt = 1;
+    coll.halt = 1;
+    lea.halt = 1;
+    pthread_join(colltid, NULL);
+    pthread_join(provtid, NULL);
+    pthread_join(leatid, NULL);
+    close(prov.listenfd);
+    close(lea.listenfd[BENCH_HI2]);
+    close(lea.listenfd[BENCH_HI3]);
+    free_records(liids, liidcount, &coll);
+    free(liids);
+    free(lea.latency);
+    pthread_mutex_destroy(&(coll.mutex));
+    pthread_mutex_destroy(&(lea.mutex));
+    return ret;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
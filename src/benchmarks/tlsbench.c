@@ -0,0 +1,357 @@
+/*
+ *
+ * Copyright (c) 2018 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* Loopback benchmark for the TLS export path used by collector forwarding
+ * threads. A sender thread pushes records through
+ * transmit_buffered_records() to a receiver thread over a TLS connection
+ * on 127.0.0.1, once with userspace TLS and once with kernel TLS offload
+ * enabled, and reports the throughput achieved per CPU-second on each side.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "logger.h"
+#include "export_buffer.h"
+#include "openli_tls.h"
+
+#define BENCH_SEND_LIMIT (64 * 1024)
+#define BENCH_BUFFER_TARGET (4 * 1024 * 1024)
+
+typedef struct bench_result {
+    uint64_t bytes;
+    double walltime;
+    double cputime;
+    int ktls_active;
+} bench_result_t;
+
+typedef struct receiver {
+    int listenfd;
+    openli_ssl_config_t *sslconf;
+    bench_result_t result;
+    int failed;
+} receiver_t;
+
+static inline double timespec_to_secs(struct timespec *ts) {
+    return ts->tv_sec + (ts->tv_nsec / 1000000000.0);
+}
+
+static double thread_cpu_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return timespec_to_secs(&ts);
+}
+
+static double wall_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return timespec_to_secs(&ts);
+}
+
+static void *run_receiver(void *arg) {
+    receiver_t *recv = (receiver_t *)arg;
+    SSL *ssl = NULL;
+    int fd, ret;
+    char buf[65536];
+    double startcpu, startwall;
+
+    fd = accept(recv->listenfd, NULL, NULL);
+    if (fd < 0) {
+        fprintf(stderr, "accept() failed: %s\n", strerror(errno));
+        recv->failed = 1;
+        return NULL;
+    }
+
+    if (listen_ssl_socket(recv->sslconf, &ssl, fd) !=
+            OPENLI_SSL_CONNECT_SUCCESS) {
+        fprintf(stderr, "TLS handshake failed on the receiving side\n");
+        recv->failed = 1;
+        goto endrecv;
+    }
+
+    startcpu = thread_cpu_seconds();
+    startwall = wall_seconds();
+    while ((ret = SSL_read(ssl, buf, sizeof(buf))) > 0) {
+        recv->result.bytes += ret;
+    }
+    recv->result.cputime = thread_cpu_seconds() - startcpu;
+    recv->result.walltime = wall_seconds() - startwall;
+
+endrecv:
+    if (ssl) {
+        SSL_free(ssl);
+    }
+    close(fd);
+    return NULL;
+}
+
+static int create_listener(uint16_t *port) {
+    struct sockaddr_in sa;
+    socklen_t salen = sizeof(sa);
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = 0;
+
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+            listen(fd, 1) < 0 ||
+            getsockname(fd, (struct sockaddr *)&sa, &salen) < 0) {
+        close(fd);
+        return -1;
+    }
+    *port = ntohs(sa.sin_port);
+    return fd;
+}
+
+static int connect_sender(uint16_t port) {
+    struct sockaddr_in sa;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = htons(port);
+
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int run_sender(SSL *ssl, int fd, uint32_t recsize, int duration,
+        bench_result_t *result) {
+
+    export_buffer_t buf;
+    uint8_t *record;
+    double startcpu, startwall, now;
+    int ret;
+
+    record = calloc(1, recsize);
+    init_export_buffer(&buf);
+
+    startcpu = thread_cpu_seconds();
+    startwall = wall_seconds();
+
+    do {
+        while (get_buffered_amount(&buf) < BENCH_BUFFER_TARGET) {
+            if (append_etsipdu_to_buffer(&buf, record, recsize, 0) == 0) {
+                fprintf(stderr, "unable to append record to export buffer\n");
+                free(record);
+                release_export_buffer(&buf);
+                return -1;
+            }
+        }
+
+        ret = transmit_buffered_records(&buf, fd, BENCH_SEND_LIMIT, ssl);
+        if (ret < 0) {
+            fprintf(stderr, "error while transmitting buffered records\n");
+            free(record);
+            release_export_buffer(&buf);
+            return -1;
+        }
+        result->bytes += ret;
+        now = wall_seconds();
+    } while (now - startwall < duration);
+
+    result->cputime = thread_cpu_seconds() - startcpu;
+    result->walltime = now - startwall;
+
+    free(record);
+    release_export_buffer(&buf);
+    return 0;
+}
+
+static void report(const char *mode, const char *side, bench_result_t *res) {
+    double mb = res->bytes / (1024.0 * 1024.0);
+
+    printf("%-10s %-8s %-10s %10.1f MB/s %10.1f MB/cpu-sec\n", mode, side,
+            res->ktls_active ? "kernel" : "userspace",
+            res->walltime > 0 ? mb / res->walltime : 0,
+            res->cputime > 0 ? mb / res->cputime : 0);
+}
+
+static int run_benchmark(openli_ssl_config_t *sslconf, uint8_t ktls,
+        uint32_t recsize, int duration) {
+
+    receiver_t recv;
+    bench_result_t sendres;
+    pthread_t tid;
+    SSL *ssl = NULL;
+    uint16_t port;
+    int fd, ret = -1;
+
+    sslconf->ktls = ktls;
+    if (create_ssl_context(sslconf) < 0 || sslconf->ctx == NULL) {
+        fprintf(stderr, "unable to create TLS context\n");
+        return -1;
+    }
+
+    memset(&recv, 0, sizeof(recv));
+    memset(&sendres, 0, sizeof(sendres));
+    recv.sslconf = sslconf;
+    recv.listenfd = create_listener(&port);
+    if (recv.listenfd < 0) {
+        fprintf(stderr, "unable to create loopback listener: %s\n",
+                strerror(errno));
+        goto endbench;
+    }
+    pthread_create(&tid, NULL, run_receiver, &recv);
+
+    fd = connect_sender(port);
+    if (fd < 0) {
+        fprintf(stderr, "unable to connect to loopback listener: %s\n",
+                strerror(errno));
+        close(recv.listenfd);
+        pthread_join(tid, NULL);
+        goto endbench;
+    }
+
+    ssl = SSL_new(sslconf->ctx);
+    SSL_set_fd(ssl, fd);
+    if (SSL_connect(ssl) <= 0) {
+        fprintf(stderr, "TLS handshake failed on the sending side\n");
+    } else {
+        /* Same socket mode as the collector forwarding threads */
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        sendres.ktls_active = openli_ssl_ktls_send_active(ssl);
+        ret = run_sender(ssl, fd, recsize, duration, &sendres);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        SSL_shutdown(ssl);
+    }
+    SSL_free(ssl);
+    close(fd);
+    pthread_join(tid, NULL);
+    close(recv.listenfd);
+
+    if (ret == 0 && !recv.failed) {
+        recv.result.ktls_active = sendres.ktls_active;
+        report(ktls ? "ktls" : "userspace", "sender", &sendres);
+        report(ktls ? "ktls" : "userspace", "receiver", &recv.result);
+    }
+
+endbench:
+    SSL_CTX_free(sslconf->ctx);
+    sslconf->ctx = NULL;
+    return ret;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr,
+            "Usage: %s -c <certfile> -k <keyfile> -a <cacertfile> [options]\n",
+            prog);
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  -s <bytes>     size of each record (default: 1024)\n");
+    fprintf(stderr, "  -d <seconds>   duration of each run (default: 10)\n");
+    fprintf(stderr, "  -m <mode>      one of 'userspace', 'ktls' or 'both' (default: both)\n");
+}
+
+int main(int argc, char *argv[]) {
+    openli_ssl_config_t sslconf;
+    uint32_t recsize = 1024;
+    int duration = 10;
+    char *mode = "both";
+    int c, ret = 0;
+
+    memset(&sslconf, 0, sizeof(sslconf));
+
+    while ((c = getopt(argc, argv, "c:k:a:s:d:m:h")) != -1) {
+        switch (c) {
+            case 'c':
+                sslconf.certfile = strdup(optarg);
+                break;
+            case 'k':
+                sslconf.keyfile = strdup(optarg);
+                break;
+            case 'a':
+                sslconf.cacertfile = strdup(optarg);
+                break;
+            case 's':
+                recsize = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 'm':
+                mode = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (!sslconf.certfile || !sslconf.keyfile || !sslconf.cacertfile ||
+            recsize == 0 || duration <= 0) {
+        usage(argv[0]);
+        free_ssl_config(&sslconf);
+        return 1;
+    }
+
+    printf("%-10s %-8s %-10s %15s %20s\n", "mode", "side", "encryption",
+            "throughput", "per core");
+
+    if (strcmp(mode, "userspace") == 0 || strcmp(mode, "both") == 0) {
+        if (run_benchmark(&sslconf, 0, recsize, duration) < 0) {
+            ret = 1;
+        }
+    }
+    if (strcmp(mode, "ktls") == 0 || strcmp(mode, "both") == 0) {
+        if (run_benchmark(&sslconf, 1, recsize, duration) < 0) {
+            ret = 1;
+        }
+    }
+
+    free_ssl_config(&sslconf);
+    return ret;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
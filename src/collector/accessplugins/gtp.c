@@ -36,6 +36,18 @@
 
 #define GTP_FLUSH_OLD_PKT_FREQ 180
 
+/* Number of one-second slots in the expiry wheel for saved packets. Must be
+ * a power of two. */
+#define GTP_EXPIRY_WHEEL_SLOTS 256
+
+/* IE contents up to this size are stored inside the IE itself */
+#define GTP_IE_INLINE_SIZE 32
+
+/* Upper limits on the number of unused saved packets and IEs that we keep
+ * around for re-use */
+#define GTP_MAX_FREE_SAVED_PKTS 4096
+#define GTP_MAX_FREE_IES 16384
+
 enum {
     GTPV1_IE_CAUSE = 1,
     GTPV1_IE_IMSI = 2,
@@ -112,6 +124,8 @@ struct gtp_infelem {
     uint8_t ieflags;
     void *iecontent;
     gtp_infoelem_t *next;
+
+    uint8_t inlinecontent[GTP_IE_INLINE_SIZE];
 };
 
 typedef struct gtp_userid {
@@ -169,6 +183,14 @@ struct gtp_saved_packet {
     uint16_t iplen;
     gtp_infoelem_t *ies;
     gtp_session_t *matched_session;
+
+    /* Expiry wheel linkage -- only valid while the packet is in
+     * saved_packets. wheelnext is also used to link unused packets
+     * together in the free list. */
+    uint32_t wheelsec;
+    uint8_t inwheel;
+    gtp_saved_pkt_t *wheelprev;
+    gtp_saved_pkt_t *wheelnext;
 };
 
 typedef struct gtp_parsed {
@@ -207,7 +229,17 @@ typedef struct gtp_global {
     Pvoid_t session_map;
     Pvoid_t alt_session_map;
 
-    double lastrefresh;
+    /* Saved packets, bucketed by the second when they were seen, so that
+     * expiring old packets only touches the ones that are due */
+    gtp_saved_pkt_t *expirywheel[GTP_EXPIRY_WHEEL_SLOTS];
+
+    /* All saved packets seen in or before this second have been expired */
+    uint32_t expiredsec;
+
+    gtp_saved_pkt_t *freesaved;
+    uint32_t freesavedcount;
+    gtp_infoelem_t *freeies;
+    uint32_t freeiecount;
 } gtp_global_t;
 
 
@@ -285,7 +317,7 @@ static inline void destroy_gtp_session(gtp_session_t *sess) {
     free(sess);
 }
 
-static inline void gtp_free_ie_list(gtp_infoelem_t *ies) {
+static void gtp_free_ie_list(gtp_global_t *glob, gtp_infoelem_t *ies) {
 
     gtp_infoelem_t *ie, *tmp;
 
@@ -294,11 +326,126 @@ static inline void gtp_free_ie_list(gtp_infoelem_t *ies) {
     while (ie) {
         tmp = ie;
         ie = ie->next;
-        if (tmp->iecontent) {
+        if (tmp->iecontent && tmp->iecontent != tmp->inlinecontent) {
             free(tmp->iecontent);
         }
-        free(tmp);
+        tmp->iecontent = NULL;
+
+        if (glob->freeiecount < GTP_MAX_FREE_IES) {
+            tmp->next = glob->freeies;
+            glob->freeies = tmp;
+            glob->freeiecount ++;
+        } else {
+            free(tmp);
+        }
+    }
+}
+
+static inline gtp_infoelem_t *gtp_get_free_ie(gtp_global_t *glob,
+        uint16_t ielen) {
+
+    gtp_infoelem_t *el;
+
+    if (glob->freeies) {
+        el = glob->freeies;
+        glob->freeies = el->next;
+        glob->freeiecount --;
+    } else {
+        el = (gtp_infoelem_t *)malloc(sizeof(gtp_infoelem_t));
+    }
+
+    if (ielen <= GTP_IE_INLINE_SIZE) {
+        el->iecontent = el->inlinecontent;
+    } else {
+        el->iecontent = malloc(ielen);
+    }
+    el->next = NULL;
+    return el;
+}
+
+static inline gtp_saved_pkt_t *gtp_get_free_saved_pkt(gtp_global_t *glob) {
+
+    gtp_saved_pkt_t *saved;
+
+    if (glob->freesaved) {
+        saved = glob->freesaved;
+        glob->freesaved = saved->wheelnext;
+        glob->freesavedcount --;
+        memset(saved, 0, sizeof(gtp_saved_pkt_t));
+    } else {
+        saved = calloc(1, sizeof(gtp_saved_pkt_t));
+    }
+    return saved;
+}
+
+/* Frees the contents of a saved packet and returns it to the free list.
+ * The packet must not be in saved_packets. */
+static void gtp_release_saved_pkt(gtp_global_t *glob, gtp_saved_pkt_t *pkt) {
+
+    if (pkt->ipcontent) {
+        free(pkt->ipcontent);
+        pkt->ipcontent = NULL;
+    }
+    gtp_free_ie_list(glob, pkt->ies);
+    pkt->ies = NULL;
+
+    if (glob->freesavedcount < GTP_MAX_FREE_SAVED_PKTS) {
+        pkt->wheelnext = glob->freesaved;
+        glob->freesaved = pkt;
+        glob->freesavedcount ++;
+    } else {
+        free(pkt);
+    }
+}
+
+static void insert_saved_packet(gtp_global_t *glob, gtp_saved_pkt_t *pkt) {
+
+    PWord_t pval;
+    uint32_t slot;
+
+    JLI(pval, glob->saved_packets, pkt->reqid);
+    *pval = (Word_t)pkt;
+
+    /* If time has gone backwards, make sure the packet goes in a slot
+     * that has not been expired yet */
+    pkt->wheelsec = (uint32_t)pkt->tvsec;
+    if (pkt->wheelsec <= glob->expiredsec) {
+        pkt->wheelsec = glob->expiredsec + 1;
+    }
+
+    slot = pkt->wheelsec & (GTP_EXPIRY_WHEEL_SLOTS - 1);
+    pkt->wheelprev = NULL;
+    pkt->wheelnext = glob->expirywheel[slot];
+    if (pkt->wheelnext) {
+        pkt->wheelnext->wheelprev = pkt;
     }
+    glob->expirywheel[slot] = pkt;
+    pkt->inwheel = 1;
+}
+
+static void remove_saved_packet(gtp_global_t *glob, gtp_saved_pkt_t *pkt) {
+
+    Word_t rc;
+    uint32_t slot;
+
+    JLD(rc, glob->saved_packets, pkt->reqid);
+
+    if (!pkt->inwheel) {
+        return;
+    }
+
+    slot = pkt->wheelsec & (GTP_EXPIRY_WHEEL_SLOTS - 1);
+    if (pkt->wheelprev) {
+        pkt->wheelprev->wheelnext = pkt->wheelnext;
+    } else {
+        glob->expirywheel[slot] = pkt->wheelnext;
+    }
+    if (pkt->wheelnext) {
+        pkt->wheelnext->wheelprev = pkt->wheelprev;
+    }
+    pkt->wheelprev = NULL;
+    pkt->wheelnext = NULL;
+    pkt->inwheel = 0;
 }
 
 static void gtp_destroy_plugin_data(access_plugin_t *p) {
@@ -330,7 +477,7 @@ static void gtp_destroy_plugin_data(access_plugin_t *p) {
         if (pkt->ipcontent) {
             free(pkt->ipcontent);
         }
-        gtp_free_ie_list(pkt->ies);
+        gtp_free_ie_list(glob, pkt->ies);
         free(pkt);
         JLN(pval, glob->saved_packets, indexnum);
     }
@@ -339,6 +486,18 @@ static void gtp_destroy_plugin_data(access_plugin_t *p) {
     if (glob->parsedpkt) {
         free(glob->parsedpkt);
     }
+
+    while (glob->freesaved) {
+        gtp_saved_pkt_t *pkt = glob->freesaved;
+        glob->freesaved = pkt->wheelnext;
+        free(pkt);
+    }
+
+    while (glob->freeies) {
+        gtp_infoelem_t *ie = glob->freeies;
+        glob->freeies = ie->next;
+        free(ie);
+    }
     free(glob);
 }
 
@@ -348,28 +507,21 @@ static void gtp_uncouple_parsed_data(access_plugin_t *p) {
 
 static void gtp_destroy_parsed_data(access_plugin_t *p, void *parsed) {
 
+    gtp_global_t *glob = (gtp_global_t *)(p->plugindata);
     gtp_parsed_t *gparsed = (gtp_parsed_t *)parsed;
 
     if (!gparsed) {
         return;
     }
 
-    gtp_free_ie_list(gparsed->ies);
+    gtp_free_ie_list(glob, gparsed->ies);
 
     if (gparsed->request) {
-        if (gparsed->request->ipcontent) {
-            free(gparsed->request->ipcontent);
-        }
-        gtp_free_ie_list(gparsed->request->ies);
-        free(gparsed->request);
+        gtp_release_saved_pkt(glob, gparsed->request);
     }
 
     if (gparsed->response) {
-        if (gparsed->response->ipcontent) {
-            free(gparsed->response->ipcontent);
-        }
-        gtp_free_ie_list(gparsed->response->ies);
-        free(gparsed->response);
+        gtp_release_saved_pkt(glob, gparsed->response);
     }
 
     if (gparsed->attached) {
@@ -410,35 +562,31 @@ static inline bool interesting_info_element(uint8_t gtpv, uint8_t ietype) {
     return false;
 }
 
-static inline gtp_infoelem_t *create_new_gtpv2_infoel(uint8_t ietype,
-        uint16_t ielen, uint8_t *ieptr) {
+static inline gtp_infoelem_t *create_new_gtpv2_infoel(gtp_global_t *glob,
+        uint8_t ietype, uint16_t ielen, uint8_t *ieptr) {
 
     gtp_infoelem_t *el;
 
-    el = (gtp_infoelem_t *)calloc(1, sizeof(gtp_infoelem_t));
+    el = gtp_get_free_ie(glob, ielen);
 
     el->ietype = ietype;
     el->ielength = ielen;
     el->ieflags = *(ieptr + 3);
-    el->iecontent = malloc(ielen);
-    el->next = NULL;
 
     memcpy(el->iecontent, ieptr + 4, ielen);
     return el;
 }
 
-static inline gtp_infoelem_t *create_new_gtpv1_infoel(uint8_t ietype,
-        uint16_t ielen, uint8_t *ieptr) {
+static inline gtp_infoelem_t *create_new_gtpv1_infoel(gtp_global_t *glob,
+        uint8_t ietype, uint16_t ielen, uint8_t *ieptr) {
 
     gtp_infoelem_t *el;
 
-    el = (gtp_infoelem_t *)calloc(1, sizeof(gtp_infoelem_t));
+    el = gtp_get_free_ie(glob, ielen);
 
     el->ietype = ietype;
     el->ielength = ielen;
     el->ieflags = 0;
-    el->iecontent = malloc(ielen);
-    el->next = NULL;
 
     if (ietype & 0x80) {
         memcpy(el->iecontent, ieptr + 3, ielen);
@@ -535,9 +683,11 @@ static inline uint16_t gtpv1_lookup_ielen(uint8_t ietype) {
     return 0;
 }
 
-static int walk_gtpv1_ies(gtp_parsed_t *parsedpkt, uint8_t *ptr, uint32_t rem,
+static int walk_gtpv1_ies(gtp_global_t *glob, uint8_t *ptr, uint32_t rem,
         uint16_t gtplen) {
 
+    gtp_parsed_t *parsedpkt = glob->parsedpkt;
+
     uint16_t used = 0;
 
     while (rem > 2 && used < gtplen) {
@@ -566,7 +716,7 @@ static int walk_gtpv1_ies(gtp_parsed_t *parsedpkt, uint8_t *ptr, uint32_t rem,
         }
 
         if (interesting_info_element(parsedpkt->version, ietype)) {
-            gtpel = create_new_gtpv1_infoel(ietype, ielen, ptr);
+            gtpel = create_new_gtpv1_infoel(glob, ietype, ielen, ptr);
             gtpel->next = parsedpkt->ies;
             parsedpkt->ies = gtpel;
         }
@@ -606,9 +756,11 @@ static int walk_gtpv1_ies(gtp_parsed_t *parsedpkt, uint8_t *ptr, uint32_t rem,
     return 0;
 }
 
-static void walk_gtpv2_ies(gtp_parsed_t *parsedpkt, uint8_t *ptr, uint32_t rem,
+static void walk_gtpv2_ies(gtp_global_t *glob, uint8_t *ptr, uint32_t rem,
         uint16_t gtplen) {
 
+    gtp_parsed_t *parsedpkt = glob->parsedpkt;
+
     uint16_t used = 0;
 
     while (rem > 4 && used < gtplen) {
@@ -620,7 +772,7 @@ static void walk_gtpv2_ies(gtp_parsed_t *parsedpkt, uint8_t *ptr, uint32_t rem,
         ielen = ntohs(*((uint16_t *)(ptr + 1)));
 
         if (interesting_info_element(parsedpkt->version, ietype)) {
-            gtpel = create_new_gtpv2_infoel(ietype, ielen, ptr);
+            gtpel = create_new_gtpv2_infoel(glob, ietype, ielen, ptr);
             gtpel->next = parsedpkt->ies;
             parsedpkt->ies = gtpel;
 
@@ -652,28 +804,44 @@ static void walk_gtpv2_ies(gtp_parsed_t *parsedpkt, uint8_t *ptr, uint32_t rem,
     }
 }
 
+/* Frees any saved packets that are more than GTP_FLUSH_OLD_PKT_FREQ seconds
+ * older than ts. Only the wheel slots for the seconds that have become due
+ * since the last call are examined.
+ */
 static void flush_old_gtp_packets(gtp_global_t *glob, double ts) {
 
-    Word_t index, rc;
-    PWord_t pval;
-    int purged = 0;
+    uint32_t due, sec, slot, visited;
+    gtp_saved_pkt_t *pkt, *next;
 
-    index = 0;
-    JLF(pval, glob->saved_packets, index);
+    if ((uint32_t)ts <= GTP_FLUSH_OLD_PKT_FREQ + 1) {
+        return;
+    }
+    due = (uint32_t)ts - GTP_FLUSH_OLD_PKT_FREQ - 1;
 
-    while (pval) {
-        gtp_saved_pkt_t *pkt = (gtp_saved_pkt_t *)(*pval);
+    if (glob->expiredsec == 0) {
+        glob->expiredsec = due;
+        return;
+    }
+
+    visited = 0;
+    for (sec = glob->expiredsec + 1; sec <= due &&
+            visited < GTP_EXPIRY_WHEEL_SLOTS; sec++, visited++) {
 
-        if (ts > pkt->tvsec + GTP_FLUSH_OLD_PKT_FREQ) {
-            gtp_free_ie_list(pkt->ies);
-            if (pkt->ipcontent) {
-                free(pkt->ipcontent);
+        slot = sec & (GTP_EXPIRY_WHEEL_SLOTS - 1);
+        pkt = glob->expirywheel[slot];
+        while (pkt) {
+            next = pkt->wheelnext;
+            /* slots are shared by seconds that are a wheel apart */
+            if (pkt->wheelsec <= due) {
+                remove_saved_packet(glob, pkt);
+                gtp_release_saved_pkt(glob, pkt);
             }
-            JLD(rc, glob->saved_packets, pkt->reqid);
-            free(pkt);
-            purged ++;
+            pkt = next;
         }
-        JLN(pval, glob->saved_packets, index);
+    }
+
+    if (due > glob->expiredsec) {
+        glob->expiredsec = due;
     }
 }
 
@@ -711,7 +879,7 @@ static int gtp_parse_v2_teid(gtp_global_t *glob, libtrace_packet_t *pkt,
     rem -= sizeof(gtpv2_header_teid_t);
     len -= (sizeof(gtpv2_header_teid_t) - 4);
 
-    walk_gtpv2_ies(glob->parsedpkt, ptr, rem, len);
+    walk_gtpv2_ies(glob, ptr, rem, len);
 
     return 0;
 }
@@ -750,7 +918,7 @@ static int gtp_parse_v1_teid(gtp_global_t *glob, libtrace_packet_t *pkt,
     rem -= sizeof(gtpv1_header_t);
     len -= (sizeof(gtpv1_header_t) - 8);
 
-    if (walk_gtpv1_ies(glob->parsedpkt, ptr, rem, len) < 0) {
+    if (walk_gtpv1_ies(glob, ptr, rem, len) < 0) {
         return -1;
     }
 
@@ -855,14 +1023,7 @@ static void *gtp_parse_packet(access_plugin_t *p, libtrace_packet_t *pkt) {
 
     glob->parsedpkt->tvsec = trace_get_seconds(pkt);
 
-    if (glob->lastrefresh == 0) {
-        glob->lastrefresh = (uint32_t)glob->parsedpkt->tvsec;
-    }
-
-    if (glob->parsedpkt->tvsec - glob->lastrefresh > GTP_FLUSH_OLD_PKT_FREQ) {
-        flush_old_gtp_packets(glob, glob->parsedpkt->tvsec);
-        glob->lastrefresh = (uint32_t)glob->parsedpkt->tvsec;
-    }
+    flush_old_gtp_packets(glob, glob->parsedpkt->tvsec);
 
     if (glob->parsedpkt->serveripfamily == 0) {
         return glob->parsedpkt;
@@ -967,7 +1128,13 @@ static user_identity_t *gtp_get_userid(access_plugin_t *p, void *parsed,
             gparsed->msgtype != GTPV1_CREATE_PDP_CONTEXT_REQUEST) {
         gtp_saved_pkt_t *saved;
 
-        saved = calloc(1, sizeof(gtp_saved_pkt_t));
+        JLG(pval, glob->saved_packets, (((uint64_t)gparsed->teid) << 32) |
+                ((uint64_t)gparsed->seqno));
+        if (pval != NULL) {
+            return NULL;
+        }
+
+        saved = gtp_get_free_saved_pkt(glob);
 
         saved->type = gparsed->msgtype;
         saved->reqid = (((uint64_t)gparsed->teid) << 32) |
@@ -985,17 +1152,7 @@ static user_identity_t *gtp_get_userid(access_plugin_t *p, void *parsed,
         openli_copy_ipcontent(gparsed->origpkt, &(saved->ipcontent),
                 &(saved->iplen));
 
-        JLG(pval, glob->saved_packets, saved->reqid);
-        if (pval == NULL) {
-            JLI(pval, glob->saved_packets, saved->reqid);
-            *pval = (Word_t)saved;
-        } else {
-            gparsed->ies = saved->ies;
-            if (saved->ipcontent) {
-                free(saved->ipcontent);
-            }
-            free(saved);
-        }
+        insert_saved_packet(glob, saved);
         return NULL;
     }
 
@@ -1321,9 +1478,8 @@ static access_session_t *gtp_update_session_state(access_plugin_t *p,
     gtp_saved_pkt_t *saved, *check;
     gtp_parsed_t *gparsed = (gtp_parsed_t *)parsed;
     PWord_t pval;
-    Word_t rcint;
 
-    saved = calloc(1, sizeof(gtp_saved_pkt_t));
+    saved = gtp_get_free_saved_pkt(glob);
 
     saved->type = gparsed->msgtype;
     saved->reqid = (((uint64_t)gparsed->teid) << 32) |
@@ -1343,8 +1499,7 @@ static access_session_t *gtp_update_session_state(access_plugin_t *p,
 
     JLG(pval, glob->saved_packets, saved->reqid);
     if (pval == NULL) {
-        JLI(pval, glob->saved_packets, saved->reqid);
-        *pval = (Word_t)saved;
+        insert_saved_packet(glob, saved);
 
         if (gparsed->msgtype == GTPV2_CREATE_SESSION_REQUEST ||
                 gparsed->msgtype == GTPV2_DELETE_SESSION_REQUEST ||
@@ -1365,7 +1520,7 @@ static access_session_t *gtp_update_session_state(access_plugin_t *p,
     } else {
         check = (gtp_saved_pkt_t *)*pval;
 
-        JLD(rcint, glob->saved_packets, check->reqid);
+        remove_saved_packet(glob, check);
 
         if (saved->type == GTPV2_CREATE_SESSION_REQUEST &&
                 check->type == GTPV2_CREATE_SESSION_RESPONSE) {
@@ -1413,14 +1568,8 @@ static access_session_t *gtp_update_session_state(access_plugin_t *p,
             gparsed->response = saved;
         } else if (saved->type == check->type) {
             /* probably a re-transmit */
-            JLI(pval, glob->saved_packets, saved->reqid);
-            *pval = (Word_t)saved;
-
-            if (check->ipcontent) {
-                free(check->ipcontent);
-            }
-            gtp_free_ie_list(check->ies);
-            free(check);
+            insert_saved_packet(glob, saved);
+            gtp_release_saved_pkt(glob, check);
             return NULL;
         } else {
             logger(LOG_INFO, "OpenLI: unexpected GTP packet pair (saved=%u, check=%u) for reqid %lu", saved->type, check->type, saved->reqid);
@@ -0,0 +1,307 @@
+/*
+ *
+ * Copyright (c) 2018-2022 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "logger.h"
+#include "openli_metrics.h"
+#include "backpressure.h"
+
+/* The most mediators that we can tell the processing threads about. If
+ * there are more than this, the extra mediators are still protected by
+ * the forwarding threads -- we just can't stop their CCs from being
+ * created. */
+#define MAX_BACKPRESSURE_DESTS 64
+
+enum {
+    SHED_TYPE_IPCC,
+    SHED_TYPE_IPMMCC,
+    SHED_TYPE_UMTSCC,
+    SHED_TYPE_EMAILCC,
+    SHED_TYPE_COUNT
+};
+
+static const char *shed_stage_names[OPENLI_SHED_STAGE_COUNT] = {
+    "capture", "forwarder"
+};
+
+static const char *shed_type_names[SHED_TYPE_COUNT] = {
+    "ipcc", "ipmmcc", "umtscc", "emailcc"
+};
+
+typedef struct backpressure_dest {
+    uint32_t mediatorid;
+
+    /** The number of forwarding threads that consider this mediator to be
+     *  congested */
+    uint32_t congested;
+} backpressure_dest_t;
+
+typedef struct openli_backpressure {
+    openli_backpressure_policy_t policy;
+    uint64_t limit;
+    uint64_t resume;
+
+    /** Protects the addition of new destinations -- lookups are lock-free,
+     *  as destinations are never removed */
+    pthread_mutex_t mutex;
+    backpressure_dest_t dests[MAX_BACKPRESSURE_DESTS];
+    uint32_t destcount;
+    uint8_t destswarned;
+
+    /** The number of congested mediators, so that the processing threads
+     *  can skip looking up the destination in the common case */
+    uint32_t congestedcount;
+
+    uint64_t shed[OPENLI_SHED_STAGE_COUNT][SHED_TYPE_COUNT];
+    openli_metric_t *metrics[OPENLI_SHED_STAGE_COUNT][SHED_TYPE_COUNT];
+} openli_backpressure_t;
+
+static openli_backpressure_t backpressure = {
+    .policy = OPENLI_BACKPRESSURE_NONE,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int shed_type_index(uint8_t msgtype) {
+    switch(msgtype) {
+        case OPENLI_EXPORT_IPCC:
+            return SHED_TYPE_IPCC;
+        case OPENLI_EXPORT_IPMMCC:
+            return SHED_TYPE_IPMMCC;
+        case OPENLI_EXPORT_UMTSCC:
+            return SHED_TYPE_UMTSCC;
+        case OPENLI_EXPORT_EMAILCC:
+            return SHED_TYPE_EMAILCC;
+    }
+    return -1;
+}
+
+static void refresh_backpressure_metrics(void *data) {
+    openli_backpressure_t *bp = (openli_backpressure_t *)data;
+    int s, t;
+
+    for (s = 0; s < OPENLI_SHED_STAGE_COUNT; s++) {
+        for (t = 0; t < SHED_TYPE_COUNT; t++) {
+            openli_metric_set(bp->metrics[s][t],
+                    (double)__atomic_load_n(&(bp->shed[s][t]),
+                    __ATOMIC_RELAXED));
+        }
+    }
+}
+
+void openli_backpressure_init(openli_backpressure_policy_t policy,
+        uint64_t limit) {
+
+    int s, t;
+
+    backpressure.policy = policy;
+    backpressure.limit = limit;
+    backpressure.resume = (limit / 4) * 3;
+    backpressure.destcount = 0;
+    backpressure.destswarned = 0;
+    backpressure.congestedcount = 0;
+    memset(backpressure.shed, 0, sizeof(backpressure.shed));
+
+    if (policy == OPENLI_BACKPRESSURE_NONE) {
+        return;
+    }
+
+    logger(LOG_INFO,
+            "OpenLI: collector will shed CC records for any mediator with more than %lu MB of records waiting",
+            (unsigned long)(limit / (1024 * 1024)));
+
+    if (!openli_metrics_enabled()) {
+        return;
+    }
+
+    for (s = 0; s < OPENLI_SHED_STAGE_COUNT; s++) {
+        for (t = 0; t < SHED_TYPE_COUNT; t++) {
+            backpressure.metrics[s][t] = openli_metrics_register(
+                    OPENLI_METRIC_COUNTER,
+                    "openli_collector_records_shed_total",
+                    "Records discarded because a mediator was not keeping up (each record discarded by the forwarder leaves a gap in its CIN's sequence numbers)",
+                    "stage", shed_stage_names[s], "type", shed_type_names[t],
+                    NULL);
+        }
+    }
+    openli_metrics_add_refresher(refresh_backpressure_metrics,
+            &backpressure);
+}
+
+void openli_backpressure_destroy(void) {
+    int s, t;
+
+    if (backpressure.policy == OPENLI_BACKPRESSURE_NONE) {
+        return;
+    }
+
+    if (backpressure.metrics[0][0] != NULL) {
+        openli_metrics_remove_refresher(&backpressure);
+    }
+
+    for (s = 0; s < OPENLI_SHED_STAGE_COUNT; s++) {
+        for (t = 0; t < SHED_TYPE_COUNT; t++) {
+            if (backpressure.metrics[s][t]) {
+                openli_metrics_deregister(backpressure.metrics[s][t]);
+                backpressure.metrics[s][t] = NULL;
+            }
+        }
+    }
+}
+
+int openli_backpressure_enabled(void) {
+    return backpressure.policy != OPENLI_BACKPRESSURE_NONE;
+}
+
+uint64_t openli_backpressure_limit(void) {
+    return backpressure.limit;
+}
+
+uint64_t openli_backpressure_resume_level(void) {
+    return backpressure.resume;
+}
+
+static backpressure_dest_t *find_dest(uint32_t mediatorid) {
+    uint32_t i, count;
+
+    count = __atomic_load_n(&(backpressure.destcount), __ATOMIC_ACQUIRE);
+    for (i = 0; i < count; i++) {
+        if (backpressure.dests[i].mediatorid == mediatorid) {
+            return &(backpressure.dests[i]);
+        }
+    }
+    return NULL;
+}
+
+void openli_backpressure_set_congested(uint32_t mediatorid, int congested) {
+    backpressure_dest_t *dest;
+
+    if (backpressure.policy == OPENLI_BACKPRESSURE_NONE) {
+        return;
+    }
+
+    pthread_mutex_lock(&(backpressure.mutex));
+    dest = find_dest(mediatorid);
+    if (dest == NULL) {
+        if (backpressure.destcount == MAX_BACKPRESSURE_DESTS) {
+            if (!backpressure.destswarned) {
+                logger(LOG_INFO,
+                        "OpenLI: too many mediators to apply backpressure to processing threads -- CCs for mediator %u will only be shed by the forwarding threads",
+                        mediatorid);
+                backpressure.destswarned = 1;
+            }
+            pthread_mutex_unlock(&(backpressure.mutex));
+            return;
+        }
+        dest = &(backpressure.dests[backpressure.destcount]);
+        dest->mediatorid = mediatorid;
+        dest->congested = 0;
+        __atomic_store_n(&(backpressure.destcount),
+                backpressure.destcount + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&(backpressure.mutex));
+
+    if (congested) {
+        if (__atomic_fetch_add(&(dest->congested), 1,
+                    __ATOMIC_RELEASE) == 0) {
+            __atomic_fetch_add(&(backpressure.congestedcount), 1,
+                    __ATOMIC_RELEASE);
+        }
+    } else {
+        if (__atomic_sub_fetch(&(dest->congested), 1,
+                    __ATOMIC_RELEASE) == 0) {
+            __atomic_fetch_sub(&(backpressure.congestedcount), 1,
+                    __ATOMIC_RELEASE);
+        }
+    }
+}
+
+int openli_backpressure_shed_record(openli_export_recv_t *msg) {
+    backpressure_dest_t *dest;
+
+    if (backpressure.policy != OPENLI_BACKPRESSURE_SHED_CC) {
+        return 0;
+    }
+
+    if (__atomic_load_n(&(backpressure.congestedcount),
+                __ATOMIC_ACQUIRE) == 0) {
+        return 0;
+    }
+
+    if (!openli_backpressure_sheddable(msg->type)) {
+        return 0;
+    }
+
+    dest = find_dest(msg->destid);
+    if (dest == NULL ||
+            __atomic_load_n(&(dest->congested), __ATOMIC_ACQUIRE) == 0) {
+        return 0;
+    }
+
+    openli_backpressure_count_shed(OPENLI_SHED_AT_CAPTURE, msg->type);
+    return 1;
+}
+
+void openli_backpressure_count_shed(int stage, uint8_t msgtype) {
+    int t = shed_type_index(msgtype);
+
+    if (t < 0 || stage < 0 || stage >= OPENLI_SHED_STAGE_COUNT) {
+        return;
+    }
+    __atomic_fetch_add(&(backpressure.shed[stage][t]), 1, __ATOMIC_RELAXED);
+}
+
+uint64_t openli_backpressure_total_shed(void) {
+    uint64_t total = 0;
+    int s, t;
+
+    for (s = 0; s < OPENLI_SHED_STAGE_COUNT; s++) {
+        for (t = 0; t < SHED_TYPE_COUNT; t++) {
+            total += __atomic_load_n(&(backpressure.shed[s][t]),
+                    __ATOMIC_RELAXED);
+        }
+    }
+    return total;
+}
+
+uint64_t openli_backpressure_stage_shed(int stage) {
+    uint64_t total = 0;
+    int t;
+
+    if (stage < 0 || stage >= OPENLI_SHED_STAGE_COUNT) {
+        return 0;
+    }
+
+    for (t = 0; t < SHED_TYPE_COUNT; t++) {
+        total += __atomic_load_n(&(backpressure.shed[stage][t]),
+                __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
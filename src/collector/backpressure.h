@@ -0,0 +1,138 @@
+/*
+ *
+ * Copyright (c) 2018-2022 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef OPENLI_COLLECTOR_BACKPRESSURE_H_
+#define OPENLI_COLLECTOR_BACKPRESSURE_H_
+
+#include <stdint.h>
+#include "collector_publish.h"
+
+/* Limits the amount of memory used to hold records for mediators that are
+ * not keeping up.
+ *
+ * Each forwarding thread tracks how much data it has waiting for each
+ * mediator. Once that reaches the configured limit, the mediator is marked
+ * as congested and the packet processing threads stop creating CC records
+ * for it until the forwarding thread has worked its way back below 3/4 of
+ * the limit. The forwarding thread also discards any CCs for a congested
+ * mediator that were already on their way through the pipeline, so the
+ * limit holds regardless of how many records are in flight.
+ *
+ * CCs shed by the processing threads have not been given a sequence number
+ * yet, but those shed by the forwarding thread have -- so each of the
+ * latter leaves a gap in the sequence numbers for its CIN. These are
+ * counted separately (OPENLI_SHED_AT_FORWARDER) so that the gaps can be
+ * accounted for.
+ *
+ * IRIs are never shed.
+ */
+
+typedef enum {
+    /** Buffer everything, no matter how much memory it takes */
+    OPENLI_BACKPRESSURE_NONE = 0,
+
+    /** Shed CC records for mediators that are over the buffer limit */
+    OPENLI_BACKPRESSURE_SHED_CC = 1,
+} openli_backpressure_policy_t;
+
+/** The pipeline stage where a record was shed */
+enum {
+    OPENLI_SHED_AT_CAPTURE,
+    OPENLI_SHED_AT_FORWARDER,
+    OPENLI_SHED_STAGE_COUNT
+};
+
+/** The default buffer limit for each mediator, in megabytes */
+#define OPENLI_BACKPRESSURE_DEFAULT_LIMIT_MB 1024
+
+/** Sets the backpressure policy. Must be called before any of the
+ *  collector threads are started.
+ *
+ *  @param policy       The backpressure policy to apply
+ *  @param limit        The amount of data that each forwarding thread may
+ *                      hold for a mediator before shedding starts, in bytes
+ */
+void openli_backpressure_init(openli_backpressure_policy_t policy,
+        uint64_t limit);
+
+/** Releases the backpressure state and any associated metrics */
+void openli_backpressure_destroy(void);
+
+/** Returns 1 if a policy other than OPENLI_BACKPRESSURE_NONE is active */
+int openli_backpressure_enabled(void);
+
+/** Returns the buffer limit (in bytes) at which a mediator becomes
+ *  congested. */
+uint64_t openli_backpressure_limit(void);
+
+/** Returns the buffer level (in bytes) at which a congested mediator
+ *  stops being congested. */
+uint64_t openli_backpressure_resume_level(void);
+
+/** Returns 1 if a record type may be shed under backpressure */
+static inline int openli_backpressure_sheddable(uint8_t msgtype) {
+    return (msgtype == OPENLI_EXPORT_IPCC || msgtype == OPENLI_EXPORT_IPMMCC
+            || msgtype == OPENLI_EXPORT_UMTSCC ||
+            msgtype == OPENLI_EXPORT_EMAILCC);
+}
+
+/** Called by a forwarding thread when a mediator becomes congested or
+ *  stops being congested.
+ *
+ *  @param mediatorid   The ID of the mediator
+ *  @param congested    1 if the mediator is now congested, 0 otherwise
+ */
+void openli_backpressure_set_congested(uint32_t mediatorid, int congested);
+
+/** Decides whether a newly created record should be shed, rather than
+ *  published, because the mediator it is going to is congested.
+ *
+ *  Shed records are counted, but it is up to the caller to free them.
+ *
+ *  @return 1 if the record should be shed, 0 if it should be published.
+ */
+int openli_backpressure_shed_record(openli_export_recv_t *msg);
+
+/** Counts a record that has been shed.
+ *
+ *  @param stage        The stage where the record was shed
+ *                      (OPENLI_SHED_AT_*)
+ *  @param msgtype      The type of the shed record
+ */
+void openli_backpressure_count_shed(int stage, uint8_t msgtype);
+
+/** Returns the total number of records that have been shed so far */
+uint64_t openli_backpressure_total_shed(void);
+
+/** Returns the number of records that have been shed so far at a given
+ *  stage (OPENLI_SHED_AT_*). For OPENLI_SHED_AT_FORWARDER, this is also
+ *  the number of gaps in the CC sequence numbers sent to mediators.
+ */
+uint64_t openli_backpressure_stage_shed(int stage);
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -35,6 +35,7 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <stddef.h>
 
 #include <libtrace_parallel.h>
 #include <libwandder.h>
@@ -52,6 +53,7 @@
 #include "alushim_parser.h"
 #include "jmirror_parser.h"
 #include "util.h"
+#include "openli_metrics.h"
 
 volatile int collector_halt = 0;
 volatile int reload_config = 0;
@@ -70,13 +72,132 @@ static void usage(char *prog) {
     fprintf(stderr, "Usage: %s -c configfile\n", prog);
 }
 
+typedef struct collector_stat_metric {
+    const char *name;
+    const char *help;
+    const char *labelname;
+    const char *labelvalue;
+    size_t offset;
+} collector_stat_metric_t;
+
+#define COLLECTOR_STAT(x) offsetof(collector_stats_t, x)
+
+/* Global collector statistics that are also exported as metrics */
+static const collector_stat_metric_t collector_stat_metrics[] = {
+    { "openli_collector_packets_accepted_total",
+            "Packets accepted by all capture inputs", NULL, NULL,
+            COLLECTOR_STAT(packets_accepted) },
+    { "openli_collector_packets_dropped_total",
+            "Packets dropped by all capture inputs", NULL, NULL,
+            COLLECTOR_STAT(packets_dropped) },
+    { "openli_collector_packets_intercepted_total",
+            "Packets that matched at least one intercept", NULL, NULL,
+            COLLECTOR_STAT(packets_intercepted) },
+    { "openli_collector_packets_synced_total",
+            "Packets passed on to a sync thread or email worker",
+            "sync", "ip", COLLECTOR_STAT(packets_sync_ip) },
+    { "openli_collector_packets_synced_total",
+            "Packets passed on to a sync thread or email worker",
+            "sync", "voip", COLLECTOR_STAT(packets_sync_voip) },
+    { "openli_collector_packets_synced_total",
+            "Packets passed on to a sync thread or email worker",
+            "sync", "email", COLLECTOR_STAT(packets_sync_email) },
+    { "openli_collector_records_created_total",
+            "ETSI records created, by record type",
+            "type", "ipcc", COLLECTOR_STAT(ipcc_created) },
+    { "openli_collector_records_created_total",
+            "ETSI records created, by record type",
+            "type", "ipiri", COLLECTOR_STAT(ipiri_created) },
+    { "openli_collector_records_created_total",
+            "ETSI records created, by record type",
+            "type", "mobiri", COLLECTOR_STAT(mobiri_created) },
+    { "openli_collector_records_created_total",
+            "ETSI records created, by record type",
+            "type", "ipmmcc", COLLECTOR_STAT(ipmmcc_created) },
+    { "openli_collector_records_created_total",
+            "ETSI records created, by record type",
+            "type", "ipmmiri", COLLECTOR_STAT(ipmmiri_created) },
+    { "openli_collector_records_created_total",
+            "ETSI records created, by record type",
+            "type", "emailcc", COLLECTOR_STAT(emailcc_created) },
+    { "openli_collector_records_created_total",
+            "ETSI records created, by record type",
+            "type", "emailiri", COLLECTOR_STAT(emailiri_created) },
+    { "openli_collector_bad_packets_total",
+            "Packets that could not be parsed, by protocol",
+            "protocol", "sip", COLLECTOR_STAT(bad_sip_packets) },
+    { "openli_collector_bad_packets_total",
+            "Packets that could not be parsed, by protocol",
+            "protocol", "ipsession", COLLECTOR_STAT(bad_ip_session_packets) },
+};
+
+#define COLLECTOR_STAT_METRIC_COUNT \
+        (sizeof(collector_stat_metrics) / sizeof(collector_stat_metric_t))
+
+static inline uint64_t *collector_stat_field(collector_stats_t *stats,
+        const collector_stat_metric_t *desc) {
+    return (uint64_t *)(((uint8_t *)stats) + desc->offset);
+}
+
+/* Called by the metrics server before each scrape, so must not be called
+ * with stats_mutex already held.
+ */
+static void refresh_collector_stat_metrics(void *data) {
+    collector_global_t *glob = (collector_global_t *)data;
+    size_t i;
+    uint64_t total;
+
+    pthread_mutex_lock(&(glob->stats_mutex));
+    for (i = 0; i < COLLECTOR_STAT_METRIC_COUNT; i++) {
+        total = *collector_stat_field(&(glob->stats),
+                    &(collector_stat_metrics[i])) +
+                *collector_stat_field(&(glob->stats_lifetime),
+                    &(collector_stat_metrics[i]));
+        openli_metric_set(glob->statmetrics[i], (double)total);
+    }
+    pthread_mutex_unlock(&(glob->stats_mutex));
+}
+
+static void register_collector_stat_metrics(collector_global_t *glob) {
+    size_t i;
+    const collector_stat_metric_t *desc;
+
+    if (!openli_metrics_enabled()) {
+        return;
+    }
+
+    glob->statmetrics = calloc(COLLECTOR_STAT_METRIC_COUNT,
+            sizeof(openli_metric_t *));
+    for (i = 0; i < COLLECTOR_STAT_METRIC_COUNT; i++) {
+        desc = &(collector_stat_metrics[i]);
+        if (desc->labelname) {
+            glob->statmetrics[i] = openli_metrics_register(
+                    OPENLI_METRIC_COUNTER, desc->name, desc->help,
+                    desc->labelname, desc->labelvalue, NULL);
+        } else {
+            glob->statmetrics[i] = openli_metrics_register(
+                    OPENLI_METRIC_COUNTER, desc->name, desc->help, NULL);
+        }
+    }
+    openli_metrics_add_refresher(refresh_collector_stat_metrics, glob);
+}
+
 static void reset_collector_stats(collector_global_t *glob) {
+    size_t i;
+
+    for (i = 0; i < COLLECTOR_STAT_METRIC_COUNT; i++) {
+        *collector_stat_field(&(glob->stats_lifetime),
+                &(collector_stat_metrics[i])) +=
+                *collector_stat_field(&(glob->stats),
+                &(collector_stat_metrics[i]));
+    }
 
     glob->stats.packets_dropped = 0;
     glob->stats.packets_accepted = 0;
     glob->stats.packets_intercepted = 0;
     glob->stats.packets_sync_ip = 0;
     glob->stats.packets_sync_voip = 0;
+    glob->stats.packets_sync_email = 0;
     glob->stats.ipcc_created = 0;
     glob->stats.mobiri_created = 0;
     glob->stats.ipiri_created = 0;
@@ -172,6 +293,63 @@ static void log_collector_stats(collector_global_t *glob) {
     logger(LOG_INFO, "OpenLI: === statistics complete ===");
 }
 
+static void fold_pending_stats(collector_global_t *glob,
+        colthread_local_t *loc) {
+
+    colthread_pending_stats_t *pend = &(loc->pendingstats);
+
+    if (pend->packets_intercepted == 0 && pend->packets_sync_ip == 0 &&
+            pend->packets_sync_voip == 0 && pend->packets_sync_email == 0 &&
+            pend->ipcc_created == 0 && pend->ipmmcc_created == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&(glob->stats_mutex));
+    glob->stats.packets_intercepted += pend->packets_intercepted;
+    glob->stats.packets_sync_ip += pend->packets_sync_ip;
+    glob->stats.packets_sync_voip += pend->packets_sync_voip;
+    glob->stats.packets_sync_email += pend->packets_sync_email;
+    glob->stats.ipcc_created += pend->ipcc_created;
+    glob->stats.ipmmcc_created += pend->ipmmcc_created;
+    pthread_mutex_unlock(&(glob->stats_mutex));
+
+    memset(pend, 0, sizeof(colthread_pending_stats_t));
+}
+
+static void update_thread_metrics(colthread_local_t *loc) {
+
+    if (loc->metric_packets == NULL) {
+        return;
+    }
+
+    openli_metric_inc(loc->metric_packets, (double)loc->metricpackets);
+    loc->metricpackets = 0;
+    openli_metric_set(loc->metric_ipsyncq,
+            (double)libtrace_message_queue_count(&(loc->fromsyncq_ip)));
+    openli_metric_set(loc->metric_voipsyncq,
+            (double)libtrace_message_queue_count(&(loc->fromsyncq_voip)));
+}
+
+static void complete_packet_batch(colthread_local_t *loc,
+        collector_global_t *glob) {
+
+    flush_openli_publish_batch(loc->zmq_pubsocks[0], &(loc->pubbatch));
+    fold_pending_stats(glob, loc);
+    loc->sincebatchstart = 0;
+}
+
+static void process_batch_tick(libtrace_t *trace, libtrace_thread_t *t,
+        void *global, void *local, uint64_t tick) {
+
+    collector_global_t *glob = (collector_global_t *)global;
+    colthread_local_t *loc = (colthread_local_t *)local;
+
+    /* Make sure a partially complete batch doesn't sit around
+     * indefinitely if the packet rate drops off */
+    complete_packet_batch(loc, glob);
+    update_thread_metrics(loc);
+}
+
 static void process_tick(libtrace_t *trace, libtrace_thread_t *t,
         void *global, void *local, uint64_t tick) {
 
@@ -179,6 +357,15 @@ static void process_tick(libtrace_t *trace, libtrace_thread_t *t,
     colthread_local_t *loc = (colthread_local_t *)local;
     libtrace_stat_t *stats;
 
+    complete_packet_batch(loc, glob);
+    update_thread_metrics(loc);
+
+    /* Ticks arrive more often than once per second when packet batching
+     * is enabled, but drops should still only be reported each second */
+    if ((tick >> 32) == loc->lastticksec) {
+        return;
+    }
+    loc->lastticksec = (tick >> 32);
 
     if (trace_get_perpkt_thread_id(t) == 0) {
 
@@ -226,8 +413,8 @@ static void init_collocal(colthread_local_t *loc, collector_global_t *glob,
     libtrace_message_queue_init(&(loc->fromsyncq_voip),
             sizeof(openli_pushed_t));
 
-    loc->activeipv4intercepts = NULL;
-    loc->activeipv6intercepts = NULL;
+    loc->sessionindex = glob->syncip.sessionindex;
+    loc->sessreader = NULL;
     loc->activertpintercepts = NULL;
     loc->activemirrorintercepts = NULL;
     loc->activestaticintercepts = NULL;
@@ -237,16 +424,31 @@ static void init_collocal(colthread_local_t *loc, collector_global_t *glob,
     loc->smtpservers = NULL;
     loc->imapservers = NULL;
     loc->pop3servers = NULL;
+    loc->coreclassifier = NULL;
+    loc->coreclassdirty = 0;
     loc->staticv4ranges = New_Patricia(32);
     loc->staticv6ranges = New_Patricia(128);
-    loc->dynamicv6ranges = New_Patricia(128);
-    loc->staticcache = NULL;
+    loc->staticcache = create_static_ipcache();
     loc->tosyncq_ip = NULL;
     loc->tosyncq_voip = NULL;
 
     loc->accepted = 0;
     loc->dropped = 0;
 
+    loc->packetbatchsize = glob->packet_batch_size;
+    if (loc->packetbatchsize == 0) {
+        loc->packetbatchsize = 1;
+    }
+    loc->sincebatchstart = 0;
+    loc->pubbatch.count = 0;
+    loc->pubbatch.limit = loc->packetbatchsize;
+    memset(&(loc->pendingstats), 0, sizeof(colthread_pending_stats_t));
+    loc->lastticksec = 0;
+    loc->metric_packets = NULL;
+    loc->metric_ipsyncq = NULL;
+    loc->metric_voipsyncq = NULL;
+    loc->metricpackets = 0;
+
 
     loc->zmq_pubsocks = calloc(glob->seqtracker_threads, sizeof(void *));
     for (i = 0; i < glob->seqtracker_threads; i++) {
@@ -281,6 +483,48 @@ static void init_collocal(colthread_local_t *loc, collector_global_t *glob,
 
 }
 
+static void register_thread_metrics(collector_global_t *glob,
+        colthread_local_t *loc, libtrace_t *trace, libtrace_thread_t *t) {
+
+    colinput_t *inp, *tmp;
+    char *inpname = "unknown";
+    char threadstr[16];
+
+    if (!openli_metrics_enabled()) {
+        return;
+    }
+
+    HASH_ITER(hh, glob->inputs, inp, tmp) {
+        if (inp->trace == trace) {
+            inpname = inp->uri;
+            break;
+        }
+    }
+    snprintf(threadstr, 16, "%d", trace_get_perpkt_thread_id(t));
+
+    loc->metric_packets = openli_metrics_register(OPENLI_METRIC_COUNTER,
+            "openli_collector_thread_packets_total",
+            "Packets seen by each packet processing thread",
+            "input", inpname, "thread", threadstr, NULL);
+    loc->metric_ipsyncq = openli_metrics_register(OPENLI_METRIC_GAUGE,
+            "openli_collector_thread_sync_queue_depth",
+            "Messages from a sync thread waiting to be read by a packet processing thread",
+            "input", inpname, "thread", threadstr, "sync", "ip", NULL);
+    loc->metric_voipsyncq = openli_metrics_register(OPENLI_METRIC_GAUGE,
+            "openli_collector_thread_sync_queue_depth",
+            "Messages from a sync thread waiting to be read by a packet processing thread",
+            "input", inpname, "thread", threadstr, "sync", "voip", NULL);
+}
+
+static void deregister_thread_metrics(colthread_local_t *loc) {
+    openli_metrics_deregister(loc->metric_packets);
+    openli_metrics_deregister(loc->metric_ipsyncq);
+    openli_metrics_deregister(loc->metric_voipsyncq);
+    loc->metric_packets = NULL;
+    loc->metric_ipsyncq = NULL;
+    loc->metric_voipsyncq = NULL;
+}
+
 static void *start_processing_thread(libtrace_t *trace, libtrace_thread_t *t,
         void *global) {
 
@@ -290,8 +534,11 @@ static void *start_processing_thread(libtrace_t *trace, libtrace_thread_t *t,
     pthread_rwlock_wrlock(&(glob->config_mutex));
     loc = glob->collocals[glob->nextloc];
     glob->nextloc ++;
+    register_thread_metrics(glob, loc, trace, t);
     pthread_rwlock_unlock(&(glob->config_mutex));
 
+    loc->sessreader = session_index_register_reader(loc->sessionindex);
+
     register_sync_queues(&(glob->syncip), loc->tosyncq_ip,
 			&(loc->fromsyncq_ip), t);
     register_sync_queues(&(glob->syncvoip), loc->tosyncq_voip,
@@ -312,27 +559,10 @@ static void free_staticrange_data(void *data) {
     }
 }
 
-static void free_staticcache(static_ipcache_t *cache) {
-    static_ipcache_t *ent, *tmp;
-
-    HASH_ITER(hh, cache, ent, tmp) {
-        HASH_DELETE(hh, cache, ent);
-        free(ent);
-    }
-}
-
 static void process_incoming_messages(libtrace_thread_t *t,
         collector_global_t *glob, colthread_local_t *loc,
         openli_pushed_t *syncpush) {
 
-    if (syncpush->type == OPENLI_PUSH_IPINTERCEPT) {
-        handle_push_ipintercept(t, loc, syncpush->data.ipsess);
-    }
-
-    if (syncpush->type == OPENLI_PUSH_HALT_IPINTERCEPT) {
-        handle_halt_ipintercept(t, loc, syncpush->data.ipsess);
-    }
-
     if (syncpush->type == OPENLI_PUSH_IPMMINTERCEPT) {
         handle_push_ipmmintercept(t, loc, syncpush->data.ipmmint);
     }
@@ -373,10 +603,6 @@ static void process_incoming_messages(libtrace_thread_t *t,
         handle_change_voip_intercept(t, loc, syncpush->data.ipmmint);
     }
 
-    if (syncpush->type == OPENLI_PUSH_UPDATE_IPINTERCEPT) {
-        handle_change_ipint_intercept(t, loc, syncpush->data.ipsess);
-    }
-
     if (syncpush->type == OPENLI_PUSH_UPDATE_VENDMIRROR_INTERCEPT) {
         handle_change_vendmirror_intercept(t, loc, syncpush->data.mirror);
     }
@@ -392,8 +618,6 @@ static void stop_processing_thread(libtrace_t *trace, libtrace_thread_t *t,
 
     collector_global_t *glob = (collector_global_t *)global;
     colthread_local_t *loc = (colthread_local_t *)tls;
-    ipv4_target_t *v4, *tmp;
-    ipv6_target_t *v6, *tmp2;
     openli_pushed_t syncpush;
     int zero = 0, i;
 
@@ -413,6 +637,10 @@ static void stop_processing_thread(libtrace_t *trace, libtrace_thread_t *t,
         process_incoming_messages(t, glob, loc, &syncpush);
     }
 
+    complete_packet_batch(loc, glob);
+    update_thread_metrics(loc);
+    deregister_thread_metrics(loc);
+
     deregister_sync_queues(&(glob->syncip), t);
     deregister_sync_queues(&(glob->syncvoip), t);
 
@@ -438,18 +666,8 @@ static void stop_processing_thread(libtrace_t *trace, libtrace_thread_t *t,
     free(loc->zmq_pubsocks);
     free(loc->email_worker_queues);
 
-    HASH_ITER(hh, loc->activeipv4intercepts, v4, tmp) {
-        free_all_ipsessions(&(v4->intercepts));
-        HASH_DELETE(hh, loc->activeipv4intercepts, v4);
-        free(v4);
-    }
-
-    HASH_ITER(hh, loc->activeipv6intercepts, v6, tmp2) {
-        free_all_ipsessions(&(v6->intercepts));
-        HASH_DELETE(hh, loc->activeipv6intercepts, v6);
-        free(v6->prefixstr);
-        free(v6);
-    }
+    session_index_release_reader(loc->sessreader);
+    loc->sessreader = NULL;
 
 
     free_all_staticipsessions(&(loc->activestaticintercepts));
@@ -461,14 +679,14 @@ static void stop_processing_thread(libtrace_t *trace, libtrace_thread_t *t,
     free_coreserver_list(loc->smtpservers);
     free_coreserver_list(loc->imapservers);
     free_coreserver_list(loc->pop3servers);
+    free_coreserver_classifier(loc->coreclassifier);
 
     destroy_ipfrag_reassembler(loc->fragreass);
 
     Destroy_Patricia(loc->staticv4ranges, free_staticrange_data);
     Destroy_Patricia(loc->staticv6ranges, free_staticrange_data);
-    Destroy_Patricia(loc->dynamicv6ranges, free_staticrange_data);
 
-    free_staticcache(loc->staticcache);
+    destroy_static_ipcache(loc->staticcache);
 }
 
 static inline void send_packet_to_sync(libtrace_packet_t *pkt,
@@ -592,81 +810,25 @@ static inline uint8_t check_for_invalid_sip(libtrace_packet_t *pkt,
     return 0;
 }
 
-static inline uint32_t is_core_server_packet(libtrace_packet_t *pkt,
-        packet_info_t *pinfo, coreserver_t *servers) {
-
-    coreserver_t *rad, *tmp;
-    coreserver_t *found = NULL;
-    uint32_t hashval = 0;
-
-    if (pinfo->srcport == 0 || pinfo->destport == 0) {
-        return 0;
-    }
-
-    HASH_ITER(hh, servers, rad, tmp) {
-        if (rad->info == NULL) {
-            rad->info = populate_addrinfo(rad->ipstr, rad->portstr,
-                    SOCK_DGRAM);
-            if (!rad->info) {
-                logger(LOG_INFO,
-                        "Removing %s:%s from %s server list due to getaddrinfo error",
-                        rad->ipstr, rad->portstr,
-                        coreserver_type_to_string(rad->servertype));
-
-                HASH_DELETE(hh, servers, rad);
-                continue;
-            }
-            if (rad->info->ai_family == AF_INET) {
-                rad->portswapped = ntohs(CS_TO_V4(rad)->sin_port);
-            } else if (rad->info->ai_family == AF_INET6) {
-                rad->portswapped = ntohs(CS_TO_V6(rad)->sin6_port);
-            }
-        }
-
-        if (pinfo->family == AF_INET) {
-            struct sockaddr_in *sa;
-            sa = (struct sockaddr_in *)(&(pinfo->srcip));
-
-            if (CORESERVER_MATCH_V4(rad, sa, pinfo->srcport)) {
-                found = rad;
-                break;
-            }
-            sa = (struct sockaddr_in *)(&(pinfo->destip));
-            if (CORESERVER_MATCH_V4(rad, sa, pinfo->destport)) {
-                found = rad;
-                break;
-            }
-        } else if (pinfo->family == AF_INET6) {
-            struct sockaddr_in6 *sa6;
-            sa6 = (struct sockaddr_in6 *)(&(pinfo->srcip));
-            if (CORESERVER_MATCH_V6(rad, sa6, pinfo->srcport)) {
-                found = rad;
-                break;
-            }
-            sa6 = (struct sockaddr_in6 *)(&(pinfo->destip));
-            if (CORESERVER_MATCH_V6(rad, sa6, pinfo->destport)) {
-                found = rad;
-                break;
-            }
-        }
-    }
-
-    /* Doesn't match any of our known core servers */
-    if (found == NULL) {
-        return 0;
-    }
-
-    /* Not technically an LIID, but we just need a hashed ID for the server
-     * entity.
-     */
-    hashval = hash_liid(found->serverkey);
-
-    /* 0 is our value for "not found", so make sure we never use it... */
-    if (hashval == 0) {
-        hashval = 1;
-    }
-    return hashval;
-
+static void rebuild_coreserver_classifier(colthread_local_t *loc) {
+
+    free_coreserver_classifier(loc->coreclassifier);
+    loc->coreclassifier = NULL;
+
+    add_coreservers_to_classifier(&(loc->coreclassifier),
+            &(loc->radiusservers));
+    add_coreservers_to_classifier(&(loc->coreclassifier),
+            &(loc->gtpservers));
+    add_coreservers_to_classifier(&(loc->coreclassifier),
+            &(loc->sipservers));
+    add_coreservers_to_classifier(&(loc->coreclassifier),
+            &(loc->smtpservers));
+    add_coreservers_to_classifier(&(loc->coreclassifier),
+            &(loc->imapservers));
+    add_coreservers_to_classifier(&(loc->coreclassifier),
+            &(loc->pop3servers));
+
+    loc->coreclassdirty = 0;
 }
 
 static libtrace_packet_t *process_packet(libtrace_t *trace,
@@ -682,24 +844,33 @@ static libtrace_packet_t *process_packet(libtrace_t *trace,
     int forwarded = 0, ret;
     int ipsynced = 0, voipsynced = 0, emailsynced = 0;
     uint16_t fragoff = 0;
-    uint32_t servhash = 0;
+    uint32_t coremask = 0;
 
     openli_pushed_t syncpush;
     packet_info_t pinfo;
+    coreserver_match_t coreclass;
 
-    /* Check for any messages from the sync threads */
-    while (libtrace_message_queue_try_get(&(loc->fromsyncq_ip),
-            (void *)&syncpush) != LIBTRACE_MQ_FAILED) {
+    /* Check for any messages from the sync threads -- if packet batching
+     * is enabled, only do this at the start of each batch */
+    if (loc->sincebatchstart == 0) {
+        while (libtrace_message_queue_try_get(&(loc->fromsyncq_ip),
+                (void *)&syncpush) != LIBTRACE_MQ_FAILED) {
 
-        process_incoming_messages(t, glob, loc, &syncpush);
-    }
+            process_incoming_messages(t, glob, loc, &syncpush);
+        }
 
-    while (libtrace_message_queue_try_get(&(loc->fromsyncq_voip),
-            (void *)&syncpush) != LIBTRACE_MQ_FAILED) {
+        while (libtrace_message_queue_try_get(&(loc->fromsyncq_voip),
+                (void *)&syncpush) != LIBTRACE_MQ_FAILED) {
 
-        process_incoming_messages(t, glob, loc, &syncpush);
+            process_incoming_messages(t, glob, loc, &syncpush);
+        }
+    }
+
+    if (loc->coreclassdirty) {
+        rebuild_coreserver_classifier(loc);
     }
 
+    loc->metricpackets ++;
 
     l3 = trace_get_layer3(pkt, &ethertype, &rem);
     if (l3 == NULL || rem == 0) {
@@ -785,6 +956,13 @@ static libtrace_packet_t *process_packet(libtrace_t *trace,
         pinfo.family = 0;
     }
 
+    /* Work out which (if any) of our known core servers this packet is
+     * to or from -- a single probe per endpoint covers every server type */
+    if (proto == TRACE_IPPROTO_UDP || proto == TRACE_IPPROTO_TCP) {
+        coremask = classify_coreserver_packet(loc->coreclassifier, &pinfo,
+                &coreclass);
+    }
+
     /* All these special packets are UDP, so we can avoid a whole bunch
      * of these checks for TCP traffic */
     if (proto == TRACE_IPPROTO_UDP) {
@@ -794,9 +972,7 @@ static libtrace_packet_t *process_packet(libtrace_t *trace,
         if (glob->alumirrors && check_alu_intercept(&(glob->sharedinfo), loc,
                 pkt, &pinfo, glob->alumirrors, loc->activemirrorintercepts)) {
             forwarded = 1;
-            pthread_mutex_lock(&(glob->stats_mutex));
-            glob->stats.ipcc_created += 1;
-            pthread_mutex_unlock(&(glob->stats_mutex));
+            loc->pendingstats.ipcc_created += 1;
             goto processdone;
         }
 
@@ -804,30 +980,25 @@ static libtrace_packet_t *process_packet(libtrace_t *trace,
                 pkt, &pinfo, glob->jmirrors, loc->activemirrorintercepts)) {
 
             forwarded = 1;
-            pthread_mutex_lock(&(glob->stats_mutex));
-            glob->stats.ipcc_created += 1;
-            pthread_mutex_unlock(&(glob->stats_mutex));
+            loc->pendingstats.ipcc_created += 1;
             goto processdone;
         }
 
         /* Is this a RADIUS packet? -- if yes, create a state update */
-        if (loc->radiusservers && is_core_server_packet(pkt, &pinfo,
-                    loc->radiusservers)) {
+        if (coremask & CORESERVER_TYPE_BIT(OPENLI_CORE_SERVER_RADIUS)) {
             send_packet_to_sync(pkt, loc->tosyncq_ip, OPENLI_UPDATE_RADIUS);
             ipsynced = 1;
             goto processdone;
         }
 
-        if (loc->gtpservers && is_core_server_packet(pkt, &pinfo,
-                    loc->gtpservers)) {
+        if (coremask & CORESERVER_TYPE_BIT(OPENLI_CORE_SERVER_GTP)) {
             send_packet_to_sync(pkt, loc->tosyncq_ip, OPENLI_UPDATE_GTP);
             ipsynced = 1;
             goto processdone;
         }
 
         /* Is this a SIP packet? -- if yes, create a state update */
-        if (loc->sipservers && is_core_server_packet(pkt, &pinfo,
-                    loc->sipservers)) {
+        if (coremask & CORESERVER_TYPE_BIT(OPENLI_CORE_SERVER_SIP)) {
             if (!check_for_invalid_sip(pkt, fragoff)) {
                 send_packet_to_sync(pkt, loc->tosyncq_voip,
                         OPENLI_UPDATE_SIP);
@@ -836,34 +1007,33 @@ static libtrace_packet_t *process_packet(libtrace_t *trace,
         }
     } else if (proto == TRACE_IPPROTO_TCP) {
         /* Is this a SIP packet? -- if yes, create a state update */
-        if (loc->sipservers && is_core_server_packet(pkt, &pinfo,
-                    loc->sipservers)) {
+        if (coremask & CORESERVER_TYPE_BIT(OPENLI_CORE_SERVER_SIP)) {
             send_packet_to_sync(pkt, loc->tosyncq_voip, OPENLI_UPDATE_SIP);
             voipsynced = 1;
         }
 
-        else if (loc->smtpservers &&
-                (servhash = is_core_server_packet(pkt, &pinfo,
-                    loc->smtpservers))) {
+        else if (coremask & CORESERVER_TYPE_BIT(OPENLI_CORE_SERVER_SMTP)) {
             send_packet_to_emailworker(pkt, loc->email_worker_queues,
-                    glob->email_threads, servhash, OPENLI_UPDATE_SMTP);
+                    glob->email_threads,
+                    coreclass.serverhash[OPENLI_CORE_SERVER_SMTP],
+                    OPENLI_UPDATE_SMTP);
             emailsynced = 1;
 
         }
 
-        else if (loc->imapservers &&
-                (servhash = is_core_server_packet(pkt, &pinfo,
-                    loc->imapservers))) {
+        else if (coremask & CORESERVER_TYPE_BIT(OPENLI_CORE_SERVER_IMAP)) {
             send_packet_to_emailworker(pkt, loc->email_worker_queues,
-                    glob->email_threads, servhash, OPENLI_UPDATE_IMAP);
+                    glob->email_threads,
+                    coreclass.serverhash[OPENLI_CORE_SERVER_IMAP],
+                    OPENLI_UPDATE_IMAP);
             emailsynced = 1;
         }
 
-        else if (loc->pop3servers &&
-                (servhash = is_core_server_packet(pkt, &pinfo,
-                    loc->pop3servers))) {
+        else if (coremask & CORESERVER_TYPE_BIT(OPENLI_CORE_SERVER_POP3)) {
             send_packet_to_emailworker(pkt, loc->email_worker_queues,
-                    glob->email_threads, servhash, OPENLI_UPDATE_POP3);
+                    glob->email_threads,
+                    coreclass.serverhash[OPENLI_CORE_SERVER_POP3],
+                    OPENLI_UPDATE_POP3);
             emailsynced = 1;
         }
     }
@@ -874,9 +1044,7 @@ static libtrace_packet_t *process_packet(libtrace_t *trace,
         if ((ret = ipv4_comm_contents(pkt, &pinfo, (libtrace_ip_t *)l3, iprem,
                     loc))) {
             forwarded = 1;
-            pthread_mutex_lock(&(glob->stats_mutex));
-            glob->stats.ipcc_created += ret;
-            pthread_mutex_unlock(&(glob->stats_mutex));
+            loc->pendingstats.ipcc_created += ret;
         }
 
         /* Is this an RTP packet? -- if yes, possible IPMM CC */
@@ -884,9 +1052,7 @@ static libtrace_packet_t *process_packet(libtrace_t *trace,
             if ((ret = ip4mm_comm_contents(pkt, &pinfo, (libtrace_ip_t *)l3,
                         iprem, loc))) {
                 forwarded = 1;
-                pthread_mutex_lock(&(glob->stats_mutex));
-                glob->stats.ipmmcc_created += ret;
-                pthread_mutex_unlock(&(glob->stats_mutex));
+                loc->pendingstats.ipmmcc_created += ret;
             }
         }
 
@@ -895,45 +1061,38 @@ static libtrace_packet_t *process_packet(libtrace_t *trace,
         if ((ret = ipv6_comm_contents(pkt, &pinfo, (libtrace_ip6_t *)l3, iprem,
                     loc))) {
             forwarded = 1;
-            pthread_mutex_lock(&(glob->stats_mutex));
-            glob->stats.ipcc_created += ret;
-            pthread_mutex_unlock(&(glob->stats_mutex));
+            loc->pendingstats.ipcc_created += ret;
         }
 
         if (proto == TRACE_IPPROTO_UDP) {
             if ((ret = ip6mm_comm_contents(pkt, &pinfo, (libtrace_ip6_t *)l3,
                         iprem, loc))) {
                 forwarded = 1;
-                pthread_mutex_lock(&(glob->stats_mutex));
-                glob->stats.ipmmcc_created += ret;
-                pthread_mutex_unlock(&(glob->stats_mutex));
+                loc->pendingstats.ipmmcc_created += ret;
             }
         }
     }
 
 processdone:
     if (emailsynced) {
-        pthread_mutex_lock(&(glob->stats_mutex));
-        glob->stats.packets_sync_email ++;
-        pthread_mutex_unlock(&(glob->stats_mutex));
+        loc->pendingstats.packets_sync_email ++;
     }
 
     if (ipsynced) {
-        pthread_mutex_lock(&(glob->stats_mutex));
-        glob->stats.packets_sync_ip ++;
-        pthread_mutex_unlock(&(glob->stats_mutex));
+        loc->pendingstats.packets_sync_ip ++;
     }
 
     if (voipsynced) {
-        pthread_mutex_lock(&(glob->stats_mutex));
-        glob->stats.packets_sync_voip ++;
-        pthread_mutex_unlock(&(glob->stats_mutex));
+        loc->pendingstats.packets_sync_voip ++;
     }
 
     if (forwarded) {
-        pthread_mutex_lock(&(glob->stats_mutex));
-        glob->stats.packets_intercepted ++;
-        pthread_mutex_unlock(&(glob->stats_mutex));
+        loc->pendingstats.packets_intercepted ++;
+    }
+
+    loc->sincebatchstart ++;
+    if (loc->sincebatchstart >= loc->packetbatchsize) {
+        complete_packet_batch(loc, glob);
     }
 
     return pkt;
@@ -956,6 +1115,8 @@ static int start_input(collector_global_t *glob, colinput_t *inp,
 
     if (inp->report_drops) {
         trace_set_tick_interval_cb(inp->pktcbs, process_tick);
+    } else if (glob->packet_batch_size > 1 || openli_metrics_enabled()) {
+        trace_set_tick_interval_cb(inp->pktcbs, process_batch_tick);
     }
 
     assert(!inp->trace);
@@ -1010,7 +1171,11 @@ static int start_input(collector_global_t *glob, colinput_t *inp,
 
     }
 
-    trace_set_tick_interval(inp->trace, 1000);
+    if (glob->packet_batch_size > 1) {
+        trace_set_tick_interval(inp->trace, COLLECTOR_BATCH_TICK_INTERVAL);
+    } else {
+        trace_set_tick_interval(inp->trace, 1000);
+    }
 
     if (trace_pstart(inp->trace, glob, inp->pktcbs, NULL) == -1) {
         libtrace_err_t lterr = trace_get_err(inp->trace);
@@ -1145,6 +1310,7 @@ static inline void init_sync_thread_data(collector_global_t *glob,
 
     sup->stats_mutex = &(glob->stats_mutex);
     sup->stats = &(glob->stats);
+    sup->sessionindex = NULL;
 }
 
 static inline void free_sync_thread_data(sync_thread_global_t *sup) {
@@ -1158,6 +1324,9 @@ static inline void free_sync_thread_data(sync_thread_global_t *sup) {
 	if (sup->epollevs) {
         libtrace_list_deinit((libtrace_list_t *)(sup->epollevs));
 	}
+    if (sup->sessionindex) {
+        destroy_session_index(sup->sessionindex);
+    }
 }
 
 static void destroy_collector_state(collector_global_t *glob) {
@@ -1232,6 +1401,10 @@ static void destroy_collector_state(collector_global_t *glob) {
         free(glob->default_email_domain);
     }
 
+    if (glob->statmetrics) {
+        free(glob->statmetrics);
+    }
+
     pthread_mutex_destroy(&(glob->stats_mutex));
     pthread_rwlock_destroy(&(glob->email_config_mutex));
     pthread_rwlock_destroy(&glob->config_mutex);
@@ -1267,6 +1440,14 @@ static void clear_global_config(collector_global_t *glob) {
         free(glob->sharedinfo.provisionerport);
     }
 
+    if (glob->metricsaddr) {
+        free(glob->metricsaddr);
+    }
+
+    if (glob->metricsport) {
+        free(glob->metricsport);
+    }
+
     if (glob->RMQ_conf.name) {
         free(glob->RMQ_conf.name);
     }
@@ -1367,6 +1548,9 @@ static int prepare_collector_glob(collector_global_t *glob) {
     init_sync_thread_data(glob, &(glob->syncip));
     init_sync_thread_data(glob, &(glob->syncvoip));
 
+    /* Only the IP sync thread manages IP sessions */
+    glob->syncip.sessionindex = create_session_index();
+
     glob->collocals = (colthread_local_t **)calloc(glob->total_col_threads,
             sizeof(colthread_local_t *));
 
@@ -1400,6 +1584,7 @@ static void init_collector_global(collector_global_t *glob) {
     glob->forwarding_threads = 1;
     glob->encoding_threads = 2;
     glob->email_threads = 1;
+    glob->packet_batch_size = 1;
     glob->sharedinfo.intpointid = NULL;
     glob->sharedinfo.intpointid_len = 0;
     glob->sharedinfo.operatorid = NULL;
@@ -1424,6 +1609,7 @@ static void init_collector_global(collector_global_t *glob) {
     glob->sslconf.keyfile = NULL;
     glob->sslconf.cacertfile = NULL;
     glob->sslconf.ctx = NULL;
+    glob->sslconf.ktls = 0;
 
     glob->RMQ_conf.name = NULL;
     glob->RMQ_conf.pass = NULL;
@@ -1446,6 +1632,13 @@ static void init_collector_global(collector_global_t *glob) {
     glob->encoding_method = OPENLI_ENCODING_DER;
 
     memset(&(glob->stats), 0, sizeof(glob->stats));
+    memset(&(glob->stats_lifetime), 0, sizeof(glob->stats_lifetime));
+    glob->statmetrics = NULL;
+    glob->metricsaddr = NULL;
+    glob->metricsport = NULL;
+    glob->backpressure_policy = OPENLI_BACKPRESSURE_NONE;
+    glob->backpressure_limit = OPENLI_BACKPRESSURE_DEFAULT_LIMIT_MB *
+            1024 * 1024;
     glob->stat_frequency = 0;
     glob->ticks_since_last_stat = 0;
 
@@ -1926,6 +2119,17 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (glob->metricsport) {
+        if (openli_metrics_start(glob->metricsaddr, glob->metricsport) < 0) {
+            logger(LOG_INFO, "OpenLI: collector metrics will not be available");
+        } else {
+            register_collector_stat_metrics(glob);
+        }
+    }
+
+    openli_backpressure_init(glob->backpressure_policy,
+            glob->backpressure_limit);
+
     /* TODO check pthread_create return values... */
 
     glob->forwarders = calloc(glob->forwarding_threads,
@@ -1937,6 +2141,7 @@ int main(int argc, char *argv[]) {
 
         glob->forwarders[i].zmq_ctxt = glob->zmq_ctxt;
         glob->forwarders[i].forwardid = i;
+        glob->forwarders[i].forwardcount = glob->forwarding_threads;
         glob->forwarders[i].encoders = glob->encoding_threads;
         glob->forwarders[i].colthreads = glob->total_col_threads;
         glob->forwarders[i].zmq_ctrlsock = NULL;
@@ -2026,7 +2231,7 @@ int main(int argc, char *argv[]) {
 
         glob->encoders[i].encrypt_byte_counter = 0;
         glob->encoders[i].encrypt_byte_startts = 0;
-        glob->encoders[i].evp_ctx = NULL;
+        glob->encoders[i].encbatch = NULL;
         glob->encoders[i].seqtrackers = glob->seqtracker_threads;
         glob->encoders[i].forwarders = glob->forwarding_threads;
 
@@ -2154,6 +2359,9 @@ int main(int argc, char *argv[]) {
         pthread_join(glob->emailworkers[i].threadid, NULL);
     }
 
+    openli_backpressure_destroy();
+    openli_metrics_stop();
+
     logger(LOG_INFO, "OpenLI: exiting OpenLI Collector.");
     /* Tidy up, exit */
     clear_global_config(glob);
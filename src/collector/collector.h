@@ -48,6 +48,7 @@
 #include "reassembler.h"
 #include "collector_publish.h"
 #include "collector_base.h"
+#include "backpressure.h"
 #include "openli_tls.h"
 #include "radius_hasher.h"
 #include "email_ingest_service.h"
@@ -133,22 +134,6 @@ typedef struct colinput {
     UT_hash_handle hh;
 } colinput_t;
 
-typedef struct ipv4_target {
-    uint32_t address;
-    ipsession_t *intercepts;
-
-    UT_hash_handle hh;
-} ipv4_target_t;
-
-typedef struct ipv6_target {
-    uint8_t address[16];
-    uint8_t prefixlen;
-    char *prefixstr;
-    ipsession_t *intercepts;
-
-    UT_hash_handle hh;
-} ipv6_target_t;
-
 enum {
     SYNC_EVENT_PROC_QUEUE,
     SYNC_EVENT_PROVISIONER,
@@ -178,12 +163,55 @@ typedef struct liid_set {
     UT_hash_handle hh;
 } liid_set_t;
 
+/* Tick interval (in ms) used to flush incomplete packet batches */
+#define COLLECTOR_BATCH_TICK_INTERVAL 10
+
+#define STATIC_IPCACHE_SETS 4096
+#define STATIC_IPCACHE_WAYS 2
+
+/* A cached result of looking up a single address in the static IP range
+ * trees -- the list of static IP sessions that cover that address (which
+ * may well be empty).
+ */
 typedef struct staticip_cacheentry {
-    prefix_t prefix;
-    patricia_node_t *pnode;
-    UT_hash_handle hh;
+    uint8_t family;
+    uint8_t addr[16];
+
+    /* Cache generation when this entry was filled, 0 if never filled */
+    uint32_t generation;
+
+    staticipsession_t **matches;
+    uint16_t matchcount;
+    uint16_t matchalloced;
+} static_ipcache_entry_t;
+
+typedef struct staticip_cacheset {
+    static_ipcache_entry_t ways[STATIC_IPCACHE_WAYS];
+
+    /* Index of the least recently used way in this set */
+    uint8_t lru;
+} static_ipcache_set_t;
+
+/* Set-associative cache of static IP range lookups. Any change to the
+ * static ranges bumps the generation, which invalidates every entry.
+ */
+typedef struct staticip_cache {
+    static_ipcache_set_t sets[STATIC_IPCACHE_SETS];
+    uint32_t generation;
 } static_ipcache_t;
 
+/* Statistics counted by a packet processing thread, which are added to the
+ * global statistics once per batch rather than locking for each packet.
+ */
+typedef struct colthread_pending_stats {
+    uint64_t packets_intercepted;
+    uint64_t packets_sync_ip;
+    uint64_t packets_sync_voip;
+    uint64_t packets_sync_email;
+    uint64_t ipcc_created;
+    uint64_t ipmmcc_created;
+} colthread_pending_stats_t;
+
 typedef struct colthread_local {
 
     /* Message queue for pushing updates to sync IP thread */
@@ -203,8 +231,8 @@ typedef struct colthread_local {
 
 
     /* Current intercepts */
-    ipv4_target_t *activeipv4intercepts;
-    ipv6_target_t *activeipv6intercepts;
+    openli_session_index_t *sessionindex;
+    session_index_reader_t *sessreader;
 
     rtpstreaminf_t *activertpintercepts;
     vendmirror_intercept_list_t *activemirrorintercepts;
@@ -214,6 +242,24 @@ typedef struct colthread_local {
     /* Message queue for exporting LI records */
     void **zmq_pubsocks;
 
+    /* Records waiting to be published to the first sequence tracker */
+    openli_publish_batch_t pubbatch;
+
+    /* Number of packets to process between checks for messages from
+     * the sync threads (and flushes of pubbatch) */
+    uint32_t packetbatchsize;
+    uint32_t sincebatchstart;
+
+    colthread_pending_stats_t pendingstats;
+    uint32_t lastticksec;
+
+    /* Per-thread metrics, updated on each tick (NULL if metrics are
+     * disabled) */
+    openli_metric_t *metric_packets;
+    openli_metric_t *metric_ipsyncq;
+    openli_metric_t *metric_voipsyncq;
+    uint64_t metricpackets;
+
     /* Known RADIUS servers, i.e. if we see traffic to or from these
      * servers, we assume it is RADIUS.
      */
@@ -244,9 +290,15 @@ typedef struct colthread_local {
      */
     coreserver_t *pop3servers;
 
+    /* Combined lookup table for all of the core server lists above, so
+     * each packet only needs to be classified once. Rebuilt whenever
+     * one of the lists changes.
+     */
+    coreserver_class_t *coreclassifier;
+    uint8_t coreclassdirty;
+
     patricia_tree_t *staticv4ranges;
     patricia_tree_t *staticv6ranges;
-    patricia_tree_t *dynamicv6ranges;
     static_ipcache_t *staticcache;
 
     ipfrag_reassembler_t *fragreass;
@@ -266,6 +318,7 @@ typedef struct collector_global {
     int encoding_threads;
     int forwarding_threads;
     int email_threads;
+    uint32_t packet_batch_size;
 
     void *zmq_encoder_ctrl;
 
@@ -303,6 +356,19 @@ typedef struct collector_global {
     collector_stats_t stats;
     pthread_mutex_t stats_mutex;
 
+    /* Totals from all of the stats periods that have already been logged
+     * and reset, so that the metrics endpoint can report monotonic counters
+     */
+    collector_stats_t stats_lifetime;
+    openli_metric_t **statmetrics;
+    char *metricsaddr;
+    char *metricsport;
+
+    /* What to do when records cannot be sent to a mediator as fast as
+     * they are being created */
+    openli_backpressure_policy_t backpressure_policy;
+    uint64_t backpressure_limit;
+
     uint8_t etsitls;
     uint8_t trust_sip_from;
 
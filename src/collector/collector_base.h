@@ -43,6 +43,8 @@
 #include "collector_publish.h"
 #include "export_buffer.h"
 #include "openli_tls.h"
+#include "openli_metrics.h"
+#include "session_index.h"
 
 #define MAX_ENCODED_RESULT_BATCH 50
 
@@ -54,6 +56,60 @@ typedef struct sync_epoll {
     UT_hash_handle hh;
 } sync_epoll_t;
 
+typedef struct queued_export_record queued_export_record_t;
+
+/** An encoded record that is waiting for its turn to be written into the
+ *  export buffer for a mediator */
+struct queued_export_record {
+    openli_encoded_result_t res;
+    queued_export_record_t *next;
+};
+
+typedef struct export_flow export_flow_t;
+
+/** The records for a single LIID that are waiting to be exported to a
+ *  mediator. IRIs and CCs for the same LIID are queued separately.
+ */
+struct export_flow {
+    char *liid;
+    queued_export_record_t *head;
+    queued_export_record_t *tail;
+
+    /** The number of bytes that this flow may still send in the current
+     *  round (deficit round robin) */
+    int64_t deficit;
+
+    /** Set if this flow has already been given its quantum for the
+     *  current round */
+    uint8_t toppedup;
+
+    /** The next flow in the round robin order */
+    export_flow_t *nextactive;
+
+    /** Set while this flow is part of the round robin order, i.e. it
+     *  has records waiting */
+    uint8_t active;
+
+    /** When this flow last ran out of records -- idle flows are kept
+     *  for a while so that a busy LIID doesn't need a new flow every
+     *  time its queue empties */
+    time_t idlesince;
+
+    UT_hash_handle hh;
+};
+
+/** A set of flows that share the export buffer using deficit round robin.
+ *  Only flows that have records waiting are in the round robin order.
+ */
+typedef struct export_sched_class {
+    export_flow_t *flows;
+    export_flow_t *activehead;
+    export_flow_t *activetail;
+
+    /** Total size of the records waiting in this class, in bytes */
+    uint64_t queuedbytes;
+} export_sched_class_t;
+
 typedef struct export_dest {
     int failmsg;
     int fd;
@@ -69,9 +125,47 @@ typedef struct export_dest {
     SSL *ssl;
     int waitingforhandshake;
     int ssllasterror;
+    /* Set if a heartbeat could not be sent immediately and must be
+     * retried before anything else is written to this destination */
+    uint8_t heartbeat_pending;
+    /* Set if we still have to tell the mediator which of our forwarders
+     * this connection belongs to -- nothing else may be sent until then */
+    uint8_t streampending;
+
+    /* Set once the mediator has told us that it can receive records that
+     * need the extended length header. Cleared on disconnect, as the
+     * mediator may have been replaced with an older version. */
+    uint8_t extframing;
+    /* Set once we know what framing the mediator supports on the current
+     * connection -- nothing is sent until then */
+    uint8_t capsknown;
+    /* When to give up waiting for the framing capabilities message and
+     * assume that the mediator predates it */
+    time_t capsdeadline;
+    /* Partially received framing capabilities message from the mediator */
+    uint8_t capsbuf[sizeof(ii_header_t)];
+    uint8_t capsrecvd;
+    /* Set if we have already complained about an oversized record that
+     * this mediator cannot accept */
+    uint8_t oversizewarned;
+
+    /* Records waiting to be written into the export buffer. IRIs are
+     * always scheduled ahead of CCs, so a busy CC intercept cannot hold up
+     * the IRIs for other intercepts. */
+    export_sched_class_t sched_iri;
+    export_sched_class_t sched_cc;
+    /* The amount of queued data at which we will next warn that this
+     * mediator is falling behind */
+    uint64_t queuewarn;
+    /* Set while more than the backpressure limit is waiting for this
+     * mediator, in which case new CCs for it are discarded */
+    uint8_t congested;
 
     amqp_bytes_t rmq_queueid;
 
+    openli_metric_t *metric_buffered;
+    openli_metric_t *metric_connected;
+
     UT_hash_handle hh_fd;
     UT_hash_handle hh_medid;
 } export_dest_t;
@@ -133,6 +227,10 @@ typedef struct sync_thread_global {
     pthread_mutex_t *stats_mutex;
     collector_stats_t *stats;
 
+    /* Shared index of active IP sessions -- only the IP sync thread may
+     * modify it */
+    openli_session_index_t *sessionindex;
+
 } sync_thread_global_t;
 
 enum {
@@ -203,10 +301,22 @@ typedef struct intercept_reorderer {
 
 } int_reorderer_t;
 
+/* Pipeline stages for which each forwarding thread reports the latency
+ * of traced records */
+enum {
+    OPENLI_FWD_LATENCY_CAPTURE,
+    OPENLI_FWD_LATENCY_SEQTRACKER,
+    OPENLI_FWD_LATENCY_ENCODER,
+    OPENLI_FWD_LATENCY_FORWARDER,
+    OPENLI_FWD_LATENCY_TOTAL,
+    OPENLI_FWD_LATENCY_STAGES
+};
+
 typedef struct forwarding_thread_data {
     void *zmq_ctxt;
     pthread_t threadid;
     int forwardid;
+    int forwardcount;
     int encoders;
     int colthreads;
 
@@ -236,8 +346,12 @@ typedef struct forwarding_thread_data {
     amqp_socket_t *ampq_sock;
     openli_RMQ_config_t RMQ_conf;
 
+    openli_metric_t *latency[OPENLI_FWD_LATENCY_STAGES];
+
 } forwarding_thread_data_t;
 
+typedef struct openli_encryption_batch openli_encryption_batch_t;
+
 typedef struct encoder_state {
     void *zmq_ctxt;
     void **zmq_recvjobs;
@@ -257,7 +371,7 @@ typedef struct encoder_state {
 
     uint32_t encrypt_byte_counter;
     uint32_t encrypt_byte_startts;
-    EVP_CIPHER_CTX *evp_ctx;
+    openli_encryption_batch_t *encbatch;
 
     int seqtrackers;
     int forwarders;
@@ -33,15 +33,40 @@
 #include <assert.h>
 #include <unistd.h>
 #include <sys/timerfd.h>
+#include <time.h>
 #include <amqp_tcp_socket.h>
 
 #include "util.h"
 #include "logger.h"
 #include "collector_base.h"
 #include "collector_publish.h"
+#include "backpressure.h"
 
 #define BUF_BATCH_SIZE (100 * 1024 * 1024)
 #define MIN_SEND_AMOUNT (1 * 1024 * 1024)
+
+/* The amount of data that we allow into the export buffer for a mediator
+ * at any one time. Everything else waits in the per-LIID queues, where
+ * it can be scheduled fairly. */
+#define EXPORT_SCHEDULE_WINDOW (2 * MIN_SEND_AMOUNT)
+
+/* Log a warning each time another this many bytes are queued for a
+ * mediator */
+#define EXPORT_QUEUE_WARNING_THRESH (1024ULL * 1024 * 1024)
+
+/* The most data that we will queue for a single mediator, across all of
+ * its LIIDs, before giving up on that mediator */
+#define EXPORT_QUEUE_LIMIT (16 * EXPORT_QUEUE_WARNING_THRESH)
+
+/* Seconds that an LIID's queue must be empty before we free it */
+#define EXPORT_FLOW_IDLE_TIMEOUT 10
+
+/* Seconds to wait for a mediator to tell us which framing it supports
+ * before assuming that it is too old to know about extended lengths */
+#define FRAMING_CAPS_WAIT 2
+
+/* Bytes added to a flow's deficit each round */
+#define EXPORT_DRR_QUANTUM (64 * 1024)
 #define AMPQ_BYTES_FROM(x) (amqp_bytes_t){.len=sizeof(x),.bytes=&x}
 #define AMQP_FRAME_MAX 131072
 
@@ -68,6 +93,155 @@ static inline void free_encoded_result(openli_encoded_result_t *res) {
 
 }
 
+static inline int is_cc_result(openli_encoded_result_t *res) {
+    return (res->origreq->type == OPENLI_EXPORT_IPCC ||
+            res->origreq->type == OPENLI_EXPORT_IPMMCC ||
+            res->origreq->type == OPENLI_EXPORT_UMTSCC ||
+            res->origreq->type == OPENLI_EXPORT_EMAILCC);
+}
+
+/** Returns the amount of data that is waiting to be sent to a mediator,
+ *  including records that have not been scheduled into the export buffer
+ *  yet.
+ */
+static inline uint64_t destination_backlog(export_dest_t *dest) {
+    return get_buffered_amount(&(dest->buffer)) +
+            dest->sched_iri.queuedbytes + dest->sched_cc.queuedbytes;
+}
+
+static void free_export_flow(export_sched_class_t *cls,
+        export_flow_t *flow) {
+
+    queued_export_record_t *rec;
+
+    while (flow->head) {
+        rec = flow->head;
+        flow->head = rec->next;
+        cls->queuedbytes -= rec->res.msgbody->len;
+        free_encoded_result(&(rec->res));
+        free(rec);
+    }
+
+    HASH_DELETE(hh, cls->flows, flow);
+    free(flow->liid);
+    free(flow);
+}
+
+static void free_export_class(export_sched_class_t *cls) {
+    export_flow_t *flow, *tmp;
+
+    HASH_ITER(hh, cls->flows, flow, tmp) {
+        free_export_flow(cls, flow);
+    }
+    cls->activehead = NULL;
+    cls->activetail = NULL;
+    cls->queuedbytes = 0;
+}
+
+static void register_destination_metrics(forwarding_thread_data_t *fwd,
+        export_dest_t *dest) {
+
+    char fwdstr[16], medstr[16];
+
+    snprintf(fwdstr, 16, "%d", fwd->forwardid);
+    snprintf(medstr, 16, "%u", dest->mediatorid);
+
+    dest->metric_buffered = openli_metrics_register(OPENLI_METRIC_GAUGE,
+            "openli_collector_forwarder_buffered_bytes",
+            "Encoded records waiting to be sent to a mediator, in bytes",
+            "forwarder", fwdstr, "mediator", medstr, NULL);
+    dest->metric_connected = openli_metrics_register(OPENLI_METRIC_GAUGE,
+            "openli_collector_forwarder_connected",
+            "Whether a forwarding thread is connected to a mediator",
+            "forwarder", fwdstr, "mediator", medstr, NULL);
+}
+
+static const char *fwd_latency_stage_names[OPENLI_FWD_LATENCY_STAGES] = {
+    "capture", "seqtracker", "encoder", "forwarder", "total"
+};
+
+static void register_latency_metrics(forwarding_thread_data_t *fwd) {
+
+    char fwdstr[16];
+    int i;
+
+    snprintf(fwdstr, 16, "%d", fwd->forwardid);
+
+    for (i = 0; i < OPENLI_FWD_LATENCY_STAGES; i++) {
+        fwd->latency[i] = openli_metrics_register_histogram(
+                "openli_collector_record_latency_seconds",
+                "Time spent by sampled records in each stage of the collector pipeline",
+                openli_latency_buckets, OPENLI_LATENCY_BUCKET_COUNT,
+                "forwarder", fwdstr, "stage", fwd_latency_stage_names[i],
+                NULL);
+    }
+}
+
+static void deregister_latency_metrics(forwarding_thread_data_t *fwd) {
+    int i;
+
+    for (i = 0; i < OPENLI_FWD_LATENCY_STAGES; i++) {
+        openli_metrics_deregister(fwd->latency[i]);
+        fwd->latency[i] = NULL;
+    }
+}
+
+static inline void trace_forwarded_record(forwarding_thread_data_t *fwd,
+        openli_encoded_result_t *res) {
+
+    openli_export_recv_t *msg = res->origreq;
+    uint64_t now, capts;
+
+    if (msg->tracets[OPENLI_TRACE_PUBLISHED] == 0) {
+        return;
+    }
+
+    now = fetch_current_time_us();
+
+    /* Capture timestamps only make sense when compared against our own
+     * clock for live inputs -- packets read from a trace file will appear
+     * to be ancient, so skip the stages that depend on them.
+     */
+    capts = (msg->ts.tv_sec * 1000000) + msg->ts.tv_usec;
+    if (capts != 0 && capts <= msg->tracets[OPENLI_TRACE_PUBLISHED]) {
+        openli_metric_observe_latency(fwd->latency[OPENLI_FWD_LATENCY_CAPTURE],
+                capts, msg->tracets[OPENLI_TRACE_PUBLISHED]);
+        openli_metric_observe_latency(fwd->latency[OPENLI_FWD_LATENCY_TOTAL],
+                capts, now);
+    }
+
+    openli_metric_observe_latency(fwd->latency[OPENLI_FWD_LATENCY_SEQTRACKER],
+            msg->tracets[OPENLI_TRACE_PUBLISHED],
+            msg->tracets[OPENLI_TRACE_SEQUENCED]);
+    openli_metric_observe_latency(fwd->latency[OPENLI_FWD_LATENCY_ENCODER],
+            msg->tracets[OPENLI_TRACE_SEQUENCED],
+            msg->tracets[OPENLI_TRACE_ENCODED]);
+    openli_metric_observe_latency(fwd->latency[OPENLI_FWD_LATENCY_FORWARDER],
+            msg->tracets[OPENLI_TRACE_ENCODED], now);
+}
+
+static void update_destination_metrics(forwarding_thread_data_t *fwd) {
+
+    export_dest_t *dest;
+    PWord_t jval;
+    Word_t index;
+
+    if (!openli_metrics_enabled()) {
+        return;
+    }
+
+    index = 0;
+    JLF(jval, fwd->destinations_by_id, index);
+    while (jval != NULL) {
+        dest = (export_dest_t *)(*jval);
+        openli_metric_set(dest->metric_buffered,
+                (double)destination_backlog(dest));
+        openli_metric_set(dest->metric_connected,
+                (dest->fd != -1 && !dest->waitingforhandshake) ? 1 : 0);
+        JLN(jval, fwd->destinations_by_id, index);
+    }
+}
+
 static int add_new_destination(forwarding_thread_data_t *fwd,
         openli_export_recv_t *msg) {
 
@@ -103,6 +277,7 @@ static int add_new_destination(forwarding_thread_data_t *fwd,
         }
 
         init_export_buffer(&(newdest->buffer));
+        register_destination_metrics(fwd, newdest);
 
         JLI(jval, fwd->destinations_by_id, newdest->mediatorid);
         *jval = (Word_t)newdest;
@@ -181,6 +356,8 @@ static inline void disconnect_mediator(forwarding_thread_data_t *fwd,
     }
 
     med->logallowed = 0;
+    med->extframing = 0;
+    med->capsknown = 0;
     if (med->pollindex >= 0 && fwd->topoll) {
         fwd->topoll[med->pollindex].fd = 0;
         fwd->topoll[med->pollindex].events = 0;
@@ -202,7 +379,15 @@ static void remove_destination(forwarding_thread_data_t *fwd,
         disconnect_mediator(fwd, med);
     }
 
+    if (med->congested) {
+        openli_backpressure_set_congested(med->mediatorid, 0);
+    }
+
     release_export_buffer(&(med->buffer));
+    free_export_class(&(med->sched_iri));
+    free_export_class(&(med->sched_cc));
+    openli_metrics_deregister(med->metric_buffered);
+    openli_metrics_deregister(med->metric_connected);
     if (med->ipstr) {
         free(med->ipstr);
     }
@@ -351,6 +536,315 @@ static int handle_ctrl_message(forwarding_thread_data_t *fwd,
     return 1;
 }
 
+/** Appends an encoded record to the export buffer for a mediator.
+ *
+ *  Records that are too large for the original 16 bit length field can
+ *  only be sent to mediators that have told us they understand the
+ *  extended length header -- for any other mediator, the record is
+ *  discarded (as it could not be delivered intact anyway).
+ *
+ *  @return 0 if the record could not be buffered, 1 otherwise.
+ */
+static int buffer_record_for_mediator(forwarding_thread_data_t *fwd,
+        export_dest_t *med, openli_encoded_result_t *res) {
+
+    if (res->msgbody->len > OPENLI_PROTO_MAX_BODYLEN && !med->extframing) {
+        if (!med->oversizewarned) {
+            logger(LOG_INFO,
+                    "OpenLI: dropping %u byte record for LIID %s because mediator %u does not support records larger than %u bytes",
+                    res->msgbody->len, res->liid, med->mediatorid,
+                    OPENLI_PROTO_MAX_BODYLEN);
+            med->oversizewarned = 1;
+        }
+        return 1;
+    }
+
+    if (append_message_to_buffer(&(med->buffer), res, 0) == 0) {
+        return 0;
+    }
+    trace_forwarded_record(fwd, res);
+    return 1;
+}
+
+/** Adds an encoded record to the queue for its LIID, ready to be scheduled
+ *  into the export buffer for a mediator.
+ *
+ *  The queue takes ownership of everything that the record points to, so
+ *  those pointers are cleared in the original record.
+ *
+ *  @return 0 if the mediator already has EXPORT_QUEUE_LIMIT bytes queued
+ *          (or we are out of memory), in which case the record has not
+ *          been queued. Otherwise, returns 1.
+ */
+static int queue_record_for_mediator(export_dest_t *med,
+        openli_encoded_result_t *res) {
+
+    export_sched_class_t *cls;
+    export_flow_t *flow;
+    queued_export_record_t *rec;
+    char *liid = res->liid ? res->liid : "";
+    uint64_t queued = med->sched_iri.queuedbytes + med->sched_cc.queuedbytes;
+
+    if (queued + res->msgbody->len > EXPORT_QUEUE_LIMIT) {
+        return 0;
+    }
+
+    if (queued >= med->queuewarn + EXPORT_QUEUE_WARNING_THRESH) {
+        med->queuewarn += EXPORT_QUEUE_WARNING_THRESH;
+        logger(LOG_INFO,
+                "OpenLI: records queued for mediator %u have exceeded warning threshold %lu.",
+                med->mediatorid, (unsigned long)med->queuewarn);
+    } else if (queued + EXPORT_QUEUE_WARNING_THRESH <= med->queuewarn) {
+        /* Mediator has caught up, so reset the warning */
+        med->queuewarn -= EXPORT_QUEUE_WARNING_THRESH;
+    }
+
+    if (is_cc_result(res)) {
+        cls = &(med->sched_cc);
+    } else {
+        cls = &(med->sched_iri);
+    }
+
+    HASH_FIND_STR(cls->flows, liid, flow);
+    if (flow == NULL) {
+        flow = (export_flow_t *)calloc(1, sizeof(export_flow_t));
+        if (flow == NULL) {
+            return 0;
+        }
+        flow->liid = strdup(liid);
+        HASH_ADD_KEYPTR(hh, cls->flows, flow->liid, strlen(flow->liid),
+                flow);
+    }
+
+    rec = (queued_export_record_t *)malloc(sizeof(queued_export_record_t));
+    if (rec == NULL) {
+        return 0;
+    }
+
+    if (!flow->active) {
+        /* Add this LIID to the end of the current round */
+        if (cls->activetail) {
+            cls->activetail->nextactive = flow;
+        } else {
+            cls->activehead = flow;
+        }
+        cls->activetail = flow;
+        flow->active = 1;
+    }
+
+    memcpy(&(rec->res), res, sizeof(openli_encoded_result_t));
+    rec->next = NULL;
+
+    res->liid = NULL;
+    res->cinstr = NULL;
+    res->msgbody = NULL;
+    res->origreq = NULL;
+
+    if (flow->tail) {
+        flow->tail->next = rec;
+    } else {
+        flow->head = rec;
+    }
+    flow->tail = rec;
+    cls->queuedbytes += rec->res.msgbody->len;
+    return 1;
+}
+
+/** Queues an encoded record for a mediator, unless it is a CC and the
+ *  mediator already has more than the backpressure limit waiting for it.
+ *
+ *  Either way, the record's contents are no longer owned by the caller
+ *  once this returns.
+ *
+ *  @return 0 if the record had to be discarded because we cannot queue
+ *          any more records for this mediator, 1 otherwise.
+ */
+static int queue_or_shed_record(export_dest_t *med,
+        openli_encoded_result_t *res) {
+
+    int ret = 1;
+
+    if (!med->congested || !is_cc_result(res)) {
+        if (queue_record_for_mediator(med, res) == 1) {
+            return 1;
+        }
+        ret = 0;
+    } else {
+        openli_backpressure_count_shed(OPENLI_SHED_AT_FORWARDER,
+                res->origreq->type);
+    }
+
+    free_encoded_result(res);
+    res->liid = NULL;
+    res->cinstr = NULL;
+    res->msgbody = NULL;
+    res->origreq = NULL;
+    return ret;
+}
+
+/** Updates the congestion state for a mediator, based on how much data we
+ *  have waiting for it. A mediator becomes congested once it reaches the
+ *  backpressure limit, but is not uncongested until it has dropped back
+ *  below the resume level so we don't flap between the two states.
+ */
+static void update_destination_credit(export_dest_t *med) {
+
+    uint64_t backlog;
+
+    if (!openli_backpressure_enabled()) {
+        return;
+    }
+
+    backlog = destination_backlog(med);
+    if (!med->congested && backlog >= openli_backpressure_limit()) {
+        med->congested = 1;
+        openli_backpressure_set_congested(med->mediatorid, 1);
+        logger(LOG_INFO,
+                "OpenLI: mediator %u has %lu bytes of records waiting, shedding CCs for this mediator until it catches up",
+                med->mediatorid, (unsigned long)backlog);
+    } else if (med->congested &&
+            backlog <= openli_backpressure_resume_level()) {
+        med->congested = 0;
+        openli_backpressure_set_congested(med->mediatorid, 0);
+        logger(LOG_INFO,
+                "OpenLI: mediator %u has caught up, no longer shedding CCs for it (%lu records shed in total, %lu of them after sequencing)",
+                med->mediatorid,
+                (unsigned long)openli_backpressure_total_shed(),
+                (unsigned long)openli_backpressure_stage_shed(
+                        OPENLI_SHED_AT_FORWARDER));
+    }
+}
+
+/** Moves records from a set of flows into the export buffer for a
+ *  mediator, using deficit round robin so that each flow gets a fair
+ *  share of the buffer regardless of how many records it has queued.
+ *
+ *  Stops once the export buffer holds EXPORT_SCHEDULE_WINDOW bytes; the
+ *  flow at the front keeps its remaining deficit for next time.
+ *
+ *  @return 0 if the export buffer has run out of space, 1 otherwise.
+ */
+static int schedule_export_class(forwarding_thread_data_t *fwd,
+        export_dest_t *med, export_sched_class_t *cls) {
+
+    export_flow_t *flow;
+    queued_export_record_t *rec;
+    int ret;
+
+    while ((flow = cls->activehead) != NULL) {
+        if (get_buffered_amount(&(med->buffer)) >= EXPORT_SCHEDULE_WINDOW) {
+            return 1;
+        }
+
+        if (!flow->toppedup) {
+            flow->deficit += EXPORT_DRR_QUANTUM;
+            flow->toppedup = 1;
+        }
+
+        while (flow->head && flow->head->res.msgbody->len <= flow->deficit
+                && get_buffered_amount(&(med->buffer)) <
+                EXPORT_SCHEDULE_WINDOW) {
+
+            rec = flow->head;
+            flow->head = rec->next;
+            if (flow->head == NULL) {
+                flow->tail = NULL;
+            }
+            cls->queuedbytes -= rec->res.msgbody->len;
+            flow->deficit -= rec->res.msgbody->len;
+
+            ret = buffer_record_for_mediator(fwd, med, &(rec->res));
+            free_encoded_result(&(rec->res));
+            free(rec);
+            if (ret == 0) {
+                return 0;
+            }
+        }
+
+        if (flow->head == NULL) {
+            /* Nothing left for this LIID, so it drops out of the round
+             * (and loses any leftover deficit). The flow itself is kept
+             * until expire_idle_export_flows() decides it is no longer
+             * needed. */
+            cls->activehead = flow->nextactive;
+            if (cls->activehead == NULL) {
+                cls->activetail = NULL;
+            }
+            flow->nextactive = NULL;
+            flow->active = 0;
+            flow->deficit = 0;
+            flow->toppedup = 0;
+            flow->idlesince = time(NULL);
+            continue;
+        }
+
+        if (flow->head->res.msgbody->len <= flow->deficit) {
+            /* Export buffer is full */
+            return 1;
+        }
+
+        /* This flow has used up its quantum, move on to the next one */
+        flow->toppedup = 0;
+        if (flow->nextactive) {
+            cls->activehead = flow->nextactive;
+            flow->nextactive = NULL;
+            cls->activetail->nextactive = flow;
+            cls->activetail = flow;
+        }
+    }
+    return 1;
+}
+
+/** Frees the queues for any LIIDs that have not had any records to send
+ *  to a mediator for the last EXPORT_FLOW_IDLE_TIMEOUT seconds.
+ */
+static void expire_idle_export_flows(export_sched_class_t *cls, time_t now) {
+
+    export_flow_t *flow, *tmp;
+
+    HASH_ITER(hh, cls->flows, flow, tmp) {
+        if (flow->active || now - flow->idlesince < EXPORT_FLOW_IDLE_TIMEOUT) {
+            continue;
+        }
+        free_export_flow(cls, flow);
+    }
+}
+
+static void expire_all_idle_export_flows(forwarding_thread_data_t *fwd) {
+
+    export_dest_t *dest;
+    PWord_t jval;
+    Word_t index = 0;
+    time_t now = time(NULL);
+
+    JLF(jval, fwd->destinations_by_id, index);
+    while (jval) {
+        dest = (export_dest_t *)(*jval);
+        expire_idle_export_flows(&(dest->sched_iri), now);
+        expire_idle_export_flows(&(dest->sched_cc), now);
+        JLN(jval, fwd->destinations_by_id, index);
+    }
+}
+
+/** Tops up the export buffer for a mediator from its queued records, IRIs
+ *  first.
+ *
+ *  @return -1 if the mediator had to be removed, 1 otherwise.
+ */
+static int schedule_destination_records(forwarding_thread_data_t *fwd,
+        export_dest_t *med) {
+
+    if (schedule_export_class(fwd, med, &(med->sched_iri)) == 0 ||
+            schedule_export_class(fwd, med, &(med->sched_cc)) == 0) {
+        logger(LOG_INFO,
+                "OpenLI: forced to drop mediator %u because we cannot buffer any more records for it -- please investigate now!",
+                med->mediatorid);
+        remove_destination(fwd, med);
+        return -1;
+    }
+    return 1;
+}
+
 static inline int enqueue_result(forwarding_thread_data_t *fwd,
         export_dest_t *med, openli_encoded_result_t *res) {
 
@@ -361,11 +855,7 @@ static inline int enqueue_result(forwarding_thread_data_t *fwd,
     openli_encoded_result_t *stored;
     int rcint;
 
-    if (res->origreq->type == OPENLI_EXPORT_IPCC ||
-            res->origreq->type == OPENLI_EXPORT_IPMMCC ||
-            res->origreq->type == OPENLI_EXPORT_UMTSCC ||
-            res->origreq->type == OPENLI_EXPORT_EMAILCC ) {
-
+    if (is_cc_result(res)) {
         reorderer = &(fwd->intreorderer_cc);
     } else {
         reorderer = &(fwd->intreorderer_iri);
@@ -410,32 +900,30 @@ static inline int enqueue_result(forwarding_thread_data_t *fwd,
         return 0;
     }
 
-    if (append_message_to_buffer(&(med->buffer), res, 0) == 0) {
+    reord->expectedseqno = res->seqno + 1;
+    if (queue_or_shed_record(med, res) == 0) {
         logger(LOG_INFO,
                 "OpenLI: forced to drop mediator %u because we cannot buffer any more records for it -- please investigate now!",
                 med->mediatorid);
         remove_destination(fwd, med);
-        return 1;
+        return -1;
     }
 
-    reord->expectedseqno = res->seqno + 1;
-
     JLG(pval, reord->pending, reord->expectedseqno);
     while (pval != NULL) {
         stored = (openli_encoded_result_t *)(*pval);
 
         JLD(rcint, reord->pending, reord->expectedseqno);
 
-        if (append_message_to_buffer(&(med->buffer), stored, 0) == 0) {
+        reord->expectedseqno = stored->seqno + 1;
+        if (queue_or_shed_record(med, stored) == 0) {
+            free(stored);
             logger(LOG_INFO,
                     "OpenLI: forced to drop mediator %u because we cannot buffer any more records for it -- please investigate asap!",
                     med->mediatorid);
             remove_destination(fwd, med);
             return -1;
         }
-        reord->expectedseqno = stored->seqno + 1;
-
-        free_encoded_result(stored);
         free(stored);
         JLG(pval, reord->pending, reord->expectedseqno);
     }
@@ -478,6 +966,7 @@ static int handle_encoded_result(forwarding_thread_data_t *fwd,
         med->halted = 0;
         med->mediatorid = res->destid;
         init_export_buffer(&(med->buffer));
+        register_destination_metrics(fwd, med);
 
         if (fwd->ampq_conn) {
             snprintf(stringspace, 32, "ID%d", med->mediatorid);
@@ -491,6 +980,11 @@ static int handle_encoded_result(forwarding_thread_data_t *fwd,
     }
 
     ret = enqueue_result(fwd, med, res);
+    if (ret < 0) {
+        /* The mediator has been removed, and the record along with it */
+        return 0;
+    }
+    update_destination_credit(med);
 
     if (ret != 0) {
         free_encoded_result(res);
@@ -518,7 +1012,8 @@ static void purge_unconfirmed_mediators(forwarding_thread_data_t *fwd) {
 
 }
 
-static int connect_single_target(export_dest_t *dest, SSL_CTX *ctx) {
+static int connect_single_target(forwarding_thread_data_t *fwd,
+        export_dest_t *dest, SSL_CTX *ctx) {
 
     int sockfd;
 
@@ -556,6 +1051,8 @@ static int connect_single_target(export_dest_t *dest, SSL_CTX *ctx) {
                 logger(LOG_INFO, "OpenLI: SSL Handshake with mediator failed");
                 return -1;
             }
+        } else {
+            log_ssl_ktls_state(dest->ssl, dest->ipstr);
         }
         if (dest->ssllasterror == 0) {
             logger(LOG_DEBUG, "OpenLI: SSL Handshake with mediator started");
@@ -572,9 +1069,159 @@ static int connect_single_target(export_dest_t *dest, SSL_CTX *ctx) {
      * with any duplication.
      */
     dest->buffer.partialfront = 0;
+    dest->buffer.partialrem = 0;
+    dest->heartbeat_pending = 0;
+    dest->streampending = 0;
+    dest->capsrecvd = 0;
+    dest->capsknown = 0;
+    dest->capsdeadline = time(NULL) + FRAMING_CAPS_WAIT;
     return sockfd;
 }
 
+/** Called once we know which framing the mediator on the current
+ *  connection supports. Any records with the extended length header that
+ *  were buffered for an earlier connection are discarded if this one
+ *  cannot handle them.
+ */
+static void finish_framing_negotiation(export_dest_t *dest) {
+
+    int removed;
+
+    dest->capsknown = 1;
+    if (dest->extframing) {
+        return;
+    }
+
+    removed = remove_extended_records(&(dest->buffer));
+    if (removed > 0) {
+        logger(LOG_INFO,
+                "OpenLI: dropped %d buffered records for mediator %s:%s because it no longer supports records larger than %u bytes",
+                removed, dest->ipstr, dest->portstr,
+                OPENLI_PROTO_MAX_BODYLEN);
+    }
+}
+
+/** Tells the mediator which of our forwarders this connection belongs to,
+ *  as each forwarding thread has its own connection to the mediator.
+ *
+ *  @return -1 if the mediator has been disconnected, 0 if the announcement
+ *          must be retried once the socket is writable, 1 if it has been
+ *          sent.
+ */
+static int announce_forwarder_stream(forwarding_thread_data_t *fwd,
+        export_dest_t *dest) {
+
+    int r = transmit_collector_stream(dest->fd, dest->ssl, fwd->forwardid,
+            fwd->forwardcount);
+
+    if (r < 0) {
+        logger(LOG_INFO,
+                "OpenLI: unable to announce forwarder %d to mediator %s:%s",
+                fwd->forwardid, dest->ipstr, dest->portstr);
+        disconnect_mediator(fwd, dest);
+        return -1;
+    }
+    dest->streampending = (r == 0);
+    return (r > 0);
+}
+
+/** Checks whether the framing negotiation with a mediator has finished
+ *  and we have identified ourselves to it, i.e. whether we can start
+ *  sending it anything else.
+ *
+ *  @return -1 if the mediator has been disconnected, 0 if we are not
+ *          ready to send to the mediator yet, 1 if we are.
+ */
+static int destination_ready(forwarding_thread_data_t *fwd,
+        export_dest_t *dest) {
+
+    if (!dest->capsknown) {
+        /* Don't buffer or send anything until we know whether this
+         * mediator can handle extended length records */
+        if (time(NULL) < dest->capsdeadline) {
+            return 0;
+        }
+        finish_framing_negotiation(dest);
+    }
+
+    if (dest->streampending) {
+        return announce_forwarder_stream(fwd, dest);
+    }
+    return 1;
+}
+
+/** Reads the framing capabilities message that a mediator sends us after
+ *  we connect to it.
+ *
+ *  Older mediators never send this message, in which case we give up
+ *  waiting for it after FRAMING_CAPS_WAIT seconds and keep using the
+ *  original framing for that mediator. Mediators that do send it also
+ *  expect us to announce which forwarder the connection belongs to
+ *  in response.
+ *
+ *  @return -1 if the mediator has disconnected, 0 if the message is not
+ *          complete yet, 1 if the message has been received.
+ */
+static int receive_framing_caps(forwarding_thread_data_t *fwd,
+        export_dest_t *dest) {
+
+    uint64_t caps = 0;
+    int ret;
+
+    if (dest->ssl) {
+        ret = SSL_read(dest->ssl, dest->capsbuf + dest->capsrecvd,
+                sizeof(dest->capsbuf) - dest->capsrecvd);
+        if (ret <= 0) {
+            int errr = SSL_get_error(dest->ssl, ret);
+            if (errr == SSL_ERROR_WANT_READ || errr == SSL_ERROR_WANT_WRITE) {
+                return 0;
+            }
+            ret = 0;
+        }
+    } else {
+        ret = recv(dest->fd, dest->capsbuf + dest->capsrecvd,
+                sizeof(dest->capsbuf) - dest->capsrecvd, MSG_DONTWAIT);
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+    }
+
+    if (ret <= 0) {
+        if (dest->logallowed) {
+            logger(LOG_INFO, "OpenLI: mediator %s:%s has closed the connection",
+                    dest->ipstr, dest->portstr);
+        }
+        disconnect_mediator(fwd, dest);
+        return -1;
+    }
+
+    dest->capsrecvd += ret;
+    if (dest->capsrecvd < sizeof(dest->capsbuf)) {
+        return 0;
+    }
+
+    if (decode_framing_caps(dest->capsbuf, dest->capsrecvd, &caps) < 0) {
+        logger(LOG_INFO,
+                "OpenLI: received unexpected message from mediator %s:%s",
+                dest->ipstr, dest->portstr);
+    } else {
+        if (caps & OPENLI_PROTO_FRAMING_EXTLEN) {
+            if (!dest->extframing) {
+                logger(LOG_INFO,
+                        "OpenLI: mediator %s:%s supports extended length records",
+                        dest->ipstr, dest->portstr);
+            }
+            dest->extframing = 1;
+        }
+        dest->streampending = 1;
+    }
+    finish_framing_negotiation(dest);
+
+    /* The mediator has nothing else to tell us */
+    fwd->topoll[dest->pollindex].events = ZMQ_POLLOUT;
+    return 1;
+}
+
 
 static void connect_export_targets(forwarding_thread_data_t *fwd) {
 
@@ -600,7 +1247,7 @@ static void connect_export_targets(forwarding_thread_data_t *fwd) {
         }
 
         pthread_mutex_lock(&(fwd->sslmutex));
-        dest->fd = connect_single_target(dest, fwd->ctx);
+        dest->fd = connect_single_target(fwd, dest, fwd->ctx);
         pthread_mutex_unlock(&(fwd->sslmutex));
         if (dest->fd == -1) {
             continue;
@@ -653,7 +1300,7 @@ static void connect_export_targets(forwarding_thread_data_t *fwd) {
         fwd->forcesend[ind] = 0;
         fwd->topoll[ind].socket = NULL;
         fwd->topoll[ind].fd = dest->fd;
-        fwd->topoll[ind].events = ZMQ_POLLOUT;
+        fwd->topoll[ind].events = ZMQ_POLLOUT | ZMQ_POLLIN;
         fwd->topoll[ind].revents = 0;
     }
 
@@ -772,17 +1419,25 @@ static void rmq_write_buffered(forwarding_thread_data_t *fwd) {
         dest = (export_dest_t *)(*jval);
         JLN(jval, fwd->destinations_by_id, index);
 
-        if (dest->fd != -1 && fwd->forcesend_rmq &&
-                !dest->waitingforhandshake) {
-            /* XXX Warning: will block */
-            if (transmit_heartbeat(dest->fd, dest->ssl) < 0) {
+        if (dest->fd != -1 && (fwd->forcesend_rmq ||
+                    dest->heartbeat_pending) && !dest->waitingforhandshake &&
+                    destination_ready(fwd, dest) > 0) {
+            int r = transmit_heartbeat(dest->fd, dest->ssl);
+            if (r < 0) {
                 logger(LOG_INFO,
                         "OpenLI: failed to send heartbeat to mediator %s:%s",
                         dest->ipstr, dest->portstr);
                 disconnect_mediator(fwd, dest);
+            } else {
+                dest->heartbeat_pending = (r == 0);
             }
         }
 
+        if (schedule_destination_records(fwd, dest) < 0) {
+            continue;
+        }
+        update_destination_credit(dest);
+
         availsend = get_buffered_amount(&(dest->buffer));
         if (availsend == 0) {
             continue;
@@ -828,6 +1483,7 @@ static void complete_ssl_handshake(forwarding_thread_data_t *fwd,
         }
     } else {
         logger(LOG_DEBUG, "OpenLI: SSL Handshake from mediator accepted");
+        log_ssl_ktls_state(dest->ssl, dest->ipstr);
         dest->waitingforhandshake = 0;
         dest->ssllasterror = 0;
     }
@@ -880,6 +1536,8 @@ static inline int forwarder_main_loop(forwarding_thread_data_t *fwd) {
         struct itimerspec its;
 
         connect_export_targets(fwd);
+        update_destination_metrics(fwd);
+        expire_all_idle_export_flows(fwd);
 
         for (i = 3; i < fwd->nextpoll; i++) {
             fwd->forcesend[i] = 1;
@@ -927,8 +1585,10 @@ static inline int forwarder_main_loop(forwarding_thread_data_t *fwd) {
         export_dest_t *dest;
         PWord_t jval;
         uint64_t availsend = 0;
+        short revents = fwd->topoll[i].revents;
+
         /* check if any destinations can received any buffered data */
-        if (!(fwd->topoll[i].revents & ZMQ_POLLOUT)) {
+        if (!(revents & (ZMQ_POLLOUT | ZMQ_POLLIN))) {
             continue;
         }
         fwd->topoll[i].revents = 0;
@@ -953,10 +1613,30 @@ static inline int forwarder_main_loop(forwarding_thread_data_t *fwd) {
             continue;
         }
 
+        if (revents & ZMQ_POLLIN) {
+            if (receive_framing_caps(fwd, dest) < 0) {
+                continue;
+            }
+            towait = 0;
+        }
+
+        if (!(revents & ZMQ_POLLOUT)) {
+            continue;
+        }
+
         if (fwd->ampq_conn) {
             continue;
         }
 
+        if (destination_ready(fwd, dest) <= 0) {
+            continue;
+        }
+
+        if (schedule_destination_records(fwd, dest) < 0) {
+            continue;
+        }
+        update_destination_credit(dest);
+
         if ((availsend = get_buffered_amount(&(dest->buffer))) == 0) {
             /* Nothing available to send */
             continue;
@@ -1033,10 +1713,13 @@ static void forwarder_main(forwarding_thread_data_t *fwd) {
     fwd->topoll[2].fd = fwd->conntimerfd;
     fwd->topoll[2].events = ZMQ_POLLIN;
 
+    register_latency_metrics(fwd);
+
     do {
         x = forwarder_main_loop(fwd);
     } while (x == 1);
 
+    deregister_latency_metrics(fwd);
     remove_reorderers(fwd, NULL, &(fwd->intreorderer_cc));
     remove_reorderers(fwd, NULL, &(fwd->intreorderer_iri));
 
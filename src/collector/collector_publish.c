@@ -35,9 +35,33 @@
 #include "util.h"
 #include "collector_publish.h"
 #include "emailiri.h"
+#include "openli_metrics.h"
+#include "backpressure.h"
+
+/** Decides whether a record is going to be traced through the rest of the
+ *  collector pipeline and, if so, records the time that it was published.
+ */
+static inline void trace_published_msg(openli_export_recv_t *msg) {
+
+    msg->tracets[OPENLI_TRACE_PUBLISHED] = 0;
+    if (!openli_metrics_enabled()) {
+        return;
+    }
+    if (msg->ts.tv_sec != 0 &&
+            (msg->ts.tv_usec & OPENLI_TRACE_SAMPLE_MASK) != 0) {
+        return;
+    }
+    msg->tracets[OPENLI_TRACE_PUBLISHED] = fetch_current_time_us();
+}
 
 int publish_openli_msg(void *pubsock, openli_export_recv_t *msg) {
 
+    if (openli_backpressure_shed_record(msg)) {
+        free_published_message(msg);
+        return 0;
+    }
+
+    trace_published_msg(msg);
     while (1) {
         if (zmq_send(pubsock, &msg, sizeof(openli_export_recv_t *), 0) < 0) {
             if (errno == EINTR) {
@@ -53,6 +77,68 @@ int publish_openli_msg(void *pubsock, openli_export_recv_t *msg) {
     return 0;
 }
 
+/** Publishes a message to a sequence tracker thread, coalescing it with
+ *  other messages published by the same thread where possible.
+ *
+ *  The receiving tracker accepts any number of message pointers (up to
+ *  OPENLI_PUBLISH_BATCH_MAX) within a single zmq message.
+ *
+ *  @param pubsock      The zmq socket to publish the message on.
+ *  @param batch        The batch of messages waiting to be published.
+ *  @param msg          The message to publish.
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+int publish_openli_msg_batched(void *pubsock, openli_publish_batch_t *batch,
+        openli_export_recv_t *msg) {
+
+    if (batch->limit <= 1) {
+        return publish_openli_msg(pubsock, msg);
+    }
+
+    if (openli_backpressure_shed_record(msg)) {
+        free_published_message(msg);
+        return 0;
+    }
+
+    trace_published_msg(msg);
+
+    batch->msgs[batch->count] = msg;
+    batch->count ++;
+
+    if (batch->count >= batch->limit ||
+            batch->count >= OPENLI_PUBLISH_BATCH_MAX) {
+        return flush_openli_publish_batch(pubsock, batch);
+    }
+    return 0;
+}
+
+int flush_openli_publish_batch(void *pubsock, openli_publish_batch_t *batch) {
+
+    int ret = 0;
+
+    if (batch->count == 0) {
+        return 0;
+    }
+
+    while (1) {
+        if (zmq_send(pubsock, batch->msgs,
+                    sizeof(openli_export_recv_t *) * batch->count, 0) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logger(LOG_INFO,
+                    "Error while publishing batch of OpenLI export messages: %s",
+                    strerror(errno));
+            ret = -1;
+        }
+        break;
+    }
+
+    batch->count = 0;
+    return ret;
+}
+
 void free_published_message(openli_export_recv_t *msg) {
 
     if (msg->type == OPENLI_EXPORT_IPCC || msg->type == OPENLI_EXPORT_IPMMCC
@@ -165,10 +165,31 @@ typedef struct provisioner_msg {
 
 typedef struct openli_export_recv openli_export_recv_t;
 
+/* Points in the collector pipeline where a record may be timestamped for
+ * latency tracing (see collector_forwarder.c for where the resulting
+ * latencies are measured).
+ */
+enum {
+    OPENLI_TRACE_PUBLISHED,     /* handed to a sequence tracker */
+    OPENLI_TRACE_SEQUENCED,     /* handed to an encoding thread */
+    OPENLI_TRACE_ENCODED,       /* encoding complete */
+    OPENLI_TRACE_STAGE_COUNT
+};
+
+/* Only records whose capture timestamp has these microsecond bits clear are
+ * traced, i.e. roughly 1 in 64 packet-derived records. Records without a
+ * capture timestamp are always traced.
+ */
+#define OPENLI_TRACE_SAMPLE_MASK 63
+
 struct openli_export_recv {
     uint8_t type;
     uint32_t destid;
     struct timeval ts;
+
+    /* Time (in microseconds) that the record reached each trace stage, or
+     * all zero if this record is not being traced */
+    uint64_t tracets[OPENLI_TRACE_STAGE_COUNT];
     union {
         openli_mediator_t med;
         libtrace_packet_t *packet;
@@ -184,7 +205,24 @@ struct openli_export_recv {
     } data;
 };
 
+/* Maximum number of messages that can be coalesced into a single
+ * publish to a sequence tracker thread.
+ */
+#define OPENLI_PUBLISH_BATCH_MAX 64
+
+typedef struct openli_publish_batch {
+    openli_export_recv_t *msgs[OPENLI_PUBLISH_BATCH_MAX];
+    int count;
+
+    /* Flush once this many messages are waiting -- 1 or less means
+     * every message is published immediately */
+    int limit;
+} openli_publish_batch_t;
+
 int publish_openli_msg(void *pubsock, openli_export_recv_t *msg);
+int publish_openli_msg_batched(void *pubsock, openli_publish_batch_t *batch,
+        openli_export_recv_t *msg);
+int flush_openli_publish_batch(void *pubsock, openli_publish_batch_t *batch);
 void free_published_message(openli_export_recv_t *msg);
 
 openli_export_recv_t *create_ipcc_job(
@@ -34,6 +34,7 @@
 #include "collector_push_messaging.h"
 #include "intercept.h"
 #include "internetaccess.h"
+#include "ipcc.h"
 
 static inline void update_intercept_common(intercept_common_t *found,
         intercept_common_t *replace) {
@@ -185,237 +186,6 @@ bailremoverange:
     return;
 }
 
-static int add_ipv4_intercept(colthread_local_t *loc, ipsession_t *sess) {
-
-    uint32_t v4addr;
-    struct sockaddr_in *sin;
-    ipv4_target_t *tgt;
-    ipsession_t *check;
-
-    sin = (struct sockaddr_in *)(sess->targetip);
-    if (sin == NULL) {
-        logger(LOG_INFO, "OpenLI: attempted to add IPv4 intercept but target IP was NULL?");
-        return -1;
-    }
-
-    v4addr = sin->sin_addr.s_addr;
-
-    HASH_FIND(hh, loc->activeipv4intercepts, &v4addr, sizeof(v4addr), tgt);
-    if (tgt == NULL) {
-        tgt = (ipv4_target_t *)malloc(sizeof(ipv4_target_t));
-        if (!tgt) {
-            logger(LOG_INFO, "OpenLI: ran out of memory while adding IPv4 intercept address.");
-            return -1;
-        }
-        tgt->address = v4addr;
-        tgt->intercepts = NULL;
-        HASH_ADD(hh, loc->activeipv4intercepts, address, sizeof(uint32_t),
-                tgt);
-    }
-
-    HASH_FIND(hh, tgt->intercepts, sess->streamkey, strlen(sess->streamkey),
-            check);
-    if (check) {
-        logger(LOG_INFO, "OpenLI: encountered duplicate stream key '%s' for address %u -- replacing...", sess->streamkey, tgt->address);
-        HASH_DELETE(hh, tgt->intercepts, check);
-        free_single_ipsession(check);
-    }
-
-    HASH_ADD_KEYPTR(hh, tgt->intercepts, sess->streamkey,
-            strlen(sess->streamkey), sess);
-
-    return 0;
-}
-
-static int add_ipv6_intercept(colthread_local_t *loc, ipsession_t *sess) {
-
-    struct sockaddr_in6 *sin6;
-    ipv6_target_t *tgt;
-    ipsession_t *check;
-    char prefixstr[100];
-    char inet[INET6_ADDRSTRLEN];
-
-    sin6 = (struct sockaddr_in6 *)(sess->targetip);
-    if (sin6 == NULL) {
-        logger(LOG_INFO, "OpenLI: attempted to add IPv6 intercept but target IP was NULL?");
-        return -1;
-    }
-
-    if (inet_ntop(AF_INET6, &(sin6->sin6_addr), inet, INET6_ADDRSTRLEN)
-            == NULL) {
-        logger(LOG_INFO, "OpenLI: IPv6 intercept prefix does not contain a valid IPv6 address");
-        return -1;
-    }
-
-    snprintf(prefixstr, 100, "%s/%u", inet, sess->prefixlen);
-
-    if (add_iprange_to_patricia(loc->dynamicv6ranges, prefixstr,
-            &(sess->common), sess->cin) < 0) {
-        return -1;
-    }
-
-    HASH_FIND(hh, loc->activeipv6intercepts, prefixstr, strlen(prefixstr), tgt);
-    if (tgt == NULL) {
-        tgt = (ipv6_target_t *)malloc(sizeof(ipv6_target_t));
-        if (!tgt) {
-            logger(LOG_INFO, "OpenLI: ran out of memory while adding IPv6 intercept address.");
-            return -1;
-        }
-        memcpy(tgt->address, sin6->sin6_addr.s6_addr, 16);
-        tgt->prefixlen = sess->prefixlen;
-        tgt->prefixstr = strdup(prefixstr);
-        tgt->intercepts = NULL;
-        HASH_ADD_KEYPTR(hh, loc->activeipv6intercepts, tgt->prefixstr,
-                strlen(tgt->prefixstr), tgt);
-    }
-
-    HASH_FIND(hh, tgt->intercepts, sess->streamkey, strlen(sess->streamkey),
-            check);
-    if (check) {
-        logger(LOG_INFO, "OpenLI: encountered duplicate stream key '%s' for address %s -- replacing...", sess->streamkey, prefixstr);
-        HASH_DELETE(hh, tgt->intercepts, check);
-        free_single_ipsession(check);
-    }
-    HASH_ADD_KEYPTR(hh, tgt->intercepts, sess->streamkey,
-            strlen(sess->streamkey), sess);
-
-    return 0;
-}
-
-static inline ipsession_t *find_ipv4_intercept(colthread_local_t *loc,
-        ipsession_t *tofind, ipv4_target_t **v4) {
-
-    struct sockaddr_in *sin;
-    uint32_t v4addr;
-    ipsession_t *found;
-
-    sin = (struct sockaddr_in *)(tofind->targetip);
-    if (sin == NULL) {
-        logger(LOG_INFO, "OpenLI: attempted to find IPv4 intercept but target IP was NULL?");
-        return NULL;
-    }
-
-    v4addr = sin->sin_addr.s_addr;
-    *v4 = NULL;
-    HASH_FIND(hh, loc->activeipv4intercepts, &v4addr, sizeof(v4addr), *v4);
-    if ((*v4) == NULL) {
-        return NULL;
-    }
-
-    HASH_FIND(hh, (*v4)->intercepts, tofind->streamkey,
-            strlen(tofind->streamkey), found);
-    return found;
-}
-
-static int update_ipv4_intercept(colthread_local_t *loc, ipsession_t *toup) {
-
-    ipsession_t *found;
-    ipv4_target_t *v4;
-
-    found = find_ipv4_intercept(loc, toup, &v4);
-    if (!found) {
-        return 0;
-    }
-
-    update_intercept_common(&(found->common), &(toup->common));
-    return 1;
-}
-
-static int remove_ipv4_intercept(colthread_local_t *loc, ipsession_t *torem) {
-
-    ipsession_t *found;
-    ipv4_target_t *v4;
-
-    found = find_ipv4_intercept(loc, torem, &v4);
-    if (!found || v4 == NULL) {
-        return 0;
-    }
-
-    HASH_DELETE(hh, v4->intercepts, found);
-    free_single_ipsession(found);
-
-    if (HASH_CNT(hh, v4->intercepts) == 0) {
-        HASH_DELETE(hh, loc->activeipv4intercepts, v4);
-        free(v4);
-    }
-
-    return 1;
-}
-
-static inline ipsession_t *find_ipv6_intercept(colthread_local_t *loc,
-        ipsession_t *tofind, ipv6_target_t **v6, char *prefixstr,
-        int pfxstrlen) {
-
-    struct sockaddr_in6 *sin6;
-    ipsession_t *found;
-    char inet[INET6_ADDRSTRLEN];
-
-    sin6 = (struct sockaddr_in6 *)(tofind->targetip);
-    if (sin6 == NULL) {
-        logger(LOG_INFO, "OpenLI: attempted to find IPv6 intercept but target IP was NULL?");
-        return NULL;
-    }
-
-    if (inet_ntop(AF_INET6, &(sin6->sin6_addr), inet, INET6_ADDRSTRLEN)
-            == NULL) {
-        logger(LOG_INFO, "OpenLI: IPv6 intercept prefix does not contain a valid IPv6 address");
-        return NULL;
-    }
-
-    snprintf(prefixstr, pfxstrlen, "%s/%u", inet, tofind->prefixlen);
-    *v6 = NULL;
-
-    HASH_FIND(hh, loc->activeipv6intercepts, prefixstr, strlen(prefixstr), *v6);
-    if ((*v6) == NULL) {
-        return NULL;
-    }
-
-    HASH_FIND(hh, (*v6)->intercepts, tofind->streamkey,
-            strlen(tofind->streamkey), found);
-    return found;
-}
-
-static int update_ipv6_intercept(colthread_local_t *loc, ipsession_t *toup) {
-
-    ipsession_t *found;
-    ipv6_target_t *v6;
-    char prefixstr[100];
-
-    found = find_ipv6_intercept(loc, toup, &v6, prefixstr, 100);
-    if (!found) {
-        return 0;
-    }
-
-    update_intercept_common(&(found->common), &(toup->common));
-    return 1;
-}
-
-static int remove_ipv6_intercept(colthread_local_t *loc, ipsession_t *torem) {
-
-    ipsession_t *found;
-    ipv6_target_t *v6;
-    char prefixstr[100];
-
-    found = find_ipv6_intercept(loc, torem, &v6, prefixstr, 100);
-    if (!found || v6 == NULL) {
-        return 0;
-    }
-
-    remove_iprange_from_patricia(loc->dynamicv6ranges, prefixstr,
-            &(found->common));
-
-    HASH_DELETE(hh, v6->intercepts, found);
-    free_single_ipsession(found);
-
-    if (HASH_CNT(hh, v6->intercepts) == 0) {
-        HASH_DELETE(hh, loc->activeipv6intercepts, v6);
-        free(v6->prefixstr);
-        free(v6);
-    }
-
-    return 1;
-}
-
 void handle_push_mirror_intercept(libtrace_thread_t *t, colthread_local_t *loc,
         vendmirror_intercept_t *vmi) {
 
@@ -479,34 +249,6 @@ void handle_halt_mirror_intercept(libtrace_thread_t *t,
     free_single_vendmirror_intercept(vmi);
 }
 
-void handle_push_ipintercept(libtrace_thread_t *t, colthread_local_t *loc,
-        ipsession_t *sess) {
-
-    if (sess->ai_family == AF_INET) {
-        if (add_ipv4_intercept(loc, sess) != 0) {
-            free_single_ipsession(sess);
-            return;
-        }
-    } else if (sess->ai_family == AF_INET6) {
-        if (add_ipv6_intercept(loc, sess) != 0) {
-            free_single_ipsession(sess);
-            return;
-        }
-    } else {
-        logger(LOG_INFO,
-                 "OpenLI: invalid address family for new IP intercept: %d",
-                 sess->ai_family);
-        free_single_ipsession(sess);
-        return;
-    }
-    /*
-    logger(LOG_INFO,
-            "OpenLI: collector thread %d has started intercepting %s IP session %s",
-            trace_get_perpkt_thread_id(t),
-            accesstype_to_string(sess->accesstype), sess->streamkey);
-    */
-}
-
 void handle_push_ipmmintercept(libtrace_thread_t *t, colthread_local_t *loc,
         rtpstreaminf_t *rtp) {
 
@@ -534,35 +276,6 @@ void handle_halt_ipmmintercept(libtrace_thread_t *t, colthread_local_t *loc,
     free(streamkey);
 }
 
-void handle_halt_ipintercept(libtrace_thread_t *t , colthread_local_t *loc,
-        ipsession_t *sess) {
-
-    if (sess->ai_family == AF_INET) {
-        if (remove_ipv4_intercept(loc, sess) > 0) {
-            /*
-            logger(LOG_INFO,
-                    "OpenLI: collector thread %d has stopped intercepting IP session %s",
-                    trace_get_perpkt_thread_id(t), sess->streamkey);
-            */
-
-        }
-    } else if (sess->ai_family == AF_INET6) {
-        if (remove_ipv6_intercept(loc, sess) > 0) {
-            /*
-            logger(LOG_INFO,
-                    "OpenLI: collector thread %d has stopped intercepting IP session %s",
-                    trace_get_perpkt_thread_id(t), sess->streamkey);
-            */
-
-        }
-    } else {
-        logger(LOG_INFO,
-                 "OpenLI: invalid address family for new IP intercept: %d",
-                 sess->ai_family);
-    }
-    free_single_ipsession(sess);
-}
-
 void handle_push_coreserver(libtrace_thread_t *t, colthread_local_t *loc,
         coreserver_t *cs) {
     coreserver_t *found, **servlist;
@@ -596,6 +309,7 @@ void handle_push_coreserver(libtrace_thread_t *t, colthread_local_t *loc,
     if (!found) {
         HASH_ADD_KEYPTR(hh, *servlist, cs->serverkey, strlen(cs->serverkey),
                 cs);
+        loc->coreclassdirty = 1;
         /*
         logger(LOG_INFO, "OpenLI: collector thread %d has added %s to its %s core server list.",
                 trace_get_perpkt_thread_id(t),
@@ -639,6 +353,7 @@ void handle_remove_coreserver(libtrace_thread_t *t, colthread_local_t *loc,
     HASH_FIND(hh, *servlist, cs->serverkey, strlen(cs->serverkey), found);
     if (found) {
         HASH_DELETE(hh, *servlist, found);
+        loc->coreclassdirty = 1;
         /*
         logger(LOG_INFO, "OpenLI: collector thread %d has removed %s from its %s core server list.",
                 trace_get_perpkt_thread_id(t),
@@ -667,6 +382,7 @@ void handle_iprange(libtrace_thread_t *t, colthread_local_t *loc,
         free_single_staticipsession(ipr);
         return;
     }
+    invalidate_static_ipcache(loc->staticcache);
 
     HASH_FIND(hh, loc->activestaticintercepts, ipr->key,
             strlen(ipr->key), ipr_exist);
@@ -719,6 +435,7 @@ void handle_modify_iprange(libtrace_thread_t *t, colthread_local_t *loc,
         goto bailmodrange;
     }
 
+    invalidate_static_ipcache(loc->staticcache);
     HASH_FIND(hh, loc->activestaticintercepts, found->key, strlen(found->key),
             sessrec);
 
@@ -775,6 +492,7 @@ void handle_remove_iprange(libtrace_thread_t *t, colthread_local_t *loc,
     }
 
     remove_iprange_from_patricia(ptree, ipr->rangestr, &(ipr->common));
+    invalidate_static_ipcache(loc->staticcache);
 
     HASH_FIND(hh, loc->activestaticintercepts, ipr->key, strlen(ipr->key),
             sessrec);
@@ -857,23 +575,4 @@ void handle_change_iprange_intercept(libtrace_thread_t *t,
     free_single_staticipsession(ipr);
 }
 
-void handle_change_ipint_intercept(libtrace_thread_t *t, colthread_local_t *loc,
-        ipsession_t *sess) {
-
-    if (sess->ai_family == AF_INET) {
-        if (update_ipv4_intercept(loc, sess) > 0) {
-
-        }
-    } else if (sess->ai_family == AF_INET6) {
-        if (update_ipv6_intercept(loc, sess) > 0) {
-
-        }
-    } else {
-        logger(LOG_INFO,
-                 "OpenLI: invalid address family for new IP intercept: %d",
-                 sess->ai_family);
-    }
-    free_single_ipsession(sess);
-}
-
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -35,14 +35,10 @@ void handle_push_mirror_intercept(libtrace_thread_t *t, colthread_local_t *loc,
         vendmirror_intercept_t *vmi);
 void handle_halt_mirror_intercept(libtrace_thread_t *t, colthread_local_t *loc,
         vendmirror_intercept_t *vmi);
-void handle_push_ipintercept(libtrace_thread_t *t, colthread_local_t *loc,
-        ipsession_t *sess);
 void handle_push_ipmmintercept(libtrace_thread_t *t, colthread_local_t *loc,
         rtpstreaminf_t *rtp);
 void handle_halt_ipmmintercept(libtrace_thread_t *t, colthread_local_t *loc,
         char *streamkey);
-void handle_halt_ipintercept(libtrace_thread_t *t , colthread_local_t *loc,
-        ipsession_t *sess);
 void handle_push_coreserver(libtrace_thread_t *t, colthread_local_t *loc,
         coreserver_t *cs);
 void handle_remove_coreserver(libtrace_thread_t *t, colthread_local_t *loc,
@@ -59,7 +55,5 @@ void handle_change_vendmirror_intercept(libtrace_thread_t *t,
         colthread_local_t *loc, vendmirror_intercept_t *vend);
 void handle_change_iprange_intercept(libtrace_thread_t *t,
         colthread_local_t *loc, staticipsession_t *ipr);
-void handle_change_ipint_intercept(libtrace_thread_t *t, colthread_local_t *loc,
-        ipsession_t *sess);
 #endif
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -33,6 +33,7 @@
 #include "logger.h"
 #include "collector_base.h"
 #include "collector_publish.h"
+#include "util.h"
 
 static inline void free_intercept_msg(exporter_intercept_msg_t *msg) {
     if (msg->liid) {
@@ -373,6 +374,9 @@ static int run_encoding_job(seqtracker_thread_data_t *seqdata,
 
 	job.preencoded = intstate->preencoded;
 	job.origreq = recvd;
+    if (recvd->tracets[OPENLI_TRACE_PUBLISHED] != 0) {
+        recvd->tracets[OPENLI_TRACE_SEQUENCED] = fetch_current_time_us();
+    }
 	job.liid = strdup(liid);
     job.cinstr = strdup(cinseq->cin_string);
     job.cin = (int64_t)cin;
@@ -416,12 +420,15 @@ static int run_encoding_job(seqtracker_thread_data_t *seqdata,
 
 static void seqtracker_main(seqtracker_thread_data_t *seqdata) {
 
+    openli_export_recv_t *jobs[OPENLI_PUBLISH_BATCH_MAX];
     openli_export_recv_t *job = NULL;
-    int halted = 0, x;
+    int halted = 0, x, i, jobcount;
     int sincepurge = 0;
 
     while (!halted) {
-        x = zmq_recv(seqdata->zmq_recvpublished, &job, sizeof(job), 0);
+        /* Packet processing threads may publish several jobs in the one
+         * message, so be prepared to receive a whole batch */
+        x = zmq_recv(seqdata->zmq_recvpublished, jobs, sizeof(jobs), 0);
         if (x < 0) {
             if (errno == EINTR) {
                 continue;
@@ -434,7 +441,20 @@ static void seqtracker_main(seqtracker_thread_data_t *seqdata) {
             break;
         }
 
-        if (job) {
+        jobcount = x / sizeof(openli_export_recv_t *);
+        if (jobcount > OPENLI_PUBLISH_BATCH_MAX) {
+            jobcount = OPENLI_PUBLISH_BATCH_MAX;
+        }
+        for (i = 0; i < jobcount; i++) {
+            job = jobs[i];
+            if (job == NULL) {
+                continue;
+            }
+            if (halted) {
+                free_published_message(job);
+                continue;
+            }
+
             switch(job->type) {
                 case OPENLI_EXPORT_HALT:
                     halted = 1;
@@ -495,8 +515,8 @@ void *start_seqtracker_thread(void *data) {
 
     char sockname[128];
     seqtracker_thread_data_t *seqdata = (seqtracker_thread_data_t *)data;
-    openli_export_recv_t *job = NULL;
-    int x, zero = 0, large=1000, sndtimeo=1000;
+    openli_export_recv_t *jobs[OPENLI_PUBLISH_BATCH_MAX];
+    int x, i, zero = 0, large=1000, sndtimeo=1000;
     exporter_intercept_state_t *intstate, *tmpexp;
 
     seqdata->zmq_recvpublished = zmq_socket(seqdata->zmq_ctxt, ZMQ_PULL);
@@ -553,7 +573,7 @@ void *start_seqtracker_thread(void *data) {
     /* we're done but we should still drain any remaining items in the queue
      * and free their memory */
     do {
-        x = zmq_recv(seqdata->zmq_recvpublished, &job, sizeof(job),
+        x = zmq_recv(seqdata->zmq_recvpublished, jobs, sizeof(jobs),
                 ZMQ_DONTWAIT);
         if (x < 0) {
             if (errno == EAGAIN) {
@@ -562,8 +582,10 @@ void *start_seqtracker_thread(void *data) {
             break;
         }
 
-        /* release published job */
-		free_published_message(job);
+        /* release published jobs */
+        for (i = 0; i < x / sizeof(openli_export_recv_t *); i++) {
+            free_published_message(jobs[i]);
+        }
 
     } while (x > 0);
 
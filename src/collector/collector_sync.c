@@ -92,6 +92,12 @@ collector_sync_t *init_sync_data(collector_global_t *glob) {
     sync->emailcount = glob->email_threads;
 
     sync->zmq_pubsocks = calloc(sync->pubsockcount, sizeof(void *));
+    sync->iribatches = calloc(sync->pubsockcount,
+            sizeof(openli_publish_batch_t));
+    for (i = 0; i < sync->pubsockcount; i++) {
+        sync->iribatches[i].limit = OPENLI_PUBLISH_BATCH_MAX;
+    }
+    sync->batchiris = 0;
     sync->zmq_fwdctrlsocks = calloc(sync->forwardcount, sizeof(void *));
     sync->zmq_emailsocks = calloc(sync->emailcount, sizeof(void *));
 
@@ -317,6 +323,7 @@ void clean_sync_data(collector_sync_t *sync) {
     free(sync->zmq_emailsocks);
     free(sync->zmq_pubsocks);
     free(sync->zmq_fwdctrlsocks);
+    free(sync->iribatches);
 
 }
 
@@ -476,6 +483,31 @@ static int create_iri_from_session(collector_sync_t *sync,
 
 }
 
+/** Publishes an IRI to a sequence tracker thread. While the sync thread is
+ *  generating a large set of IRIs in one go (e.g. when many intercepts
+ *  start at the same time), the IRIs are coalesced into batches and only
+ *  sent when flush_sync_iri_batches() is called.
+ */
+int publish_sync_iri(collector_sync_t *sync, int trackerid,
+        openli_export_recv_t *msg) {
+
+    if (sync->batchiris) {
+        return publish_openli_msg_batched(sync->zmq_pubsocks[trackerid],
+                &(sync->iribatches[trackerid]), msg);
+    }
+    return publish_openli_msg(sync->zmq_pubsocks[trackerid], msg);
+}
+
+static void flush_sync_iri_batches(collector_sync_t *sync) {
+    int i;
+
+    for (i = 0; i < sync->pubsockcount; i++) {
+        flush_openli_publish_batch(sync->zmq_pubsocks[i],
+                &(sync->iribatches[i]));
+    }
+    sync->batchiris = 0;
+}
+
 static void generate_startend_ipiris(collector_sync_t *sync,
 		ipintercept_t *ipint, time_t tstamp) {
 
@@ -511,6 +543,31 @@ static void generate_startend_ipiris(collector_sync_t *sync,
 }
 
 
+/* Applies every intercept start or end time that has been reached as a
+ * single set, so that the resulting IRIs can be published in batches
+ * rather than one message at a time.
+ */
+static void apply_due_intercept_time_events(collector_sync_t *sync,
+        time_t tstamp) {
+
+    struct upcoming_intercept_event *due, *ev, *tmp;
+
+    due = collect_due_intercept_time_events(
+            &(sync->upcoming_intercept_events), tstamp);
+    if (due == NULL) {
+        return;
+    }
+
+    sync->batchiris = 1;
+    HASH_ITER(hh, due, ev, tmp) {
+        generate_startend_ipiris(sync, (ipintercept_t *)ev->intercept,
+                tstamp);
+    }
+    flush_sync_iri_batches(sync);
+
+    free_intercept_time_events(due);
+}
+
 static inline void push_static_iprange_to_collectors(
         libtrace_message_queue_t *q, ipintercept_t *ipint,
         static_ipranges_t *ipr) {
@@ -571,12 +628,13 @@ static inline void push_static_iprange_remove_to_collectors(
 
 }
 
+/* Adds the IPs for an intercepted session to the shared session index,
+ * so that all collector threads will begin intercepting traffic for them.
+ */
 static inline void push_single_ipintercept(collector_sync_t *sync,
-        libtrace_message_queue_t *q, ipintercept_t *ipint,
-        access_session_t *session) {
+        ipintercept_t *ipint, access_session_t *session) {
 
     ipsession_t *ipsess;
-    openli_pushed_t msg;
     int i;
 
     for (i = 0; i < session->sessipcount; i++) {
@@ -588,14 +646,12 @@ static inline void push_single_ipintercept(collector_sync_t *sync,
 
         if (!ipsess) {
             logger(LOG_INFO,
-                    "OpenLI: ran out of memory while creating IP session message.");
+                    "OpenLI: ran out of memory while creating IP session.");
             return;
         }
-        memset(&msg, 0, sizeof(openli_pushed_t));
-        msg.type = OPENLI_PUSH_IPINTERCEPT;
-        msg.data.ipsess = ipsess;
 
-        libtrace_message_queue_put(q, (void *)(&msg));
+        /* index takes ownership of ipsess */
+        session_index_add(sync->glob->sessionindex, ipsess);
     }
 }
 
@@ -855,31 +911,35 @@ static void update_vendmirror_intercept(collector_sync_t *sync,
 }
 
 
-/* Used to push either OPENLI_PUSH_HALT_IPINTERCEPT or
- * OPENLI_PUSH_UPDATE_IPINTERCEPT to all collector threads.
+/* Applies either OPENLI_PUSH_HALT_IPINTERCEPT or
+ * OPENLI_PUSH_UPDATE_IPINTERCEPT to the shared session index that is
+ * used by all collector threads.
  */
-static void push_session_update_to_threads(void *sendqs,
+static void push_session_update_to_threads(openli_session_index_t *index,
         access_session_t *sess, ipintercept_t *ipint, int updatetype) {
 
-    sync_sendq_t *sendq, *tmp;
     int i;
+    ipsession_t *sessdup;
 
     for (i = 0; i < sess->sessipcount; i++) {
-        openli_pushed_t pmsg;
-        ipsession_t *sessdup;
+        sessdup = create_ipsession(ipint, sess->cin,
+                sess->sessionips[i].ipfamily,
+                (struct sockaddr *)&(sess->sessionips[i].assignedip),
+                sess->sessionips[i].prefixbits);
 
-        HASH_ITER(hh, (sync_sendq_t *)sendqs, sendq, tmp) {
-            memset(&pmsg, 0, sizeof(openli_pushed_t));
-            pmsg.type = updatetype;
-            sessdup = create_ipsession(ipint, sess->cin,
-                    sess->sessionips[i].ipfamily,
-                    (struct sockaddr *)&(sess->sessionips[i].assignedip),
-                    sess->sessionips[i].prefixbits);
-
-            pmsg.data.ipsess = sessdup;
-            libtrace_message_queue_put(sendq->q, &pmsg);
+        if (!sessdup) {
+            logger(LOG_INFO,
+                    "OpenLI: ran out of memory while updating IP session.");
+            return;
         }
 
+        if (updatetype == OPENLI_PUSH_UPDATE_IPINTERCEPT) {
+            /* index takes ownership of sessdup */
+            session_index_update(index, sessdup);
+        } else {
+            session_index_remove(index, sessdup);
+            free_single_ipsession(sessdup);
+        }
     }
 
 }
@@ -910,7 +970,7 @@ static inline void push_ipintercept_halt_to_threads(collector_sync_t *sync,
         /* TODO skip sessions that were never active */
 
         create_iri_from_session(sync, sess, ipint, OPENLI_IPIRI_ENDWHILEACTIVE);
-        push_session_update_to_threads(sync->glob->collector_queues, sess,
+        push_session_update_to_threads(sync->glob->sessionindex, sess,
                 ipint, OPENLI_PUSH_HALT_IPINTERCEPT);
     }
 
@@ -1005,7 +1065,7 @@ static void push_ipintercept_update_to_threads(collector_sync_t *sync,
             create_iri_from_session(sync, sess, ipint, irirequired);
         }
 
-        push_session_update_to_threads(sync->glob->collector_queues, sess,
+        push_session_update_to_threads(sync->glob->sessionindex, sess,
                 ipint, OPENLI_PUSH_UPDATE_IPINTERCEPT);
     }
 
@@ -1183,7 +1243,6 @@ static inline void announce_vendormirror_id(collector_sync_t *sync,
 static void push_existing_user_sessions(collector_sync_t *sync,
         ipintercept_t *cept) {
 
-    sync_sendq_t *tmp, *sendq;
     internet_user_t *user;
 
     HASH_FIND(hh, sync->allusers, cept->username, cept->username_len, user);
@@ -1192,10 +1251,7 @@ static void push_existing_user_sessions(collector_sync_t *sync,
         access_session_t *sess, *tmp2;
 
         HASH_ITER(hh, user->sessions, sess, tmp2) {
-            HASH_ITER(hh, (sync_sendq_t *)(sync->glob->collector_queues),
-                    sendq, tmp) {
-                push_single_ipintercept(sync, sendq->q, cept, sess);
-            }
+            push_single_ipintercept(sync, cept, sess);
 
             create_iri_from_session(sync, sess, cept,
                     OPENLI_IPIRI_STARTWHILEACTIVE);
@@ -1679,7 +1735,7 @@ static void disable_unconfirmed_intercepts(collector_sync_t *sync) {
 static int recv_from_provisioner(collector_sync_t *sync) {
     int ret = 0;
     uint8_t *provmsg;
-    uint16_t msglen = 0;
+    uint32_t msglen = 0;
     uint64_t intid = 0;
     static_ipranges_t *ipr;
     openli_proto_msgtype_t msgtype;
@@ -2011,24 +2067,14 @@ void sync_disconnect_provisioner(collector_sync_t *sync, uint8_t dropmeds) {
 }
 
 static void push_all_active_intercepts(collector_sync_t *sync,
-        internet_user_t *allusers,
         ipintercept_t *intlist, libtrace_message_queue_t *q) {
 
     ipintercept_t *orig, *tmp;
-    internet_user_t *user;
-    access_session_t *sess, *tmp2;
     static_ipranges_t *ipr, *tmpr;
 
     HASH_ITER(hh_liid, intlist, orig, tmp) {
-        /* Do we have a valid user that matches the target username? */
-        if (orig->username != NULL) {
-            HASH_FIND(hh, allusers, orig->username, orig->username_len, user);
-            if (user) {
-                HASH_ITER(hh, user->sessions, sess, tmp2) {
-                    push_single_ipintercept(sync, q, orig, sess);
-                }
-            }
-        }
+        /* Active IP sessions are already in the shared session index, so
+         * the new thread will see those without us doing anything */
         if (orig->vendmirrorid != OPENLI_VENDOR_MIRROR_NONE) {
             push_single_vendmirrorid(q, orig, OPENLI_PUSH_VENDMIRROR_INTERCEPT);
         }
@@ -2121,7 +2167,7 @@ static inline int report_silent_logoffs(collector_sync_t *sync,
                 create_iri_from_session(sync,
                         prev->session[i],
                         ipint, OPENLI_IPIRI_SILENTLOGOFF);
-                push_session_update_to_threads(sync->glob->collector_queues,
+                push_session_update_to_threads(sync->glob->sessionindex,
                         prev->session[i], ipint, OPENLI_PUSH_HALT_IPINTERCEPT);
             }
         }
@@ -2235,7 +2281,6 @@ static int newly_active_session(collector_sync_t *sync,
         access_session_t *sess, user_identity_t *uid) {
 
     int mapret = 0;
-    sync_sendq_t *sendq, *tmpq;
     ipintercept_t *ipint, *tmp;
 
     if (sess->sessipcount > 0) {
@@ -2258,10 +2303,7 @@ static int newly_active_session(collector_sync_t *sync,
         if (!identity_match_intercept(ipint, uid)) {
             continue;
         }
-        HASH_ITER(hh, (sync_sendq_t *)(sync->glob->collector_queues),
-                sendq, tmpq) {
-            push_single_ipintercept(sync, sendq->q, ipint, sess);
-        }
+        push_single_ipintercept(sync, ipint, sess);
     }
     pthread_mutex_lock(sync->glob->stats_mutex);
     sync->glob->stats->ipsessions_added_diff ++;
@@ -2374,7 +2416,7 @@ static int update_user_sessions(collector_sync_t *sync, libtrace_packet_t *pkt,
                     HASH_ITER(hh_user, userint->intlist, ipint, tmp) {
                         if (identity_match_intercept(ipint, &(identities[i]))) {
                             push_session_update_to_threads(
-                                    sync->glob->collector_queues,
+                                    sync->glob->sessionindex,
                                     sess, ipint, OPENLI_PUSH_HALT_IPINTERCEPT);
                         }
                     }
@@ -2494,19 +2536,16 @@ int sync_thread_main(collector_sync_t *sync) {
     if (items[2].revents & ZMQ_POLLIN) {
         struct timeval tv;
         char readbuf[16];
-        ipintercept_t *ipint_v;
 
         if (read(sync->upcomingtimerfd, readbuf, 16) > 0) {
             gettimeofday(&tv, NULL);
 
-            do {
-                ipint_v = (ipintercept_t *)check_intercept_time_event(
-                        &(sync->upcoming_intercept_events), tv.tv_sec);
-                if (ipint_v) {
-                    generate_startend_ipiris(sync, ipint_v, tv.tv_sec);
-                }
-            } while (ipint_v);
+            apply_due_intercept_time_events(sync, tv.tv_sec);
 
+            /* Free any sessions that were retired by our last update, now
+             * that the processing threads have had time to finish with
+             * them */
+            session_index_reclaim(sync->glob->sessionindex);
         }
     }
 
@@ -2555,8 +2594,8 @@ int sync_thread_main(collector_sync_t *sync) {
 
             /* If a hello from a thread, push all active intercepts back */
             if (recvd.type == OPENLI_UPDATE_HELLO) {
-                push_all_active_intercepts(sync, sync->allusers,
-                        sync->ipintercepts, recvd.data.replyq);
+                push_all_active_intercepts(sync, sync->ipintercepts,
+                        recvd.data.replyq);
                 push_all_coreservers(sync->coreservers, recvd.data.replyq);
                 sync->hellosreceived ++;
 
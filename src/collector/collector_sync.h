@@ -64,6 +64,11 @@ typedef struct colsync_data {
     Pvoid_t upcoming_intercept_events;
     int upcomingtimerfd;
 
+    /* IRIs waiting to be published to each sequence tracker -- only used
+     * while batchiris is set */
+    openli_publish_batch_t *iribatches;
+    uint8_t batchiris;
+
     coreserver_t *coreservers;
 
     int instruct_fd;
@@ -98,6 +103,8 @@ void sync_thread_publish_reload(collector_sync_t *sync);
 int sync_thread_main(collector_sync_t *sync);
 void sync_reconnect_all_mediators(collector_sync_t *sync);
 void sync_drop_all_mediators(collector_sync_t *sync);
+int publish_sync_iri(collector_sync_t *sync, int trackerid,
+        openli_export_recv_t *msg);
 
 #endif
 
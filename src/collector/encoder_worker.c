@@ -37,6 +37,7 @@
 #include "logger.h"
 #include "etsili_core.h"
 #include "encoder_worker.h"
+#include "util.h"
 
 static int init_worker(openli_encoder_t *enc) {
     int zero = 0, rto = 10;
@@ -247,9 +248,7 @@ void destroy_encoder_worker(openli_encoder_t *enc) {
         zmq_close(enc->zmq_recvjobs[i]);
     }
 
-    if (enc->evp_ctx) {
-        EVP_CIPHER_CTX_free(enc->evp_ctx);
-    }
+    etsili_destroy_encryption_batch(enc);
 
     if (enc->zmq_control) {
         zmq_close(enc->zmq_control);
@@ -825,7 +824,7 @@ static encoded_header_template_t *encode_templated_psheader(
     return tplate;
 }
 
-static int encode_etsi(openli_encoder_t *enc, openli_encoding_job_t *job,
+int encode_etsi(openli_encoder_t *enc, openli_encoding_job_t *job,
         openli_encoded_result_t *res) {
 
     int ret = -1;
@@ -879,6 +878,89 @@ static int encode_etsi(openli_encoder_t *enc, openli_encoding_job_t *job,
     return ret;
 }
 
+/** Chooses the forwarding thread for a record. Each forwarding thread has
+ *  its own connection to every mediator, so all records for an LIID must
+ *  go through the same forwarder to keep them in order.
+ */
+static inline int forwarder_for_liid(openli_encoder_t *enc, char *liid) {
+    if (liid == NULL) {
+        return 0;
+    }
+    return hashlittle(liid, strlen(liid), 0x5c4c) % enc->forwarders;
+}
+
+/** Sends a batch of encoded results to the forwarding threads, splitting
+ *  the batch up based on the LIID of each result.
+ */
+static int push_results_by_liid(openli_encoder_t *enc,
+        openli_encoded_result_t *result, int batch) {
+
+    openli_encoded_result_t tosend[MAX_ENCODED_RESULT_BATCH];
+    uint8_t fwdids[MAX_ENCODED_RESULT_BATCH];
+    int i, f, count;
+
+    for (i = 0; i < batch; i++) {
+        fwdids[i] = forwarder_for_liid(enc, result[i].liid);
+    }
+
+    for (f = 0; f < enc->forwarders; f++) {
+        count = 0;
+        for (i = 0; i < batch; i++) {
+            if (fwdids[i] == f) {
+                tosend[count] = result[i];
+                count ++;
+            }
+        }
+        if (count == 0) {
+            continue;
+        }
+        if (zmq_send(enc->zmq_pushresults[f], tosend,
+                    count * sizeof(openli_encoded_result_t), 0) < 0) {
+            logger(LOG_INFO, "OpenLI: error while pushing encoded result to forwarder %d (worker=%d)", f, enc->workerid);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/** Encrypts any records in the batch that need it, and removes any
+ *  records that could not be encrypted from the batch.
+ *
+ *  @return the number of records remaining in the batch.
+ */
+static int finish_encrypted_results(openli_encoder_t *enc,
+        openli_encoded_result_t *result, int batch) {
+
+    int i, kept = 0;
+
+    /* Check every record, even if this flush succeeded, as the pending
+     * encryption batch may also have been flushed while encoding */
+    etsili_flush_encryption_batch(enc);
+
+    for (i = 0; i < batch; i++) {
+        if (result[i].msgbody == NULL) {
+            logger(LOG_INFO,
+                    "OpenLI: encoder worker %d dropped a record for LIID %s because the payload could not be encrypted",
+                    enc->workerid, result[i].liid);
+            if (result[i].cinstr) {
+                free(result[i].cinstr);
+            }
+            if (result[i].liid) {
+                free(result[i].liid);
+            }
+            if (result[i].origreq) {
+                free_published_message(result[i].origreq);
+            }
+            continue;
+        }
+        if (kept != i) {
+            result[kept] = result[i];
+        }
+        kept ++;
+    }
+    return kept;
+}
+
 static int process_job(openli_encoder_t *enc, void *socket) {
     int x;
     int batch = 0;
@@ -934,23 +1016,29 @@ static int process_job(openli_encoder_t *enc, void *socket) {
         result[batch].origreq = job.origreq;
         result[batch].encodedby = enc->workerid;
 
+        if (job.origreq->tracets[OPENLI_TRACE_PUBLISHED] != 0) {
+            job.origreq->tracets[OPENLI_TRACE_ENCODED] =
+                    fetch_current_time_us();
+        }
+
         if (job.encryptkey) {
             free(job.encryptkey);
         }
         batch++;
     }
 
-    /* TODO if we have multiple forwarding threads, we will need to
-     * assign individual results to the forwarder based on its LIID --
-     * this will also require multiple result[] arrays (one per forwarder)
-     * for message batching.
-     */
-    if (batch > 0) {
+    batch = finish_encrypted_results(enc, result, batch);
+
+    if (batch > 0 && enc->forwarders <= 1) {
         if (zmq_send(enc->zmq_pushresults[0], result,
                     batch * sizeof(openli_encoded_result_t), 0) < 0) {
             logger(LOG_INFO, "OpenLI: error while pushing encoded result back to exporter (worker=%d)", enc->workerid);
             return -1;
         }
+    } else if (batch > 0) {
+        if (push_results_by_liid(enc, result, batch) < 0) {
+            return -1;
+        }
     }
 
     return batch;
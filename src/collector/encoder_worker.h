@@ -72,6 +72,26 @@ typedef struct saved_encoding_templates {
 void destroy_encoder_worker(openli_encoder_t *enc);
 void *run_encoder_worker(void *encstate);
 
+/** Encodes a single job as an ETSI record, creating or updating any
+ *  templates that the record needs.
+ *
+ *  Only the encoder, freegenerics, template and encryption fields of the
+ *  encoder state are used, so this can be called outside of an encoder
+ *  thread.
+ *
+ *  If the job requires payload encryption, the record is not complete
+ *  until etsili_flush_encryption_batch() has been called.
+ *
+ *  @param enc          The encoder state
+ *  @param job          The job to encode
+ *  @param res          The result structure to populate
+ *
+ *  @return 1 if a record was encoded, 0 if the job type is not an ETSI
+ *          record type, -1 if an error occurred.
+ */
+int encode_etsi(openli_encoder_t *enc, openli_encoding_job_t *job,
+        openli_encoded_result_t *res);
+
 #endif
 
 
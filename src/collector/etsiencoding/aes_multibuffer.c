@@ -0,0 +1,330 @@
+/*
+ *
+ * Copyright (c) 2023 The OpenLI Foundation
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * OpenLI was originally developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include <openssl/err.h>
+#include <openssl/crypto.h>
+
+#include "logger.h"
+#include "aes_multibuffer.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define OPENLI_HAVE_AESNI 1
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#ifdef OPENLI_HAVE_AESNI
+
+static int aesni_available(void) {
+    static int available = -1;
+
+    if (available == -1) {
+        __builtin_cpu_init();
+        available = __builtin_cpu_supports("aes") ? 1 : 0;
+    }
+    return available;
+}
+
+/* AES-192 key expansion, as described in Intel's AES-NI white paper */
+__attribute__((target("aes,sse2")))
+static inline void aes192_key_assist(__m128i *t1, __m128i *t2, __m128i *t3) {
+    __m128i t4;
+
+    *t2 = _mm_shuffle_epi32(*t2, 0x55);
+    t4 = _mm_slli_si128(*t1, 0x4);
+    *t1 = _mm_xor_si128(*t1, t4);
+    t4 = _mm_slli_si128(t4, 0x4);
+    *t1 = _mm_xor_si128(*t1, t4);
+    t4 = _mm_slli_si128(t4, 0x4);
+    *t1 = _mm_xor_si128(*t1, t4);
+    *t1 = _mm_xor_si128(*t1, *t2);
+    *t2 = _mm_shuffle_epi32(*t1, 0xff);
+    t4 = _mm_slli_si128(*t3, 0x4);
+    *t3 = _mm_xor_si128(*t3, t4);
+    *t3 = _mm_xor_si128(*t3, *t2);
+}
+
+/* Combines the last 64 bits of 'a' with the first 64 bits of 'b' */
+#define AES192_SPLICE(a, b, sel) \
+    _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(a), \
+            _mm_castsi128_pd(b), sel))
+
+#define AES192_EXPAND_STEP(rcon) \
+    t2 = _mm_aeskeygenassist_si128(t3, rcon); \
+    aes192_key_assist(&t1, &t2, &t3);
+
+__attribute__((target("aes,sse2")))
+static void aesni_expand_key_192(const uint8_t *userkey, uint8_t *roundkeys) {
+    __m128i t1, t2, t3;
+    __m128i *rk = (__m128i *)roundkeys;
+    uint8_t padded[32];
+
+    /* Avoid reading past the end of the 24 byte key */
+    memset(padded, 0, sizeof(padded));
+    memcpy(padded, userkey, 24);
+
+    t1 = _mm_loadu_si128((__m128i *)padded);
+    t3 = _mm_loadu_si128((__m128i *)(padded + 16));
+    rk[0] = t1;
+    rk[1] = t3;
+
+    AES192_EXPAND_STEP(0x01);
+    rk[1] = AES192_SPLICE(rk[1], t1, 0);
+    rk[2] = AES192_SPLICE(t1, t3, 1);
+    AES192_EXPAND_STEP(0x02);
+    rk[3] = t1;
+    rk[4] = t3;
+    AES192_EXPAND_STEP(0x04);
+    rk[4] = AES192_SPLICE(rk[4], t1, 0);
+    rk[5] = AES192_SPLICE(t1, t3, 1);
+    AES192_EXPAND_STEP(0x08);
+    rk[6] = t1;
+    rk[7] = t3;
+    AES192_EXPAND_STEP(0x10);
+    rk[7] = AES192_SPLICE(rk[7], t1, 0);
+    rk[8] = AES192_SPLICE(t1, t3, 1);
+    AES192_EXPAND_STEP(0x20);
+    rk[9] = t1;
+    rk[10] = t3;
+    AES192_EXPAND_STEP(0x40);
+    rk[10] = AES192_SPLICE(rk[10], t1, 0);
+    rk[11] = AES192_SPLICE(t1, t3, 1);
+    AES192_EXPAND_STEP(0x80);
+    rk[12] = t1;
+
+    OPENSSL_cleanse(padded, sizeof(padded));
+}
+
+/* Applies one AES round to every lane. Written out in full so that the
+ * lane states stay in registers and the rounds for different lanes can
+ * overlap, regardless of how much loop unrolling the compiler does.
+ */
+#if OPENLI_AES_LANES != 8
+#error "AES_LANES_ROUND assumes eight lanes"
+#endif
+#define AES_LANES_ROUND(fn, r) \
+    state[0] = fn(state[0], _mm_load_si128(rk[0] + (r))); \
+    state[1] = fn(state[1], _mm_load_si128(rk[1] + (r))); \
+    state[2] = fn(state[2], _mm_load_si128(rk[2] + (r))); \
+    state[3] = fn(state[3], _mm_load_si128(rk[3] + (r))); \
+    state[4] = fn(state[4], _mm_load_si128(rk[4] + (r))); \
+    state[5] = fn(state[5], _mm_load_si128(rk[5] + (r))); \
+    state[6] = fn(state[6], _mm_load_si128(rk[6] + (r))); \
+    state[7] = fn(state[7], _mm_load_si128(rk[7] + (r)));
+
+/* Encrypts the jobs using OPENLI_AES_LANES interleaved CBC chains. Whenever
+ * a lane reaches the end of its buffer, it is refilled with the next job so
+ * that all of the lanes stay busy until we run out of jobs.
+ *
+ * Idle lanes still run through the rounds (on whatever was left in their
+ * state), as this is cheaper than breaking up the interleaving -- their
+ * output is simply discarded.
+ */
+__attribute__((target("aes,sse2")))
+static void aesni_cbc_encrypt_lanes(openli_aes_cbc_job_t *jobs, int count) {
+    __m128i state[OPENLI_AES_LANES];
+    const __m128i *rk[OPENLI_AES_LANES];
+    uint32_t offset[OPENLI_AES_LANES];
+    int lanejob[OPENLI_AES_LANES];
+    int next = 0, active = 0, l, r;
+
+    for (l = 0; l < OPENLI_AES_LANES; l++) {
+        state[l] = _mm_setzero_si128();
+        rk[l] = (const __m128i *)jobs[0].key->roundkeys;
+        offset[l] = 0;
+        lanejob[l] = -1;
+    }
+
+    while (1) {
+        for (l = 0; l < OPENLI_AES_LANES; l++) {
+            while (lanejob[l] == -1 && next < count) {
+                if (jobs[next].len == 0) {
+                    next ++;
+                    continue;
+                }
+                lanejob[l] = next;
+                offset[l] = 0;
+                state[l] = _mm_loadu_si128((const __m128i *)jobs[next].iv);
+                rk[l] = (const __m128i *)jobs[next].key->roundkeys;
+                next ++;
+                active ++;
+            }
+        }
+
+        if (active == 0) {
+            break;
+        }
+
+        for (l = 0; l < OPENLI_AES_LANES; l++) {
+            if (lanejob[l] >= 0) {
+                state[l] = _mm_xor_si128(state[l], _mm_loadu_si128(
+                        (const __m128i *)(jobs[lanejob[l]].src + offset[l])));
+            }
+            state[l] = _mm_xor_si128(state[l], _mm_load_si128(rk[l]));
+        }
+
+        for (r = 1; r < OPENLI_AES192_ROUNDS; r++) {
+            AES_LANES_ROUND(_mm_aesenc_si128, r);
+        }
+        AES_LANES_ROUND(_mm_aesenclast_si128, OPENLI_AES192_ROUNDS);
+
+        for (l = 0; l < OPENLI_AES_LANES; l++) {
+            if (lanejob[l] < 0) {
+                continue;
+            }
+            _mm_storeu_si128((__m128i *)(jobs[lanejob[l]].dest + offset[l]),
+                    state[l]);
+            offset[l] += 16;
+            if (offset[l] >= jobs[lanejob[l]].len) {
+                lanejob[l] = -1;
+                active --;
+            }
+        }
+    }
+}
+
+#endif
+
+static int evp_cbc_encrypt(openli_aes_cbc_job_t *job) {
+    int len;
+
+    /* The key schedule is already in the context, so we only need to
+     * reset the IV */
+    if (EVP_EncryptInit_ex(job->key->evp, NULL, NULL, NULL, job->iv) != 1) {
+        logger(LOG_INFO, "OpenLI: unable to initialise EVP encryption operation -- openssl error %s", ERR_error_string(ERR_get_error(), NULL));
+        return -1;
+    }
+
+    if (EVP_EncryptUpdate(job->key->evp, job->dest, &len, job->src,
+                (int)job->len) != 1) {
+        logger(LOG_INFO, "OpenLI: unable to perform EVP encryption operation -- openssl error %s", ERR_error_string(ERR_get_error(), NULL));
+        return -1;
+    }
+    return 0;
+}
+
+openli_aes192_key_t *openli_aes192_lookup_key(openli_aes192_key_t **keys,
+        const char *keystr) {
+
+    openli_aes192_key_t *key;
+    uint8_t userkey[24];
+    size_t keylen = strlen(keystr);
+
+    if (keylen > 24) {
+        keylen = 24;
+    }
+    memset(userkey, 0, 24);
+    memcpy(userkey, keystr, keylen);
+
+    HASH_FIND(hh, *keys, userkey, 24, key);
+    if (key) {
+        OPENSSL_cleanse(userkey, 24);
+        return key;
+    }
+
+    key = calloc(1, sizeof(openli_aes192_key_t));
+    memcpy(key->userkey, userkey, 24);
+    OPENSSL_cleanse(userkey, 24);
+
+#ifdef OPENLI_HAVE_AESNI
+    if (aesni_available()) {
+        aesni_expand_key_192(key->userkey, key->roundkeys);
+        HASH_ADD(hh, *keys, userkey, 24, key);
+        return key;
+    }
+#endif
+
+    key->evp = EVP_CIPHER_CTX_new();
+    if (key->evp == NULL) {
+        logger(LOG_INFO, "OpenLI: unable to create EVP encryption context -- openssl error %s", ERR_error_string(ERR_get_error(), NULL));
+        goto keyfail;
+    }
+
+    if (EVP_EncryptInit_ex(key->evp, EVP_aes_192_cbc(), NULL, key->userkey,
+                NULL) != 1) {
+        logger(LOG_INFO, "OpenLI: unable to initialise EVP encryption key -- openssl error %s", ERR_error_string(ERR_get_error(), NULL));
+        goto keyfail;
+    }
+
+    /* Our buffers are always a multiple of the block size, so there is
+     * no need for OpenSSL to add a block of padding */
+    EVP_CIPHER_CTX_set_padding(key->evp, 0);
+
+    HASH_ADD(hh, *keys, userkey, 24, key);
+    return key;
+
+keyfail:
+    if (key->evp) {
+        EVP_CIPHER_CTX_free(key->evp);
+    }
+    OPENSSL_cleanse(key, sizeof(openli_aes192_key_t));
+    free(key);
+    return NULL;
+}
+
+void openli_aes192_free_keys(openli_aes192_key_t **keys) {
+    openli_aes192_key_t *key, *tmp;
+
+    HASH_ITER(hh, *keys, key, tmp) {
+        HASH_DELETE(hh, *keys, key);
+        if (key->evp) {
+            EVP_CIPHER_CTX_free(key->evp);
+        }
+        OPENSSL_cleanse(key, sizeof(openli_aes192_key_t));
+        free(key);
+    }
+}
+
+int openli_aes192_cbc_encrypt_batch(openli_aes_cbc_job_t *jobs, int count,
+        uint8_t *failed) {
+
+    int i, fails = 0;
+
+    memset(failed, 0, count);
+    if (count <= 0) {
+        return 0;
+    }
+
+#ifdef OPENLI_HAVE_AESNI
+    if (aesni_available()) {
+        aesni_cbc_encrypt_lanes(jobs, count);
+        return 0;
+    }
+#endif
+
+    for (i = 0; i < count; i++) {
+        if (evp_cbc_encrypt(&(jobs[i])) < 0) {
+            failed[i] = 1;
+            fails ++;
+        }
+    }
+    return fails;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,116 @@
+/*
+ *
+ * Copyright (c) 2023 The OpenLI Foundation
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * OpenLI was originally developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef OPENLI_AES_MULTIBUFFER_H_
+#define OPENLI_AES_MULTIBUFFER_H_
+
+#include <stdint.h>
+#include <uthash.h>
+#include <openssl/evp.h>
+
+/* AES-192-CBC encryption of many independent buffers at once.
+ *
+ * CBC is serial within a buffer, as each block depends on the ciphertext
+ * of the block before it. However, the AES-NI instructions can start a
+ * new round every cycle while each round takes several cycles to
+ * complete, so a single CBC chain leaves most of the AES unit idle.
+ * Encrypting several buffers side by side ("lanes") keeps it busy.
+ *
+ * If the CPU does not support AES-NI, each buffer is encrypted in turn
+ * using OpenSSL instead.
+ */
+
+#define OPENLI_AES_LANES 8
+#define OPENLI_AES192_ROUNDS 12
+
+typedef struct openli_aes192_key openli_aes192_key_t;
+
+/** An AES-192 key that has been prepared for encryption. Keys are cached
+ *  so that the key schedule only has to be derived once for each key.
+ */
+struct openli_aes192_key {
+    /** The key itself, zero-padded to 24 bytes */
+    uint8_t userkey[24];
+
+    /** The expanded key schedule, if we are using AES-NI */
+    uint8_t roundkeys[(OPENLI_AES192_ROUNDS + 1) * 16]
+            __attribute__((aligned(16)));
+
+    /** An OpenSSL context that has been initialised with this key, if we
+     *  are not using AES-NI */
+    EVP_CIPHER_CTX *evp;
+
+    UT_hash_handle hh;
+};
+
+/** A single buffer to be encrypted */
+typedef struct openli_aes_cbc_job {
+    /** The key to encrypt the buffer with */
+    openli_aes192_key_t *key;
+
+    /** The IV to use for this buffer */
+    uint8_t iv[16];
+
+    /** The plaintext */
+    const uint8_t *src;
+
+    /** Where to write the ciphertext (may not overlap src) */
+    uint8_t *dest;
+
+    /** The number of bytes to encrypt -- must be a multiple of 16 */
+    uint32_t len;
+} openli_aes_cbc_job_t;
+
+/** Finds a key in a key cache, adding it to the cache if it is not
+ *  already present.
+ *
+ *  @param keys         The key cache
+ *  @param keystr       The key, as configured for the intercept. Keys
+ *                      longer than 24 bytes are truncated, shorter keys
+ *                      are padded with zeroes.
+ *
+ *  @return the prepared key, or NULL if the key could not be prepared.
+ */
+openli_aes192_key_t *openli_aes192_lookup_key(openli_aes192_key_t **keys,
+        const char *keystr);
+
+/** Removes all keys from a key cache. */
+void openli_aes192_free_keys(openli_aes192_key_t **keys);
+
+/** Encrypts a set of buffers using AES-192-CBC, without any padding.
+ *
+ *  @param jobs         The buffers to encrypt
+ *  @param count        The number of buffers in the jobs array
+ *  @param failed       Set to 1 for each job that could not be encrypted
+ *
+ *  @return the number of jobs that could not be encrypted.
+ */
+int openli_aes192_cbc_encrypt_batch(openli_aes_cbc_job_t *jobs, int count,
+        uint8_t *failed);
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
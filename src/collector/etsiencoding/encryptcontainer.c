@@ -33,6 +33,28 @@
 #include "logger.h"
 #include "intercept.h"
 #include "etsiencoding.h"
+#include "aes_multibuffer.h"
+
+/* Records that have been encoded but are waiting for their payload to be
+ * encrypted. Encryption is deferred until the encoder has a batch of
+ * records, so that several records can be encrypted at once.
+ */
+struct openli_encryption_batch {
+    /** The keys that have been used by this encoder */
+    openli_aes192_key_t *keys;
+
+    /** The pending encryption operations */
+    openli_aes_cbc_job_t jobs[MAX_ENCODED_RESULT_BATCH];
+
+    /** The result that each pending operation belongs to */
+    openli_encoded_result_t *results[MAX_ENCODED_RESULT_BATCH];
+
+    /** The number of pending operations */
+    int count;
+};
+
+/* Don't let the key cache grow forever if keys are being changed often */
+#define MAX_CACHED_ENCRYPTION_KEYS 256
 
 static void DEVDEBUG_dump_contents(uint8_t *buf, uint16_t len) {
 
@@ -126,16 +148,16 @@ static int encode_encrypt_container(wandder_encoder_t *encoder,
 }
 
 static int etsili_update_encrypted_template(
-        encoded_encrypt_template_t *tplate, uint8_t *enccontent,
-        uint16_t enclen, openli_encoding_job_t *job) {
+        encoded_encrypt_template_t *tplate, uint16_t enclen,
+        openli_encoding_job_t *job) {
 
     uint32_t payloadtype = job_origreq_to_encrypted_payload_type(job);
     uint8_t ptype;
     assert(enclen == tplate->payloadlen);
     assert(payloadtype < 255);
 
-    memcpy(tplate->payload, enccontent, enclen);
-
+    /* The encrypted payload itself is written directly into the encoded
+     * result, so only the payload type needs to change here */
     ptype = (payloadtype & 0xff);
     memcpy(tplate->payload_type, &ptype, sizeof(uint8_t));
     return 0;
@@ -231,49 +253,75 @@ static encoded_encrypt_template_t *lookup_encrypted_template(
     return tplate;
 }
 
-static int encrypt_aes_192_cbc(EVP_CIPHER_CTX *ctx,
-        uint8_t *buf, uint16_t buflen, uint8_t *dest,
-        uint16_t destlen, uint32_t seqno, char *encryptkey) {
-
-    uint8_t IV_128[16];
-    uint8_t key[24];
+static void aes_192_cbc_iv(uint8_t *iv, uint32_t seqno) {
     uint32_t swapseqno;
-    size_t keylen = strlen(encryptkey);
-    int len, i;
-
-    assert(buflen <= destlen);
+    int i;
 
-    /* Generate the IV */
     swapseqno = htonl(seqno);
-
     for (i = 0; i < 16; i+=sizeof(uint32_t)) {
-        memcpy(&(IV_128[i]), &swapseqno, sizeof(uint32_t));
+        memcpy(&(iv[i]), &swapseqno, sizeof(uint32_t));
     }
+}
+
+static openli_encryption_batch_t *get_encryption_batch(
+        openli_encoder_t *enc) {
 
-    if (keylen > 24) {
-        keylen = 24;
+    /* If this is our first time through, we'll need to create the batch */
+    if (enc->encbatch == NULL) {
+        enc->encbatch = calloc(1, sizeof(openli_encryption_batch_t));
     }
-    memset(key, 0, 24);
-    memcpy(key, encryptkey, keylen);
+    return enc->encbatch;
+}
 
-    /* Do the encryption */
-    if (EVP_EncryptInit_ex(ctx, EVP_aes_192_cbc(), NULL, key, IV_128) != 1) {
-            logger(LOG_INFO, "OpenLI: unable to initialise EVP encryption operation -- openssl error %s", ERR_error_string(ERR_get_error(), NULL));
-            return -1;
+int etsili_flush_encryption_batch(openli_encoder_t *enc) {
+    openli_encryption_batch_t *batch = enc->encbatch;
+    uint8_t failed[MAX_ENCODED_RESULT_BATCH];
+    openli_encoded_result_t *res;
+    int i, fails;
+
+    if (batch == NULL || batch->count == 0) {
+        return 0;
     }
 
-    if (EVP_EncryptUpdate(ctx, dest, &len, buf, (int)buflen) != 1) {
-            logger(LOG_INFO, "OpenLI: unable to perform EVP encryption operation -- openssl error %s", ERR_error_string(ERR_get_error(), NULL));
-            return -1;
+    fails = openli_aes192_cbc_encrypt_batch(batch->jobs, batch->count,
+            failed);
+
+    for (i = 0; i < batch->count; i++) {
+        /* The plaintext was allocated by create_encrypted_message_body() */
+        free((uint8_t *)batch->jobs[i].src);
+
+        if (!failed[i]) {
+            continue;
+        }
+
+        /* Never send a record with a payload that has not been encrypted */
+        res = batch->results[i];
+        free(res->msgbody->encoded);
+        free(res->msgbody);
+        res->msgbody = NULL;
     }
+    batch->count = 0;
 
-    if (EVP_EncryptFinal_ex(ctx, dest + len, &len) != 1) {
-            logger(LOG_INFO, "OpenLI: unable to finish EVP encryption operation -- openssl error %s", ERR_error_string(ERR_get_error(), NULL));
-            return -1;
+    /* No jobs refer to the cached keys any more, so this is the only safe
+     * time to evict them */
+    if (HASH_COUNT(batch->keys) > MAX_CACHED_ENCRYPTION_KEYS) {
+        openli_aes192_free_keys(&(batch->keys));
     }
 
+    if (fails > 0) {
+        return -1;
+    }
     return 0;
+}
 
+void etsili_destroy_encryption_batch(openli_encoder_t *enc) {
+    if (enc->encbatch == NULL) {
+        return;
+    }
+    etsili_flush_encryption_batch(enc);
+    openli_aes192_free_keys(&(enc->encbatch->keys));
+    free(enc->encbatch);
+    enc->encbatch = NULL;
 }
 
 int create_encrypted_message_body(openli_encoder_t *enc,
@@ -286,11 +334,13 @@ int create_encrypted_message_body(openli_encoder_t *enc,
     uint32_t inplen;
     uint32_t enclen = 0, newbodylen = 0;
     uint8_t containerlen = 0, is_new = 0;
-    uint8_t *buf, *ptr;
-    uint8_t *encrypted;
+    uint8_t *buf, *ptr, *dest;
+    uint8_t *placeholder;
     uint32_t bytecounter;
     uint32_t bc_increase;
     encoded_encrypt_template_t *tplate = NULL;
+    openli_encryption_batch_t *batch = NULL;
+    openli_aes192_key_t *key = NULL;
 
     if (payloadbody == NULL) {
         logger(LOG_INFO, "OpenLI: cannot encrypt an ETSI PDU that does not have valid encoded payload");
@@ -323,7 +373,6 @@ int create_encrypted_message_body(openli_encoder_t *enc,
     /* Add 16 bytes extra, just to be safe...
      */
     buf = calloc(enclen + 16, sizeof(uint8_t));
-    encrypted = calloc(enclen + 16, sizeof(uint8_t));
 
     /* Take the contents of body_tplate (minus the initial "payload" field).
      * Add EncryptedPayload and byteCounter fields to the front to get
@@ -401,27 +450,20 @@ int create_encrypted_message_body(openli_encoder_t *enc,
         ptr += ipclen;
     }
 
-    /* If this is our first time through, we'll need an encryption context */
-    if (enc->evp_ctx == NULL) {
-        enc->evp_ctx = EVP_CIPHER_CTX_new();
-        if (enc->evp_ctx == NULL) {
-            logger(LOG_INFO, "OpenLI: unable to create EVP encryption context -- openssl error %s", ERR_error_string(ERR_get_error(), NULL));
-            return -1;
-        }
-    }
-
-    /* Do the encryption */
     if (job->encryptmethod == OPENLI_PAYLOAD_ENCRYPTION_AES_192_CBC) {
-        if (encrypt_aes_192_cbc(enc->evp_ctx, buf, enclen, encrypted, enclen,
-                job->seqno, job->encryptkey) < 0) {
+        batch = get_encryption_batch(enc);
+        /* Flush a full batch before looking up the key, as flushing may
+         * evict every cached key (including the one we're about to use) */
+        if (batch->count == MAX_ENCODED_RESULT_BATCH) {
+            etsili_flush_encryption_batch(enc);
+        }
+        key = openli_aes192_lookup_key(&(batch->keys), job->encryptkey);
+        if (key == NULL) {
+            free(buf);
             return -1;
         }
-    } else {
-        memcpy(encrypted, buf, enclen);
     }
 
-    free(buf);
-
     /* Lookup the template for a message of this length and encryption method */
     tplate = lookup_encrypted_template(enc, enclen, job->encryptmethod,
             &is_new);
@@ -430,15 +472,19 @@ int create_encrypted_message_body(openli_encoder_t *enc,
      * the one that we already have.
      */
     if (is_new) {
+        /* The payload is filled in for each record, so the template just
+         * needs a placeholder of the right length */
+        placeholder = calloc(enclen, sizeof(uint8_t));
         if (etsili_create_encrypted_template(enc->encoder, job->preencoded,
-                job->encryptmethod, encrypted, enclen, tplate, job) < 0) {
-            free(encrypted);
+                job->encryptmethod, placeholder, enclen, tplate, job) < 0) {
+            free(placeholder);
+            free(buf);
             return -1;
         }
+        free(placeholder);
     } else {
-        if (etsili_update_encrypted_template(tplate, encrypted, enclen,
-                job) < 0) {
-            free(encrypted);
+        if (etsili_update_encrypted_template(tplate, enclen, job) < 0) {
+            free(buf);
             return -1;
         }
     }
@@ -447,11 +493,31 @@ int create_encrypted_message_body(openli_encoder_t *enc,
      * create a complete ETSI PSPDU record */
     if (create_etsi_encoded_result(res, hdr_tplate, tplate->start,
             tplate->totallen, NULL, 0, job) < 0) {
-        free(encrypted);
+        free(buf);
         return -1;
     }
 
-    free(encrypted);
+    /* The encrypted container is at the end of the record */
+    dest = res->msgbody->encoded + (res->msgbody->len - tplate->totallen) +
+            (tplate->payload - tplate->start);
+
+    if (job->encryptmethod != OPENLI_PAYLOAD_ENCRYPTION_AES_192_CBC) {
+        memcpy(dest, buf, enclen);
+        free(buf);
+        return 0;
+    }
+
+    /* Encrypt the payload straight into the record, but only once we have
+     * a batch of records to encrypt -- see etsili_flush_encryption_batch().
+     * Until then, the payload in the record is just zeroes.
+     */
+    batch->jobs[batch->count].key = key;
+    aes_192_cbc_iv(batch->jobs[batch->count].iv, job->seqno);
+    batch->jobs[batch->count].src = buf;
+    batch->jobs[batch->count].dest = dest;
+    batch->jobs[batch->count].len = enclen;
+    batch->results[batch->count] = res;
+    batch->count ++;
     return 0;
 }
 
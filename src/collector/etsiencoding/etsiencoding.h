@@ -71,6 +71,22 @@ int create_encrypted_message_body(openli_encoder_t *enc,
                 uint8_t *ipcontents, uint16_t ipclen,
                 openli_encoding_job_t *job);
 
+/** Encrypts the payloads of any encrypted records that have been encoded
+ *  since the last call to this function.
+ *
+ *  Records that are encoded with payload encryption are not complete until
+ *  this function has been called. Any record that could not be encrypted
+ *  has its msgbody freed and set to NULL, and must not be exported.
+ *
+ *  @param enc          The encoder that encoded the records
+ *
+ *  @return -1 if any record could not be encrypted, 0 otherwise.
+ */
+int etsili_flush_encryption_batch(openli_encoder_t *enc);
+
+/** Releases any encryption state held by an encoder. */
+void etsili_destroy_encryption_batch(openli_encoder_t *enc);
+
 int create_etsi_encoded_result(openli_encoded_result_t *res,
         encoded_header_template_t *hdr_tplate,
         uint8_t *body_content, uint16_t bodylen,
@@ -39,83 +39,137 @@
 #include "etsili_core.h"
 #include "ipcc.h"
 
-static inline static_ipcache_t *find_static_cached(prefix_t *prefix,
-        colthread_local_t *loc) {
+static_ipcache_t *create_static_ipcache(void) {
+    static_ipcache_t *cache;
 
-    static_ipcache_t *found;
-    HASH_FIND(hh, loc->staticcache, prefix, sizeof(prefix_t), found);
+    cache = (static_ipcache_t *)calloc(1, sizeof(static_ipcache_t));
+    cache->generation = 1;
+    return cache;
+}
+
+void invalidate_static_ipcache(static_ipcache_t *cache) {
+    if (cache == NULL) {
+        return;
+    }
+
+    /* Entries are lazily refilled once they notice the generation has
+     * moved on, so we don't need to touch them here. Skip 0 on wrap,
+     * since that marks an entry that has never been filled.
+     */
+    cache->generation ++;
+    if (cache->generation == 0) {
+        cache->generation = 1;
+    }
+}
+
+void destroy_static_ipcache(static_ipcache_t *cache) {
+    int i, j;
 
-    if (found) {
-        /* Push it back to the front of the queue so it doesn't expire */
-        HASH_DELETE(hh, loc->staticcache, found);
-        HASH_ADD_KEYPTR(hh, loc->staticcache, &(found->prefix),
-                sizeof(prefix_t), found);
+    if (cache == NULL) {
+        return;
     }
-    return found;
 
+    for (i = 0; i < STATIC_IPCACHE_SETS; i++) {
+        for (j = 0; j < STATIC_IPCACHE_WAYS; j++) {
+            if (cache->sets[i].ways[j].matches) {
+                free(cache->sets[i].ways[j].matches);
+            }
+        }
+    }
+    free(cache);
 }
 
-static inline int add_static_cached(prefix_t *prefix, patricia_node_t *pnode,
-        colthread_local_t *loc) {
+static inline uint32_t hash_static_cache_addr(uint8_t *addr, int addrlen) {
+    uint32_t h = 0;
+    uint32_t word;
+    int i;
 
-    static_ipcache_t *ent, *tmp;
+    for (i = 0; i < addrlen; i += 4) {
+        memcpy(&word, addr + i, sizeof(uint32_t));
+        h = (h ^ word) * 0x9e3779b1;
+    }
+    return (h >> 16) ^ h;
+}
 
-    ent = (static_ipcache_t *)malloc(sizeof(static_ipcache_t));
-    memcpy(&(ent->prefix), prefix, sizeof(prefix_t));
-    ent->pnode = pnode;
+static inline static_ipcache_entry_t *find_static_cached(
+        static_ipcache_t *cache, static_ipcache_set_t *set, int family,
+        uint8_t *addr, int addrlen) {
 
-    HASH_ADD_KEYPTR(hh, loc->staticcache, &(ent->prefix), sizeof(prefix_t),
-            ent);
+    static_ipcache_entry_t *ent;
+    int i;
 
-    if (HASH_COUNT(loc->staticcache) >= 1000000) {
-        HASH_ITER(hh, loc->staticcache, ent, tmp) {
-            HASH_DELETE(hh, loc->staticcache, ent);
-            free(ent);
-            break;
+    for (i = 0; i < STATIC_IPCACHE_WAYS; i++) {
+        ent = &(set->ways[i]);
+        if (ent->generation != cache->generation || ent->family != family) {
+            continue;
         }
+        if (memcmp(ent->addr, addr, addrlen) != 0) {
+            continue;
+        }
+
+        /* The other way is now the least recently used one */
+        set->lru = (i + 1) % STATIC_IPCACHE_WAYS;
+        return ent;
     }
-    return 0;
+    return NULL;
 }
 
-static inline int lookup_static_ranges(struct sockaddr *cmp,
-        int family, libtrace_packet_t *pkt, uint8_t dir,
-        colthread_local_t *loc, struct timeval *tv) {
+static void add_static_cached_match(static_ipcache_entry_t *ent,
+        staticipsession_t *sess) {
 
-    int matched = 0;
-    patricia_node_t *pnode = NULL;
-    prefix_t prefix;
-    openli_export_recv_t *msg;
-    static_ipcache_t *cached = NULL;
+    int i;
 
-    memset(&prefix, 0, sizeof(prefix_t));
+    /* A session can be reachable through more than one prefix covering
+     * the same address, but should only be intercepted once */
+    for (i = 0; i < ent->matchcount; i++) {
+        if (ent->matches[i] == sess) {
+            return;
+        }
+    }
 
-    if (family == AF_INET) {
-        struct sockaddr_in *in = (struct sockaddr_in *)cmp;
-        memcpy(&(prefix.add.sin), &(in->sin_addr), 4);
-        prefix.bitlen = 32;
-        prefix.family = AF_INET;
-        prefix.ref_count = 0;
-    } else {
-        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)cmp;
-        memcpy(&(prefix.add.sin6), &(in6->sin6_addr), 16);
-        prefix.bitlen = 128;
-        prefix.family = AF_INET6;
-        prefix.ref_count = 0;
+    if (ent->matchcount == ent->matchalloced) {
+        ent->matchalloced += 4;
+        ent->matches = (staticipsession_t **)realloc(ent->matches,
+                sizeof(staticipsession_t *) * ent->matchalloced);
+    }
+    ent->matches[ent->matchcount] = sess;
+    ent->matchcount ++;
+}
+
+static static_ipcache_entry_t *add_static_cached(static_ipcache_t *cache,
+        static_ipcache_set_t *set, prefix_t *prefix, uint8_t *addr,
+        int addrlen, colthread_local_t *loc) {
+
+    static_ipcache_entry_t *ent;
+    patricia_node_t *pnode = NULL;
+    int i;
+
+    /* Prefer an entry that is empty or stale, otherwise evict the least
+     * recently used way */
+    ent = &(set->ways[set->lru]);
+    for (i = 0; i < STATIC_IPCACHE_WAYS; i++) {
+        if (set->ways[i].generation != cache->generation) {
+            ent = &(set->ways[i]);
+            break;
+        }
     }
+    set->lru = ((ent - set->ways) + 1) % STATIC_IPCACHE_WAYS;
 
+    ent->family = prefix->family;
+    memset(ent->addr, 0, sizeof(ent->addr));
+    memcpy(ent->addr, addr, addrlen);
+    ent->generation = cache->generation;
+    ent->matchcount = 0;
 
-    //cached = find_static_cached(&prefix, loc);
-    if (cached) {
-        pnode = cached->pnode;
+    if (prefix->family == AF_INET) {
+        pnode = patricia_search_best2(loc->staticv4ranges, prefix, 1);
     } else {
-        if (family == AF_INET) {
-            pnode = patricia_search_best2(loc->staticv4ranges, &prefix, 1);
-        } else {
-            pnode = patricia_search_best2(loc->staticv6ranges, &prefix, 1);
-        }
-        //add_static_cached(&prefix, pnode, loc);
+        pnode = patricia_search_best2(loc->staticv6ranges, prefix, 1);
     }
 
+    /* Flatten the prefix and all of its covering prefixes into a single
+     * list of sessions, so subsequent packets for this address don't need
+     * to go anywhere near the trees */
     while (pnode) {
         liid_set_t **all, *sliid, *tmp2;
 
@@ -128,92 +182,132 @@ static inline int lookup_static_ranges(struct sockaddr *cmp,
                 logger(LOG_INFO,
                         "OpenLI: matched an IP range for intercept %s but this is not present in activestaticintercepts",
                         sliid->key);
-            } else {
-                if (matchsess->common.tomediate ==
-                        OPENLI_INTERCEPT_OUTPUTS_IRIONLY) {
-                    continue;
-                }
-
-                if (tv->tv_sec < matchsess->common.tostart_time) {
-                    continue;
-                }
-
-                if (matchsess->common.toend_time > 0 &&
-                        tv->tv_sec >= matchsess->common.toend_time) {
-                    continue;
-                }
-
-                matched ++;
-                msg = create_ipcc_job(matchsess->cin, matchsess->common.liid,
-                        matchsess->common.destid, pkt, dir);
-                publish_openli_msg(loc->zmq_pubsocks[0], msg);  //FIXME
+                continue;
             }
+            add_static_cached_match(ent, matchsess);
         }
         pnode = pnode->parent;
     }
-    return matched;
+
+    return ent;
 }
 
-static void singlev6_conn_contents(struct sockaddr_in6 *cmp,
-        colthread_local_t *loc, int *matched, libtrace_packet_t *pkt,
-        struct timeval *tv) {
+static inline int lookup_static_ranges(struct sockaddr *cmp,
+        int family, libtrace_packet_t *pkt, uint8_t dir,
+        colthread_local_t *loc, struct timeval *tv) {
 
-    patricia_node_t *pnode = NULL;
+    int matched = 0, i, addrlen;
     prefix_t prefix;
     openli_export_recv_t *msg;
-    ipv6_target_t *tgt;
-    ipsession_t *sess, *tmp;
+    static_ipcache_t *cache = loc->staticcache;
+    static_ipcache_set_t *set;
+    static_ipcache_entry_t *cached = NULL;
+    uint8_t *addr;
 
-    memset(&prefix, 0, sizeof(prefix_t));
-    memcpy(&(prefix.add.sin6), &(cmp->sin6_addr), 16);
-    prefix.bitlen = 128;
-    prefix.family = AF_INET6;
-    prefix.ref_count = 0;
+    if (family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in *)cmp;
+        addr = (uint8_t *)&(in->sin_addr);
+        addrlen = 4;
+    } else {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)cmp;
+        addr = (uint8_t *)&(in6->sin6_addr);
+        addrlen = 16;
+    }
 
-    pnode = patricia_search_best2(loc->dynamicv6ranges, &prefix, 1);
+    set = &(cache->sets[hash_static_cache_addr(addr, addrlen) %
+            STATIC_IPCACHE_SETS]);
 
-    while (pnode) {
-        liid_set_t **all, *sliid, *tmp2;
+    cached = find_static_cached(cache, set, family, addr, addrlen);
+    if (!cached) {
+        memset(&prefix, 0, sizeof(prefix_t));
+        if (family == AF_INET) {
+            memcpy(&(prefix.add.sin), addr, 4);
+            prefix.bitlen = 32;
+        } else {
+            memcpy(&(prefix.add.sin6), addr, 16);
+            prefix.bitlen = 128;
+        }
+        prefix.family = family;
+        prefix.ref_count = 0;
 
-        all = (liid_set_t **)(&(pnode->data));
-        HASH_ITER(hh, *all, sliid, tmp2) {
-            HASH_FIND(hh, loc->activeipv6intercepts, sliid->key, sliid->keylen,
-                    tgt);
-            if (!tgt) {
-                logger(LOG_INFO,
-                        "OpenLI: matched an IPv6 range for intercept %s but this intercept is not present in activeipv6intercepts?",
-                        sliid->key);
-            } else {
-                HASH_ITER(hh, tgt->intercepts, sess, tmp) {
-                    if (sess->common.tomediate ==
-                            OPENLI_INTERCEPT_OUTPUTS_IRIONLY) {
-                        continue;
-                    }
-
-                    if (tv->tv_sec < sess->common.tostart_time) {
-                        continue;
-                    }
-
-                    if (sess->common.toend_time > 0 && tv->tv_sec >=
-                            sess->common.toend_time) {
-                        continue;
-                    }
-
-                    *matched = ((*matched) + 1);
-                    msg = create_ipcc_job(sess->cin, sess->common.liid,
-                            sess->common.destid, pkt, 0);
-                    if (sess->accesstype == INTERNET_ACCESS_TYPE_MOBILE && msg)
-                    {
-                        msg->type = OPENLI_EXPORT_UMTSCC;
-                    }
-                    if (msg != NULL) {
-                        publish_openli_msg(loc->zmq_pubsocks[0], msg);  //FIXME
-                    }
-                }
-            }
+        cached = add_static_cached(cache, set, &prefix, addr, addrlen, loc);
+    }
+
+    for (i = 0; i < cached->matchcount; i++) {
+        staticipsession_t *matchsess = cached->matches[i];
+
+        if (matchsess->common.tomediate == OPENLI_INTERCEPT_OUTPUTS_IRIONLY) {
+            continue;
+        }
+
+        if (tv->tv_sec < matchsess->common.tostart_time) {
+            continue;
+        }
+
+        if (matchsess->common.toend_time > 0 &&
+                tv->tv_sec >= matchsess->common.toend_time) {
+            continue;
+        }
+
+        matched ++;
+        msg = create_ipcc_job(matchsess->cin, matchsess->common.liid,
+                matchsess->common.destid, pkt, dir);
+        publish_openli_msg_batched(loc->zmq_pubsocks[0],
+                &(loc->pubbatch), msg);  //FIXME
+    }
+    return matched;
+}
+
+/** Publishes an IPCC job for every session in the shared session index
+ *  that matches the given address.
+ *
+ *  @return the number of sessions that matched.
+ */
+static int lookup_session_index(colthread_local_t *loc, int family,
+        const uint8_t *addr, libtrace_packet_t *pkt, uint8_t dir,
+        struct timeval *tv) {
+
+    session_index_iter_t iter;
+    ipsession_t *sess;
+    openli_export_recv_t *msg;
+    int matched = 0;
+
+    session_index_enter(loc->sessionindex, loc->sessreader);
+    sess = session_index_first(loc->sessionindex, &iter, family, addr);
+    for (; sess != NULL; sess = session_index_next(&iter)) {
+        if (sess->common.tomediate == OPENLI_INTERCEPT_OUTPUTS_IRIONLY) {
+            continue;
+        }
+        if (tv->tv_sec < sess->common.tostart_time) {
+            continue;
+        }
+
+        if (sess->common.toend_time > 0 && tv->tv_sec >=
+                sess->common.toend_time) {
+            continue;
+        }
+
+        matched ++;
+        msg = create_ipcc_job(sess->cin, sess->common.liid,
+                sess->common.destid, pkt, dir);
+        if (sess->accesstype == INTERNET_ACCESS_TYPE_MOBILE && msg) {
+            msg->type = OPENLI_EXPORT_UMTSCC;
+        }
+        if (msg != NULL) {
+            publish_openli_msg_batched(loc->zmq_pubsocks[0],
+                    &(loc->pubbatch), msg);  //FIXME
         }
-        pnode = pnode->parent;
     }
+    session_index_exit(loc->sessreader);
+    return matched;
+}
+
+static void singlev6_conn_contents(struct sockaddr_in6 *cmp,
+        colthread_local_t *loc, int *matched, libtrace_packet_t *pkt,
+        struct timeval *tv) {
+
+    *matched += lookup_session_index(loc, AF_INET6, cmp->sin6_addr.s6_addr,
+            pkt, 0, tv);
 }
 
 int ipv6_comm_contents(libtrace_packet_t *pkt, packet_info_t *pinfo,
@@ -250,10 +344,7 @@ int ipv4_comm_contents(libtrace_packet_t *pkt, packet_info_t *pinfo,
         libtrace_ip_t *ip, uint32_t rem, colthread_local_t *loc) {
 
     struct sockaddr_in *cmp;
-    openli_export_recv_t *msg;
     int matched = 0;
-    ipv4_target_t *tgt;
-    ipsession_t *sess, *tmp;
 
     if (rem < sizeof(libtrace_ip_t)) {
         /* Truncated IP header */
@@ -266,64 +357,12 @@ int ipv4_comm_contents(libtrace_packet_t *pkt, packet_info_t *pinfo,
      */
 
     cmp = (struct sockaddr_in *)(&pinfo->srcip);
-    HASH_FIND(hh, loc->activeipv4intercepts, &(cmp->sin_addr.s_addr),
-            sizeof(cmp->sin_addr.s_addr), tgt);
-
-    if (tgt) {
-        HASH_ITER(hh, tgt->intercepts, sess, tmp) {
-            if (sess->common.tomediate == OPENLI_INTERCEPT_OUTPUTS_IRIONLY) {
-                continue;
-            }
-            if (pinfo->tv.tv_sec < sess->common.tostart_time) {
-                continue;
-            }
-
-            if (sess->common.toend_time > 0 && pinfo->tv.tv_sec >=
-                    sess->common.toend_time) {
-                continue;
-            }
-
-            matched ++;
-            msg = create_ipcc_job(sess->cin, sess->common.liid,
-                    sess->common.destid, pkt, 0);
-            if (sess->accesstype == INTERNET_ACCESS_TYPE_MOBILE && msg) {
-                msg->type = OPENLI_EXPORT_UMTSCC;
-            }
-            if (msg != NULL) {
-                publish_openli_msg(loc->zmq_pubsocks[0], msg);  //FIXME
-            }
-        }
-    }
+    matched += lookup_session_index(loc, AF_INET,
+            (uint8_t *)&(cmp->sin_addr.s_addr), pkt, 0, &pinfo->tv);
 
     cmp = (struct sockaddr_in *)(&pinfo->destip);
-    HASH_FIND(hh, loc->activeipv4intercepts, &(cmp->sin_addr.s_addr),
-            sizeof(cmp->sin_addr.s_addr), tgt);
-
-    if (tgt) {
-        HASH_ITER(hh, tgt->intercepts, sess, tmp) {
-            if (sess->common.tomediate == OPENLI_INTERCEPT_OUTPUTS_IRIONLY) {
-                continue;
-            }
-            if (pinfo->tv.tv_sec < sess->common.tostart_time) {
-                continue;
-            }
-
-            if (sess->common.toend_time > 0 && pinfo->tv.tv_sec >=
-                    sess->common.toend_time) {
-                continue;
-            }
-
-            matched ++;
-            msg = create_ipcc_job(sess->cin, sess->common.liid,
-                    sess->common.destid, pkt, 1);
-            if (sess->accesstype == INTERNET_ACCESS_TYPE_MOBILE && msg) {
-                msg->type = OPENLI_EXPORT_UMTSCC;
-            }
-            if (msg != NULL) {
-                publish_openli_msg(loc->zmq_pubsocks[0], msg);  //FIXME
-            }
-        }
-    }
+    matched += lookup_session_index(loc, AF_INET,
+            (uint8_t *)&(cmp->sin_addr.s_addr), pkt, 1, &pinfo->tv);
 
     if (loc->staticv4ranges == NULL) {
         goto ipv4ccdone;
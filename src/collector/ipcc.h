@@ -35,6 +35,10 @@ int ipv4_comm_contents(libtrace_packet_t *pkt, packet_info_t *pinfo,
 int ipv6_comm_contents(libtrace_packet_t *pkt, packet_info_t *pinfo,
         libtrace_ip6_t *ip, uint32_t rem, colthread_local_t *loc);
 
+static_ipcache_t *create_static_ipcache(void);
+void invalidate_static_ipcache(static_ipcache_t *cache);
+void destroy_static_ipcache(static_ipcache_t *cache);
+
 #endif
 
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -329,8 +329,7 @@ static inline void finish_ipiri_job(collector_sync_t *sync,
     pthread_mutex_lock(sync->glob->stats_mutex);
     sync->glob->stats->ipiri_created ++;
     pthread_mutex_unlock(sync->glob->stats_mutex);
-    publish_openli_msg(sync->zmq_pubsocks[ipint->common.seqtrackerid],
-            irimsg);
+    publish_sync_iri(sync, ipint->common.seqtrackerid, irimsg);
 }
 
 static inline openli_export_recv_t *_create_ipiri_job_basic(
@@ -413,7 +412,7 @@ int create_ipiri_job_from_iprange(collector_sync_t *sync,
     pthread_mutex_lock(sync->glob->stats_mutex);
     sync->glob->stats->ipiri_created ++;
     pthread_mutex_unlock(sync->glob->stats_mutex);
-    publish_openli_msg(sync->zmq_pubsocks[ipint->common.seqtrackerid], irimsg);
+    publish_sync_iri(sync, ipint->common.seqtrackerid, irimsg);
     free(prefix);
     return 0;
 }
@@ -149,7 +149,8 @@ static inline int generic_mm_comm_contents(int family, libtrace_packet_t *pkt,
             msg = create_ipcc_job(rtp->cin, rtp->common.liid,
                     rtp->common.destid, pkt, ETSI_DIR_FROM_TARGET);
             msg->type = OPENLI_EXPORT_IPMMCC;
-            publish_openli_msg(loc->zmq_pubsocks[0], msg); // FIXME
+            publish_openli_msg_batched(loc->zmq_pubsocks[0],
+                    &(loc->pubbatch), msg); // FIXME
             matched ++;
             continue;
         }
@@ -162,7 +163,8 @@ static inline int generic_mm_comm_contents(int family, libtrace_packet_t *pkt,
             msg = create_ipcc_job(rtp->cin, rtp->common.liid,
                     rtp->common.destid, pkt, ETSI_DIR_TO_TARGET);
             msg->type = OPENLI_EXPORT_IPMMCC;
-            publish_openli_msg(loc->zmq_pubsocks[0], msg); // FIXME
+            publish_openli_msg_batched(loc->zmq_pubsocks[0],
+                    &(loc->pubbatch), msg); // FIXME
             matched ++;
             continue;
         }
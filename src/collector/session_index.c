@@ -0,0 +1,626 @@
+/*
+ *
+ * Copyright (c) 2018-2022 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "logger.h"
+#include "util.h"
+#include "session_index.h"
+
+/* Writers (i.e. the sync thread) publish changes to the index using
+ * atomic pointer stores, so a reader will either see the old version of
+ * a hash chain or the new one. Anything that is unlinked from the index is
+ * placed on a retired list, tagged with the epoch at the time it was
+ * unlinked, and is only freed once every reader that might have seen it
+ * has exited the index.
+ */
+
+#define SESSION_INDEX_INITIAL_BUCKETS 1024
+
+struct retired_index_object {
+    uint64_t epoch;
+    indexed_ipsession_t *node;
+    uint8_t freesess;
+    session_index_table_t *table;
+    retired_index_object_t *next;
+};
+
+static inline uint32_t hash_session_key(uint8_t family, uint8_t prefixlen,
+        const uint8_t *addr) {
+
+    if (family == AF_INET) {
+        return hashlittle(addr, 4, 32);
+    }
+    return hashlittle(addr, 16, prefixlen);
+}
+
+static inline int session_key_matches(indexed_ipsession_t *node,
+        uint8_t family, uint8_t prefixlen, const uint8_t *addr) {
+
+    if (node->family != family || node->prefixlen != prefixlen) {
+        return 0;
+    }
+    if (family == AF_INET) {
+        return (memcmp(node->addr, addr, 4) == 0);
+    }
+    return (memcmp(node->addr, addr, 16) == 0);
+}
+
+static inline void mask_v6_address(uint8_t *dst, const uint8_t *src,
+        uint8_t prefixlen) {
+
+    int i;
+    uint8_t bits;
+
+    for (i = 0; i < 16; i++) {
+        if (prefixlen >= 8) {
+            dst[i] = src[i];
+            prefixlen -= 8;
+        } else if (prefixlen > 0) {
+            bits = prefixlen;
+            dst[i] = src[i] & (uint8_t)(0xff << (8 - bits));
+            prefixlen = 0;
+        } else {
+            dst[i] = 0;
+        }
+    }
+}
+
+/** Derives the index key (family, prefix length and masked address) for
+ *  an IP session.
+ *
+ *  @return -1 if the session does not have a usable IP, 0 otherwise.
+ */
+static int derive_session_key(ipsession_t *sess, uint8_t *family,
+        uint8_t *prefixlen, uint8_t *addr) {
+
+    memset(addr, 0, 16);
+
+    if (sess->targetip == NULL) {
+        return -1;
+    }
+
+    if (sess->ai_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)(sess->targetip);
+
+        *family = AF_INET;
+        *prefixlen = 32;
+        memcpy(addr, &(sin->sin_addr.s_addr), 4);
+        return 0;
+    }
+
+    if (sess->ai_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)(sess->targetip);
+
+        *family = AF_INET6;
+        *prefixlen = sess->prefixlen > 128 ? 128 : sess->prefixlen;
+        mask_v6_address(addr, sin6->sin6_addr.s6_addr, *prefixlen);
+        return 0;
+    }
+
+    logger(LOG_INFO, "OpenLI: invalid address family for IP session: %d",
+            sess->ai_family);
+    return -1;
+}
+
+static session_index_table_t *create_index_table(uint32_t buckets) {
+    session_index_table_t *table;
+
+    table = calloc(1, sizeof(session_index_table_t));
+    table->buckets = calloc(buckets, sizeof(indexed_ipsession_t *));
+    table->mask = buckets - 1;
+    return table;
+}
+
+openli_session_index_t *create_session_index(void) {
+    openli_session_index_t *index;
+
+    index = calloc(1, sizeof(openli_session_index_t));
+    index->table = create_index_table(SESSION_INDEX_INITIAL_BUCKETS);
+
+    /* Readers use an epoch of zero to indicate that they are idle */
+    index->epoch = 1;
+    return index;
+}
+
+static void free_retired_objects(openli_session_index_t *index,
+        uint64_t before) {
+
+    retired_index_object_t *r, *prev = NULL, *nextr;
+
+    r = index->retired;
+    while (r) {
+        nextr = r->next;
+        if (r->epoch >= before) {
+            prev = r;
+            r = nextr;
+            continue;
+        }
+
+        if (r->node) {
+            if (r->freesess) {
+                free_single_ipsession(r->node->sess);
+            }
+            free(r->node);
+        }
+        if (r->table) {
+            free(r->table->buckets);
+            free(r->table);
+        }
+        free(r);
+
+        if (prev) {
+            prev->next = nextr;
+        } else {
+            index->retired = nextr;
+        }
+        r = nextr;
+    }
+}
+
+void destroy_session_index(openli_session_index_t *index) {
+    session_index_table_t *table;
+    indexed_ipsession_t *node, *nextnode;
+    session_index_reader_t *reader, *nextreader;
+    uint32_t i;
+
+    if (index == NULL) {
+        return;
+    }
+
+    /* All of the readers should have stopped by now */
+    free_retired_objects(index, UINT64_MAX);
+
+    table = index->table;
+    for (i = 0; i <= table->mask; i++) {
+        node = table->buckets[i];
+        while (node) {
+            nextnode = node->next;
+            free_single_ipsession(node->sess);
+            free(node);
+            node = nextnode;
+        }
+    }
+    free(table->buckets);
+    free(table);
+
+    reader = index->readers;
+    while (reader) {
+        nextreader = reader->next;
+        free(reader);
+        reader = nextreader;
+    }
+    free(index);
+}
+
+session_index_reader_t *session_index_register_reader(
+        openli_session_index_t *index) {
+
+    session_index_reader_t *reader;
+    uint8_t unused;
+
+    /* Re-use the state from a thread that has since stopped, if we can */
+    reader = __atomic_load_n(&(index->readers), __ATOMIC_ACQUIRE);
+    while (reader) {
+        unused = 0;
+        if (__atomic_compare_exchange_n(&(reader->inuse), &unused, 1, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return reader;
+        }
+        reader = reader->next;
+    }
+
+    if (posix_memalign((void **)&reader, 64,
+            sizeof(session_index_reader_t)) != 0) {
+        logger(LOG_INFO, "OpenLI: out of memory while registering session index reader");
+        exit(1);
+    }
+    memset(reader, 0, sizeof(session_index_reader_t));
+    reader->inuse = 1;
+
+    reader->next = __atomic_load_n(&(index->readers), __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&(index->readers), &(reader->next),
+            reader, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return reader;
+}
+
+void session_index_release_reader(session_index_reader_t *reader) {
+    if (reader == NULL) {
+        return;
+    }
+    __atomic_store_n(&(reader->active), 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&(reader->inuse), 0, __ATOMIC_RELEASE);
+}
+
+static void retire_index_object(openli_session_index_t *index,
+        indexed_ipsession_t *node, uint8_t freesess,
+        session_index_table_t *table) {
+
+    retired_index_object_t *r;
+
+    r = calloc(1, sizeof(retired_index_object_t));
+    r->epoch = __atomic_load_n(&(index->epoch), __ATOMIC_RELAXED);
+    r->node = node;
+    r->freesess = freesess;
+    r->table = table;
+    r->next = index->retired;
+    index->retired = r;
+}
+
+/** Frees any retired objects that can no longer be in use by a reader. */
+static void reclaim_retired_objects(openli_session_index_t *index) {
+
+    session_index_reader_t *reader;
+    uint64_t oldest = UINT64_MAX, active;
+
+    if (index->retired == NULL) {
+        return;
+    }
+
+    /* Readers that enter after this point will not be able to see
+     * anything that has already been retired.
+     */
+    __atomic_add_fetch(&(index->epoch), 1, __ATOMIC_SEQ_CST);
+
+    reader = __atomic_load_n(&(index->readers), __ATOMIC_ACQUIRE);
+    while (reader) {
+        active = __atomic_load_n(&(reader->active), __ATOMIC_SEQ_CST);
+        if (active != 0 && active < oldest) {
+            oldest = active;
+        }
+        reader = reader->next;
+    }
+
+    free_retired_objects(index, oldest);
+}
+
+void session_index_reclaim(openli_session_index_t *index) {
+    if (index == NULL) {
+        return;
+    }
+    reclaim_retired_objects(index);
+}
+
+/** Rebuilds the index with twice as many buckets. Readers may still be
+ *  walking the old table, so it is retired rather than freed.
+ */
+static void grow_session_index(openli_session_index_t *index) {
+
+    session_index_table_t *oldt, *newt;
+    indexed_ipsession_t *node, *copy;
+    uint32_t i, b;
+
+    oldt = index->table;
+    newt = create_index_table((oldt->mask + 1) * 2);
+
+    for (i = 0; i <= oldt->mask; i++) {
+        for (node = oldt->buckets[i]; node; node = node->next) {
+            copy = malloc(sizeof(indexed_ipsession_t));
+            memcpy(copy, node, sizeof(indexed_ipsession_t));
+
+            b = hash_session_key(copy->family, copy->prefixlen, copy->addr)
+                    & newt->mask;
+            copy->next = newt->buckets[b];
+            newt->buckets[b] = copy;
+        }
+    }
+
+    __atomic_store_n(&(index->table), newt, __ATOMIC_RELEASE);
+
+    for (i = 0; i <= oldt->mask; i++) {
+        for (node = oldt->buckets[i]; node; node = node->next) {
+            retire_index_object(index, node, 0, NULL);
+        }
+    }
+    retire_index_object(index, NULL, 0, oldt);
+}
+
+/** Finds the link that points to the session with the same key and stream
+ *  key as the given session, i.e. either the bucket itself or the next
+ *  pointer of the preceding session.
+ */
+static indexed_ipsession_t **find_index_link(openli_session_index_t *index,
+        uint8_t family, uint8_t prefixlen, uint8_t *addr,
+        const char *streamkey) {
+
+    session_index_table_t *table = index->table;
+    indexed_ipsession_t **link;
+    uint32_t b;
+
+    b = hash_session_key(family, prefixlen, addr) & table->mask;
+    link = &(table->buckets[b]);
+
+    while (*link) {
+        if (session_key_matches(*link, family, prefixlen, addr) &&
+                strcmp((*link)->sess->streamkey, streamkey) == 0) {
+            return link;
+        }
+        link = &((*link)->next);
+    }
+    return NULL;
+}
+
+static inline void set_v6_prefix_bit(openli_session_index_t *index,
+        uint8_t prefixlen, int present) {
+
+    uint64_t word = index->v6prefixes[prefixlen / 64];
+
+    if (present) {
+        word |= (1ULL << (prefixlen % 64));
+    } else {
+        word &= ~(1ULL << (prefixlen % 64));
+    }
+    __atomic_store_n(&(index->v6prefixes[prefixlen / 64]), word,
+            __ATOMIC_RELEASE);
+}
+
+int session_index_add(openli_session_index_t *index, ipsession_t *sess) {
+
+    indexed_ipsession_t *node, **link;
+    session_index_table_t *table;
+    uint32_t b;
+
+    node = calloc(1, sizeof(indexed_ipsession_t));
+    if (node == NULL) {
+        logger(LOG_INFO,
+                "OpenLI: ran out of memory while indexing IP session.");
+        free_single_ipsession(sess);
+        return -1;
+    }
+    if (derive_session_key(sess, &(node->family), &(node->prefixlen),
+            node->addr) < 0) {
+        free(node);
+        free_single_ipsession(sess);
+        return -1;
+    }
+    node->sess = sess;
+
+    link = find_index_link(index, node->family, node->prefixlen, node->addr,
+            sess->streamkey);
+    if (link) {
+        logger(LOG_INFO, "OpenLI: encountered duplicate stream key '%s' in session index -- replacing...", sess->streamkey);
+        node->next = (*link)->next;
+        retire_index_object(index, *link, 1, NULL);
+        __atomic_store_n(link, node, __ATOMIC_RELEASE);
+        reclaim_retired_objects(index);
+        return 0;
+    }
+
+    if (node->family == AF_INET6) {
+        if (index->v6prefixcounts[node->prefixlen] == 0) {
+            set_v6_prefix_bit(index, node->prefixlen, 1);
+        }
+        index->v6prefixcounts[node->prefixlen] ++;
+    }
+
+    table = index->table;
+    b = hash_session_key(node->family, node->prefixlen, node->addr) &
+            table->mask;
+    node->next = table->buckets[b];
+    __atomic_store_n(&(table->buckets[b]), node, __ATOMIC_RELEASE);
+    index->entries ++;
+
+    if (index->entries > (table->mask + 1) * 2) {
+        grow_session_index(index);
+    }
+    reclaim_retired_objects(index);
+    return 0;
+}
+
+int session_index_update(openli_session_index_t *index, ipsession_t *sess) {
+
+    indexed_ipsession_t *node, **link;
+
+    node = calloc(1, sizeof(indexed_ipsession_t));
+    if (node == NULL) {
+        logger(LOG_INFO,
+                "OpenLI: ran out of memory while updating IP session index.");
+        free_single_ipsession(sess);
+        return -1;
+    }
+    if (derive_session_key(sess, &(node->family), &(node->prefixlen),
+            node->addr) < 0) {
+        free(node);
+        free_single_ipsession(sess);
+        return 0;
+    }
+
+    link = find_index_link(index, node->family, node->prefixlen, node->addr,
+            sess->streamkey);
+    if (link == NULL) {
+        free(node);
+        free_single_ipsession(sess);
+        return 0;
+    }
+
+    node->sess = sess;
+    node->next = (*link)->next;
+    retire_index_object(index, *link, 1, NULL);
+    __atomic_store_n(link, node, __ATOMIC_RELEASE);
+    reclaim_retired_objects(index);
+    return 1;
+}
+
+int session_index_remove(openli_session_index_t *index, ipsession_t *sess) {
+
+    indexed_ipsession_t *found, **link;
+    uint8_t family, prefixlen;
+    uint8_t addr[16];
+
+    if (derive_session_key(sess, &family, &prefixlen, addr) < 0) {
+        return 0;
+    }
+
+    link = find_index_link(index, family, prefixlen, addr, sess->streamkey);
+    if (link == NULL) {
+        return 0;
+    }
+
+    found = *link;
+    __atomic_store_n(link, found->next, __ATOMIC_RELEASE);
+    retire_index_object(index, found, 1, NULL);
+    index->entries --;
+
+    if (family == AF_INET6) {
+        index->v6prefixcounts[prefixlen] --;
+        if (index->v6prefixcounts[prefixlen] == 0) {
+            set_v6_prefix_bit(index, prefixlen, 0);
+        }
+    }
+
+    reclaim_retired_objects(index);
+    return 1;
+}
+
+/** Searches the hash chain for the iterator's current key, starting from
+ *  iter->cur.
+ */
+static ipsession_t *walk_index_chain(session_index_iter_t *iter,
+        const uint8_t *key) {
+
+    while (iter->cur) {
+        if (session_key_matches(iter->cur, iter->family,
+                (uint8_t)iter->prefixlen, key)) {
+            return iter->cur->sess;
+        }
+        iter->cur = __atomic_load_n(&(iter->cur->next), __ATOMIC_ACQUIRE);
+    }
+    return NULL;
+}
+
+/** Finds the longest IPv6 prefix length in the bitmap that is shorter
+ *  than 'below'.
+ *
+ *  @return the prefix length, or -1 if there are no more prefix lengths.
+ */
+static inline int next_v6_prefixlen(uint64_t *bitmap, int below) {
+
+    int p = below - 1;
+    uint64_t word;
+
+    while (p >= 0) {
+        word = bitmap[p / 64];
+        if ((p % 64) != 63) {
+            word &= ((1ULL << ((p % 64) + 1)) - 1);
+        }
+        if (word) {
+            return ((p / 64) * 64) + 63 - __builtin_clzll(word);
+        }
+        p = ((p / 64) * 64) - 1;
+    }
+    return -1;
+}
+
+/** Moves the iterator on to the next IPv6 prefix length (in descending
+ *  order) that is present in the index and has a matching session.
+ */
+static ipsession_t *next_v6_prefix(session_index_iter_t *iter) {
+
+    uint8_t key[16];
+    uint32_t b;
+    ipsession_t *found;
+
+    while ((iter->prefixlen = next_v6_prefixlen(iter->v6prefixes,
+                    iter->prefixlen)) >= 0) {
+
+        mask_v6_address(key, iter->addr, iter->prefixlen);
+        b = hash_session_key(AF_INET6, iter->prefixlen, key) &
+                iter->table->mask;
+        iter->cur = __atomic_load_n(&(iter->table->buckets[b]),
+                __ATOMIC_ACQUIRE);
+
+        found = walk_index_chain(iter, key);
+        if (found) {
+            return found;
+        }
+    }
+    return NULL;
+}
+
+ipsession_t *session_index_first(openli_session_index_t *index,
+        session_index_iter_t *iter, int family, const uint8_t *addr) {
+
+    uint32_t b;
+    int i;
+
+    iter->table = __atomic_load_n(&(index->table), __ATOMIC_ACQUIRE);
+    iter->family = family;
+    iter->cur = NULL;
+
+    if (family == AF_INET) {
+        memset(iter->addr, 0, 16);
+        memcpy(iter->addr, addr, 4);
+        iter->prefixlen = 32;
+
+        b = hash_session_key(AF_INET, 32, iter->addr) & iter->table->mask;
+        iter->cur = __atomic_load_n(&(iter->table->buckets[b]),
+                __ATOMIC_ACQUIRE);
+        return walk_index_chain(iter, iter->addr);
+    }
+
+    if (family != AF_INET6) {
+        return NULL;
+    }
+
+    memcpy(iter->addr, addr, 16);
+    for (i = 0; i < 3; i++) {
+        iter->v6prefixes[i] = __atomic_load_n(&(index->v6prefixes[i]),
+                __ATOMIC_ACQUIRE);
+    }
+    iter->prefixlen = 129;
+    return next_v6_prefix(iter);
+}
+
+ipsession_t *session_index_next(session_index_iter_t *iter) {
+
+    uint8_t key[16];
+    ipsession_t *found;
+
+    if (iter->cur == NULL) {
+        return NULL;
+    }
+
+    iter->cur = __atomic_load_n(&(iter->cur->next), __ATOMIC_ACQUIRE);
+
+    if (iter->family == AF_INET) {
+        return walk_index_chain(iter, iter->addr);
+    }
+
+    mask_v6_address(key, iter->addr, iter->prefixlen);
+    found = walk_index_chain(iter, key);
+    if (found) {
+        return found;
+    }
+    return next_v6_prefix(iter);
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
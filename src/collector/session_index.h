@@ -0,0 +1,229 @@
+/*
+ *
+ * Copyright (c) 2018-2022 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef OPENLI_COLLECTOR_SESSION_INDEX_H_
+#define OPENLI_COLLECTOR_SESSION_INDEX_H_
+
+#include <stdint.h>
+#include "intercept.h"
+
+/* A single index of the active IP sessions for all intercepts, shared by
+ * every packet processing thread.
+ *
+ * The index is only ever modified by the IP sync thread. Processing
+ * threads search it without taking any locks: each search must be wrapped
+ * in session_index_enter() and session_index_exit(), which lets the sync
+ * thread work out when it is safe to free sessions that have been removed
+ * from the index (epoch-based reclamation).
+ *
+ * Sessions in the index must be treated as read-only by the processing
+ * threads. Modifying a session is done by the sync thread replacing it
+ * with a new copy.
+ */
+
+typedef struct indexed_ipsession indexed_ipsession_t;
+
+struct indexed_ipsession {
+    /** The session itself */
+    ipsession_t *sess;
+
+    /** The address family of the session IP (AF_INET or AF_INET6) */
+    uint8_t family;
+
+    /** The prefix length for the session IP (always 32 for IPv4) */
+    uint8_t prefixlen;
+
+    /** The session IP, masked to the prefix length */
+    uint8_t addr[16];
+
+    /** The next session in the same hash bucket */
+    indexed_ipsession_t *next;
+};
+
+typedef struct session_index_table {
+    /** The number of buckets in the table, minus one */
+    uint32_t mask;
+
+    /** The hash buckets for the table */
+    indexed_ipsession_t **buckets;
+} session_index_table_t;
+
+typedef struct session_index_reader session_index_reader_t;
+
+/** Per-thread reader state. Kept on its own cache line so that readers do
+ *  not slow each other down when entering and exiting the index.
+ */
+struct session_index_reader {
+    /** The epoch when the reader entered the index, or 0 if the reader is
+     *  not currently searching the index */
+    uint64_t active;
+
+    /** Set if this reader state is owned by a thread */
+    uint8_t inuse;
+
+    session_index_reader_t *next;
+} __attribute__((aligned(64)));
+
+typedef struct retired_index_object retired_index_object_t;
+
+typedef struct openli_session_index {
+    /** The current hash table -- replaced in full when the index grows */
+    session_index_table_t *table;
+
+    /** The current epoch, incremented each time the sync thread tries to
+     *  reclaim removed sessions */
+    uint64_t epoch;
+
+    /** Bitmap of the IPv6 prefix lengths that are present in the index */
+    uint64_t v6prefixes[3];
+
+    /** All of the reader states that have been created for this index */
+    session_index_reader_t *readers;
+
+    /* The remaining fields are only used by the sync thread */
+
+    /** The number of sessions in the index */
+    uint32_t entries;
+
+    /** The number of sessions for each IPv6 prefix length */
+    uint32_t v6prefixcounts[129];
+
+    /** Objects that have been removed from the index but may still be in
+     *  use by a reader */
+    retired_index_object_t *retired;
+} openli_session_index_t;
+
+/** State for iterating over all of the sessions that match an address */
+typedef struct session_index_iter {
+    session_index_table_t *table;
+    indexed_ipsession_t *cur;
+
+    uint8_t family;
+    uint8_t addr[16];
+
+    /** The prefix length that is currently being searched */
+    int prefixlen;
+    uint64_t v6prefixes[3];
+} session_index_iter_t;
+
+openli_session_index_t *create_session_index(void);
+void destroy_session_index(openli_session_index_t *index);
+
+/** Claims a reader state for a processing thread.
+ *
+ *  @param index        The session index
+ *
+ *  @return the reader state that the thread must use when searching the
+ *          index.
+ */
+session_index_reader_t *session_index_register_reader(
+        openli_session_index_t *index);
+
+/** Returns a reader state to the index, once the thread that owns it has
+ *  stopped.
+ */
+void session_index_release_reader(session_index_reader_t *reader);
+
+/** Marks the start of a search of the index by a processing thread. Any
+ *  sessions found by the search remain valid until session_index_exit()
+ *  is called.
+ */
+static inline void session_index_enter(openli_session_index_t *index,
+        session_index_reader_t *reader) {
+
+    __atomic_store_n(&(reader->active),
+            __atomic_load_n(&(index->epoch), __ATOMIC_ACQUIRE),
+            __ATOMIC_SEQ_CST);
+
+    /* Our epoch must be visible to the sync thread before we read
+     * anything from the index, otherwise the sync thread could free
+     * something that we are about to look at. A seq_cst store on its own
+     * does not stop later loads from being reordered ahead of it.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/** Marks the end of a search of the index by a processing thread. */
+static inline void session_index_exit(session_index_reader_t *reader) {
+    __atomic_store_n(&(reader->active), 0, __ATOMIC_RELEASE);
+}
+
+/** Finds the first session in the index that matches an address.
+ *
+ *  For IPv6, sessions with a prefix that covers the address will match.
+ *
+ *  @param index        The session index
+ *  @param iter         Iterator state to use for finding further matches
+ *  @param family       The address family (AF_INET or AF_INET6)
+ *  @param addr         The address to search for, in network byte order
+ *
+ *  @return the first matching session, or NULL if there are none.
+ */
+ipsession_t *session_index_first(openli_session_index_t *index,
+        session_index_iter_t *iter, int family, const uint8_t *addr);
+
+/** Finds the next session that matches the address given to
+ *  session_index_first().
+ *
+ *  @return the next matching session, or NULL if there are no more.
+ */
+ipsession_t *session_index_next(session_index_iter_t *iter);
+
+/** Adds a session to the index. The index takes ownership of the session.
+ *
+ *  If a session with the same IP and stream key is already in the index,
+ *  it is replaced.
+ *
+ *  @return -1 if the session could not be added, 0 otherwise.
+ */
+int session_index_add(openli_session_index_t *index, ipsession_t *sess);
+
+/** Replaces the session in the index that has the same IP and stream key
+ *  as the given session. The index takes ownership of the given session.
+ *
+ *  @return 1 if a session was replaced, 0 if there was no matching session,
+ *          -1 if we ran out of memory (in both of the latter cases, the
+ *          given session is freed).
+ */
+int session_index_update(openli_session_index_t *index, ipsession_t *sess);
+
+/** Removes the session in the index that has the same IP and stream key
+ *  as the given session. The given session remains owned by the caller.
+ *
+ *  @return 1 if a session was removed, 0 if there was no matching session.
+ */
+int session_index_remove(openli_session_index_t *index, ipsession_t *sess);
+
+/** Frees any sessions that have been removed from the index and are no
+ *  longer in use by a reader. This happens automatically whenever the
+ *  index is modified, but should also be called periodically by the sync
+ *  thread so that memory is released even if there are no more updates.
+ */
+void session_index_reclaim(openli_session_index_t *index);
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -169,46 +169,61 @@ void update_intercept_time_event(Pvoid_t *timeevents, void *intercept,
 
 }
 
-void *check_intercept_time_event(Pvoid_t *timeevents, time_t currtime) {
+struct upcoming_intercept_event *collect_due_intercept_time_events(
+        Pvoid_t *timeevents, time_t currtime) {
 
     PWord_t pval;
     Word_t index;
-    struct upcoming_intercept_event *ev;
+    struct upcoming_intercept_event *ev, *evtmp, *found;
+    struct upcoming_intercept_event *due = NULL;
     upcoming_intercept_time_t *upts;
     int rcint;
-    void *toret = NULL;
 
     index = 0;
     JLF(pval, *timeevents, index);
 
     while (pval) {
         upts = (upcoming_intercept_time_t *)(*pval);
-        if (upts == NULL) {
-            JLN(pval, *timeevents, index);
-            continue;
+        if (upts != NULL && upts->timestamp > currtime) {
+            break;
         }
 
-        if (upts->timestamp > currtime) {
-            return NULL;
+        if (upts) {
+            HASH_ITER(hh, upts->events, ev, evtmp) {
+                HASH_DELETE(hh, upts->events, ev);
+
+                /* An intercept may have both its start and end time
+                 * fall due at once -- we only need one event for it, as
+                 * the handler works out what to do from the intercept's
+                 * start and end times.
+                 */
+                HASH_FIND(hh, due, ev->liid, strlen(ev->liid), found);
+                if (found) {
+                    free(ev->liid);
+                    free(ev);
+                    continue;
+                }
+                HASH_ADD_KEYPTR(hh, due, ev->liid, strlen(ev->liid), ev);
+            }
+            free(upts);
         }
 
-        ev = upts->events;
-        toret = ev->intercept;
-        HASH_DELETE(hh, upts->events, ev);
+        JLD(rcint, *timeevents, index);
+        JLF(pval, *timeevents, index);
+    }
+
+    return due;
+}
+
+void free_intercept_time_events(struct upcoming_intercept_event *events) {
+
+    struct upcoming_intercept_event *ev, *evtmp;
+
+    HASH_ITER(hh, events, ev, evtmp) {
+        HASH_DELETE(hh, events, ev);
         free(ev->liid);
         free(ev);
-
-        /* If there are no more events for this time, delete the timestamp
-         * entry entirely.
-         */
-        if (HASH_CNT(hh, upts->events) == 0) {
-            JLD(rcint, *timeevents, index);
-            free(upts);
-        }
-        return toret;
     }
-
-    return NULL;
 }
 
 void clear_intercept_time_events(Pvoid_t *timeevents) {
@@ -37,7 +37,22 @@ void remove_intercept_time_event(Pvoid_t *timeevents,
         intercept_common_t *common);
 void update_intercept_time_event(Pvoid_t *timeevents, void *intercept,
         intercept_common_t *prevcommon, intercept_common_t *newcommon);
-void *check_intercept_time_event(Pvoid_t *timeevents, time_t currtime);
+
+/** Removes all of the events that are due at or before the given time.
+ *
+ *  Events for the same intercept are merged, so each intercept appears
+ *  at most once in the returned set.
+ *
+ *  @param timeevents       The set of upcoming time events
+ *  @param currtime         The current time
+ *
+ *  @return a hash map (keyed by LIID) of all due events, or NULL if no
+ *          events are due. The caller must free the result using
+ *          free_intercept_time_events().
+ */
+struct upcoming_intercept_event *collect_due_intercept_time_events(
+        Pvoid_t *timeevents, time_t currtime);
+void free_intercept_time_events(struct upcoming_intercept_event *events);
 void clear_intercept_time_events(Pvoid_t *timeevents);
 
 #endif
@@ -66,7 +66,7 @@ int create_mobiri_job_from_session(collector_sync_t *sync,
     pthread_mutex_lock(sync->glob->stats_mutex);
     sync->glob->stats->mobiri_created ++;
     pthread_mutex_unlock(sync->glob->stats_mutex);
-    publish_openli_msg(sync->zmq_pubsocks[ipint->common.seqtrackerid], irimsg);
+    publish_sync_iri(sync, ipint->common.seqtrackerid, irimsg);
 
     return 1;
 }
@@ -110,7 +110,7 @@ int create_mobiri_job_from_packet(collector_sync_t *sync,
     pthread_mutex_lock(sync->glob->stats_mutex);
     sync->glob->stats->mobiri_created ++;
     pthread_mutex_unlock(sync->glob->stats_mutex);
-    publish_openli_msg(sync->zmq_pubsocks[ipint->common.seqtrackerid], irimsg);
+    publish_sync_iri(sync, ipint->common.seqtrackerid, irimsg);
 
     return 1;
 }
@@ -1237,6 +1237,63 @@ static int global_parser(void *arg, yaml_document_t *doc,
         }
     }
 
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "metricsport") == 0) {
+        SET_CONFIG_STRING_OPTION(glob->metricsport, value);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "metricsaddr") == 0) {
+        SET_CONFIG_STRING_OPTION(glob->metricsaddr, value);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value,
+                    "backpressurepolicy") == 0) {
+        if (strcasecmp((char *)value->data.scalar.value, "none") == 0) {
+            glob->backpressure_policy = OPENLI_BACKPRESSURE_NONE;
+        } else if (strcasecmp((char *)value->data.scalar.value,
+                    "shedcc") == 0) {
+            glob->backpressure_policy = OPENLI_BACKPRESSURE_SHED_CC;
+        } else {
+            logger(LOG_INFO, "OpenLI: unknown backpressure policy '%s', must be one of 'none' or 'shedcc'",
+                    (char *)value->data.scalar.value);
+            return -1;
+        }
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value,
+                    "backpressurelimit") == 0) {
+        uint64_t limit = strtoul((char *) value->data.scalar.value,
+                NULL, 10);
+        if (limit == 0) {
+            logger(LOG_INFO, "OpenLI: backpressure limit must be at least 1 MB, using the default of %d MB",
+                    OPENLI_BACKPRESSURE_DEFAULT_LIMIT_MB);
+            limit = OPENLI_BACKPRESSURE_DEFAULT_LIMIT_MB;
+        }
+        glob->backpressure_limit = limit * 1024 * 1024;
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "packetbatchsize") == 0) {
+        glob->packet_batch_size = strtoul((char *) value->data.scalar.value,
+                NULL, 10);
+        if (glob->packet_batch_size == 0) {
+            glob->packet_batch_size = 1;
+        }
+        if (glob->packet_batch_size > OPENLI_PUBLISH_BATCH_MAX) {
+            logger(LOG_INFO, "OpenLI: packet batch size cannot be larger than %d, using %d instead",
+                    OPENLI_PUBLISH_BATCH_MAX, OPENLI_PUBLISH_BATCH_MAX);
+            glob->packet_batch_size = OPENLI_PUBLISH_BATCH_MAX;
+        }
+    }
+
     if (key->type == YAML_SCALAR_NODE &&
             value->type == YAML_SCALAR_NODE &&
             strcmp((char *)key->data.scalar.value, "logstatfrequency") == 0) {
@@ -1262,6 +1319,12 @@ static int global_parser(void *arg, yaml_document_t *doc,
         SET_CONFIG_STRING_OPTION(glob->sslconf.cacertfile, value);
     }
 
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "ktls") == 0) {
+        glob->sslconf.ktls = check_onoff((char *)value->data.scalar.value);
+    }
+
     if (key->type == YAML_SCALAR_NODE &&
             value->type == YAML_SCALAR_NODE &&
             strcmp((char *)key->data.scalar.value, "etsitls") == 0) {
@@ -1390,6 +1453,18 @@ static int mediator_parser(void *arg, yaml_document_t *doc,
         SET_CONFIG_STRING_OPTION(state->provisioner.provaddr, value);
     }
 
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "metricsport") == 0) {
+        SET_CONFIG_STRING_OPTION(state->metricsport, value);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "metricsaddr") == 0) {
+        SET_CONFIG_STRING_OPTION(state->metricsaddr, value);
+    }
+
     if (key->type == YAML_SCALAR_NODE &&
             value->type == YAML_SCALAR_NODE &&
             strcmp((char *)key->data.scalar.value, "pcapdirectory") == 0) {
@@ -1459,6 +1534,31 @@ static int mediator_parser(void *arg, yaml_document_t *doc,
         }
     }
 
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "pcapthreads") == 0) {
+        state->pcapthreads = strtoul((char *)value->data.scalar.value,
+                NULL, 10);
+        if (state->pcapthreads == 0) {
+            logger(LOG_INFO, "OpenLI: 0 is not a valid value for the 'pcapthreads' config option.");
+            return -1;
+        }
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "logstatfrequency") == 0) {
+        state->stat_frequency = strtoul((char *)value->data.scalar.value,
+                NULL, 10);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "zerocopyhandovers") == 0) {
+        state->zerocopy_handovers = check_onoff(
+                (char *)value->data.scalar.value);
+    }
+
     if (key->type == YAML_SCALAR_NODE &&
             value->type == YAML_SCALAR_NODE &&
             strcmp((char *)key->data.scalar.value, "tlscert") == 0) {
@@ -1477,6 +1577,12 @@ static int mediator_parser(void *arg, yaml_document_t *doc,
         SET_CONFIG_STRING_OPTION(state->sslconf.cacertfile, value);
     }
 
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "ktls") == 0) {
+        state->sslconf.ktls = check_onoff((char *)value->data.scalar.value);
+    }
+
     if (key->type == YAML_SCALAR_NODE &&
             value->type == YAML_SCALAR_NODE &&
             strcmp((char *)key->data.scalar.value, "etsitls") == 0) {
@@ -1702,6 +1808,18 @@ static int provisioning_parser(void *arg, yaml_document_t *doc,
         SET_CONFIG_STRING_OPTION(state->pushaddr, value);
     }
 
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "metricsport") == 0) {
+        SET_CONFIG_STRING_OPTION(state->metricsport, value);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "metricsaddr") == 0) {
+        SET_CONFIG_STRING_OPTION(state->metricsaddr, value);
+    }
+
     if (key->type == YAML_SCALAR_NODE &&
             value->type == YAML_SCALAR_NODE &&
             strcmp((char *)key->data.scalar.value, "mediationport") == 0) {
@@ -1750,6 +1868,17 @@ static int provisioning_parser(void *arg, yaml_document_t *doc,
         SET_CONFIG_STRING_OPTION(state->restauthkey, value);
     }
 
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "restapithreads") == 0) {
+        state->restapithreads = strtoul((char *) value->data.scalar.value,
+                NULL, 10);
+        if (state->restapithreads <= 0) {
+            state->restapithreads = 1;
+            logger(LOG_INFO, "OpenLI: must have at least one thread for the REST API!");
+        }
+    }
+
     return 0;
 }
 
@@ -28,6 +28,7 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <stdlib.h>
+#include <string.h>
 #include <libtrace/linked_list.h>
 #include "coreserver.h"
 #include "logger.h"
@@ -162,4 +163,176 @@ coreserver_t *match_packet_to_coreserver(coreserver_t *serverlist,
 	return NULL;
 }
 
+static int fill_coreserver_endpoint(coreserver_endpoint_t *ep, int family,
+        void *addr, uint16_t port) {
+
+    memset(ep, 0, sizeof(coreserver_endpoint_t));
+    ep->family = family;
+    ep->port = port;
+
+    if (family == AF_INET) {
+        memcpy(ep->addr, addr, sizeof(struct in_addr));
+    } else if (family == AF_INET6) {
+        memcpy(ep->addr, addr, sizeof(struct in6_addr));
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/** Adds every server in a core server list to a classification table.
+ *
+ *  Address resolution for each server happens here, rather than when
+ *  packets are being matched. Servers whose address cannot be resolved
+ *  are removed from the list.
+ *
+ *  @param table        The classification table to add the servers to.
+ *  @param servlist     The list of core servers to add.
+ *
+ *  @return the number of servers added to the table.
+ */
+int add_coreservers_to_classifier(coreserver_class_t **table,
+        coreserver_t **servlist) {
+
+    coreserver_t *cs, *tmp;
+    coreserver_class_t *found;
+    coreserver_endpoint_t key;
+    uint32_t hashval;
+    void *addr;
+    int added = 0;
+
+    HASH_ITER(hh, *servlist, cs, tmp) {
+        if (cs->info == NULL) {
+            cs->info = populate_addrinfo(cs->ipstr, cs->portstr, SOCK_DGRAM);
+            if (!cs->info) {
+                logger(LOG_INFO,
+                        "Removing %s:%s from %s server list due to getaddrinfo error",
+                        cs->ipstr, cs->portstr,
+                        coreserver_type_to_string(cs->servertype));
+
+                HASH_DELETE(hh, *servlist, cs);
+                free_single_coreserver(cs);
+                continue;
+            }
+            if (cs->info->ai_family == AF_INET) {
+                cs->portswapped = ntohs(CS_TO_V4(cs)->sin_port);
+            } else if (cs->info->ai_family == AF_INET6) {
+                cs->portswapped = ntohs(CS_TO_V6(cs)->sin6_port);
+            }
+        }
+
+        if (cs->servertype >= OPENLI_CORE_SERVER_TYPE_COUNT) {
+            continue;
+        }
+
+        if (cs->info->ai_family == AF_INET) {
+            addr = &(CS_TO_V4(cs)->sin_addr);
+        } else if (cs->info->ai_family == AF_INET6) {
+            addr = &(CS_TO_V6(cs)->sin6_addr);
+        } else {
+            continue;
+        }
+
+        if (fill_coreserver_endpoint(&key, cs->info->ai_family, addr,
+                    cs->portswapped) < 0) {
+            continue;
+        }
+
+        HASH_FIND(hh, *table, &key, sizeof(key), found);
+        if (!found) {
+            found = (coreserver_class_t *)calloc(1,
+                    sizeof(coreserver_class_t));
+            memcpy(&(found->key), &key, sizeof(key));
+            HASH_ADD(hh, *table, key, sizeof(coreserver_endpoint_t), found);
+        }
+
+        /* Not technically an LIID, but we just need a hashed ID for the
+         * server entity. 0 is our value for "not found", so make sure we
+         * never use it...
+         */
+        hashval = hash_liid(cs->serverkey);
+        if (hashval == 0) {
+            hashval = 1;
+        }
+
+        /* If two servers of the same type share an endpoint, the first
+         * one wins -- they are indistinguishable on the wire anyway.
+         */
+        if (!(found->typemask & CORESERVER_TYPE_BIT(cs->servertype))) {
+            found->typemask |= CORESERVER_TYPE_BIT(cs->servertype);
+            found->serverhash[cs->servertype] = hashval;
+        }
+        added ++;
+    }
+    return added;
+}
+
+void free_coreserver_classifier(coreserver_class_t *table) {
+    coreserver_class_t *c, *tmp;
+
+    HASH_ITER(hh, table, c, tmp) {
+        HASH_DELETE(hh, table, c);
+        free(c);
+    }
+}
+
+/** Determines which core server types (if any) a packet is to or from,
+ *  using at most one table probe per endpoint.
+ *
+ *  @param table        The classification table to search.
+ *  @param pinfo        The addresses and ports of the packet.
+ *  @param match        Populated with the server hash for each matching
+ *                      server type.
+ *
+ *  @return a bitmask of the matching OPENLI_CORE_SERVER_* types, or 0 if
+ *          the packet does not involve any known core server.
+ */
+uint32_t classify_coreserver_packet(coreserver_class_t *table,
+        packet_info_t *pinfo, coreserver_match_t *match) {
+
+    coreserver_endpoint_t key;
+    coreserver_class_t *srcfound = NULL, *dstfound = NULL;
+    void *srcaddr, *dstaddr;
+    int i;
+
+    match->typemask = 0;
+    if (table == NULL || pinfo->srcport == 0 || pinfo->destport == 0) {
+        return 0;
+    }
+
+    if (pinfo->family == AF_INET) {
+        srcaddr = &(((struct sockaddr_in *)&(pinfo->srcip))->sin_addr);
+        dstaddr = &(((struct sockaddr_in *)&(pinfo->destip))->sin_addr);
+    } else if (pinfo->family == AF_INET6) {
+        srcaddr = &(((struct sockaddr_in6 *)&(pinfo->srcip))->sin6_addr);
+        dstaddr = &(((struct sockaddr_in6 *)&(pinfo->destip))->sin6_addr);
+    } else {
+        return 0;
+    }
+
+    fill_coreserver_endpoint(&key, pinfo->family, srcaddr, pinfo->srcport);
+    HASH_FIND(hh, table, &key, sizeof(key), srcfound);
+
+    fill_coreserver_endpoint(&key, pinfo->family, dstaddr, pinfo->destport);
+    HASH_FIND(hh, table, &key, sizeof(key), dstfound);
+
+    if (!srcfound && !dstfound) {
+        return 0;
+    }
+
+    /* Source endpoint takes precedence if both ends are core servers of
+     * the same type */
+    for (i = 0; i < OPENLI_CORE_SERVER_TYPE_COUNT; i++) {
+        if (srcfound && (srcfound->typemask & CORESERVER_TYPE_BIT(i))) {
+            match->serverhash[i] = srcfound->serverhash[i];
+        } else if (dstfound && (dstfound->typemask & CORESERVER_TYPE_BIT(i))) {
+            match->serverhash[i] = dstfound->serverhash[i];
+        } else {
+            continue;
+        }
+        match->typemask |= CORESERVER_TYPE_BIT(i);
+    }
+    return match->typemask;
+}
+
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
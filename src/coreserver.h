@@ -48,6 +48,9 @@ enum {
     OPENLI_CORE_SERVER_POP3,
 };
 
+#define OPENLI_CORE_SERVER_TYPE_COUNT (OPENLI_CORE_SERVER_POP3 + 1)
+#define CORESERVER_TYPE_BIT(t) (((uint32_t)1) << (t))
+
 typedef struct packetinfo {
     int family;
     struct sockaddr_storage srcip;
@@ -70,6 +73,38 @@ typedef struct coreserver {
     UT_hash_handle hh;
 } coreserver_t;
 
+/* Key for the per-thread core server classification table -- a single
+ * (family, address, port) endpoint.
+ */
+typedef struct coreserver_endpoint {
+    uint8_t family;
+    uint8_t unused;
+    uint16_t port;
+    uint8_t addr[16];
+} coreserver_endpoint_t;
+
+/* An entry in the classification table. One entry covers every core server
+ * type that has been configured on the same endpoint, so a packet can be
+ * classified with a single probe per endpoint.
+ */
+typedef struct coreserver_class {
+    coreserver_endpoint_t key;
+
+    /* Bitmask of the OPENLI_CORE_SERVER_* types served by this endpoint */
+    uint32_t typemask;
+
+    /* Pre-computed hash of the server key for each of those types */
+    uint32_t serverhash[OPENLI_CORE_SERVER_TYPE_COUNT];
+
+    UT_hash_handle hh;
+} coreserver_class_t;
+
+/* Result of classifying a packet against the classification table */
+typedef struct coreserver_match {
+    uint32_t typemask;
+    uint32_t serverhash[OPENLI_CORE_SERVER_TYPE_COUNT];
+} coreserver_match_t;
+
 void free_single_coreserver(coreserver_t *cs);
 char *construct_coreserver_key(coreserver_t *cs);
 void free_coreserver_list(coreserver_t *servlist);
@@ -79,6 +114,12 @@ coreserver_t *deep_copy_coreserver(coreserver_t *cs);
 coreserver_t *match_packet_to_coreserver(coreserver_t *serverlist,
         packet_info_t *pinfo);
 
+int add_coreservers_to_classifier(coreserver_class_t **table,
+        coreserver_t **servlist);
+void free_coreserver_classifier(coreserver_class_t *table);
+uint32_t classify_coreserver_packet(coreserver_class_t *table,
+        packet_info_t *pinfo, coreserver_match_t *match);
+
 #define CS_TO_V4(cs) ((struct sockaddr_in *)(cs->info->ai_addr))
 #define CS_TO_V6(cs) ((struct sockaddr_in6 *)(cs->info->ai_addr))
 
@@ -243,6 +243,8 @@ typedef struct encoded_global_template {
     encoded_cc_template_t cc_content;
 } encoded_global_template_t;
 
+extern uint8_t etsi_ipccoid[4];
+
 uint8_t DERIVE_INTEGER_LENGTH(uint64_t x);
 
 int calculate_pspdu_length(uint32_t contentsize);
@@ -26,12 +26,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
 #include <assert.h>
 #include <libwandder_etsili.h>
 
 #include "logger.h"
+#include "byteswap.h"
 #include "export_buffer.h"
 #include "netcomms.h"
+#include "openli_tls.h"
 
 #define BUFFER_ALLOC_SIZE (1024 * 1024 * 50)
 #define BUFFER_WARNING_THRESH (1024 * 1024 * 1024)
@@ -185,13 +188,22 @@ uint64_t append_message_to_buffer(export_buffer_t *buf,
     uint64_t bufused = buf->buftail - buf->bufhead;
     uint64_t spaceleft = buf->alloced - bufused;
     uint32_t added = 0;
+    uint32_t extlen = 0;
     int rcint;
 
     if (bufused == 0) {
         buf->partialfront = beensent;
     }
 
-    while (spaceleft < res->msgbody->len + sizeof(res->header)) {
+    /* Records that are too big for the 16 bit length field need the
+     * extended header -- the caller must have checked that the recipient
+     * understands it.
+     */
+    if (res->msgbody->len > OPENLI_PROTO_MAX_BODYLEN) {
+        extlen = sizeof(uint32_t);
+    }
+
+    while (spaceleft < res->msgbody->len + sizeof(res->header) + extlen) {
         /* Add some space to the buffer */
         spaceleft = extend_buffer(buf);
         if (spaceleft == 0) {
@@ -200,8 +212,16 @@ uint64_t append_message_to_buffer(export_buffer_t *buf,
     }
 
     memcpy(buf->buftail, &res->header, sizeof(res->header));
-    buf->buftail += sizeof(res->header);
-    added += sizeof(res->header);
+    if (extlen > 0) {
+        ii_header_t *hdr = (ii_header_t *)buf->buftail;
+        uint32_t len32 = htonl(res->msgbody->len);
+
+        hdr->magic = htonl(OPENLI_PROTO_MAGIC_EXTLEN);
+        hdr->bodylen = 0;
+        memcpy(buf->buftail + sizeof(res->header), &len32, extlen);
+    }
+    buf->buftail += (sizeof(res->header) + extlen);
+    added += (sizeof(res->header) + extlen);
 
     if (enclen > 0) {
         memcpy(buf->buftail, res->msgbody->encoded, enclen);
@@ -222,30 +242,72 @@ uint64_t append_message_to_buffer(export_buffer_t *buf,
     return (buf->buftail - buf->bufhead);
 }
 
-int transmit_heartbeat(int fd, SSL *ssl) {
-    ii_header_t hbeat;
+/** Maximum time (in milliseconds) to wait for a socket to become writable
+ *  again after only part of a header-only message could be sent.
+ */
+#define BODYLESS_PARTIAL_WAIT 1000
+
+/** Waits for a socket to have room to send the rest of a partially sent
+ *  header-only message.
+ *
+ *  @return -1 if the socket did not become writable in time, 0 otherwise.
+ */
+static int wait_for_writable(int fd, const char *desc) {
+    struct pollfd pfd;
+    int ret;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+
+    do {
+        ret = poll(&pfd, 1, BODYLESS_PARTIAL_WAIT);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret <= 0 || !(pfd.revents & POLLOUT)) {
+        logger(LOG_INFO,
+                "OpenLI: unable to finish sending %s: socket is not writable",
+                desc);
+        return -1;
+    }
+    return 0;
+}
+
+/** Sends a message that consists of just a header over a connection.
+ *
+ *  @return -1 if an error occurs, 0 if the socket is not ready for the
+ *          message yet, otherwise the number of bytes sent.
+ */
+static int transmit_bodyless_message(int fd, SSL *ssl,
+        openli_proto_msgtype_t msgtype, uint64_t internalid,
+        const char *desc) {
+    ii_header_t hdr;
     char *ptr;
     int ret;
-    int tosend = sizeof(hbeat);
+    int tosend = sizeof(hdr);
 
-    hbeat.magic = htonl(OPENLI_PROTO_MAGIC);
-    hbeat.bodylen = 0;
-    hbeat.intercepttype = htons((uint16_t)OPENLI_PROTO_HEARTBEAT);
-    hbeat.internalid = 0;
+    hdr.magic = htonl(OPENLI_PROTO_MAGIC);
+    hdr.bodylen = 0;
+    hdr.intercepttype = htons((uint16_t)msgtype);
+    hdr.internalid = bswap_host_to_be64(internalid);
 
-    ptr = (char *)(&hbeat);
+    ptr = (char *)(&hdr);
     while (tosend > 0) {
         if (ssl) {
             ret = SSL_write(ssl, ptr, tosend);
             if (ret <= 0 ) {
                 char errstring[128];
                 int errr = SSL_get_error(ssl, ret);
-                if (errr == SSL_ERROR_WANT_WRITE) {
-                    continue;
+                if (errr == SSL_ERROR_WANT_WRITE ||
+                        errr == SSL_ERROR_WANT_READ) {
+                    /* OpenSSL retains the partially written record, so
+                     * the retry just has to repeat this exact write */
+                    return 0;
                 }
                 logger(LOG_INFO,
-                        "OpenLI: ssl_write error (%d) when sending heartbeat: %s",
-                        errr, ERR_error_string(ERR_get_error(), errstring));
+                        "OpenLI: ssl_write error (%d) when sending %s: %s",
+                        errr, desc,
+                        ERR_error_string(ERR_get_error(), errstring));
                 return -1;
             }
         } else {
@@ -253,8 +315,17 @@ int transmit_heartbeat(int fd, SSL *ssl) {
             if (ret < 0) {
                 if (errno != EAGAIN) {
                     logger(LOG_INFO,
-                            "OpenLI: error while sending heartbeat: %s",
-                            strerror(errno));
+                            "OpenLI: error while sending %s: %s",
+                            desc, strerror(errno));
+                    return -1;
+                }
+                if (tosend == sizeof(hdr)) {
+                    /* Nothing sent yet, so we can safely try later */
+                    return 0;
+                }
+                /* The rest of the header has to follow straight away,
+                 * but wait for the socket rather than spinning on it */
+                if (wait_for_writable(fd, desc) < 0) {
                     return -1;
                 }
                 continue;
@@ -264,7 +335,48 @@ int transmit_heartbeat(int fd, SSL *ssl) {
         tosend -= ret;
         ptr += ret;
     }
-    return (int)(sizeof(hbeat));
+    return (int)(sizeof(hdr));
+}
+
+/** Sends a heartbeat message over a connection.
+ *
+ *  If the connection is not ready to accept the heartbeat, the caller
+ *  must call this function again (before sending anything else on a TLS
+ *  connection) once the socket becomes writable.
+ *
+ *  @return -1 if an error occurs, 0 if the socket is not ready for the
+ *          heartbeat yet, otherwise the number of bytes sent.
+ */
+int transmit_heartbeat(int fd, SSL *ssl) {
+    return transmit_bodyless_message(fd, ssl, OPENLI_PROTO_HEARTBEAT, 0,
+            "heartbeat");
+}
+
+/** Tells a newly connected collector which framing features we support.
+ *
+ *  @return -1 if an error occurs, 0 if the socket is not ready for the
+ *          message yet, otherwise the number of bytes sent.
+ */
+int transmit_framing_caps(int fd, SSL *ssl, uint64_t caps) {
+    return transmit_bodyless_message(fd, ssl, OPENLI_PROTO_FRAMING_CAPS, caps,
+            "framing capabilities");
+}
+
+/** Tells a mediator which of our parallel connections to it this is. Sent
+ *  once the mediator has told us its framing capabilities, i.e. after the
+ *  TLS handshake (if any) has completed.
+ *
+ *  If the connection is not ready to accept the message, the caller
+ *  must call this function again (before sending anything else on a TLS
+ *  connection) once the socket becomes writable.
+ *
+ *  @return -1 if an error occurs, 0 if the socket is not ready for the
+ *          message yet, otherwise the number of bytes sent.
+ */
+int transmit_collector_stream(int fd, SSL *ssl, uint16_t streamid,
+        uint16_t streamcount) {
+    return transmit_bodyless_message(fd, ssl, OPENLI_PROTO_COLLECTOR_STREAM,
+            (((uint64_t)streamid) << 16) | streamcount, "stream announcement");
 }
 
 static inline void post_transmit(export_buffer_t *buf) {
@@ -327,22 +439,29 @@ int transmit_buffered_records(export_buffer_t *buf, int fd,
     }
 
     if (sent != 0) {
-        if (ssl != NULL) {
-            while (1) {
-                ret = SSL_write(ssl, bhead + offset, (int)sent);
-
-                if ((ret) <= 0 ) {
-                    char errstring[128];
-                    int errr = SSL_get_error(ssl, ret);
-                    if (errr == SSL_ERROR_WANT_WRITE) {
-                        continue;
-                    }
-                    logger(LOG_INFO,
-                            "OpenLI: ssl_write error (%d) in export_buffer: %s",
-                            errr, ERR_error_string(ERR_get_error(), errstring));
-                    return -1;
+        /* If the kernel is doing the TLS record encryption, we can write
+         * plaintext straight to the socket and get the same non-blocking
+         * behaviour as a non-TLS connection.
+         */
+        if (ssl != NULL && !openli_ssl_ktls_send_active(ssl)) {
+            ret = SSL_write(ssl, bhead + offset, (int)sent);
+
+            if ((ret) <= 0 ) {
+                char errstring[128];
+                int errr = SSL_get_error(ssl, ret);
+                if (errr == SSL_ERROR_WANT_WRITE ||
+                        errr == SSL_ERROR_WANT_READ) {
+                    /* The peer isn't keeping up. OpenSSL requires that we
+                     * retry with the same length, which partialrem
+                     * guarantees, so go back to polling rather than
+                     * spinning here and starving other destinations.
+                     */
+                    return 0;
                 }
-                break;
+                logger(LOG_INFO,
+                        "OpenLI: ssl_write error (%d) in export_buffer: %s",
+                        errr, ERR_error_string(ERR_get_error(), errstring));
+                return -1;
             }
         }
         else {
@@ -416,6 +535,67 @@ int transmit_buffered_records_RMQ(export_buffer_t *buf,
     return sent;
 }
 
+/** Removes every record that uses the extended length header from an
+ *  export buffer, e.g. because the mediator that they were buffered for
+ *  no longer supports them after a reconnect.
+ *
+ *  Must not be called while a record is partially sent.
+ *
+ *  @return the number of records that were removed.
+ */
+int remove_extended_records(export_buffer_t *buf) {
+
+    uint8_t *rd, *wr;
+    ii_header_t *hdr;
+    uint64_t reclen;
+    uint32_t len32;
+    int removed = 0, rcint;
+
+    if (buf->bufhead == NULL) {
+        return 0;
+    }
+
+    rd = buf->bufhead + buf->deadfront;
+    wr = rd;
+    while (rd + sizeof(ii_header_t) <= buf->buftail) {
+        hdr = (ii_header_t *)rd;
+        if (ntohl(hdr->magic) == OPENLI_PROTO_MAGIC_EXTLEN) {
+            memcpy(&len32, rd + sizeof(ii_header_t), sizeof(uint32_t));
+            rd += sizeof(ii_header_t) + sizeof(uint32_t) + ntohl(len32);
+            removed ++;
+            continue;
+        }
+
+        reclen = sizeof(ii_header_t) + ntohs(hdr->bodylen);
+        if (wr != rd) {
+            memmove(wr, rd, reclen);
+        }
+        wr += reclen;
+        rd += reclen;
+    }
+
+    if (removed == 0) {
+        return 0;
+    }
+    buf->buftail = wr;
+
+    /* The saved record offsets are now wrong, so work them out again */
+    J1FA(rcint, buf->record_offsets);
+    buf->since_last_saved_offset = 0;
+    rd = buf->bufhead + buf->deadfront;
+    while (rd < buf->buftail) {
+        hdr = (ii_header_t *)rd;
+        reclen = sizeof(ii_header_t) + ntohs(hdr->bodylen);
+        if (buf->since_last_saved_offset + reclen >= BUF_OFFSET_FREQUENCY) {
+            J1S(rcint, buf->record_offsets, rd - buf->bufhead);
+            buf->since_last_saved_offset = 0;
+        }
+        buf->since_last_saved_offset += reclen;
+        rd += reclen;
+    }
+    return removed;
+}
+
 int advance_export_buffer_head(export_buffer_t *buf, uint64_t amount) {
 
     uint64_t rem = get_buffered_amount(buf);
@@ -79,7 +79,11 @@ int transmit_buffered_records_RMQ(export_buffer_t *buf,
         amqp_bytes_t exchange, amqp_bytes_t routing_key,
         uint64_t bytelimit);
 int transmit_heartbeat(int fd, SSL *ssl);
+int transmit_framing_caps(int fd, SSL *ssl, uint64_t caps);
+int transmit_collector_stream(int fd, SSL *ssl, uint16_t streamid,
+        uint16_t streamcount);
 int advance_export_buffer_head(export_buffer_t *buf, uint64_t amount);
+int remove_extended_records(export_buffer_t *buf);
 uint8_t *get_buffered_head(export_buffer_t *buf, uint64_t *rem);
 
 #endif
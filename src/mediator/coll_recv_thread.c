@@ -63,6 +63,12 @@
  */
 #define LIID_QUEUE_EXPIRY_THRESH (10 * 60)
 
+/** Number of seconds that a newly accepted collector connection has to
+ *  complete its TLS handshake and identify which stream it belongs to,
+ *  before we give up and close it.
+ */
+#define COLLECTOR_IDENTIFY_TIMEOUT 30
+
 /** Initialises the shared configuration for the collectors managed by a
  *  mediator.
  *
@@ -161,47 +167,6 @@ static void remove_expired_liid_queues(coll_recv_t *col) {
     }
 }
 
-/** Perform the necessary setup to establish a TLS connection with the
- *  OpenLI collector that we are responsible for.
- *
- *  @param col      The state object for this collector receive thread
- *
- *  @return -1 if an error occurs, MED_EPOLL_COLLECTOR_HANDSHAKE if the
- *          connection is established but TLS handshake is incomplete,
- *          MED_EPOLL_COLLECTOR if the connection is established and the
- *          TLS handshake has completed.
- */
-static int start_collector_ssl(coll_recv_t *col) {
-
-    int r;
-
-    lock_med_collector_config(col->parentconfig);
-    r = listen_ssl_socket(col->parentconfig->sslconf, &col->ssl, col->col_fd);
-    unlock_med_collector_config(col->parentconfig);
-
-    if (r == OPENLI_SSL_CONNECT_FAILED) {
-        close(col->col_fd);
-        col->col_fd = -1;
-        SSL_free(col->ssl);
-        col->ssl = NULL;
-
-        if (r != col->lastsslerror) {
-            logger(LOG_INFO,
-                    "OpenLI Mediator: SSL handshake failed for collector %s",
-                    col->ipaddr);
-        }
-        col->lastsslerror = r;
-        return -1;
-    }
-
-    col->using_tls = 1;
-    if (r == OPENLI_SSL_CONNECT_WAITING) {
-        return MED_EPOLL_COLLECTOR_HANDSHAKE;
-    }
-    col->lastsslerror = 0;
-    return MED_EPOLL_COLLECTOR;
-}
-
 /** Connects to the RMQ queue for this mediator on the collector and
  *  (if successful) creates an epoll read event for the underlying TCP
  *  socket for the RMQ connection.
@@ -249,6 +214,9 @@ static med_epoll_ev_t *prepare_collector_receive_rmq(coll_recv_t *col,
         destroy_net_buffer(col->incoming_rmq);
     }
     col->incoming_rmq = create_net_buffer(NETBUF_RECV, 0, NULL);
+    if (col->extlen_announced) {
+        net_buffer_allow_extlen(col->incoming_rmq);
+    }
 
     /* Create an epoll event and add it to our epoll FD set */
     rmqev = create_mediator_fdevent(epoll_fd, col, MED_EPOLL_COL_RMQ, rmq_sock,
@@ -287,20 +255,16 @@ static med_epoll_ev_t *prepare_collector_receive_fd(coll_recv_t *col,
         int epoll_fd) {
 
     med_epoll_ev_t *colev = NULL;
-    int fdtype;
 
-    /* If we are supposed to be using TLS, establish a TLS session */
-    if (col->parentconfig->usingtls) {
-        fdtype = start_collector_ssl(col);
-    } else {
-        /* Otherwise, we can use the existing socket as is */
-        fdtype = MED_EPOLL_COLLECTOR;
-        col->using_tls = 0;
-    }
+    /* Any TLS handshake has already been completed by the main thread
+     * before the connection was handed to us, so we can use the socket
+     * (and TLS session) as is.
+     */
+    col->using_tls = col->parentconfig->usingtls;
 
     /* Create an epoll event and add it to our epoll FD set */
-    colev = create_mediator_fdevent(epoll_fd, col, fdtype, col->col_fd,
-            EPOLLIN | EPOLLRDHUP);
+    colev = create_mediator_fdevent(epoll_fd, col, MED_EPOLL_COLLECTOR,
+            col->col_fd, EPOLLIN | EPOLLRDHUP);
     if (colev == NULL && col->disabled_log == 0) {
         logger(LOG_INFO,
                 "OpenLI Mediator: unable to add collector fd to epoll: %s",
@@ -318,6 +282,13 @@ static med_epoll_ev_t *prepare_collector_receive_fd(coll_recv_t *col,
     col->incoming = create_net_buffer(NETBUF_RECV, col->col_fd,
             col->ssl);
 
+    /* The main thread has already told the collector that we can receive
+     * records that need the extended length header.
+     */
+    col->extlen_announced = 1;
+    net_buffer_allow_extlen(col->incoming);
+    net_buffer_allow_extlen(col->incoming_rmq);
+
     if (col->disabled_log == 0) {
         logger(LOG_INFO,
                 "OpenLI Mediator: accepted connection from collector %s.",
@@ -326,40 +297,48 @@ static med_epoll_ev_t *prepare_collector_receive_fd(coll_recv_t *col,
     return colev;
 }
 
-/** Completes a partially-established TLS handshake on the TCP socket that
- *  connects this thread to the collector.
+/** Samples a received record for latency tracing, observing the time
+ *  between the record's capture and its arrival at the mediator.
  *
- *  @param col          The state object for this collector receive thread
- *  @param mev          The mediator epoll event for the TCP socket
+ *  @param col      The state object for this collector receive thread
+ *  @param rec      A pointer to the start of the encoded ETSI record
+ *  @param reclen   The length of the encoded record, in bytes
+ *  @param trace    The tracing state to populate for this record
  *
- *  @return -1 if an error occurs, 0 if the handshake remains incomplete, 1
- *          if the handshake is now complete
+ *  @return the populated tracing state, or NULL if this record is not
+ *          being traced
  */
-static int continue_collector_handshake(coll_recv_t *col, med_epoll_ev_t *mev) {
+static mediator_rmq_trace_t *trace_received_record(coll_recv_t *col,
+        uint8_t *rec, uint32_t reclen, mediator_rmq_trace_t *trace) {
 
-    int ret = SSL_accept(col->ssl);
+    struct timeval capts;
 
-    if (ret <= 0) {
-        ret = SSL_get_error(col->ssl, ret);
-        if (ret == SSL_ERROR_WANT_READ || ret == SSL_ERROR_WANT_WRITE) {
-            /* Not fatal -- can keep trying */
-            return 0;
-        } else {
-            logger(LOG_INFO, "OpenLI Mediator: Pending SSL handshake for collector %s failed", col->ipaddr);
-            return -1;
-        }
+    if (col->linklatency == NULL) {
+        return NULL;
+    }
+    if (((col->tracecounter ++) & MEDIATOR_TRACE_SAMPLE_MASK) != 0) {
+        return NULL;
     }
-    logger(LOG_INFO, "OpenLI Mediator: Pending SSL handshake for collector %s completed", col->ipaddr);
-    col->lastsslerror = 0;
-    mev->fdtype = MED_EPOLL_COLLECTOR;
 
-    /* If we're meant to be reading records from RMQ, then we are now
-     * ready to set that event up too.
-     */
-    if (col->rmqenabled && col->rmq_colev == NULL) {
-        col->rmq_colev = prepare_collector_receive_rmq(col, mev->epoll_fd);
+    if (col->decoder == NULL) {
+        col->decoder = wandder_create_etsili_decoder();
     }
-    return 1;
+    wandder_attach_etsili_buffer(col->decoder, rec, reclen, false);
+    capts = wandder_etsili_get_header_timestamp(col->decoder);
+
+    trace->received_ts = fetch_current_time_us();
+    trace->capture_ts = (capts.tv_sec * 1000000) + capts.tv_usec;
+    trace->queuelatency = NULL;
+
+    /* Records from a collector reading a trace file will have capture
+     * times that can't be sensibly compared with our clock */
+    if (trace->capture_ts != 0 && trace->capture_ts <= trace->received_ts) {
+        openli_metric_observe_latency(col->linklatency, trace->capture_ts,
+                trace->received_ts);
+    } else {
+        trace->capture_ts = 0;
+    }
+    return trace;
 }
 
 /** Processes an intercept record received from a collector and inserts
@@ -374,12 +353,13 @@ static int continue_collector_handshake(coll_recv_t *col, med_epoll_ev_t *mev) {
  *          occurs.
  */
 static int process_received_data(coll_recv_t *col, uint8_t *msgbody,
-        uint16_t msglen, openli_proto_msgtype_t msgtype) {
+        uint32_t msglen, openli_proto_msgtype_t msgtype) {
 
     unsigned char liidstr[65536];
     uint16_t liidlen;
     col_known_liid_t *found;
     struct timeval tv;
+    mediator_rmq_trace_t trace;
     int r;
 
     /* The queue that this record must be published to is derived from
@@ -425,13 +405,17 @@ static int process_received_data(coll_recv_t *col, uint8_t *msgbody,
     /* Hand off to publishing methods defined in mediator_rmq.c */
     if (msgtype == OPENLI_PROTO_ETSI_CC) {
         r = publish_cc_on_mediator_liid_RMQ_queue(col->amqp_producer_state,
-                msgbody + (liidlen + 2), msglen - (liidlen + 2), found->liid);
+                msgbody + (liidlen + 2), msglen - (liidlen + 2), found->liid,
+                trace_received_record(col, msgbody + (liidlen + 2),
+                        msglen - (liidlen + 2), &trace));
         return r;
     }
 
     if (msgtype == OPENLI_PROTO_ETSI_IRI) {
         return publish_iri_on_mediator_liid_RMQ_queue(col->amqp_producer_state,
-                msgbody + (liidlen + 2), msglen - (liidlen + 2), found->liid);
+                msgbody + (liidlen + 2), msglen - (liidlen + 2), found->liid,
+                trace_received_record(col, msgbody + (liidlen + 2),
+                        msglen - (liidlen + 2), &trace));
     }
 
     if (msgtype == OPENLI_PROTO_RAWIP_SYNC) {
@@ -459,7 +443,7 @@ static int process_received_data(coll_recv_t *col, uint8_t *msgbody,
 static int receive_collector(coll_recv_t *col, med_epoll_ev_t *mev) {
 
     uint8_t *msgbody = NULL;
-    uint16_t msglen = 0;
+    uint32_t msglen = 0;
     uint64_t internalid;
     int total_recvd = 0;
     openli_proto_msgtype_t msgtype;
@@ -564,15 +548,6 @@ static int collector_thread_epoll_event(coll_recv_t *col,
             }
             break;
 
-        case MED_EPOLL_COLLECTOR_HANDSHAKE:
-            /* A socket with an incomplete SSL handshake is active -- try
-             * to complete the handshake.
-             */
-            ret = continue_collector_handshake(col, mev);
-            if (ret == -1) {
-                return -1;
-            }
-            break;
         case MED_EPOLL_COLLECTOR:
         case MED_EPOLL_COL_RMQ:
             /* Data is readable from our collector socket / RMQ */
@@ -625,6 +600,10 @@ static void cleanup_collector_thread(coll_recv_t *col) {
     if (col->internalpass) {
         free(col->internalpass);
     }
+    if (col->decoder) {
+        wandder_free_etsili_decoder(col->decoder);
+    }
+    openli_metrics_deregister(col->linklatency);
     HASH_ITER(hh, col->known_liids, known, tmp) {
         if (known->liid) {
             free(known->liid);
@@ -635,7 +614,7 @@ static void cleanup_collector_thread(coll_recv_t *col) {
 
     if (col->ipaddr) {
         logger(LOG_INFO, "OpenLI mediator: exiting collector thread for %s",
-                col->ipaddr);
+                col->threadkey);
         free(col->ipaddr);
     }
 
@@ -680,7 +659,13 @@ static void *start_collector_thread(void *params) {
     col->incoming = NULL;
 
     logger(LOG_INFO, "OpenLI Mediator: starting collector thread for %s",
-            col->ipaddr);
+            col->threadkey);
+
+    col->linklatency = openli_metrics_register_histogram(
+            "openli_mediator_record_latency_seconds",
+            "Time spent by sampled records in each stage of the mediator",
+            openli_latency_buckets, OPENLI_LATENCY_BUCKET_COUNT,
+            "collector", col->threadkey, "stage", "collector_link", NULL);
 
     /* timerev is used to regularly break from epoll_wait() so we can check
      * for incoming messages on our control socket.
@@ -747,6 +732,11 @@ static void *start_collector_thread(void *params) {
                         remove_mediator_fdevent(col->colev);
                         col->colev = NULL;
                     }
+                    if (col->ssl) {
+                        SSL_free(col->ssl);
+                        col->ssl = NULL;
+                    }
+                    col->col_fd = -1;
                 }
 
                 /* re-save rmqconf->heartbeat */
@@ -789,7 +779,11 @@ static void *start_collector_thread(void *params) {
                     remove_mediator_fdevent(col->rmq_colev);
                     col->rmq_colev = NULL;
                 }
+                if (col->ssl) {
+                    SSL_free(col->ssl);
+                }
                 col->col_fd = (int)msg.arg;
+                col->ssl = (SSL *)msg.argptr;
                 col->was_dropped = 0;
             }
 
@@ -817,8 +811,11 @@ static void *start_collector_thread(void *params) {
             col->colev = prepare_collector_receive_fd(col, epoll_fd);
         }
 
+        /* The collector's forwarders all publish to the same RMQ queue,
+         * so only one of our threads should be consuming from it */
         if (col->colev && col->colev->fdtype == MED_EPOLL_COLLECTOR &&
-                col->rmqenabled && col->rmq_colev == NULL) {
+                col->rmqenabled && col->rmq_colev == NULL &&
+                col->streamid == 0) {
             col->rmq_colev = prepare_collector_receive_rmq(col, epoll_fd);
         }
 
@@ -881,8 +878,117 @@ threadexit:
 
 }
 
-/** Accepts a connection from a collector and spawns a new collector
- *  receive thread for that collector.
+/** Closes a collector connection that has not been handed to a receive
+ *  thread yet and frees the state that we kept for it.
+ *
+ *  @param medcol       The shared state for all collector receive threads
+ *  @param pend         The pending connection to close
+ */
+static void drop_pending_collector(mediator_collector_t *medcol,
+        pending_coll_conn_t *pend) {
+
+    HASH_DELETE(hh, medcol->pending, pend);
+    if (pend->ev) {
+        remove_mediator_fdevent(pend->ev);
+    } else {
+        close(pend->fd);
+    }
+    if (pend->ssl) {
+        SSL_free(pend->ssl);
+    }
+    free(pend->ipaddr);
+    free(pend);
+}
+
+/** Changes the epoll events that we are waiting for on a pending
+ *  collector connection.
+ *
+ *  @param pend         The pending collector connection
+ *  @param events       The events to wait for (EPOLLRDHUP is implied)
+ *
+ *  @return -1 if an error occurs, 0 otherwise
+ */
+static int wait_pending_collector(pending_coll_conn_t *pend,
+        uint32_t events) {
+
+    if (modify_mediator_fdevent(pend->ev, events | EPOLLRDHUP) < 0) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: unable to update epoll events for collector %s: %s",
+                pend->ipaddr, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/** Tells a newly connected collector that we can receive records that
+ *  need the extended length header. Collectors that do not recognise this
+ *  message will never read it.
+ *
+ *  This is sent as soon as the connection is usable (i.e. once any TLS
+ *  handshake is complete), so that the collector does not have to wait
+ *  for its receive thread to be started before it can send us large
+ *  records. We're running on the main mediator thread, so we must never
+ *  block here -- if the socket cannot take the whole message, we wait for
+ *  it to become writable and carry on from where we left off.
+ *
+ *  @param pend         The pending collector connection
+ *
+ *  @return -1 if the message could not be sent, 0 if the message is not
+ *          completely sent yet, 1 if the message has been sent.
+ */
+static int send_framing_caps(pending_coll_conn_t *pend) {
+
+    uint8_t *ptr = ((uint8_t *)&(pend->capsmsg)) + pend->capssent;
+    int tosend = sizeof(ii_header_t) - pend->capssent;
+    int ret;
+
+    while (tosend > 0) {
+        if (pend->ssl) {
+            ret = SSL_write(pend->ssl, ptr, tosend);
+            if (ret <= 0) {
+                ret = SSL_get_error(pend->ssl, ret);
+                /* OpenSSL retains the partially written record, so the
+                 * retry just has to repeat this exact write */
+                if (ret == SSL_ERROR_WANT_WRITE) {
+                    return wait_pending_collector(pend, EPOLLOUT);
+                }
+                if (ret == SSL_ERROR_WANT_READ) {
+                    return wait_pending_collector(pend, EPOLLIN);
+                }
+                goto capsfail;
+            }
+        } else {
+            ret = send(pend->fd, ptr, tosend, MSG_DONTWAIT);
+            if (ret < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return wait_pending_collector(pend, EPOLLOUT);
+                }
+                goto capsfail;
+            }
+        }
+        pend->capssent += ret;
+        ptr += ret;
+        tosend -= ret;
+    }
+
+    /* Go back to waiting for the collector to identify itself */
+    if (wait_pending_collector(pend, EPOLLIN) < 0) {
+        return -1;
+    }
+    return 1;
+
+capsfail:
+    logger(LOG_INFO,
+            "OpenLI Mediator: unable to send framing capabilities to collector %s",
+            pend->ipaddr);
+    return -1;
+}
+
+/** Accepts a connection from a collector, starts the TLS handshake (if
+ *  required) and tells the collector which framing features we support.
+ *  The connection is handed to a collector receive thread by
+ *  mediator_identify_collector_stream() once the collector has sent its
+ *  first data.
  *
  *  @param medcol       The shared config for all collector receive threads
  *  @param listenfd     The listening file descriptor that the connection
@@ -893,12 +999,11 @@ threadexit:
  */
 int mediator_accept_collector_connection(mediator_collector_t *medcol,
         int listenfd) {
-    int newfd = -1;
+    int newfd = -1, r = OPENLI_SSL_CONNECT_NOSSL;
     struct sockaddr_storage saddr;
     socklen_t socklen = sizeof(saddr);
     char strbuf[INET6_ADDRSTRLEN];
-    coll_recv_t *newcol = NULL;
-    mediator_collector_config_t *config = &(medcol->config);
+    pending_coll_conn_t *pend;
 
     /* Standard socket connection accept code... */
     newfd = accept(listenfd, (struct sockaddr *)&saddr, &socklen);
@@ -914,21 +1019,88 @@ int mediator_accept_collector_connection(mediator_collector_t *medcol,
         return newfd;
     }
 
-    HASH_FIND(hh, medcol->threads, strbuf, strlen(strbuf), newcol);
+    pend = (pending_coll_conn_t *)calloc(1, sizeof(pending_coll_conn_t));
+    pend->fd = newfd;
+    pend->ipaddr = strdup(strbuf);
+    pend->deadline = time(NULL) + COLLECTOR_IDENTIFY_TIMEOUT;
+    encode_framing_caps(&(pend->capsmsg), OPENLI_PROTO_FRAMING_EXTLEN);
+    HASH_ADD_INT(medcol->pending, fd, pend);
+
+    pend->ev = create_mediator_fdevent(medcol->epoll_fd, pend,
+            MED_EPOLL_COLL_PENDING, newfd, EPOLLIN | EPOLLRDHUP);
+
+    if (pend->ev == NULL) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: unable to wait for data from collector %s",
+                pend->ipaddr);
+        drop_pending_collector(medcol, pend);
+        return -1;
+    }
+
+    /* If we are supposed to be using TLS, establish a TLS session */
+    lock_med_collector_config(&(medcol->config));
+    if (medcol->config.usingtls) {
+        r = listen_ssl_socket(medcol->config.sslconf, &(pend->ssl), newfd);
+    }
+    unlock_med_collector_config(&(medcol->config));
+
+    if (r == OPENLI_SSL_CONNECT_FAILED) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: SSL handshake failed for collector %s",
+                pend->ipaddr);
+        drop_pending_collector(medcol, pend);
+        return -1;
+    }
+
+    if (r == OPENLI_SSL_CONNECT_WAITING) {
+        /* mediator_identify_collector_stream() will finish the handshake */
+        pend->handshaking = 1;
+        return newfd;
+    }
+
+    if (pend->ssl) {
+        log_ssl_ktls_state(pend->ssl, pend->ipaddr);
+    }
+    if (send_framing_caps(pend) < 0) {
+        drop_pending_collector(medcol, pend);
+        return -1;
+    }
+    return newfd;
+}
+
+/** Hands a collector connection to the receive thread for its stream,
+ *  spawning a new thread if we have not seen this stream before.
+ */
+static void assign_collector_connection(mediator_collector_t *medcol,
+        int newfd, SSL *ssl, char *ipaddr, uint16_t streamid) {
+
+    coll_recv_t *newcol = NULL;
+    char key[INET6_ADDRSTRLEN + 8];
+
+    if (streamid == 0) {
+        snprintf(key, sizeof(key), "%s", ipaddr);
+    } else {
+        snprintf(key, sizeof(key), "%s#%u", ipaddr, streamid);
+    }
+
+    HASH_FIND(hh, medcol->threads, key, strlen(key), newcol);
 
     if (newcol == NULL) {
         /* Never seen a connection from this collector before, so spawn
          * a new receive thread for it.
          */
         newcol = (coll_recv_t *)calloc(1, sizeof(coll_recv_t));
-        newcol->parentconfig = config;
+        newcol->parentconfig = &(medcol->config);
 
-        newcol->ipaddr = strdup(strbuf);
-        newcol->iplen = strlen(strbuf);
+        newcol->ipaddr = strdup(ipaddr);
+        newcol->iplen = strlen(ipaddr);
+        newcol->streamid = streamid;
+        newcol->threadkey = strdup(key);
         newcol->col_fd = newfd;
+        newcol->ssl = ssl;
 
-        HASH_ADD_KEYPTR(hh, medcol->threads, newcol->ipaddr, newcol->iplen,
-                newcol);
+        HASH_ADD_KEYPTR(hh, medcol->threads, newcol->threadkey,
+                strlen(newcol->threadkey), newcol);
 
         libtrace_message_queue_init(&(newcol->in_main),
                 sizeof(col_thread_msg_t));
@@ -940,10 +1112,199 @@ int mediator_accept_collector_connection(mediator_collector_t *medcol,
         col_thread_msg_t reconn_msg;
         reconn_msg.type = MED_COLL_MESSAGE_RECONNECT;
         reconn_msg.arg = newfd;
+        reconn_msg.argptr = ssl;
         libtrace_message_queue_put(&(newcol->in_main), &reconn_msg);
     }
+}
 
-    return newfd;
+/** Continues the TLS handshake for a pending collector connection.
+ *
+ *  @param pend         The pending collector connection
+ *
+ *  @return -1 if the handshake has failed, 0 if it is still incomplete,
+ *          1 if it has completed.
+ */
+static int continue_collector_handshake(pending_coll_conn_t *pend) {
+
+    int ret = SSL_accept(pend->ssl);
+
+    if (ret <= 0) {
+        ret = SSL_get_error(pend->ssl, ret);
+        /* Not fatal -- can keep trying once the socket is ready */
+        if (ret == SSL_ERROR_WANT_READ) {
+            return wait_pending_collector(pend, EPOLLIN);
+        }
+        if (ret == SSL_ERROR_WANT_WRITE) {
+            return wait_pending_collector(pend, EPOLLOUT);
+        }
+        logger(LOG_INFO, "OpenLI Mediator: Pending SSL handshake for collector %s failed", pend->ipaddr);
+        return -1;
+    }
+    logger(LOG_INFO, "OpenLI Mediator: Pending SSL handshake for collector %s completed", pend->ipaddr);
+    log_ssl_ktls_state(pend->ssl, pend->ipaddr);
+    pend->handshaking = 0;
+    return 1;
+}
+
+/** Hands a pending collector connection over to the receive thread for
+ *  the given stream, and frees the pending connection state.
+ */
+static void hand_over_pending_collector(mediator_collector_t *medcol,
+        pending_coll_conn_t *pend, uint16_t streamid) {
+
+    HASH_DELETE(hh, medcol->pending, pend);
+    detach_mediator_fdevent(pend->ev);
+    free(pend->ev);
+
+    assign_collector_connection(medcol, pend->fd, pend->ssl, pend->ipaddr,
+            streamid);
+    free(pend->ipaddr);
+    free(pend);
+}
+
+/** Reads from a pending collector connection without consuming the data,
+ *  unless peek is zero.
+ *
+ *  @return -1 if the connection has failed, 0 if there is nothing to read
+ *          yet, otherwise the number of bytes read.
+ */
+static int read_pending_collector(pending_coll_conn_t *pend, uint8_t *buf,
+        int len, int peek) {
+
+    int ret;
+
+    if (pend->ssl) {
+        if (peek) {
+            ret = SSL_peek(pend->ssl, buf, len);
+        } else {
+            ret = SSL_read(pend->ssl, buf, len);
+        }
+        if (ret <= 0) {
+            ret = SSL_get_error(pend->ssl, ret);
+            if (ret == SSL_ERROR_WANT_READ || ret == SSL_ERROR_WANT_WRITE) {
+                return 0;
+            }
+            return -1;
+        }
+        return ret;
+    }
+
+    ret = recv(pend->fd, buf, len, peek ? (MSG_PEEK | MSG_DONTWAIT) :
+            MSG_DONTWAIT);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (ret <= 0) {
+        return -1;
+    }
+    return ret;
+}
+
+int mediator_identify_collector_stream(mediator_collector_t *medcol,
+        med_epoll_ev_t *mev) {
+
+    pending_coll_conn_t *pend = (pending_coll_conn_t *)(mev->state);
+    uint8_t hdrbuf[sizeof(ii_header_t)];
+    ii_header_t *hdr = (ii_header_t *)hdrbuf;
+    uint16_t streamid = 0, streamcount = 0;
+    uint32_t expectmagic = htonl(OPENLI_PROTO_MAGIC);
+    int ret;
+
+    if (pend->handshaking) {
+        ret = continue_collector_handshake(pend);
+        if (ret == 0) {
+            return 0;
+        }
+        if (ret < 0) {
+            drop_pending_collector(medcol, pend);
+            return 0;
+        }
+    }
+
+    if (pend->capssent < sizeof(ii_header_t)) {
+        ret = send_framing_caps(pend);
+        if (ret == 0) {
+            return 0;
+        }
+        if (ret < 0) {
+            drop_pending_collector(medcol, pend);
+            return 0;
+        }
+        /* The collector may have already sent its announcement along
+         * with the end of the handshake, so check for it now */
+    }
+
+    ret = read_pending_collector(pend, hdrbuf, sizeof(hdrbuf), 1);
+    if (ret == 0) {
+        return 0;
+    }
+
+    if (ret < 0) {
+        /* Collector went away before telling us anything */
+        drop_pending_collector(medcol, pend);
+        return 0;
+    }
+
+    /* A stream announcement begins with our magic -- anything else comes
+     * from a collector that doesn't announce its streams. If we've got a
+     * partial header that could still be an announcement, wait for the
+     * rest of it (but no later than pend->deadline).
+     */
+    if (memcmp(hdrbuf, &expectmagic, ret < 4 ? ret : 4) == 0 &&
+            ret < sizeof(ii_header_t)) {
+        return 0;
+    }
+
+    if (ret == sizeof(ii_header_t) &&
+            decode_collector_stream(hdrbuf, ret, &streamid,
+                    &streamcount) == 0) {
+        /* consume the announcement so the receive thread doesn't see it */
+        if (read_pending_collector(pend, hdrbuf, sizeof(hdrbuf), 0) !=
+                sizeof(hdrbuf)) {
+            streamid = 0;
+        } else if (streamid == 0 || ntohs(hdr->bodylen) != 0) {
+            /* stream 0 is the plain collector thread anyway */
+            streamid = 0;
+        } else {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: collector %s connected stream %u of %u",
+                    pend->ipaddr, streamid, streamcount);
+        }
+    }
+
+    hand_over_pending_collector(medcol, pend, streamid);
+    return 0;
+}
+
+/** Deals with any accepted collector connections that have not identified
+ *  their stream within COLLECTOR_IDENTIFY_TIMEOUT seconds. Connections that
+ *  are still in the TLS handshake are closed; the rest are assumed to come
+ *  from collectors that do not announce their streams, and are handed to
+ *  the stream 0 receive thread.
+ *
+ *  @param medcol       The shared state for all collector receive threads
+ */
+void mediator_expire_pending_collectors(mediator_collector_t *medcol) {
+
+    pending_coll_conn_t *pend, *ptmp;
+    time_t now = time(NULL);
+
+    HASH_ITER(hh, medcol->pending, pend, ptmp) {
+        if (now < pend->deadline) {
+            continue;
+        }
+        if (pend->handshaking) {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: collector %s did not complete its SSL handshake within %d seconds, closing connection",
+                    pend->ipaddr, COLLECTOR_IDENTIFY_TIMEOUT);
+            drop_pending_collector(medcol, pend);
+            continue;
+        }
+
+        /* Older collectors never announce their stream, and won't send
+         * us anything at all until they have a record for us */
+        hand_over_pending_collector(medcol, pend, 0);
+    }
 }
 
 /** Halts all collector receive threads and waits for the threads to
@@ -954,6 +1315,11 @@ int mediator_accept_collector_connection(mediator_collector_t *medcol,
 void mediator_disconnect_all_collectors(mediator_collector_t *medcol) {
 
     coll_recv_t *col, *tmp;
+    pending_coll_conn_t *pend, *ptmp;
+
+    HASH_ITER(hh, medcol->pending, pend, ptmp) {
+        drop_pending_collector(medcol, pend);
+    }
 
     /* Send a halt message to all known threads, then use pthread_join() to
      * block until each thread exits.
@@ -962,11 +1328,13 @@ void mediator_disconnect_all_collectors(mediator_collector_t *medcol) {
         col_thread_msg_t end_msg;
         end_msg.type = MED_COLL_MESSAGE_HALT;
         end_msg.arg = 0;
+        end_msg.argptr = NULL;
         libtrace_message_queue_put(&(col->in_main), &end_msg);
 
         pthread_join(col->tid, NULL);
         libtrace_message_queue_destroy(&(col->in_main));
         HASH_DELETE(hh, medcol->threads, col);
+        free(col->threadkey);
         free(col);
     }
 }
@@ -27,11 +27,14 @@
 #ifndef OPENLI_MEDIATOR_COLL_RECV_THREAD_H
 #define OPENLI_MEDIATOR_COLL_RECV_THREAD_H
 
+#include <time.h>
 #include <amqp.h>
 #include <libtrace/message_queue.h>
+#include <libwandder_etsili.h>
 #include "netcomms.h"
 #include "openli_tls.h"
 #include "med_epoll.h"
+#include "openli_metrics.h"
 
 /** This file defines public types and methods for interactive with a
  *  "collector receive" thread for the OpenLI mediator.
@@ -81,6 +84,11 @@ typedef struct col_thread_msg {
      *  type.
      */
     uint64_t arg;
+
+    /** A pointer argument, e.g. the TLS session that goes with the file
+     *  descriptor in a RECONNECT message.
+     */
+    void *argptr;
 } col_thread_msg_t;
 
 /** Structure for keeping track of the LIIDs that a collector receive thread
@@ -120,6 +128,10 @@ typedef struct mediator_collector_config {
 } mediator_collector_config_t;
 
 
+/** Only one in every (MEDIATOR_TRACE_SAMPLE_MASK + 1) received records
+ *  is traced for latency measurement purposes */
+#define MEDIATOR_TRACE_SAMPLE_MASK 63
+
 /** State associated with a single collector connection */
 typedef struct single_coll_receiver {
 
@@ -132,6 +144,14 @@ typedef struct single_coll_receiver {
     /** The length of the IP address string */
     int iplen;
 
+    /** Which of the collector's parallel connections this thread is
+     *  handling (always 0 for collectors that only use one connection) */
+    uint16_t streamid;
+
+    /** The key for this thread in the thread map -- the IP address, plus
+     *  the stream index for any stream other than 0 */
+    char *threadkey;
+
     /** The file descriptor for the connection with the collector */
     int col_fd;
 
@@ -186,6 +206,11 @@ typedef struct single_coll_receiver {
      *  RabbitMQ */
     net_buffer_t *incoming_rmq;
 
+    /** Flag indicating whether we have told the collector on this
+     *  connection that we accept records with the extended length header
+     */
+    uint8_t extlen_announced;
+
     /** A flag indicating whether error logging is disabled for this
      *  collector.
      */
@@ -197,6 +222,17 @@ typedef struct single_coll_receiver {
     /** The set of LIIDs that we have seen */
     col_known_liid_t *known_liids;
 
+    /** Number of records received, used to sample records for latency
+     *  tracing */
+    uint32_t tracecounter;
+
+    /** Decoder for reading the PS header timestamp of sampled records */
+    wandder_etsispec_t *decoder;
+
+    /** Histogram of the time between capture and receipt of sampled
+     *  records (NULL if metrics are disabled) */
+    openli_metric_t *linklatency;
+
     /** A pointer to the shared global config for collector receive threads
      *  (owned by the main mediator thread)
      */
@@ -211,13 +247,55 @@ typedef struct single_coll_receiver {
 
 } coll_recv_t;
 
+/** A collector connection that has been accepted, but not yet handed over
+ *  to a receive thread because we don't know which stream it is yet.
+ */
+typedef struct pending_coll_conn {
+    /** The file descriptor for the connection */
+    int fd;
+
+    /** The IP address that the collector has connected from */
+    char *ipaddr;
+
+    /** The epoll event for reading from the connection */
+    med_epoll_ev_t *ev;
+
+    /** The TLS session for the connection, if TLS is required */
+    SSL *ssl;
+
+    /** Flag indicating whether the TLS handshake is still in progress */
+    uint8_t handshaking;
+
+    /** The framing capabilities message that we send to the collector */
+    ii_header_t capsmsg;
+
+    /** The number of bytes of capsmsg that have been sent so far */
+    uint8_t capssent;
+
+    /** The time by which the collector must have identified the stream
+     *  that this connection belongs to. If the TLS handshake is still
+     *  incomplete by then, the connection is closed -- otherwise it is
+     *  handed to the stream 0 receive thread. */
+    time_t deadline;
+
+    UT_hash_handle hh;
+} pending_coll_conn_t;
+
 /** Structure that tracks the set of existing collector receive threads
  *  and their shared configuration.
  */
 typedef struct mediator_collectors {
-    /** A hashmap containing the set of collector receive threads */
+    /** A hashmap containing the set of collector receive threads, keyed
+     *  by collector IP address and stream index */
     coll_recv_t *threads;
 
+    /** Accepted connections that have not been assigned to a thread yet */
+    pending_coll_conn_t *pending;
+
+    /** The epoll fd for the main mediator thread, used to wait for pending
+     *  connections to identify themselves */
+    int epoll_fd;
+
     /** Shared configuration for all collector receive threads */
     mediator_collector_config_t config;
 
@@ -272,8 +350,11 @@ void update_med_collector_config(mediator_collector_config_t *config,
  */
 void destroy_med_collector_config(mediator_collector_config_t *config);
 
-/** Accepts a connection from a collector and spawns a new collector
- *  receive thread for that collector.
+/** Accepts a connection from a collector, starts the TLS handshake (if
+ *  required) and tells the collector which framing features we support.
+ *  The connection is handed to a collector receive thread by
+ *  mediator_identify_collector_stream() once the collector has sent its
+ *  first data.
  *
  *  @param medcol       The shared config for all collector receive threads
  *  @param listenfd     The listening file descriptor that the connection
@@ -285,6 +366,37 @@ void destroy_med_collector_config(mediator_collector_config_t *config);
 int mediator_accept_collector_connection(mediator_collector_t *medcol,
         int listenfd);
 
+/** Works out which stream a newly accepted collector connection belongs
+ *  to and passes it to the collector receive thread for that stream,
+ *  spawning a new thread if required.
+ *
+ *  Called whenever the pending connection is readable or writable, so
+ *  that the TLS handshake and the framing capabilities message can be
+ *  completed without blocking the main thread.
+ *
+ *  Collectors announce the stream index once they have received our
+ *  framing capabilities, i.e. after the TLS handshake (if any) is complete.
+ *  Any other first message means the connection is stream 0 of a collector
+ *  that predates stream announcements.
+ *
+ *  @param medcol       The shared config for all collector receive threads
+ *  @param mev          The epoll event for the pending connection
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+int mediator_identify_collector_stream(mediator_collector_t *medcol,
+        med_epoll_ev_t *mev);
+
+/** Deals with any accepted collector connections that have not identified
+ *  their stream within COLLECTOR_IDENTIFY_TIMEOUT seconds. Connections that
+ *  are still in the TLS handshake are closed; the rest are assumed to come
+ *  from collectors that do not announce their streams, and are handed to
+ *  the stream 0 receive thread.
+ *
+ *  @param medcol       The shared state for all collector receive threads
+ */
+void mediator_expire_pending_collectors(mediator_collector_t *medcol);
+
 /** Halts all collector receive threads and waits for the threads to
  *  terminate.
  *
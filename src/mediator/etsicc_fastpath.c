@@ -0,0 +1,323 @@
+/*
+ *
+ * Copyright (c) 2018-2022 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include <string.h>
+#include "etsili_core.h"
+#include "etsicc_fastpath.h"
+
+/** This source file implements a minimal BER walker for the ETSI IPCC
+ *  records that are produced by the OpenLI collector.
+ *
+ *  The collector builds every IPCC record from the same templates, so we
+ *  know exactly which fields we need to look at and can step over
+ *  everything else without decoding it. The record layout is:
+ *
+ *    PS-PDU SEQUENCE (definite length)
+ *      pSHeader [1] -- contains the LIID [1]
+ *      payload [2]
+ *        cCPayloadSequence [1]
+ *          CCPayload SEQUENCE
+ *            payloadDirection [0]
+ *            cCContents [2]
+ *              iPCC [2]
+ *                iPCCObjId [0]
+ *                iPCCContents [1]
+ *                  iPPackets [0] -- the intercepted packet
+ *
+ *  Anything unexpected (including any non-IPCC record) makes us give up
+ *  so that the caller can use the generic libwandder decoder instead.
+ */
+
+/** Maximum nesting depth that we will follow when skipping over an
+ *  indefinite length field */
+#define FASTPATH_MAX_DEPTH 16
+
+/** Identifier octets for the fields that we care about */
+#define BER_SEQUENCE        0x30
+#define BER_CTX_PRIM(n)     (0x80 | (n))
+#define BER_CTX_CONS(n)     (0xA0 | (n))
+
+typedef struct ber_field {
+    uint8_t ident;
+    uint8_t indefinite;
+    uint8_t *content;
+    uint32_t len;
+} ber_field_t;
+
+/** Reads the identifier and length of the BER field at ptr.
+ *
+ *  @return 1 if the field header was read successfully, 0 if the field
+ *          uses an encoding that we do not support or runs past end.
+ */
+static inline int read_ber_field(uint8_t *ptr, uint8_t *end,
+        ber_field_t *field) {
+
+    uint8_t lenoctets;
+
+    if (end - ptr < 2) {
+        return 0;
+    }
+
+    field->ident = *ptr;
+    if ((field->ident & 0x1f) == 0x1f) {
+        /* multi-byte tags are never used in the fields we want */
+        return 0;
+    }
+    ptr ++;
+
+    field->indefinite = 0;
+    if (*ptr < 0x80) {
+        field->len = *ptr;
+        ptr ++;
+    } else if (*ptr == 0x80) {
+        if ((field->ident & 0x20) == 0) {
+            return 0;
+        }
+        field->indefinite = 1;
+        field->len = 0;
+        ptr ++;
+    } else {
+        lenoctets = *ptr & 0x7f;
+        ptr ++;
+        if (lenoctets > 4 || end - ptr < lenoctets) {
+            return 0;
+        }
+        field->len = 0;
+        while (lenoctets > 0) {
+            field->len = (field->len << 8) | *ptr;
+            ptr ++;
+            lenoctets --;
+        }
+    }
+
+    field->content = ptr;
+    if (!field->indefinite && field->len > (uint64_t)(end - ptr)) {
+        return 0;
+    }
+    return 1;
+}
+
+static inline int is_end_of_contents(uint8_t *ptr, uint8_t *end) {
+    return (end - ptr >= 2 && ptr[0] == 0x00 && ptr[1] == 0x00);
+}
+
+/** Finds the first byte after a BER field.
+ *
+ *  @return a pointer to the next field, or NULL if the field could not
+ *          be skipped.
+ */
+static uint8_t *skip_ber_field(ber_field_t *field, uint8_t *end,
+        int depth) {
+
+    uint8_t *ptr;
+    ber_field_t child;
+
+    if (!field->indefinite) {
+        return field->content + field->len;
+    }
+
+    if (depth >= FASTPATH_MAX_DEPTH) {
+        return NULL;
+    }
+
+    ptr = field->content;
+    while (!is_end_of_contents(ptr, end)) {
+        if (!read_ber_field(ptr, end, &child)) {
+            return NULL;
+        }
+        ptr = skip_ber_field(&child, end, depth + 1);
+        if (ptr == NULL) {
+            return NULL;
+        }
+    }
+    return ptr + 2;
+}
+
+/** Reads the next field inside a constructed field, stopping at the end
+ *  of the parent.
+ *
+ *  @return 1 if a field was read, 0 if the parent has no more fields or
+ *          the next field could not be read.
+ */
+static inline int next_child_field(uint8_t *ptr, uint8_t *end,
+        ber_field_t *child) {
+
+    if (ptr >= end || is_end_of_contents(ptr, end)) {
+        return 0;
+    }
+    return read_ber_field(ptr, end, child);
+}
+
+/** Returns a pointer to the end of a field's contents, for iterating over
+ *  its children. For indefinite length fields, this is the end of the
+ *  record as a whole (the end-of-contents marker stops iteration).
+ */
+static inline uint8_t *field_end(ber_field_t *field, uint8_t *recend) {
+    if (field->indefinite) {
+        return recend;
+    }
+    return field->content + field->len;
+}
+
+static int parse_psheader(ber_field_t *hdr, uint8_t *recend,
+        openli_etsicc_fields_t *fields, uint8_t **next) {
+
+    uint8_t *ptr = hdr->content;
+    uint8_t *end = field_end(hdr, recend);
+    ber_field_t child;
+
+    while (next_child_field(ptr, end, &child)) {
+        if (child.ident == BER_CTX_PRIM(1)) {
+            if (child.len == 0 || child.len > 65535) {
+                return 0;
+            }
+            fields->liid = child.content;
+            fields->liidlen = (uint16_t)child.len;
+        }
+
+        ptr = skip_ber_field(&child, end, 0);
+        if (ptr == NULL) {
+            return 0;
+        }
+    }
+
+    if (fields->liid == NULL) {
+        return 0;
+    }
+
+    if (hdr->indefinite) {
+        if (!is_end_of_contents(ptr, recend)) {
+            return 0;
+        }
+        ptr += 2;
+    }
+    *next = ptr;
+    return 1;
+}
+
+/** Steps into the first child of a constructed field, checking that it
+ *  has the expected identifier.
+ */
+static inline int descend_into(ber_field_t *parent, uint8_t *recend,
+        uint8_t ident, ber_field_t *child) {
+
+    if (!next_child_field(parent->content, field_end(parent, recend),
+            child)) {
+        return 0;
+    }
+    return (child->ident == ident);
+}
+
+static int parse_ipcc_payload(ber_field_t *payload, uint8_t *recend,
+        openli_etsicc_fields_t *fields) {
+
+    ber_field_t seq, ccpayload, cccontents, ipcc, oid, ipcccontents, pkt;
+    uint8_t *ptr, *end;
+
+    if (!descend_into(payload, recend, BER_CTX_CONS(1), &seq)) {
+        return 0;
+    }
+    if (!descend_into(&seq, recend, BER_SEQUENCE, &ccpayload)) {
+        return 0;
+    }
+
+    /* Find cCContents -- the payloadDirection will precede it */
+    ptr = ccpayload.content;
+    end = field_end(&ccpayload, recend);
+    while (1) {
+        if (!next_child_field(ptr, end, &cccontents)) {
+            return 0;
+        }
+        if (cccontents.ident == BER_CTX_CONS(2)) {
+            break;
+        }
+        ptr = skip_ber_field(&cccontents, end, 0);
+        if (ptr == NULL) {
+            return 0;
+        }
+    }
+
+    if (!descend_into(&cccontents, recend, BER_CTX_CONS(2), &ipcc)) {
+        return 0;
+    }
+    if (!descend_into(&ipcc, recend, BER_CTX_PRIM(0), &oid)) {
+        return 0;
+    }
+    if (oid.len != sizeof(etsi_ipccoid) ||
+            memcmp(oid.content, etsi_ipccoid, sizeof(etsi_ipccoid)) != 0) {
+        return 0;
+    }
+
+    if (!next_child_field(oid.content + oid.len, field_end(&ipcc, recend),
+            &ipcccontents)) {
+        return 0;
+    }
+    if (ipcccontents.ident != BER_CTX_CONS(1)) {
+        return 0;
+    }
+    if (!descend_into(&ipcccontents, recend, BER_CTX_PRIM(0), &pkt)) {
+        return 0;
+    }
+
+    fields->ipcontent = pkt.content;
+    fields->iplen = pkt.len;
+    return 1;
+}
+
+int openli_extract_etsi_ipcc_fields(uint8_t *pdu, uint64_t bufrem,
+        openli_etsicc_fields_t *fields) {
+
+    ber_field_t pspdu, hdr, payload;
+    uint8_t *recend, *ptr;
+
+    memset(fields, 0, sizeof(openli_etsicc_fields_t));
+
+    if (!read_ber_field(pdu, pdu + bufrem, &pspdu)) {
+        return 0;
+    }
+    if (pspdu.ident != BER_SEQUENCE || pspdu.indefinite) {
+        return 0;
+    }
+
+    recend = pspdu.content + pspdu.len;
+    fields->pdulen = recend - pdu;
+
+    if (!next_child_field(pspdu.content, recend, &hdr) ||
+            hdr.ident != BER_CTX_CONS(1)) {
+        return 0;
+    }
+    if (!parse_psheader(&hdr, recend, fields, &ptr)) {
+        return 0;
+    }
+
+    if (!next_child_field(ptr, recend, &payload) ||
+            payload.ident != BER_CTX_CONS(2)) {
+        return 0;
+    }
+    return parse_ipcc_payload(&payload, recend, fields);
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
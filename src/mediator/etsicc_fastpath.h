@@ -0,0 +1,75 @@
+/*
+ *
+ * Copyright (c) 2018-2022 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef OPENLI_MEDIATOR_ETSICC_FASTPATH_H_
+#define OPENLI_MEDIATOR_ETSICC_FASTPATH_H_
+
+#include <stdint.h>
+
+/** The fields from an ETSI IPCC record that the mediator needs in order
+ *  to write the intercepted packet to a pcap file.
+ *
+ *  All pointers refer to locations inside the original record.
+ */
+typedef struct openli_etsicc_fields {
+    /** The length of the entire PS-PDU, including the outer header */
+    uint32_t pdulen;
+
+    /** The LIID for the record (not NULL-terminated) */
+    uint8_t *liid;
+
+    /** The length of the LIID */
+    uint16_t liidlen;
+
+    /** The intercepted IP packet */
+    uint8_t *ipcontent;
+
+    /** The length of the intercepted IP packet */
+    uint32_t iplen;
+} openli_etsicc_fields_t;
+
+/** Extracts the PDU length, LIID and IP packet from an ETSI
+ *  IPCC record, assuming it has the layout that the OpenLI collector's
+ *  templated encoder produces.
+ *
+ *  This is much cheaper than running the full libwandder ETSI decoder, but
+ *  only recognises IPCC records. If it fails, the caller should fall back
+ *  to the generic decoder, which will deal with any other record types and
+ *  report any genuine encoding errors.
+ *
+ *  @param pdu          Pointer to the start of the ETSI record
+ *  @param bufrem       The number of readable bytes available at pdu
+ *  @param fields       The structure to populate with the extracted fields
+ *
+ *  @return 1 if the record was parsed successfully, 0 if the record must
+ *          be decoded using the generic decoder instead.
+ */
+int openli_extract_etsi_ipcc_fields(uint8_t *pdu, uint64_t bufrem,
+        openli_etsicc_fields_t *fields);
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -26,6 +26,8 @@
 
 #include <pthread.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 
 #include "logger.h"
 #include "util.h"
@@ -114,7 +116,117 @@ int xmit_handover_keepalive(handover_t *ho) {
     return 0;
 }
 
+/** Returns the number of bytes that are queued for sending over a
+ *  handover, including both buffered and held records.
+ *
+ *  @param ho              The handover to check
+ *
+ *  @return the number of bytes waiting to be sent
+ */
+uint64_t get_handover_pending_amount(handover_t *ho) {
+    return get_buffered_amount(&(ho->ho_state->buf)) +
+            ho->ho_state->held.heldbytes;
+}
+
+/** Destroys every envelope in a handover's held envelope ring.
+ *
+ *  @param held             The ring to empty
+ */
+static void release_held_envelopes(held_envelope_ring_t *held) {
+
+    while (held->count > 0) {
+        amqp_destroy_envelope(&(held->envs[held->head]));
+        held->head = (held->head + 1) % HANDOVER_HELD_ENVELOPES;
+        held->count --;
+    }
+    held->head = 0;
+    held->frontoffset = 0;
+    held->heldbytes = 0;
+}
+
+/** Sends held RMQ envelopes out via a handover, using a single sendmsg()
+ *  call that gathers directly from the envelope bodies.
+ *
+ *  Envelopes are destroyed as soon as they have been sent in full.
+ *
+ *  @param ho              The handover to send the records over
+ *  @param maxsend         The maximum amount of data to send (in bytes)
+ *
+ *  @return -1 if an error occurs, otherwise the number of bytes sent.
+ */
+static int transmit_held_envelopes(handover_t *ho, uint32_t maxsend) {
+    held_envelope_ring_t *held = &(ho->ho_state->held);
+    struct iovec iov[HANDOVER_MAX_IOVECS];
+    struct msghdr msg;
+    amqp_envelope_t *env;
+    uint32_t i, idx, iovcnt = 0;
+    uint64_t total = 0;
+    ssize_t ret;
+
+    for (i = 0; i < held->count && iovcnt < HANDOVER_MAX_IOVECS &&
+            total < maxsend; i++) {
+        idx = (held->head + i) % HANDOVER_HELD_ENVELOPES;
+        env = &(held->envs[idx]);
+
+        if (i == 0) {
+            iov[iovcnt].iov_base = ((uint8_t *)env->message.body.bytes) +
+                    held->frontoffset;
+            iov[iovcnt].iov_len = env->message.body.len - held->frontoffset;
+        } else {
+            iov[iovcnt].iov_base = env->message.body.bytes;
+            iov[iovcnt].iov_len = env->message.body.len;
+        }
+        total += iov[iovcnt].iov_len;
+        iovcnt ++;
+    }
+
+    if (iovcnt == 0) {
+        return 0;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    ret = sendmsg(ho->outev->fd, &msg, MSG_DONTWAIT);
+    if (ret < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        if (ho->disconnect_msg == 0) {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: error while transmitting records for handover %s:%s HI%d -- %s",
+                    ho->ipstr, ho->portstr, ho->handover_type,
+                    strerror(errno));
+        }
+        return -1;
+    }
+
+    held->heldbytes -= ret;
+    total = ret;
+
+    /* Release every envelope that has now been sent in full */
+    while (ret > 0) {
+        env = &(held->envs[held->head]);
+        if ((uint64_t)ret < env->message.body.len - held->frontoffset) {
+            held->frontoffset += ret;
+            break;
+        }
+        ret -= (env->message.body.len - held->frontoffset);
+        amqp_destroy_envelope(env);
+        held->head = (held->head + 1) % HANDOVER_HELD_ENVELOPES;
+        held->count --;
+        held->frontoffset = 0;
+    }
+
+    return (int)total;
+}
+
 /** Sends a buffer of ETSI records out via a handover.
+ *
+ *  Any records in the export buffer are sent before any held RMQ
+ *  envelopes, so that records are always sent in the order they were
+ *  consumed.
  *
  *  @param ho              The handover to send the records over
  *  @param maxsend         The maximum amount of data to send (in bytes)
@@ -129,8 +241,13 @@ int xmit_handover_records(handover_t *ho, uint32_t maxsend) {
      * loop to handle other events rather than getting stuck trying to send
      * massive amounts of data in one go.
      */
-    if ((ret = transmit_buffered_records(&(ho->ho_state->buf), ho->outev->fd,
-			maxsend, NULL)) == -1) {
+    if (get_buffered_amount(&(ho->ho_state->buf)) > 0) {
+        ret = transmit_buffered_records(&(ho->ho_state->buf),
+                ho->outev->fd, maxsend, NULL);
+    } else {
+        ret = transmit_held_envelopes(ho, maxsend);
+    }
+    if (ret == -1) {
         return -1;
     }
 
@@ -222,7 +339,7 @@ int trigger_handover_keepalive(handover_t *ho, uint32_t mediator_id,
 
     if (ho->ho_state->pending_ka == NULL &&
             ho->aliverespev->fd == -1 &&
-            get_buffered_amount(&(ho->ho_state->buf)) == 0) {
+            get_handover_pending_amount(ho) == 0) {
         /* Only create a new KA message if we have sent the last one we
          * had queued up.
          * Also only create one if we don't already have data to send. We
@@ -346,8 +463,15 @@ void disconnect_handover(handover_t *ho) {
      */
     reset_export_buffer(&(ho->ho_state->buf));
 
+    /* Any partially sent held record will need to be sent again in full
+     * once we reconnect. */
+    ho->ho_state->held.heldbytes += ho->ho_state->held.frontoffset;
+    ho->ho_state->bytes_sent -= ho->ho_state->held.frontoffset;
+    ho->ho_state->held.frontoffset = 0;
+
     /* Drop the RMQ connection */
     reset_handover_rmq(ho);
+    ho->output_paused = 0;
 
     /* This handover is officially disconnected, so no more logging for it
      * until / unless it reconnects.
@@ -367,13 +491,28 @@ void free_handover(handover_t *ho) {
 
     destroy_mediator_timer(ho->aliveev);
     destroy_mediator_timer(ho->aliverespev);
+    if (ho->rmqev) {
+        detach_mediator_fdevent(ho->rmqev);
+        free(ho->rmqev);
+    }
 
     if (ho->rmq_consumer) {
         amqp_destroy_connection(ho->rmq_consumer);
     }
 
     if (ho->ho_state) {
+        if (ho->ho_state->held.envs) {
+            release_held_envelopes(&(ho->ho_state->held));
+            free(ho->ho_state->held.envs);
+        }
     	release_export_buffer(&(ho->ho_state->buf));
+        openli_metrics_deregister(ho->ho_state->metric_pending);
+        openli_metrics_deregister(ho->ho_state->metric_connected);
+        openli_metrics_deregister(ho->ho_state->metric_rmq_batch);
+        openli_metrics_deregister(ho->ho_state->metric_consumed);
+        openli_metrics_deregister(ho->ho_state->metric_lea_send);
+        openli_metrics_deregister(ho->ho_state->metric_total);
+        openli_metrics_deregister(ho->ho_state->rmqtrace.queuelatency);
 	    pthread_mutex_destroy(&(ho->ho_state->ho_mutex));
         free(ho->ho_state);
     }
@@ -496,6 +635,13 @@ int register_handover_RMQ_all(handover_t *ho, liid_map_t *liidmap,
         }
         ho->amqp_log_failure = 1;
         ho->rmq_registered = 1;
+
+        /* If we stopped writing while we had no RMQ consumer, start
+         * again now that we can consume records to send.
+         */
+        if (resume_handover_output(ho) < 0) {
+            return -1;
+        }
     }
 
     return 1;
@@ -628,9 +774,14 @@ handover_t *create_new_handover(int epoll_fd, char *ipstr, char *portstr,
     ho->ho_state->kawait = kawait;
     ho->ho_state->next_rmq_ack = 0;
     ho->ho_state->valid_rmq_ack = 0;
+    ho->ho_state->rmq_batch = HANDOVER_RMQ_BATCH_MIN;
+    ho->ho_state->bytes_sent = 0;
+    ho->ho_state->ackhead = 0;
+    ho->ho_state->ackcount = 0;
     ho->rmq_consumer = NULL;
     ho->rmq_registered = 0;
     ho->amqp_log_failure = 1;
+    ho->output_paused = 0;
 
 	pthread_mutex_init(&(ho->ho_state->ho_mutex), NULL);
 
@@ -652,6 +803,20 @@ handover_t *create_new_handover(int epoll_fd, char *ipstr, char *portstr,
         logger(LOG_INFO, "OpenLI Mediator: unable to create keep alive response timer for agency %s:%s", ipstr, portstr);
     }
 
+    /* This event is only added to epoll when we are waiting for the RMQ
+     * consumer to receive more records, so allocate it but leave it
+     * detached for now.
+     */
+    ho->rmqev = (med_epoll_ev_t *)calloc(1, sizeof(med_epoll_ev_t));
+    if (ho->rmqev == NULL) {
+        logger(LOG_INFO, "OpenLI Mediator: ran out of memory while allocating RMQ event for agency %s:%s", ipstr, portstr);
+    } else {
+        ho->rmqev->fd = -1;
+        ho->rmqev->fdtype = MED_EPOLL_LEA_RMQ;
+        ho->rmqev->epoll_fd = epoll_fd;
+        ho->rmqev->state = ho;
+    }
+
 	/* The output event will be created when the handover is connected */
 	ho->outev = NULL;
 
@@ -774,6 +939,147 @@ int receive_handover(handover_t *ho) {
     return 0;
 }
 
+/** Stops watching a handover socket for writability while there are no
+ *  records to send, and instead waits for the handover's RMQ consumer
+ *  socket to become readable.
+ *
+ *  @param ho       The handover to pause
+ *
+ *  @return -1 if an error occurs, 0 if the handover still has data that
+ *          can be sent or consumed immediately, 1 if the handover has
+ *          been paused.
+ */
+int pause_handover_output(handover_t *ho) {
+    int fd;
+
+    if (ho->outev == NULL) {
+        return 0;
+    }
+
+    if (ho->output_paused) {
+        return 1;
+    }
+
+    if (ho->ho_state->pending_ka || get_handover_pending_amount(ho) > 0) {
+        return 0;
+    }
+
+    if (ho->rmq_consumer) {
+        /* librabbitmq may have already pulled more messages off the
+         * socket, in which case epoll won't ever tell us about them.
+         */
+        if (mediator_RMQ_consumer_has_pending(ho->rmq_consumer)) {
+            return 0;
+        }
+
+        fd = get_mediator_RMQ_consumer_fd(ho->rmq_consumer);
+        if (attach_mediator_fdevent(ho->rmqev, fd, EPOLLIN) < 0) {
+            /* Fall back to polling the RMQ connection whenever the
+             * handover is writable */
+            return 0;
+        }
+    }
+
+    /* If we have no RMQ consumer, then we will be resumed once the
+     * consumer has been re-registered.
+     */
+    if (modify_mediator_fdevent(ho->outev, EPOLLIN | EPOLLRDHUP) < 0) {
+        return -1;
+    }
+    ho->output_paused = 1;
+    return 1;
+}
+
+/** Re-enables write events for a handover that was paused by
+ *  pause_handover_output().
+ *
+ *  @param ho       The handover to resume
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+int resume_handover_output(handover_t *ho) {
+
+    detach_mediator_fdevent(ho->rmqev);
+
+    if (!ho->output_paused) {
+        return 0;
+    }
+
+    if (modify_mediator_fdevent(ho->outev,
+                EPOLLIN | EPOLLOUT | EPOLLRDHUP) < 0) {
+        if (ho->disconnect_msg == 0) {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: unable to re-enable writing for handover %s:%s HI%d -- %s",
+                    ho->ipstr, ho->portstr, ho->handover_type,
+                    strerror(errno));
+        }
+        return -1;
+    }
+    ho->output_paused = 0;
+    return 0;
+}
+
+/** Updates the exported metrics for a handover, registering them first if
+ *  this is the first update since the handover was created.
+ *
+ *  @param ho       The handover to update metrics for
+ *  @param agencyid The ID of the agency that the handover belongs to
+ */
+void update_handover_metrics(handover_t *ho, char *agencyid) {
+    per_handover_state_t *hs;
+    const char *hi_str;
+
+    if (ho == NULL || ho->ho_state == NULL || !openli_metrics_enabled()) {
+        return;
+    }
+    hs = ho->ho_state;
+
+    if (hs->metric_pending == NULL) {
+        hi_str = (ho->handover_type == HANDOVER_HI2) ? "HI2" : "HI3";
+
+        hs->metric_pending = openli_metrics_register(OPENLI_METRIC_GAUGE,
+                "openli_mediator_handover_pending_bytes",
+                "Records waiting to be sent over a handover, in bytes",
+                "agency", agencyid, "handover", hi_str, NULL);
+        hs->metric_connected = openli_metrics_register(OPENLI_METRIC_GAUGE,
+                "openli_mediator_handover_connected",
+                "Whether a handover is connected to its agency",
+                "agency", agencyid, "handover", hi_str, NULL);
+        hs->metric_rmq_batch = openli_metrics_register(OPENLI_METRIC_GAUGE,
+                "openli_mediator_handover_rmq_batch",
+                "Number of records that a handover will consume from RMQ at a time",
+                "agency", agencyid, "handover", hi_str, NULL);
+        hs->metric_consumed = openli_metrics_register(OPENLI_METRIC_COUNTER,
+                "openli_mediator_handover_records_consumed_total",
+                "Records consumed from RMQ by a handover",
+                "agency", agencyid, "handover", hi_str, NULL);
+
+        hs->rmqtrace.queuelatency = openli_metrics_register_histogram(
+                "openli_mediator_record_latency_seconds",
+                "Time spent by sampled records in each stage of the mediator",
+                openli_latency_buckets, OPENLI_LATENCY_BUCKET_COUNT,
+                "agency", agencyid, "handover", hi_str,
+                "stage", "internal_rmq", NULL);
+        hs->metric_lea_send = openli_metrics_register_histogram(
+                "openli_mediator_record_latency_seconds",
+                "Time spent by sampled records in each stage of the mediator",
+                openli_latency_buckets, OPENLI_LATENCY_BUCKET_COUNT,
+                "agency", agencyid, "handover", hi_str,
+                "stage", "lea_send", NULL);
+        hs->metric_total = openli_metrics_register_histogram(
+                "openli_mediator_record_latency_seconds",
+                "Time spent by sampled records in each stage of the mediator",
+                openli_latency_buckets, OPENLI_LATENCY_BUCKET_COUNT,
+                "agency", agencyid, "handover", hi_str,
+                "stage", "total", NULL);
+    }
+
+    openli_metric_set(hs->metric_pending,
+            (double)get_handover_pending_amount(ho));
+    openli_metric_set(hs->metric_connected, ho->outev ? 1 : 0);
+    openli_metric_set(hs->metric_rmq_batch, hs->rmq_batch);
+}
+
 /** Checks if a handover's RMQ connection is still alive and error-free. If
  *  not, destroy the connection and reset it to NULL
  *
@@ -789,12 +1095,35 @@ int check_handover_rmq_status(handover_t *ho, char *agencyid) {
 
     if (ho->handover_type == HANDOVER_HI2) {
         hi_str = "HI2";
-        r = consume_mediator_iri_messages(ho->rmq_consumer,
-                &(ho->ho_state->buf), 1, &(ho->ho_state->next_rmq_ack));
+        if (ho->ho_state->zerocopy) {
+            r = consume_mediator_iri_envelopes(ho->rmq_consumer,
+                    &(ho->ho_state->held), 1, &(ho->ho_state->next_rmq_ack),
+                    &(ho->ho_state->rmqtrace));
+        } else {
+            r = consume_mediator_iri_messages(ho->rmq_consumer,
+                    &(ho->ho_state->buf), 1, &(ho->ho_state->next_rmq_ack),
+                    &(ho->ho_state->rmqtrace));
+        }
     } else {
         hi_str = "HI3";
-        r = consume_mediator_cc_messages(ho->rmq_consumer,
-                &(ho->ho_state->buf), 1, &(ho->ho_state->next_rmq_ack));
+        if (ho->ho_state->zerocopy) {
+            r = consume_mediator_cc_envelopes(ho->rmq_consumer,
+                    &(ho->ho_state->held), 1, &(ho->ho_state->next_rmq_ack),
+                    &(ho->ho_state->rmqtrace));
+        } else {
+            r = consume_mediator_cc_messages(ho->rmq_consumer,
+                    &(ho->ho_state->buf), 1, &(ho->ho_state->next_rmq_ack),
+                    &(ho->ho_state->rmqtrace));
+        }
+    }
+
+    if (r > 0) {
+        /* We've pulled a record into the buffer, so we need to make sure
+         * that it gets sent and acknowledged.
+         */
+        ho->ho_state->valid_rmq_ack = 1;
+        note_handover_rmq_consumed(ho, r);
+        resume_handover_output(ho);
     }
 
     if (r == -2) {
@@ -819,6 +1148,8 @@ int check_handover_rmq_status(handover_t *ho, char *agencyid) {
  *  @param ho       The handover to reset RMQ state for
  */
 void reset_handover_rmq(handover_t *ho) {
+    /* The RMQ socket is about to be closed, so stop watching it */
+    detach_mediator_fdevent(ho->rmqev);
     if (ho->rmq_consumer) {
         amqp_destroy_connection(ho->rmq_consumer);
     }
@@ -826,6 +1157,58 @@ void reset_handover_rmq(handover_t *ho) {
     ho->rmq_consumer = NULL;
     ho->rmq_registered = 0;
     ho->ho_state->valid_rmq_ack = 0;
+
+    /* Delivery tags from the old connection are meaningless now */
+    ho->ho_state->ackhead = 0;
+    ho->ho_state->ackcount = 0;
+}
+
+/** Records that a batch of records has just been consumed from RMQ into
+ *  the handover buffer, so that the batch can be acknowledged once the
+ *  records have been sent.
+ *
+ *  @param ho       The handover that consumed the records
+ *  @param count    The number of records that were consumed
+ */
+void note_handover_rmq_consumed(handover_t *ho, int count) {
+    per_handover_state_t *hs = ho->ho_state;
+    handover_ack_mark_t *mark;
+    uint64_t byteend;
+
+    if (count <= 0) {
+        return;
+    }
+
+    /* Every byte currently in the buffer has to be sent before the last
+     * record in this batch has been fully sent.
+     */
+    byteend = hs->bytes_sent + get_handover_pending_amount(ho);
+    hs->stat_consumed += count;
+    openli_metric_inc(hs->metric_consumed, count);
+
+    if (hs->ackcount == HANDOVER_MAX_ACK_MARKS) {
+        /* Ring is full, so merge this batch into the newest one. This
+         * just means that we'll acknowledge both at the same time.
+         */
+        mark = &(hs->ackmarks[(hs->ackhead + hs->ackcount - 1) %
+                HANDOVER_MAX_ACK_MARKS]);
+        mark->byteend = byteend;
+        mark->tag = hs->next_rmq_ack;
+        if (mark->capture_ts == 0) {
+            mark->capture_ts = hs->rmqtrace.capture_ts;
+        }
+        hs->rmqtrace.capture_ts = 0;
+        return;
+    }
+
+    mark = &(hs->ackmarks[(hs->ackhead + hs->ackcount) %
+            HANDOVER_MAX_ACK_MARKS]);
+    mark->byteend = byteend;
+    mark->tag = hs->next_rmq_ack;
+    mark->consumed_at = fetch_current_time_us();
+    mark->capture_ts = hs->rmqtrace.capture_ts;
+    hs->rmqtrace.capture_ts = 0;
+    hs->ackcount ++;
 }
 
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -35,6 +35,7 @@
 #include "export_buffer.h"
 #include "med_epoll.h"
 #include "liidmapping.h"
+#include "openli_metrics.h"
 
 /** Possible handover types */
 enum {
@@ -50,11 +51,98 @@ enum {
     HANDOVER_RAWIP = 4,
 };
 
+/** The smallest number of records that a handover will try to consume
+ *  from its internal RMQ queues in a single batch.
+ */
+#define HANDOVER_RMQ_BATCH_MIN 32
+
+/** The largest number of records that a handover will try to consume
+ *  from its internal RMQ queues in a single batch.
+ */
+#define HANDOVER_RMQ_BATCH_MAX 2048
+
+/** The maximum number of outstanding (i.e. consumed but not yet
+ *  acknowledged) batches that a handover will keep track of. If more
+ *  batches are consumed, they are merged into the most recent batch.
+ */
+#define HANDOVER_MAX_ACK_MARKS 64
+
+/** The amount of buffered data (in bytes) above which a handover will
+ *  stop consuming more records from RMQ until some of it has been sent.
+ */
+#define HANDOVER_PIPELINE_HIGH_WATER (8 * 1024 * 1024)
+
+/** The number of consumed RMQ envelopes that a handover can hold on to
+ *  while waiting to send them, when zero-copy sending is enabled.
+ */
+#define HANDOVER_HELD_ENVELOPES (HANDOVER_RMQ_BATCH_MAX * 2)
+
+/** The maximum number of held envelopes to send with a single call to
+ *  sendmsg() -- must not exceed IOV_MAX.
+ */
+#define HANDOVER_MAX_IOVECS 512
+
+/** A ring of consumed RMQ envelopes that are waiting to be sent directly
+ *  from the envelope body, instead of being copied into an export buffer.
+ */
+typedef struct held_envelope_ring {
+    /** The envelopes themselves -- allocated when first needed */
+    amqp_envelope_t *envs;
+    /** Index of the oldest (i.e. next to be sent) envelope */
+    uint32_t head;
+    /** Number of envelopes in the ring */
+    uint32_t count;
+    /** Number of bytes of the oldest envelope that have already been sent */
+    uint32_t frontoffset;
+    /** Total number of bytes in the ring that are yet to be sent */
+    uint64_t heldbytes;
+} held_envelope_ring_t;
+
+/** Latency tracing state for records that pass through the internal RMQ.
+ *
+ *  Producers fill in the timestamps for a sampled record so that they are
+ *  attached to the published message. Consumers provide a histogram for
+ *  the time spent in RMQ, and the capture timestamp of the first traced
+ *  record in a consumed batch is written back into capture_ts.
+ */
+typedef struct mediator_rmq_trace {
+    /** Time that the record was received from the collector (usecs) */
+    uint64_t received_ts;
+    /** Capture timestamp from the record's PS header (usecs) */
+    uint64_t capture_ts;
+    /** Histogram for time spent waiting in RMQ (consumers only) */
+    openli_metric_t *queuelatency;
+} mediator_rmq_trace_t;
+
+/** Describes a batch of records consumed from RMQ that have been written
+ *  into the handover buffer, but not yet fully sent to the agency.
+ */
+typedef struct handover_ack_mark {
+    /** The value of the handover's sent byte counter that must be reached
+     *  before every record in this batch has been sent.
+     */
+    uint64_t byteend;
+    /** The RMQ delivery tag of the last record in the batch */
+    uint64_t tag;
+    /** The time (in microseconds) that the batch was consumed */
+    uint64_t consumed_at;
+    /** Capture timestamp of a traced record in the batch (in microseconds),
+     *  or zero if the batch contained no traced records */
+    uint64_t capture_ts;
+} handover_ack_mark_t;
+
 /** State that needs to be retained for each mediator handover */
 typedef struct per_handover_state {
     /** A buffer for storing data queued for sending over the handover */
     export_buffer_t buf;
 
+    /** Envelopes consumed from RMQ that are queued for sending over the
+     *  handover without being copied into 'buf' */
+    held_envelope_ring_t held;
+    /** Flag indicating whether newly consumed records are being held
+     *  in 'held' (1) or copied into 'buf' (0) */
+    uint8_t zerocopy;
+
     /** A buffer for storing data received over the handover
      * (e.g. keepalives)
      */
@@ -69,6 +157,44 @@ typedef struct per_handover_state {
     pthread_mutex_t ho_mutex;
     uint64_t next_rmq_ack;
     uint8_t valid_rmq_ack;
+
+    /** The number of records to consume from RMQ in the next batch --
+     *  grows while the LEA is keeping up, shrinks when it is not.
+     */
+    uint32_t rmq_batch;
+    /** Total number of bytes that have left the buffer for this handover,
+     *  used as a watermark for deciding which RMQ deliveries can be
+     *  acknowledged.
+     */
+    uint64_t bytes_sent;
+    /** Ring of consumed batches that are waiting to be acknowledged */
+    handover_ack_mark_t ackmarks[HANDOVER_MAX_ACK_MARKS];
+    /** Index of the oldest entry in the ackmarks ring */
+    uint16_t ackhead;
+    /** Number of entries in the ackmarks ring */
+    uint16_t ackcount;
+
+    /** Number of records consumed from RMQ since stats were last logged */
+    uint64_t stat_consumed;
+    /** Number of consumed batches that have been sent in full since stats
+     *  were last logged */
+    uint64_t stat_batches;
+    /** Sum of the consume-to-send latencies for those batches (in usecs) */
+    uint64_t stat_latency_total;
+    /** Largest consume-to-send latency for those batches (in usecs) */
+    uint64_t stat_latency_max;
+
+    /** Exported metrics for this handover (NULL until first updated, or if
+     *  metrics are disabled) */
+    openli_metric_t *metric_pending;
+    openli_metric_t *metric_connected;
+    openli_metric_t *metric_rmq_batch;
+    openli_metric_t *metric_consumed;
+    openli_metric_t *metric_lea_send;
+    openli_metric_t *metric_total;
+
+    /** Latency tracing state for records consumed from RMQ */
+    mediator_rmq_trace_t rmqtrace;
 } per_handover_state_t;
 
 typedef struct handover {
@@ -83,6 +209,15 @@ typedef struct handover {
     med_epoll_ev_t *aliverespev;
     per_handover_state_t *ho_state;
     uint8_t disconnect_msg;
+
+    /** Epoll event for the RMQ consumer socket, only attached while the
+     *  handover is waiting for more records to arrive from RMQ.
+     */
+    med_epoll_ev_t *rmqev;
+    /** Flag indicating whether write events on the handover socket are
+     *  currently disabled because there is nothing to send.
+     */
+    uint8_t output_paused;
 } handover_t;
 
 typedef struct mediator_agency {
@@ -110,6 +245,15 @@ void destroy_agency(mediator_agency_t *ag);
  */
 int xmit_handover_records(handover_t *ho, uint32_t maxsend);
 
+/** Returns the number of bytes that are queued for sending over a
+ *  handover, including both buffered and held records.
+ *
+ *  @param ho              The handover to check
+ *
+ *  @return the number of bytes waiting to be sent
+ */
+uint64_t get_handover_pending_amount(handover_t *ho);
+
 /** Sends any pending keep-alive message out via a handover.
  *
  *  @param ho              The handover to send the keep-alive over
@@ -221,6 +365,47 @@ int register_handover_RMQ_all(handover_t *ho, liid_map_t *liidmap,
  */
 void reset_handover_rmq(handover_t *ho);
 
+/** Stops watching a handover socket for writability while there are no
+ *  records to send, and instead waits for the handover's RMQ consumer
+ *  socket to become readable.
+ *
+ *  Avoids spinning on a writable handover socket (or sleeping) when the
+ *  internal RMQ queues are empty.
+ *
+ *  @param ho       The handover to pause
+ *
+ *  @return -1 if an error occurs, 0 if the handover still has data that
+ *          can be sent or consumed immediately, 1 if the handover has
+ *          been paused.
+ */
+int pause_handover_output(handover_t *ho);
+
+/** Re-enables write events for a handover that was paused by
+ *  pause_handover_output().
+ *
+ *  @param ho       The handover to resume
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+int resume_handover_output(handover_t *ho);
+
+/** Records that a batch of records has just been consumed from RMQ into
+ *  the handover buffer, so that the batch can be acknowledged once the
+ *  records have been sent.
+ *
+ *  @param ho       The handover that consumed the records
+ *  @param count    The number of records that were consumed
+ */
+void note_handover_rmq_consumed(handover_t *ho, int count);
+
+/** Updates the exported metrics for a handover, registering them first if
+ *  this is the first update since the handover was created.
+ *
+ *  @param ho       The handover to update metrics for
+ *  @param agencyid The ID of the agency that the handover belongs to
+ */
+void update_handover_metrics(handover_t *ho, char *agencyid);
+
 /** Checks if a handover's RMQ connection is still alive and error-free. If
  *  not, destroy the connection and reset it to NULL
  *
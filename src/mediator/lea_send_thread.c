@@ -31,6 +31,7 @@
 #include "mediator_rmq.h"
 #include "handover.h"
 #include "agency.h"
+#include "util.h"
 
 /** The code in this source file implements an "LEA send" thread for the
  *  OpenLI mediator.
@@ -174,6 +175,47 @@ static int purge_empty_withdrawn_liid_queues(liid_map_entry_t *m,
     return 0;
 }
 
+/** Updates the metrics that report how many records are waiting in the
+ *  internal RMQ queues for an LIID.
+ *
+ *  Used as a callback for foreach_liid_agency_mapping().
+ *
+ *  @param m            The LIID to update the queue metrics for
+ *  @param statearg     The state object for the LEA send thread
+ *
+ *  @return 0 always
+ */
+static int update_liid_queue_metrics(liid_map_entry_t *m, void *statearg) {
+
+    lea_thread_state_t *state = (lea_thread_state_t *)statearg;
+    uint32_t count;
+
+    if (m->metric_iri_ready == NULL) {
+        m->metric_iri_ready = openli_metrics_register(OPENLI_METRIC_GAUGE,
+                "openli_mediator_rmq_ready_messages",
+                "Records waiting to be consumed from an internal RMQ queue",
+                "agency", state->agencyid, "liid", m->liid, "queue", "iri",
+                NULL);
+        m->metric_cc_ready = openli_metrics_register(OPENLI_METRIC_GAUGE,
+                "openli_mediator_rmq_ready_messages",
+                "Records waiting to be consumed from an internal RMQ queue",
+                "agency", state->agencyid, "liid", m->liid, "queue", "cc",
+                NULL);
+    }
+
+    /* Don't re-declare queues that we have already removed */
+    if (m->iriqueue_deleted == 0 && count_mediator_iri_RMQ_messages(
+                state->agency.hi2->rmq_consumer, m->liid, &count) == 0) {
+        openli_metric_set(m->metric_iri_ready, count);
+    }
+
+    if (m->ccqueue_deleted == 0 && count_mediator_cc_RMQ_messages(
+                state->agency.hi3->rmq_consumer, m->liid, &count) == 0) {
+        openli_metric_set(m->metric_cc_ready, count);
+    }
+    return 0;
+}
+
 /** Updates the handovers for an agency based on new information sent
  *  by the provisioner.
  *
@@ -237,9 +279,77 @@ static void update_agency_handovers(mediator_agency_t *currag,
     free_liagency(newag);
 }
 
+/** Acknowledges every consumed batch whose records have now been sent in
+ *  full, i.e. every batch that is below the handover's sent bytes
+ *  watermark.
+ *
+ *  @param ho       The handover to acknowledge sent records for
+ *  @param state    The state object for the LEA send thread
+ *
+ *  @return -1 if an error occurs while acknowledging, 0 otherwise.
+ */
+static int ack_sent_rmq_records(handover_t *ho, lea_thread_state_t *state) {
+    per_handover_state_t *hs = ho->ho_state;
+    handover_ack_mark_t *mark;
+    uint64_t tag = 0, now = 0, lat;
+    int r;
+
+    while (hs->ackcount > 0) {
+        mark = &(hs->ackmarks[hs->ackhead]);
+        if (mark->byteend > hs->bytes_sent) {
+            break;
+        }
+        if (now == 0) {
+            now = fetch_current_time_us();
+        }
+        lat = (now > mark->consumed_at) ? now - mark->consumed_at : 0;
+        hs->stat_latency_total += lat;
+        if (lat > hs->stat_latency_max) {
+            hs->stat_latency_max = lat;
+        }
+        hs->stat_batches ++;
+        openli_metric_observe_latency(hs->metric_lea_send,
+                mark->consumed_at, now);
+        if (mark->capture_ts != 0 && mark->capture_ts <= now) {
+            openli_metric_observe_latency(hs->metric_total,
+                    mark->capture_ts, now);
+        }
+
+        tag = mark->tag;
+        hs->ackhead = (hs->ackhead + 1) % HANDOVER_MAX_ACK_MARKS;
+        hs->ackcount --;
+    }
+
+    if (tag == 0) {
+        return 0;
+    }
+
+    /* Acks are cumulative, so acknowledging the most recent tag covers
+     * all of the earlier batches too */
+    if (ho->handover_type == HANDOVER_HI2) {
+        if ((r = ack_mediator_iri_messages(ho->rmq_consumer, tag)) != 0) {
+            logger(LOG_INFO, "OpenLI Mediator: error while acknowledging sent data from internal IRI queue by agency %s: %d", state->agencyid, r);
+            return -1;
+        }
+    } else if (ho->handover_type == HANDOVER_HI3) {
+        if ((r = ack_mediator_cc_messages(ho->rmq_consumer, tag)) != 0) {
+            logger(LOG_INFO, "OpenLI Mediator: error while acknowledging sent data from internal CC queue by agency %s: %d", state->agencyid, r);
+            return -1;
+        }
+    }
+    if (hs->ackcount == 0) {
+        hs->valid_rmq_ack = 0;
+    }
+    return 0;
+}
+
 /** Sends intercept records from a handover's local buffer to the
  *  corresponding agency.
  *
+ *  Records are acknowledged in RMQ as soon as the batch they were
+ *  consumed in has left the buffer, rather than waiting for the entire
+ *  buffer to drain.
+ *
  *  @param ho       The handover to send records from
  *  @param state    The state object for the LEA send thread
  *
@@ -249,9 +359,10 @@ static void update_agency_handovers(mediator_agency_t *currag,
  */
 static inline int send_available_rmq_records(handover_t *ho,
         lea_thread_state_t *state) {
-    int r;
+    uint64_t before, after;
 
-    if (get_buffered_amount(&(ho->ho_state->buf)) == 0) {
+    before = get_handover_pending_amount(ho);
+    if (before == 0) {
         /* No records available to send */
         return 0;
     }
@@ -261,24 +372,16 @@ static inline int send_available_rmq_records(handover_t *ho,
         return -1;
     }
 
-    /* We only acknowledge in RMQ once the whole message set has been
-     * sent, so try to avoid buffering too many messages at once */
-    if (get_buffered_amount(&(ho->ho_state->buf)) == 0 &&
-            ho->ho_state->valid_rmq_ack) {
-        if (ho->handover_type == HANDOVER_HI2) {
-            if (ack_mediator_iri_messages(ho->rmq_consumer,
-                        ho->ho_state->next_rmq_ack) < 0) {
-                logger(LOG_INFO, "OpenLI Mediator: error while acknowledging sent data from internal IRI queue by agency %s", state->agencyid);
-                return -2;
-            }
-        } else if (ho->handover_type == HANDOVER_HI3) {
-            if ((r = ack_mediator_cc_messages(ho->rmq_consumer,
-                        ho->ho_state->next_rmq_ack)) != 0) {
-                logger(LOG_INFO, "OpenLI Mediator: error while acknowledging sent data from internal CC queue by agency %s: %d", state->agencyid, r);
-                return -2;
-            }
-        }
-        ho->ho_state->valid_rmq_ack = 0;
+    /* Partially sent records remain in the buffer, so this will only
+     * count records that have been sent in full.
+     */
+    after = get_handover_pending_amount(ho);
+    if (after < before) {
+        ho->ho_state->bytes_sent += (before - after);
+    }
+
+    if (ack_sent_rmq_records(ho, state) < 0) {
+        return -2;
     }
     return 1;
 }
@@ -286,9 +389,18 @@ static inline int send_available_rmq_records(handover_t *ho,
 /** Consumes any available intercept records from the RMQ connection for
  *  a particular handover and tries to send them to the receiving agency.
  *
- *  Only consumes if the handover local buffer is empty, otherwise this
- *  function will try to send and acknowledge the existing buffer contents
- *  first.
+ *  Consumption and sending are pipelined: more records are consumed
+ *  whenever the handover buffer is below HANDOVER_PIPELINE_HIGH_WATER,
+ *  even if earlier records are still waiting to be sent, so the handover
+ *  socket always has data available while the LEA is keeping up.
+ *
+ *  The number of records consumed at once adapts to how quickly the
+ *  agency is accepting them: the batch doubles whenever a full batch was
+ *  available and halves whenever the buffer reaches the high water mark.
+ *
+ *  If there is nothing to consume and nothing to send, the handover stops
+ *  polling for writability and waits for the RMQ socket to become readable
+ *  instead.
  *
  *  @param ho       The handover to consume and send records for
  *  @param state    The state object for the LEA send thread
@@ -298,46 +410,91 @@ static inline int send_available_rmq_records(handover_t *ho,
 static int consume_available_rmq_records(handover_t *ho,
         lea_thread_state_t *state) {
 
-    int r;
+    int r, consumed = 0;
+    per_handover_state_t *hs = ho->ho_state;
 
-    if (ho->rmq_registered == 0) {
-        return 0;
-    }
-
-    /* If we have records in the buffer already, try to send and
-     * acknowledge those.
+    /* Send whatever we have already, acknowledging any batches that
+     * have now been sent in full.
      */
-    if ((r = send_available_rmq_records(ho, state)) == 1) {
-        ho->disconnect_msg = 0;
-        return 0;
-    } else if (r == -2) {
+    r = send_available_rmq_records(ho, state);
+    if (r == -2) {
         reset_handover_rmq(ho);
-        return 0;
     } else if (r == -1) {
         return -1;
+    } else if (r == 1) {
+        ho->disconnect_msg = 0;
+    }
+
+    if (get_handover_pending_amount(ho) >= HANDOVER_PIPELINE_HIGH_WATER ||
+            hs->held.count >= HANDOVER_HELD_ENVELOPES) {
+        /* The LEA is not keeping up, so consume smaller batches until it
+         * catches up again.
+         */
+        if (hs->rmq_batch > HANDOVER_RMQ_BATCH_MIN) {
+            hs->rmq_batch /= 2;
+        }
+        return 0;
     }
 
-    r = 0;
-    /* Otherwise, read some new messages from RMQ and try to send those */
+    if (ho->rmq_registered == 0) {
+        /* Nothing to consume until the RMQ consumer is re-registered by
+         * the main thread loop, so don't spin on a writable socket */
+        if (get_handover_pending_amount(ho) == 0) {
+            return pause_handover_output(ho) < 0 ? -1 : 0;
+        }
+        return 0;
+    }
+
+    /* Only switch between copying and holding consumed records when
+     * nothing is queued, so that records are always sent in order */
+    if (get_handover_pending_amount(ho) == 0) {
+        hs->zerocopy = state->zerocopy_handovers;
+    }
+
+    /* Read some new messages from RMQ to go out behind whatever is
+     * already in the buffer */
     if (ho->handover_type == HANDOVER_HI3) {
-        r = consume_mediator_cc_messages(ho->rmq_consumer,
-                &(ho->ho_state->buf), 32, &(ho->ho_state->next_rmq_ack));
-        if (r < 0) {
+        if (hs->zerocopy) {
+            consumed = consume_mediator_cc_envelopes(ho->rmq_consumer,
+                    &(hs->held), hs->rmq_batch, &(hs->next_rmq_ack),
+                    &(hs->rmqtrace));
+        } else {
+            consumed = consume_mediator_cc_messages(ho->rmq_consumer,
+                    &(hs->buf), hs->rmq_batch, &(hs->next_rmq_ack),
+                    &(hs->rmqtrace));
+        }
+        if (consumed < 0) {
             reset_handover_rmq(ho);
             logger(LOG_INFO, "OpenLI Mediator: error while consuming CC messages from internal queue by agency %s", state->agencyid);
             return 0;
-        } else if (r > 0) {
-            ho->ho_state->valid_rmq_ack = 1;
         }
     } else if (ho->handover_type == HANDOVER_HI2) {
-        r = consume_mediator_iri_messages(ho->rmq_consumer,
-                &(ho->ho_state->buf), 32, &(ho->ho_state->next_rmq_ack));
-        if (r < 0) {
+        if (hs->zerocopy) {
+            consumed = consume_mediator_iri_envelopes(ho->rmq_consumer,
+                    &(hs->held), hs->rmq_batch, &(hs->next_rmq_ack),
+                    &(hs->rmqtrace));
+        } else {
+            consumed = consume_mediator_iri_messages(ho->rmq_consumer,
+                    &(hs->buf), hs->rmq_batch, &(hs->next_rmq_ack),
+                    &(hs->rmqtrace));
+        }
+        if (consumed < 0) {
             reset_handover_rmq(ho);
             logger(LOG_INFO, "OpenLI Mediator: error while consuming IRI messages from internal queue by agency %s", state->agencyid);
             return 0;
-        } else if (r > 0) {
-            ho->ho_state->valid_rmq_ack = 1;
+        }
+    }
+
+    if (consumed > 0) {
+        hs->valid_rmq_ack = 1;
+        note_handover_rmq_consumed(ho, consumed);
+
+        /* A full batch suggests there is more waiting for us, so try
+         * to grab more next time.
+         */
+        if ((uint32_t)consumed >= hs->rmq_batch &&
+                hs->rmq_batch < HANDOVER_RMQ_BATCH_MAX) {
+            hs->rmq_batch *= 2;
         }
     }
 
@@ -349,19 +506,91 @@ static int consume_available_rmq_records(handover_t *ho,
         start_mediator_timer(state->rmqhb, state->rmq_hb_freq);
     }
 
-    /* If our earlier "consume" got us some intercept records, try to send
-     * them now.
-     */
-    r = send_available_rmq_records(ho, state);
-    if (r > 0) {
-        ho->disconnect_msg = 0;
-        return 0;
-    } else if (r == -2) {
-        reset_handover_rmq(ho);
+    if (consumed > 0) {
+        /* Try to get the new records moving straight away */
+        r = send_available_rmq_records(ho, state);
+        if (r == -2) {
+            reset_handover_rmq(ho);
+        } else if (r == -1) {
+            return -1;
+        }
+    }
+
+    if (get_handover_pending_amount(ho) > 0) {
+        /* We'll be back here as soon as the socket is writable again */
         return 0;
     }
 
-    return r;
+    /* Nothing to send and nothing in RMQ -- wait for RMQ to tell us that
+     * more records have arrived, rather than polling.
+     */
+    if (pause_handover_output(ho) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/** Writes the consume and send statistics for a handover to the log, then
+ *  resets them.
+ *
+ *  @param ho           The handover to log statistics for
+ *  @param state        The state object for the LEA send thread
+ *  @param elapsed      The time since the statistics were last reset, in
+ *                      microseconds
+ */
+static void log_handover_stats(handover_t *ho, lea_thread_state_t *state,
+        uint64_t elapsed) {
+
+    per_handover_state_t *hs = ho->ho_state;
+    double rate = 0;
+    uint64_t avglat = 0;
+
+    if (elapsed > 0) {
+        rate = ((double)hs->stat_consumed * 1000000.0) / elapsed;
+    }
+    if (hs->stat_batches > 0) {
+        avglat = hs->stat_latency_total / hs->stat_batches;
+    }
+
+    logger(LOG_INFO, "OpenLI Mediator: HI%d for agency %s consumed %lu records (%.1f msgs/s), batch size %u",
+            ho->handover_type, state->agencyid, hs->stat_consumed, rate,
+            hs->rmq_batch);
+    logger(LOG_INFO, "OpenLI Mediator: HI%d for agency %s consume-to-send latency... avg: %lu us   max: %lu us   (%lu batches)",
+            ho->handover_type, state->agencyid, avglat,
+            hs->stat_latency_max, hs->stat_batches);
+
+    hs->stat_consumed = 0;
+    hs->stat_batches = 0;
+    hs->stat_latency_total = 0;
+    hs->stat_latency_max = 0;
+}
+
+/** Logs the handover statistics for an LEA send thread, if the configured
+ *  statistic logging interval has passed.
+ *
+ *  @param state        The state object for the LEA send thread
+ */
+static void check_handover_stats(lea_thread_state_t *state) {
+    uint64_t now = fetch_current_time_us();
+
+    if (state->stat_frequency == 0) {
+        state->last_stat_log = now;
+        return;
+    }
+
+    if (state->last_stat_log == 0) {
+        state->last_stat_log = now;
+        return;
+    }
+
+    if (now - state->last_stat_log <
+            ((uint64_t)state->stat_frequency) * 60 * 1000000) {
+        return;
+    }
+
+    log_handover_stats(state->agency.hi2, state, now - state->last_stat_log);
+    log_handover_stats(state->agency.hi3, state, now - state->last_stat_log);
+    state->last_stat_log = now;
 }
 
 /** De-registers the RMQ consumers for an LIID that has not been
@@ -423,6 +652,11 @@ int agency_thread_action_rmqcheck_timer(lea_thread_state_t *state,
             (void *)(&(state->agency)),
             purge_empty_withdrawn_liid_queues);
 
+    if (openli_metrics_enabled()) {
+        foreach_liid_agency_mapping(&(state->active_liids), (void *)state,
+                update_liid_queue_metrics);
+    }
+
     if (start_mediator_timer(mev, state->rmq_hb_freq) < 0) {
         logger(LOG_INFO, "OpenLI Mediator: unable to reset RMQ heartbeat timer in agency thread for %s: %s", state->agencyid, strerror(errno));
         return 0;
@@ -495,6 +729,11 @@ static int agency_thread_epoll_event(lea_thread_state_t *state,
             ho = (handover_t *)(mev->state);
             trigger_handover_keepalive(ho, state->mediator_id,
                     state->operator_id);
+            /* Make sure we are watching for writability, otherwise the
+             * keep alive will never get sent */
+            if (ho->ho_state->pending_ka && resume_handover_output(ho) < 0) {
+                disconnect_handover(ho);
+            }
             ret = 0;
             break;
         case MED_EPOLL_KA_RESPONSE_TIMER:
@@ -544,6 +783,23 @@ static int agency_thread_epoll_event(lea_thread_state_t *state,
                 ret = 0;
             }
             break;
+        case MED_EPOLL_LEA_RMQ:
+            /* more records have arrived for an idle handover */
+            ho = (handover_t *)(mev->state);
+            if (mev->fd == -1) {
+                /* already resumed earlier in this batch of events */
+                ret = 0;
+                break;
+            }
+            if (ev->events & (EPOLLERR | EPOLLHUP)) {
+                /* RMQ connection has failed, it will be re-registered
+                 * by the main loop */
+                reset_handover_rmq(ho);
+            } else if (resume_handover_output(ho) < 0) {
+                disconnect_handover(ho);
+            }
+            ret = 0;
+            break;
         default:
             logger(LOG_INFO, "OpenLI Mediator: invalid epoll event type %d seen in agency thread for %s", mev->fdtype, state->agencyid);
             ret = -1;
@@ -676,6 +932,8 @@ int read_parent_config(lea_thread_state_t *state) {
     state->mediator_id = state->parentconfig->mediatorid;
     state->pcap_compress_level = state->parentconfig->pcap_compress_level;
     state->pcap_rotate_frequency = state->parentconfig->pcap_rotate_frequency;
+    state->stat_frequency = state->parentconfig->stat_frequency;
+    state->zerocopy_handovers = state->parentconfig->zerocopy_handovers;
 
     /* most LEA threads won't need these pcap options, but it's not a
      * big cost for us to copy them
@@ -1073,6 +1331,9 @@ static void *run_agency_thread(void *params) {
         }
 
         halt_mediator_timer(state->timerev);
+        check_handover_stats(state);
+        update_handover_metrics(state->agency.hi2, state->agencyid);
+        update_handover_metrics(state->agency.hi3, state->agencyid);
     }
 threadexit:
     logger(LOG_INFO, "OpenLI Mediator: ending agency thread for %s",
@@ -1263,12 +1524,17 @@ void mediator_disconnect_all_leas(mediator_lea_t *medleas) {
  *  @param pcaptemplate     The template to use when naming pcap files
  *  @param pcapcompress     The compression level to use when writing pcap files
  *  @param pcaprotate       The frequency to rotate pcap files, in minutes
+ *  @param statfreq         The frequency to log handover statistics, in
+ *                          minutes (0 to disable)
+ *  @param zerocopy         Flag indicating whether handovers should send
+ *                          records directly from the consumed RMQ messages
  *
  */
 void init_med_agency_config(mediator_lea_config_t *config,
         openli_RMQ_config_t *rmqconf, uint32_t mediatorid, char *operatorid,
         char *shortopid, char *pcapdir, char *pcaptemplate,
-        uint8_t pcapcompress, uint32_t pcaprotate) {
+        uint8_t pcapcompress, uint32_t pcaprotate, uint32_t statfreq,
+        uint8_t zerocopy) {
 
     memset(config, 0, sizeof(mediator_lea_config_t));
 
@@ -1282,6 +1548,8 @@ void init_med_agency_config(mediator_lea_config_t *config,
     }
     config->pcap_compress_level = pcapcompress;
     config->pcap_rotate_frequency = pcaprotate;
+    config->stat_frequency = statfreq;
+    config->zerocopy_handovers = zerocopy;
     if (pcapdir) {
         config->pcap_dir = strdup(pcapdir);
     }
@@ -1302,17 +1570,24 @@ void init_med_agency_config(mediator_lea_config_t *config,
  *  @param pcaptemplate     The template to use when naming pcap files
  *  @param pcapcompress     The compression level to use when writing pcap files
  *  @param pcaprotate       The frequency to rotate pcap files, in minutes
+ *  @param statfreq         The frequency to log handover statistics, in
+ *                          minutes (0 to disable)
+ *  @param zerocopy         Flag indicating whether handovers should send
+ *                          records directly from the consumed RMQ messages
  *
  */
 void update_med_agency_config(mediator_lea_config_t *config,
         uint32_t mediatorid, char *operatorid,
         char *shortopid, char *pcapdir, char *pcaptemplate,
-        uint8_t pcapcompress, uint32_t pcaprotate) {
+        uint8_t pcapcompress, uint32_t pcaprotate, uint32_t statfreq,
+        uint8_t zerocopy) {
 
     pthread_mutex_lock(&(config->mutex));
     config->mediatorid = mediatorid;
     config->pcap_compress_level = pcapcompress;
     config->pcap_rotate_frequency = pcaprotate;
+    config->stat_frequency = statfreq;
+    config->zerocopy_handovers = zerocopy;
 
     if (config->operatorid) {
         free(config->operatorid);
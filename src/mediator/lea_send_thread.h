@@ -134,6 +134,15 @@ typedef struct mediator_lea_config {
     /** The frequency (in minutes) to rotate pcap files */
     uint32_t pcap_rotate_frequency;
 
+    /** The frequency (in minutes) to log handover statistics, or zero to
+     *  disable statistic logging */
+    uint32_t stat_frequency;
+
+    /** Flag indicating whether handovers should send records directly
+     *  from the consumed RMQ messages, rather than copying them into an
+     *  export buffer first */
+    uint8_t zerocopy_handovers;
+
     /** A mutex to protect the shared config from race conditions */
     pthread_mutex_t mutex;
 } mediator_lea_config_t;
@@ -172,6 +181,16 @@ typedef struct lea_thread_state {
     /** The frequency (in minutes) to rotate pcap files */
     uint32_t pcap_rotate_frequency;
 
+    /** The frequency (in minutes) to log handover statistics */
+    uint32_t stat_frequency;
+    /** The time (in microseconds) when handover statistics were last
+     *  logged */
+    uint64_t last_stat_log;
+
+    /** Flag indicating whether handovers should send records directly
+     *  from the consumed RMQ messages */
+    uint8_t zerocopy_handovers;
+
     /** The queue for messages from the main mediator thread */
     libtrace_message_queue_t in_main;
 
@@ -197,6 +216,9 @@ typedef struct lea_thread_state {
     /** Mediator epoll event for a timer to remove unconfirmed LIID mappings */
     med_epoll_ev_t *cleanse_liids;
 
+    /** The number of pcap writer threads to start (pcap thread only) */
+    uint32_t pcap_writers;
+
     UT_hash_handle hh;
 
 } lea_thread_state_t;
@@ -263,12 +285,17 @@ void mediator_disconnect_all_leas(mediator_lea_t *medleas);
  *  @param pcaptemplate     The template to use when naming pcap files
  *  @param pcapcompress     The compression level to use when writing pcap files
  *  @param pcaprotate       The frequency to rotate pcap files, in minutes
+ *  @param statfreq         The frequency to log handover statistics, in
+ *                          minutes (0 to disable)
+ *  @param zerocopy         Flag indicating whether handovers should send
+ *                          records directly from the consumed RMQ messages
  *
  */
 void init_med_agency_config(mediator_lea_config_t *config,
         openli_RMQ_config_t *rmqconf, uint32_t mediatorid, char *operatorid,
         char *shortopid, char *pcapdir, char *pcaptemplate,
-        uint8_t pcapcompress, uint32_t pcaprotate);
+        uint8_t pcapcompress, uint32_t pcaprotate, uint32_t statfreq,
+        uint8_t zerocopy);
 
 /** Updates the shared configuration for the LEA send threads with new values
  *
@@ -280,12 +307,17 @@ void init_med_agency_config(mediator_lea_config_t *config,
  *  @param pcaptemplate     The template to use when naming pcap files
  *  @param pcapcompress     The compression level to use when writing pcap files
  *  @param pcaprotate       The frequency to rotate pcap files, in minutes
+ *  @param statfreq         The frequency to log handover statistics, in
+ *                          minutes (0 to disable)
+ *  @param zerocopy         Flag indicating whether handovers should send
+ *                          records directly from the consumed RMQ messages
  *
  */
 void update_med_agency_config(mediator_lea_config_t *config,
         uint32_t mediatorid, char *operatorid,
         char *shortopid, char *pcapdir, char *pcaptemplate,
-        uint8_t pcapcompress, uint32_t pcaprotate);
+        uint8_t pcapcompress, uint32_t pcaprotate, uint32_t statfreq,
+        uint8_t zerocopy);
 
 /** Destroys the shared configuration for the LEA send threads.
  *
@@ -52,6 +52,8 @@ liid_map_entry_t *lookup_liid_agency_mapping(liid_map_t *map, char *liidstr) {
  *  @param m        The LIID map entry to be freed
  */
 void destroy_liid_mapping(liid_map_entry_t *m) {
+    openli_metrics_deregister(m->metric_iri_ready);
+    openli_metrics_deregister(m->metric_cc_ready);
     free(m->liid);
     free(m);
 }
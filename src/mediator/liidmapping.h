@@ -29,6 +29,7 @@
 
 #include <Judy.h>
 #include <amqp.h>
+#include "openli_metrics.h"
 
 typedef struct liidmapping liid_map_entry_t;
 
@@ -58,6 +59,12 @@ struct liidmapping {
      *  been deleted by the mediator.
      */
     uint8_t iriqueue_deleted;
+
+    /** Exported metrics for the number of records waiting in the internal
+     *  IRI and CC queues for this LIID (NULL if metrics are disabled).
+     */
+    openli_metric_t *metric_iri_ready;
+    openli_metric_t *metric_cc_ready;
 };
 
 /** The map used to track which LIIDs should be sent to which agencies */
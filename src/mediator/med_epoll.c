@@ -295,4 +295,59 @@ int remove_mediator_fdevent(med_epoll_ev_t *remev) {
 	return ret;
 }
 
+/** Adds an existing mediator epoll event to the epoll event set, using a
+ *  file descriptor that is owned by some other entity (e.g. a library
+ *  connection object).
+ *
+ *  @param ev               The epoll event to attach -- the fdtype, state
+ *                          and epoll_fd members must already be set.
+ *  @param fd               The file descriptor to watch.
+ *  @param events           The epoll events to apply to the fd, as a bitmask.
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+int attach_mediator_fdevent(med_epoll_ev_t *ev, int fd, uint32_t events) {
+    struct epoll_event epollev;
+
+    if (ev == NULL || fd < 0) {
+        return -1;
+    }
+    if (ev->fd != -1) {
+        /* Already attached */
+        return 0;
+    }
+
+    epollev.data.ptr = ev;
+    epollev.events = events;
+
+    if (epoll_ctl(ev->epoll_fd, EPOLL_CTL_ADD, fd, &epollev) == -1) {
+        return -1;
+    }
+    ev->fd = fd;
+    return 0;
+}
+
+/** Removes an epoll event that was added using attach_mediator_fdevent()
+ *  from the epoll event set.
+ *
+ *  Unlike remove_mediator_fdevent(), the file descriptor is NOT closed
+ *  and the mediator epoll event structure is NOT freed.
+ *
+ *  @param ev               The epoll event to detach.
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+int detach_mediator_fdevent(med_epoll_ev_t *ev) {
+    struct epoll_event epollev;
+    int ret = 0;
+
+    if (ev == NULL || ev->fd == -1) {
+        return 0;
+    }
+
+    ret = epoll_ctl(ev->epoll_fd, EPOLL_CTL_DEL, ev->fd, &epollev);
+    ev->fd = -1;
+    return ret;
+}
+
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
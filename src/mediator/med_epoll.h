@@ -87,9 +87,6 @@ enum {
     /** The mediator should now attempt to reconnect to a lost provisioner */
     MED_EPOLL_PROVRECONNECT,
 
-    /** An incomplete SSL handshake with a collector can now be resumed */
-    MED_EPOLL_COLLECTOR_HANDSHAKE,
-
     /** The mediator needs to send heartbeats to the RabbitMQ connections */
     MED_EPOLL_RMQCHECK_TIMER,
 
@@ -102,6 +99,16 @@ enum {
      *  has disconnected, or failed to re-announce them after reconnecting
      */
     MED_EPOLL_SHUTDOWN_LEA_THREAD,
+
+    /** The internal RabbitMQ consumer for an idle handover has new
+     *  messages available for reading
+     */
+    MED_EPOLL_LEA_RMQ,
+
+    /** A newly accepted collector connection has data available, which
+     *  should tell us which of the collector's streams it belongs to
+     */
+    MED_EPOLL_COLL_PENDING,
 };
 
 /** Starts an existing timer and adds it to the global epoll event set.
@@ -223,6 +230,33 @@ int modify_mediator_fdevent(med_epoll_ev_t *modev, uint32_t events);
  */
 int remove_mediator_fdevent(med_epoll_ev_t *remev);
 
+/** Adds an existing mediator epoll event to the epoll event set, using a
+ *  file descriptor that is owned by some other entity (e.g. a library
+ *  connection object).
+ *
+ *  @param ev               The epoll event to attach -- the fdtype, state
+ *                          and epoll_fd members must already be set.
+ *  @param fd               The file descriptor to watch.
+ *  @param events           The epoll events to apply to the fd, as a bitmask.
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+int attach_mediator_fdevent(med_epoll_ev_t *ev, int fd, uint32_t events);
+
+/** Removes an epoll event that was added using attach_mediator_fdevent()
+ *  from the epoll event set.
+ *
+ *  Unlike remove_mediator_fdevent(), the file descriptor is NOT closed
+ *  and the mediator epoll event structure is NOT freed, so it is safe to
+ *  call this while other epoll events for the same fd may still be
+ *  waiting to be processed.
+ *
+ *  @param ev               The epoll event to detach.
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+int detach_mediator_fdevent(med_epoll_ev_t *ev);
+
 #endif
 
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -59,6 +59,7 @@
 #include "pcapthread.h"
 #include "coll_recv_thread.h"
 #include "lea_send_thread.h"
+#include "openli_metrics.h"
 
 /** This file implements the "main" thread for an OpenLI mediator.
  */
@@ -117,6 +118,12 @@ static void clear_med_config(mediator_state_t *state) {
     if (state->pcapdirectory) {
         free(state->pcapdirectory);
     }
+    if (state->metricsaddr) {
+        free(state->metricsaddr);
+    }
+    if (state->metricsport) {
+        free(state->metricsport);
+    }
     if (state->pcaptemplate) {
         free(state->pcaptemplate);
     }
@@ -197,6 +204,7 @@ static int init_mediator_config(mediator_state_t *state,
     state->sslconf.keyfile = NULL;
     state->sslconf.cacertfile = NULL;
     state->sslconf.ctx = NULL;
+    state->sslconf.ktls = 0;
 
     state->RMQ_conf.name = NULL;
     state->RMQ_conf.pass = NULL;
@@ -213,6 +221,11 @@ static int init_mediator_config(mediator_state_t *state,
     state->pcaptemplate = NULL;
     state->pcapcompress = 1;
     state->pcaprotatefreq = 30;
+    state->pcapthreads = 1;
+    state->stat_frequency = 0;
+    state->zerocopy_handovers = 0;
+    state->metricsaddr = NULL;
+    state->metricsport = NULL;
 
     /* Parse the provided config file */
     if (parse_mediator_config(configfile, state) == -1) {
@@ -282,10 +295,12 @@ static int init_med_state(mediator_state_t *state, char *configfile) {
             &(state->RMQ_conf), state->mediatorid, state->operatorid,
             state->shortoperatorid,
             state->pcapdirectory, state->pcaptemplate, state->pcapcompress,
-            state->pcaprotatefreq);
+            state->pcaprotatefreq, state->stat_frequency,
+            state->zerocopy_handovers);
 
     /* Initialise state and config for the collector receive threads */
     state->collector_threads.threads = NULL;
+    state->collector_threads.pending = NULL;
     init_med_collector_config(&(state->collector_threads.config),
             state->etsitls,
             &(state->sslconf), &(state->RMQ_conf), state->mediatorid);
@@ -328,6 +343,7 @@ static void prepare_mediator_state(mediator_state_t *state) {
     state->epoll_fd = epoll_create1(0);
 
     state->provisioner.epoll_fd = state->epoll_fd;
+    state->collector_threads.epoll_fd = state->epoll_fd;
 
     /* Use an fd to catch signals during our main epoll loop, so that we
      * can provide our own signal handling without causing epoll_wait to
@@ -361,7 +377,8 @@ static void update_lea_thread_config(mediator_state_t *state) {
             state->mediatorid, state->operatorid,
             state->shortoperatorid,
             state->pcapdirectory, state->pcaptemplate, state->pcapcompress,
-            state->pcaprotatefreq);
+            state->pcaprotatefreq, state->stat_frequency,
+            state->zerocopy_handovers);
 
     /* Send the "reload your config" message to every LEA thread */
     memset(&msg, 0, sizeof(msg));
@@ -799,7 +816,7 @@ static int receive_liid_mapping(mediator_state_t *state, uint8_t *msgbody,
 static int receive_provisioner(mediator_state_t *state, med_epoll_ev_t *mev) {
 
     uint8_t *msgbody = NULL;
-    uint16_t msglen = 0;
+    uint32_t msglen = 0;
     uint64_t internalid;
 
     openli_proto_msgtype_t msgtype;
@@ -899,6 +916,11 @@ static int check_epoll_fd(mediator_state_t *state, struct epoll_event *ev) {
             ret = mediator_accept_collector_connection(
                     &(state->collector_threads), state->listenerev->fd);
             break;
+        case MED_EPOLL_COLL_PENDING:
+            /* a new collector connection has sent us its first message */
+            ret = mediator_identify_collector_stream(
+                    &(state->collector_threads), mev);
+            break;
         case MED_EPOLL_CEASE_LIID_TIMER:
             /* an LIID->agency mapping can now be safely removed */
             assert(ev->events == EPOLLIN);
@@ -1067,6 +1089,12 @@ static int reload_pcap_config(mediator_state_t *currstate,
         changed = 1;
     }
 
+    if (currstate->pcapthreads != newstate->pcapthreads) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: pcap writer thread count has changed -- restart the mediator to apply the new value (%u)",
+                newstate->pcapthreads);
+    }
+
     tmp = currstate->pcapdirectory;
     currstate->pcapdirectory = newstate->pcapdirectory;
     newstate->pcapdirectory = tmp;
@@ -1153,6 +1181,7 @@ static int reload_mediator_config(mediator_state_t *currstate) {
     int rmqchanged = 0;
     int medidchanged = 0;
     int opidchanged = 0;
+    int leaconfchanged = 0;
 
     /* TODO the logic in here is horrible to try and follow! */
 
@@ -1231,10 +1260,26 @@ static int reload_mediator_config(mediator_state_t *currstate) {
         return -1;
     }
 
+    /* Has the statistic logging frequency changed? */
+    if (currstate->stat_frequency != newstate.stat_frequency) {
+        logger(LOG_INFO, "OpenLI Mediator: statistic logging frequency changed from %u to %u minutes.",
+                currstate->stat_frequency, newstate.stat_frequency);
+        leaconfchanged = 1;
+        currstate->stat_frequency = newstate.stat_frequency;
+    }
+
+    if (currstate->zerocopy_handovers != newstate.zerocopy_handovers) {
+        logger(LOG_INFO, "OpenLI Mediator: zero-copy handovers have been %s.",
+                newstate.zerocopy_handovers ? "enabled" : "disabled");
+        leaconfchanged = 1;
+        currstate->zerocopy_handovers = newstate.zerocopy_handovers;
+    }
+
     /* RabbitMQ heartbeat, mediator ID or operator ID has changed?
      * Tell LEA threads to update their local copies of this config...
      */
-    if (medidchanged || opidchanged || rmqchanged || pcapchanged) {
+    if (medidchanged || opidchanged || rmqchanged || pcapchanged ||
+            leaconfchanged) {
         update_lea_thread_config(currstate);
     }
 
@@ -1343,6 +1388,9 @@ static void run(mediator_state_t *state) {
     logger(LOG_INFO,
             "OpenLI Mediator: pcap output file rotation frequency is set to %d minutes.",
             state->pcaprotatefreq);
+    logger(LOG_INFO,
+            "OpenLI Mediator: using %u thread(s) to write pcap output files.",
+            state->pcapthreads);
 
     state->timerev = create_mediator_timer(state->epoll_fd, NULL,
             MED_EPOLL_SIGCHECK_TIMER, 0);
@@ -1386,6 +1434,11 @@ static void run(mediator_state_t *state) {
                 state->provisioner.just_connected = 0;
             }
         }
+
+        /* Give up on any collector connections that have not told us
+         * which stream they belong to */
+        mediator_expire_pending_collectors(&(state->collector_threads));
+
         /* This timer will force us to stop checking epoll and go back
          * to the start of this loop (i.e. checking if we should halt the
          * entire mediator) every second.
@@ -1527,10 +1580,19 @@ int main(int argc, char *argv[]) {
 
     prepare_mediator_state(&medstate);
 
+    if (medstate.metricsport) {
+        if (openli_metrics_start(medstate.metricsaddr,
+                    medstate.metricsport) < 0) {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: mediator metrics will not be available.");
+        }
+    }
+
     logger(LOG_INFO, "OpenLI Mediator: '%u' has started.", medstate.mediatorid);
 
     /* Start the pcap output thread (which behaves like an LEA thread) */
-    mediator_start_pcap_thread(&(medstate.agency_threads));
+    mediator_start_pcap_thread(&(medstate.agency_threads),
+            medstate.pcapthreads);
 
     /* Open the socket that listens for connections from collectors */
     if (start_collector_listener(&medstate) == -1) {
@@ -1549,6 +1611,7 @@ int main(int argc, char *argv[]) {
      */
     mediator_disconnect_all_collectors(&(medstate.collector_threads));
     mediator_disconnect_all_leas(&(medstate.agency_threads));
+    openli_metrics_stop();
 
     /* Clean up */
     destroy_med_state(&medstate);
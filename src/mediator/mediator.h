@@ -104,12 +104,29 @@ typedef struct med_state {
     /** The frequency to rotate the pcap files (in minutes) */
     uint32_t pcaprotatefreq;
 
+    /** The number of threads to use for writing pcap files */
+    uint32_t pcapthreads;
+
+    /** The frequency to log handover statistics (in minutes) */
+    uint32_t stat_frequency;
+
+    /** Flag indicating whether handovers should send records directly from
+     *  the consumed internal RMQ messages (i.e. without copying them) */
+    uint8_t zerocopy_handovers;
+
     /** The SSL configuration for the mediator */
     openli_ssl_config_t sslconf;
 
     /** The RabbitMQ configuration for the mediator */
     openli_RMQ_config_t RMQ_conf;
 
+    /** The IP address to serve metrics on */
+    char *metricsaddr;
+
+    /** The port to serve metrics on (as a string). If NULL, metrics are
+     *  disabled */
+    char *metricsport;
+
 } mediator_state_t;
 
 #endif
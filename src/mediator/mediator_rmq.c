@@ -30,6 +30,7 @@
 #include "mediator_rmq.h"
 #include <unistd.h>
 #include "logger.h"
+#include "util.h"
 #include "coll_recv_thread.h"
 
 /** This file implements the interactions between various elements of the
@@ -76,8 +77,8 @@ static int declare_RMQ_queue(amqp_connection_state_t state,
  *  @return -1 if an error occurs, 0 if the queue is not empty, 1 if the queue
  *          is empty.
  */
-static int is_RMQ_queue_empty(amqp_connection_state_t state, char *queueid,
-        int channel) {
+static int count_RMQ_queue_messages(amqp_connection_state_t state,
+        char *queueid, int channel, uint32_t *count) {
 
     amqp_bytes_t rmq_queueid;
     amqp_table_t queueargs;
@@ -95,14 +96,27 @@ static int is_RMQ_queue_empty(amqp_connection_state_t state, char *queueid,
         return -1;
     }
 
+    *count = r->message_count;
+    return 0;
+}
+
+static int is_RMQ_queue_empty(amqp_connection_state_t state, char *queueid,
+        int channel) {
+
+    uint32_t count;
+
+    if (count_RMQ_queue_messages(state, queueid, channel, &count) < 0) {
+        return -1;
+    }
+
     /* TODO this is wrong! message_count doesn't include pre-fetched
      * messages so is often 0 when there are still unacked messages :(
      *
      * Need a way to get the number that rabbitmqctl reports for the
      * queue -- I don't think rabbitmq-c provides a useful API for this.
      */
-    printf("queueid %s -- message count %u\n", queueid, r->message_count);
-    if (r->message_count == 0) {
+    printf("queueid %s -- message count %u\n", queueid, count);
+    if (count == 0) {
         return 1;
     }
 
@@ -212,14 +226,17 @@ int declare_mediator_rawip_RMQ_queue(amqp_connection_state_t state,
  *  @param queuetype        The message type (one of "iri", "cc", or "rawip")
  *  @param expiry           The TTL of the message in seconds -- if set to 0,
  *                          the message will not be expired by RMQ
+ *  @param trace            Latency tracing timestamps to attach to the
+ *                          message as headers, or NULL if not traced
  *
  *  @return 0 if an error occurs, 1 if the message is published successfully
  */
 static int produce_mediator_RMQ(amqp_connection_state_t state,
-        uint8_t *msg, uint16_t msglen, char *liid, int channel,
-        char *queuetype, uint32_t expiry) {
+        uint8_t *msg, uint32_t msglen, char *liid, int channel,
+        char *queuetype, uint32_t expiry, mediator_rmq_trace_t *trace) {
     amqp_bytes_t message_bytes;
     amqp_basic_properties_t props;
+    amqp_table_entry_t traceheaders[2];
     int pub_ret;
     char queuename[1024];
     char expirystr[1024];
@@ -236,6 +253,19 @@ static int produce_mediator_RMQ(amqp_connection_state_t state,
         props.expiration = amqp_cstring_bytes(expirystr);
     }
 
+    if (trace) {
+        traceheaders[0].key = amqp_cstring_bytes(MEDIATOR_RMQ_RECVTS_HEADER);
+        traceheaders[0].value.kind = AMQP_FIELD_KIND_U64;
+        traceheaders[0].value.value.u64 = trace->received_ts;
+        traceheaders[1].key = amqp_cstring_bytes(MEDIATOR_RMQ_CAPTS_HEADER);
+        traceheaders[1].value.kind = AMQP_FIELD_KIND_U64;
+        traceheaders[1].value.value.u64 = trace->capture_ts;
+
+        props._flags |= AMQP_BASIC_HEADERS_FLAG;
+        props.headers.num_entries = 2;
+        props.headers.entries = traceheaders;
+    }
+
     pub_ret = amqp_basic_publish(state, channel, amqp_cstring_bytes(""),
             amqp_cstring_bytes(queuename), 0, 0, &props, message_bytes);
     if (pub_ret != 0) {
@@ -256,7 +286,7 @@ static int produce_mediator_RMQ(amqp_connection_state_t state,
  *  @return 0 if an error occurs, 1 if the message is published successfully
  */
 int publish_rawip_on_mediator_liid_RMQ_queue(amqp_connection_state_t state,
-        uint8_t *msg, uint16_t msglen, char *liid) {
+        uint8_t *msg, uint32_t msglen, char *liid) {
     /* If we haven't managed to write this to a pcap file within 60 seconds,
      * expire the message from the RMQ.
      *
@@ -267,7 +297,8 @@ int publish_rawip_on_mediator_liid_RMQ_queue(amqp_connection_state_t state,
      * output (assuming 60 seconds have passed since the first pcapdisk
      * output was halted).
      */
-    return produce_mediator_RMQ(state, msg, msglen, liid, 4, "rawip", 60);
+    return produce_mediator_RMQ(state, msg, msglen, liid, 4, "rawip", 60,
+            NULL);
 }
 
 /** Publishes an encoded IRI onto a mediator RMQ queue.
@@ -276,13 +307,16 @@ int publish_rawip_on_mediator_liid_RMQ_queue(amqp_connection_state_t state,
  *  @param msg              A pointer to the start of the encoded IRI
  *  @param msglen           The length of the encoded IRI, in bytes
  *  @param liid             The LIID that the message belongs to
+ *  @param trace            Latency tracing timestamps to attach to the
+ *                          message, or NULL if the message is not traced
  *
  *  @return 0 if an error occurs, 1 if the message is published successfully
  */
 int publish_iri_on_mediator_liid_RMQ_queue(amqp_connection_state_t state,
-        uint8_t *msg, uint16_t msglen, char *liid) {
+        uint8_t *msg, uint32_t msglen, char *liid,
+        mediator_rmq_trace_t *trace) {
 
-    return produce_mediator_RMQ(state, msg, msglen, liid, 2, "iri", 0);
+    return produce_mediator_RMQ(state, msg, msglen, liid, 2, "iri", 0, trace);
 }
 
 /** Publishes an encoded CC onto a mediator RMQ queue.
@@ -291,13 +325,16 @@ int publish_iri_on_mediator_liid_RMQ_queue(amqp_connection_state_t state,
  *  @param msg              A pointer to the start of the encoded CC
  *  @param msglen           The length of the encoded CC, in bytes
  *  @param liid             The LIID that the message belongs to
+ *  @param trace            Latency tracing timestamps to attach to the
+ *                          message, or NULL if the message is not traced
  *
  *  @return 0 if an error occurs, 1 if the message is published successfully
  */
 int publish_cc_on_mediator_liid_RMQ_queue(amqp_connection_state_t state,
-        uint8_t *msg, uint16_t msglen, char *liid) {
+        uint8_t *msg, uint32_t msglen, char *liid,
+        mediator_rmq_trace_t *trace) {
 
-    return produce_mediator_RMQ(state, msg, msglen, liid, 3, "cc", 0);
+    return produce_mediator_RMQ(state, msg, msglen, liid, 3, "cc", 0, trace);
 }
 
 void remove_mediator_liid_RMQ_queue(amqp_connection_state_t state,
@@ -341,6 +378,29 @@ void remove_mediator_rawip_RMQ_queue(amqp_connection_state_t state,
     }
 }
 
+/** Sets the prefetch limit (i.e. the maximum number of unacknowledged
+ *  messages that the broker will deliver to us) for a consumer channel.
+ *
+ *  @param state            The RMQ connection to apply the limit to
+ *  @param channel          The channel to apply the limit to
+ *  @param agencyid         The ID of the agency that owns the connection
+ *  @param logfailure       Flag indicating whether to log an error message
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+static int set_RMQ_consumer_prefetch(amqp_connection_state_t state,
+        int channel, char *agencyid, int logfailure) {
+
+    amqp_basic_qos(state, channel, 0, MEDIATOR_RMQ_PREFETCH_COUNT, 0);
+    if ((amqp_get_rpc_reply(state).reply_type) != AMQP_RESPONSE_NORMAL) {
+        if (logfailure) {
+            logger(LOG_ERR, "OpenLI Mediator: failed to set RMQ prefetch limit on channel %d in agency thread %s", channel, agencyid);
+        }
+        return -1;
+    }
+    return 0;
+}
+
 /** Creates a connection to the internal RMQ instance for the purposes of
  *  consuming intercept records for intercepts headed for a particular agency.
  *
@@ -407,6 +467,16 @@ amqp_connection_state_t join_mediator_RMQ_as_consumer(char *agencyid,
         goto consfailed;
     }
 
+    /* Allow the broker to push a couple of batches worth of messages to
+     * us ahead of time, so that there is always something waiting in
+     * our socket buffer when we come back to consume the next batch.
+     */
+    if (set_RMQ_consumer_prefetch(state, 2, agencyid, logfailure) < 0 ||
+            set_RMQ_consumer_prefetch(state, 3, agencyid, logfailure) < 0 ||
+            set_RMQ_consumer_prefetch(state, 4, agencyid, logfailure) < 0) {
+        goto consfailed;
+    }
+
     return state;
 
 consfailed:
@@ -842,11 +912,62 @@ static int consume_other_frame(amqp_connection_state_t state) {
 
 #define MAX_CONSUMER_REJECTIONS 10
 
+/** Reads the latency tracing headers from a consumed message (if present),
+ *  updating the internal RMQ latency histogram and remembering the
+ *  capture timestamp of the first traced record.
+ *
+ *  @param envelope         The consumed message
+ *  @param trace            The latency tracing state for the consumer
+ */
+static void trace_consumed_envelope(amqp_envelope_t *envelope,
+        mediator_rmq_trace_t *trace) {
+
+    amqp_table_t *headers = &(envelope->message.properties.headers);
+    amqp_table_entry_t *entry;
+    uint64_t recvts = 0, capts = 0;
+    int i;
+
+    if (!(envelope->message.properties._flags & AMQP_BASIC_HEADERS_FLAG)) {
+        return;
+    }
+
+    for (i = 0; i < headers->num_entries; i++) {
+        entry = &(headers->entries[i]);
+        if (entry->value.kind != AMQP_FIELD_KIND_U64) {
+            continue;
+        }
+        if (entry->key.len == strlen(MEDIATOR_RMQ_RECVTS_HEADER) &&
+                memcmp(entry->key.bytes, MEDIATOR_RMQ_RECVTS_HEADER,
+                    entry->key.len) == 0) {
+            recvts = entry->value.value.u64;
+        } else if (entry->key.len == strlen(MEDIATOR_RMQ_CAPTS_HEADER) &&
+                memcmp(entry->key.bytes, MEDIATOR_RMQ_CAPTS_HEADER,
+                    entry->key.len) == 0) {
+            capts = entry->value.value.u64;
+        }
+    }
+
+    if (recvts == 0) {
+        return;
+    }
+    openli_metric_observe_latency(trace->queuelatency, recvts,
+            fetch_current_time_us());
+    if (trace->capture_ts == 0) {
+        trace->capture_ts = capts;
+    }
+}
+
 /** Consumes messages from an internal RMQ connection and writes them into
  *  an export buffer.
  *
+ *  If a held envelope ring is provided, the consumed envelopes are added
+ *  to the ring instead and their bodies are not copied anywhere. The
+ *  caller becomes responsible for destroying those envelopes.
+ *
  *  @param state            The RMQ connection to consume messages from
  *  @param buf              The export buffer to write the messages into
+ *  @param held             The ring to hold consumed envelopes in, or NULL
+ *                          to copy messages into the export buffer
  *  @param maxread          The maximum number of messages to read before
  *                          returning from this function
  *  @param channel          The channel to consume from
@@ -857,12 +978,13 @@ static int consume_other_frame(amqp_connection_state_t state) {
  *                          of writing the message itself
  *
  *  @return -1 if an error occurs, -2 if the RMQ connection has timed out
- *          due to a heartbeat failure, 0 if no messages were consumed, or
- *          1 if at least one message was consumed successfully.
+ *          due to a heartbeat failure, otherwise the number of messages
+ *          that were consumed successfully (which may be zero).
  */
 static int consume_mediator_liid_messages(amqp_connection_state_t state,
-        export_buffer_t *buf, int maxread, int channel, uint64_t *last_deliv,
-        uint8_t prependlength) {
+        export_buffer_t *buf, held_envelope_ring_t *held, int maxread,
+        int channel, uint64_t *last_deliv, uint8_t prependlength,
+        mediator_rmq_trace_t *trace) {
 
     int msgread = 0;
     int rejects = 0;
@@ -871,15 +993,30 @@ static int consume_mediator_liid_messages(amqp_connection_state_t state,
     amqp_envelope_t envelope;
     amqp_rpc_reply_t ret;
 
+    /* Never block waiting for messages -- callers should wait for the
+     * RMQ socket to become readable (via epoll) if there is nothing
+     * available right now.
+     */
     tv.tv_sec = 0;
-    tv.tv_usec = 100000;
+    tv.tv_usec = 0;
 
     if (state == NULL) {
-        usleep(10000);
         return 0;
     }
 
+    if (held && held->envs == NULL) {
+        held->envs = calloc(HANDOVER_HELD_ENVELOPES, sizeof(amqp_envelope_t));
+        if (held->envs == NULL) {
+            logger(LOG_INFO, "OpenLI Mediator: unable to allocate ring for holding RMQ envelopes");
+            return -1;
+        }
+    }
+
     while (msgread < maxread) {
+        if (held && held->count >= HANDOVER_HELD_ENVELOPES) {
+            break;
+        }
+
         /* Let the connection free any unused internal state / buffers */
         amqp_maybe_release_buffers(state);
 
@@ -889,8 +1026,7 @@ static int consume_mediator_liid_messages(amqp_connection_state_t state,
             if (ret.reply_type == AMQP_RESPONSE_LIBRARY_EXCEPTION &&
                     ret.library_error == AMQP_STATUS_TIMEOUT) {
                 /* No messages available */
-                usleep(10000);
-                return (msgread > 0);
+                return msgread;
             }
 
             if (ret.reply_type == AMQP_RESPONSE_LIBRARY_EXCEPTION &&
@@ -934,13 +1070,31 @@ static int consume_mediator_liid_messages(amqp_connection_state_t state,
             amqp_destroy_envelope(&envelope);
             rejects += 1;
             if (rejects >= MAX_CONSUMER_REJECTIONS) {
-                return (msgread > 0);
+                return msgread;
             }
             continue;
         }
 
         msgread += 1;
 
+        if (trace) {
+            trace_consumed_envelope(&envelope, trace);
+        }
+
+        if (held) {
+            /* Keep the envelope (and therefore the message body) around
+             * until it has been sent -- the body lives in the envelope's
+             * own memory pool, so it is unaffected by any later calls to
+             * amqp_maybe_release_buffers().
+             */
+            held->envs[(held->head + held->count) % HANDOVER_HELD_ENVELOPES]
+                    = envelope;
+            held->count ++;
+            held->heldbytes += envelope.message.body.len;
+            *last_deliv = envelope.delivery_tag;
+            continue;
+        }
+
         /* Raw IP messages need to be prepended with their length as we have
          * no other reliable indicator of their length in the message
          * itself.
@@ -964,7 +1118,7 @@ static int consume_mediator_liid_messages(amqp_connection_state_t state,
         amqp_destroy_envelope(&envelope);
     }
 
-    return 1;
+    return msgread;
 }
 
 /** Consumes IRI records using an RMQ connection, writing them into the
@@ -979,16 +1133,19 @@ static int consume_mediator_liid_messages(amqp_connection_state_t state,
  *                          returning from this function
  *  @param last_deliv       The delivery tag of the most recent consumed
  *                          message (updated by this function)
+ *  @param trace            Latency tracing state for the consumer, or
+ *                          NULL if consumed records are not being traced
  *
  *  @return -1 if an error occurs, -2 if the RMQ connection has timed out
- *          due to a heartbeat failure, 0 if no IRIs were consumed, or
- *          1 if at least one IRI was consumed successfully.
+ *          due to a heartbeat failure, otherwise the number of IRIs
+ *          that were consumed successfully (which may be zero).
  */
 int consume_mediator_iri_messages(amqp_connection_state_t state,
-        export_buffer_t *buf, int maxread, uint64_t *last_deliv) {
+        export_buffer_t *buf, int maxread, uint64_t *last_deliv,
+        mediator_rmq_trace_t *trace) {
 
-    return consume_mediator_liid_messages(state, buf, maxread, 2, last_deliv,
-            0);
+    return consume_mediator_liid_messages(state, buf, NULL, maxread, 2,
+            last_deliv, 0, trace);
 }
 
 /** Consumes CC records using an RMQ connection, writing them into the
@@ -1003,16 +1160,19 @@ int consume_mediator_iri_messages(amqp_connection_state_t state,
  *                          returning from this function
  *  @param last_deliv       The delivery tag of the most recent consumed
  *                          message (updated by this function)
+ *  @param trace            Latency tracing state for the consumer, or
+ *                          NULL if consumed records are not being traced
  *
  *  @return -1 if an error occurs, -2 if the RMQ connection has timed out
- *          due to a heartbeat failure, 0 if no CCs were consumed, or
- *          1 if at least one CC was consumed successfully.
+ *          due to a heartbeat failure, otherwise the number of CCs
+ *          that were consumed successfully (which may be zero).
  */
 int consume_mediator_cc_messages(amqp_connection_state_t state,
-        export_buffer_t *buf, int maxread, uint64_t *last_deliv) {
+        export_buffer_t *buf, int maxread, uint64_t *last_deliv,
+        mediator_rmq_trace_t *trace) {
 
-    return consume_mediator_liid_messages(state, buf, maxread, 3, last_deliv,
-            0);
+    return consume_mediator_liid_messages(state, buf, NULL, maxread, 3,
+            last_deliv, 0, trace);
 }
 
 /** Consumes raw IP packets using an RMQ connection, writing them into the
@@ -1029,14 +1189,62 @@ int consume_mediator_cc_messages(amqp_connection_state_t state,
  *                          message (updated by this function)
  *
  *  @return -1 if an error occurs, -2 if the RMQ connection has timed out
- *          due to a heartbeat failure, 0 if no packets were consumed, or
- *          1 if at least one packet was consumed successfully.
+ *          due to a heartbeat failure, otherwise the number of packets
+ *          that were consumed successfully (which may be zero).
  */
 int consume_mediator_rawip_messages(amqp_connection_state_t state,
         export_buffer_t *buf, int maxread, uint64_t *last_deliv) {
 
-    return consume_mediator_liid_messages(state, buf, maxread, 4, last_deliv,
-            1);
+    return consume_mediator_liid_messages(state, buf, NULL, maxread, 4,
+            last_deliv, 1, NULL);
+}
+
+/** Consumes IRI records using an RMQ connection, holding on to the
+ *  consumed envelopes so that they can be sent without copying.
+ *
+ *  @param state            The RMQ connection to consume IRIs from
+ *  @param held             The ring to add the consumed envelopes to
+ *  @param maxread          The maximum number of IRIs to read before
+ *                          returning from this function
+ *  @param last_deliv       The delivery tag of the most recent consumed
+ *                          message (updated by this function)
+ *  @param trace            Latency tracing state for the consumer, or
+ *                          NULL if consumed records are not being traced
+ *
+ *  @return -1 if an error occurs, -2 if the RMQ connection has timed out
+ *          due to a heartbeat failure, otherwise the number of IRIs
+ *          that were consumed successfully (which may be zero).
+ */
+int consume_mediator_iri_envelopes(amqp_connection_state_t state,
+        held_envelope_ring_t *held, int maxread, uint64_t *last_deliv,
+        mediator_rmq_trace_t *trace) {
+
+    return consume_mediator_liid_messages(state, NULL, held, maxread, 2,
+            last_deliv, 0, trace);
+}
+
+/** Consumes CC records using an RMQ connection, holding on to the
+ *  consumed envelopes so that they can be sent without copying.
+ *
+ *  @param state            The RMQ connection to consume CCs from
+ *  @param held             The ring to add the consumed envelopes to
+ *  @param maxread          The maximum number of CCs to read before
+ *                          returning from this function
+ *  @param last_deliv       The delivery tag of the most recent consumed
+ *                          message (updated by this function)
+ *  @param trace            Latency tracing state for the consumer, or
+ *                          NULL if consumed records are not being traced
+ *
+ *  @return -1 if an error occurs, -2 if the RMQ connection has timed out
+ *          due to a heartbeat failure, otherwise the number of CCs
+ *          that were consumed successfully (which may be zero).
+ */
+int consume_mediator_cc_envelopes(amqp_connection_state_t state,
+        held_envelope_ring_t *held, int maxread, uint64_t *last_deliv,
+        mediator_rmq_trace_t *trace) {
+
+    return consume_mediator_liid_messages(state, NULL, held, maxread, 3,
+            last_deliv, 0, trace);
 }
 
 /** Acknowledges messages for an RMQ connection, up to the provided
@@ -1242,6 +1450,56 @@ int check_empty_mediator_cc_RMQ(amqp_connection_state_t state, char *liid) {
     return is_RMQ_queue_empty(state, cc_queuename, 3);
 }
 
+/** Fetches the number of records that are ready to be consumed from the
+ *  IRI queue for a given LIID.
+ *
+ *  Records that have been delivered to a consumer but not yet acknowledged
+ *  are not included in the count.
+ *
+ *  @param state            The RMQ connection to use to undertake the check
+ *  @param liid             The LIID whose IRI queue needs to be checked
+ *  @param count            Set to the number of ready records in the queue
+ *
+ *  @return -1 if an error occurs or the parameters are invalid, 0 otherwise.
+ */
+int count_mediator_iri_RMQ_messages(amqp_connection_state_t state,
+        char *liid, uint32_t *count) {
+
+    char iri_queuename[1024];
+
+    if (state == NULL || liid == NULL) {
+        return -1;
+    }
+    snprintf(iri_queuename, 1024, "%s-%s", liid, "iri");
+
+    return count_RMQ_queue_messages(state, iri_queuename, 2, count);
+}
+
+/** Fetches the number of records that are ready to be consumed from the
+ *  CC queue for a given LIID.
+ *
+ *  Records that have been delivered to a consumer but not yet acknowledged
+ *  are not included in the count.
+ *
+ *  @param state            The RMQ connection to use to undertake the check
+ *  @param liid             The LIID whose CC queue needs to be checked
+ *  @param count            Set to the number of ready records in the queue
+ *
+ *  @return -1 if an error occurs or the parameters are invalid, 0 otherwise.
+ */
+int count_mediator_cc_RMQ_messages(amqp_connection_state_t state,
+        char *liid, uint32_t *count) {
+
+    char cc_queuename[1024];
+
+    if (state == NULL || liid == NULL) {
+        return -1;
+    }
+    snprintf(cc_queuename, 1024, "%s-%s", liid, "cc");
+
+    return count_RMQ_queue_messages(state, cc_queuename, 3, count);
+}
+
 /** Indicates whether the raw IP packet queue for a given LIID is empty or not.
  *
  *  @param state            The RMQ connection to use to undertake the check
@@ -1262,4 +1520,40 @@ int check_empty_mediator_rawip_RMQ(amqp_connection_state_t state, char *liid) {
     return is_RMQ_queue_empty(state, raw_queuename, 4);
 }
 
+/** Returns the socket file descriptor for an RMQ consumer connection, so
+ *  that it can be added to an epoll event set and the caller can be woken
+ *  when new messages arrive.
+ *
+ *  @param state            The RMQ connection to get the socket for
+ *
+ *  @return -1 if the connection is invalid, otherwise the socket fd
+ */
+int get_mediator_RMQ_consumer_fd(amqp_connection_state_t state) {
+    if (state == NULL) {
+        return -1;
+    }
+    return amqp_get_sockfd(state);
+}
+
+/** Indicates whether an RMQ connection has already read data from its
+ *  socket that has not yet been consumed.
+ *
+ *  Epoll will not tell us about this data, as it has already been removed
+ *  from the socket, so callers must check this before deciding to wait
+ *  for the socket to become readable.
+ *
+ *  @param state            The RMQ connection to check
+ *
+ *  @return 1 if there is pending data in the connection buffers, 0 otherwise
+ */
+int mediator_RMQ_consumer_has_pending(amqp_connection_state_t state) {
+    if (state == NULL) {
+        return 0;
+    }
+    if (amqp_frames_enqueued(state) || amqp_data_in_buffer(state)) {
+        return 1;
+    }
+    return 0;
+}
+
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
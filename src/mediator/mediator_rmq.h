@@ -30,6 +30,22 @@
 #include "coll_recv_thread.h"
 #include "lea_send_thread.h"
 
+/** The maximum number of unacknowledged messages that the internal RMQ
+ *  broker may deliver to each consumer channel.
+ *
+ *  Each consumed batch is acknowledged as soon as all of its records have
+ *  been sent to the LEA, but several batches (see HANDOVER_MAX_ACK_MARKS)
+ *  can be waiting to be sent at once, so this should be comfortably larger
+ *  than the largest consume batch.
+ */
+#define MEDIATOR_RMQ_PREFETCH_COUNT 4096
+
+/** Names of the message headers used to carry latency tracing timestamps
+ *  for sampled records through the internal RMQ.
+ */
+#define MEDIATOR_RMQ_RECVTS_HEADER "openli-recvts"
+#define MEDIATOR_RMQ_CAPTS_HEADER "openli-capts"
+
 /** Creates a connection to the internal RMQ instance for the purposes of
  *  writing intercept records received from a collector
  *
@@ -184,11 +200,14 @@ void remove_mediator_rawip_RMQ_queue(amqp_connection_state_t state,
  *  @param msg              A pointer to the start of the encoded CC
  *  @param msglen           The length of the encoded CC, in bytes
  *  @param liid             The LIID that the message belongs to
+ *  @param trace            Latency tracing timestamps to attach to the
+ *                          message, or NULL if the message is not traced
  *
  *  @return 0 if an error occurs, 1 if the message is published successfully
  */
 int publish_iri_on_mediator_liid_RMQ_queue(amqp_connection_state_t state,
-        uint8_t *msg, uint16_t msglen, char *liid);
+        uint8_t *msg, uint32_t msglen, char *liid,
+        mediator_rmq_trace_t *trace);
 
 /** Publishes an encoded CC onto a mediator RMQ queue.
  *
@@ -196,11 +215,14 @@ int publish_iri_on_mediator_liid_RMQ_queue(amqp_connection_state_t state,
  *  @param msg              A pointer to the start of the encoded CC
  *  @param msglen           The length of the encoded CC, in bytes
  *  @param liid             The LIID that the message belongs to
+ *  @param trace            Latency tracing timestamps to attach to the
+ *                          message, or NULL if the message is not traced
  *
  *  @return 0 if an error occurs, 1 if the message is published successfully
  */
 int publish_cc_on_mediator_liid_RMQ_queue(amqp_connection_state_t state,
-        uint8_t *msg, uint16_t msglen, char *liid);
+        uint8_t *msg, uint32_t msglen, char *liid,
+        mediator_rmq_trace_t *trace);
 
 /** Publishes an encoded CC onto a mediator RMQ queue.
  *
@@ -212,7 +234,7 @@ int publish_cc_on_mediator_liid_RMQ_queue(amqp_connection_state_t state,
  *  @return 0 if an error occurs, 1 if the message is published successfully
  */
 int publish_rawip_on_mediator_liid_RMQ_queue(amqp_connection_state_t state,
-        uint8_t *msg, uint16_t msglen, char *liid);
+        uint8_t *msg, uint32_t msglen, char *liid);
 
 /** Consumes CC records using an RMQ connection, writing them into the
  *  provided export buffer.
@@ -226,13 +248,16 @@ int publish_rawip_on_mediator_liid_RMQ_queue(amqp_connection_state_t state,
  *                          returning from this function
  *  @param last_deliv       The delivery tag of the most recent consumed
  *                          message (updated by this function)
+ *  @param trace            Latency tracing state for the consumer, or
+ *                          NULL if consumed records are not being traced
  *
  *  @return -1 if an error occurs, -2 if the RMQ connection has timed out
- *          due to a heartbeat failure, 0 if no CCs were consumed, or
- *          1 if at least one CC was consumed successfully.
+ *          due to a heartbeat failure, otherwise the number of CCs
+ *          that were consumed successfully (which may be zero).
  */
 int consume_mediator_cc_messages(amqp_connection_state_t state,
-        export_buffer_t *buf, int maxread, uint64_t *last_deliv);
+        export_buffer_t *buf, int maxread, uint64_t *last_deliv,
+        mediator_rmq_trace_t *trace);
 
 /** Consumes IRI records using an RMQ connection, writing them into the
  *  provided export buffer.
@@ -246,13 +271,16 @@ int consume_mediator_cc_messages(amqp_connection_state_t state,
  *                          returning from this function
  *  @param last_deliv       The delivery tag of the most recent consumed
  *                          message (updated by this function)
+ *  @param trace            Latency tracing state for the consumer, or
+ *                          NULL if consumed records are not being traced
  *
  *  @return -1 if an error occurs, -2 if the RMQ connection has timed out
- *          due to a heartbeat failure, 0 if no IRIs were consumed, or
- *          1 if at least one IRI was consumed successfully.
+ *          due to a heartbeat failure, otherwise the number of IRIs
+ *          that were consumed successfully (which may be zero).
  */
 int consume_mediator_iri_messages(amqp_connection_state_t state,
-        export_buffer_t *buf, int maxread, uint64_t *last_deliv);
+        export_buffer_t *buf, int maxread, uint64_t *last_deliv,
+        mediator_rmq_trace_t *trace);
 
 /** Consumes raw IP packets using an RMQ connection, writing them into the
  *  provided export buffer.
@@ -268,12 +296,58 @@ int consume_mediator_iri_messages(amqp_connection_state_t state,
  *                          message (updated by this function)
  *
  *  @return -1 if an error occurs, -2 if the RMQ connection has timed out
- *          due to a heartbeat failure, 0 if no packets were consumed, or
- *          1 if at least one packet was consumed successfully.
+ *          due to a heartbeat failure, otherwise the number of packets
+ *          that were consumed successfully (which may be zero).
  */
 int consume_mediator_rawip_messages(amqp_connection_state_t state,
         export_buffer_t *buf, int maxread, uint64_t *last_deliv);
 
+/** Consumes IRI records using an RMQ connection, holding on to the
+ *  consumed envelopes so that they can be sent without copying.
+ *
+ *  The caller is responsible for destroying the held envelopes once
+ *  they are no longer required.
+ *
+ *  @param state            The RMQ connection to consume IRIs from
+ *  @param held             The ring to add the consumed envelopes to
+ *  @param maxread          The maximum number of IRIs to read before
+ *                          returning from this function
+ *  @param last_deliv       The delivery tag of the most recent consumed
+ *                          message (updated by this function)
+ *  @param trace            Latency tracing state for the consumer, or
+ *                          NULL if consumed records are not being traced
+ *
+ *  @return -1 if an error occurs, -2 if the RMQ connection has timed out
+ *          due to a heartbeat failure, otherwise the number of IRIs
+ *          that were consumed successfully (which may be zero).
+ */
+int consume_mediator_iri_envelopes(amqp_connection_state_t state,
+        held_envelope_ring_t *held, int maxread, uint64_t *last_deliv,
+        mediator_rmq_trace_t *trace);
+
+/** Consumes CC records using an RMQ connection, holding on to the
+ *  consumed envelopes so that they can be sent without copying.
+ *
+ *  The caller is responsible for destroying the held envelopes once
+ *  they are no longer required.
+ *
+ *  @param state            The RMQ connection to consume CCs from
+ *  @param held             The ring to add the consumed envelopes to
+ *  @param maxread          The maximum number of CCs to read before
+ *                          returning from this function
+ *  @param last_deliv       The delivery tag of the most recent consumed
+ *                          message (updated by this function)
+ *  @param trace            Latency tracing state for the consumer, or
+ *                          NULL if consumed records are not being traced
+ *
+ *  @return -1 if an error occurs, -2 if the RMQ connection has timed out
+ *          due to a heartbeat failure, otherwise the number of CCs
+ *          that were consumed successfully (which may be zero).
+ */
+int consume_mediator_cc_envelopes(amqp_connection_state_t state,
+        held_envelope_ring_t *held, int maxread, uint64_t *last_deliv,
+        mediator_rmq_trace_t *trace);
+
 /** Acknowledges IRI messages for an RMQ connection, up to the provided
  *  delivery tag number.
  *
@@ -330,6 +404,36 @@ int check_empty_mediator_iri_RMQ(amqp_connection_state_t state, char *liid);
  */
 int check_empty_mediator_cc_RMQ(amqp_connection_state_t state, char *liid);
 
+/** Fetches the number of records that are ready to be consumed from the
+ *  IRI queue for a given LIID.
+ *
+ *  Records that have been delivered to a consumer but not yet acknowledged
+ *  are not included in the count.
+ *
+ *  @param state            The RMQ connection to use to undertake the check
+ *  @param liid             The LIID whose IRI queue needs to be checked
+ *  @param count            Set to the number of ready records in the queue
+ *
+ *  @return -1 if an error occurs or the parameters are invalid, 0 otherwise.
+ */
+int count_mediator_iri_RMQ_messages(amqp_connection_state_t state,
+        char *liid, uint32_t *count);
+
+/** Fetches the number of records that are ready to be consumed from the
+ *  CC queue for a given LIID.
+ *
+ *  Records that have been delivered to a consumer but not yet acknowledged
+ *  are not included in the count.
+ *
+ *  @param state            The RMQ connection to use to undertake the check
+ *  @param liid             The LIID whose CC queue needs to be checked
+ *  @param count            Set to the number of ready records in the queue
+ *
+ *  @return -1 if an error occurs or the parameters are invalid, 0 otherwise.
+ */
+int count_mediator_cc_RMQ_messages(amqp_connection_state_t state,
+        char *liid, uint32_t *count);
+
 /** Indicates whether the raw IP packet queue for a given LIID is empty or not.
  *
  *  @param state            The RMQ connection to use to undertake the check
@@ -340,5 +444,23 @@ int check_empty_mediator_cc_RMQ(amqp_connection_state_t state, char *liid);
  */
 int check_empty_mediator_rawip_RMQ(amqp_connection_state_t state, char *liid);
 
+/** Returns the socket file descriptor for an RMQ consumer connection, so
+ *  that it can be added to an epoll event set.
+ *
+ *  @param state            The RMQ connection to get the socket for
+ *
+ *  @return -1 if the connection is invalid, otherwise the socket fd
+ */
+int get_mediator_RMQ_consumer_fd(amqp_connection_state_t state);
+
+/** Indicates whether an RMQ connection has already read data from its
+ *  socket that has not yet been consumed.
+ *
+ *  @param state            The RMQ connection to check
+ *
+ *  @return 1 if there is pending data in the connection buffers, 0 otherwise
+ */
+int mediator_RMQ_consumer_has_pending(amqp_connection_state_t state);
+
 #endif
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -25,6 +25,7 @@
  */
 
 #include <unistd.h>
+#include <pthread.h>
 #include <amqp.h>
 
 #include "logger.h"
@@ -32,6 +33,7 @@
 #include "util.h"
 #include "pcapthread.h"
 #include "mediator_rmq.h"
+#include "etsicc_fastpath.h"
 #include <libtrace.h>
 #include <assert.h>
 
@@ -50,18 +52,30 @@
  *  LEA send thread state instance, which includes all of the state that is
  *  common to both LEA send threads and the pcap thread, the other is the
  *  pcap specific thread state that is never required by an LEA send thread.
+ *
+ *  The actual conversion and writing of records (including any compression)
+ *  is done by a pool of writer threads. Each LIID is assigned to a single
+ *  writer based on a hash of the LIID, so the records for an intercept
+ *  are still written in order. The pcap thread consumes records from RMQ,
+ *  hands them to the writers and waits for every writer to finish before
+ *  acknowledging the records and consuming any more -- so the writers can
+ *  work directly from the consumed records without copying them.
  */
 
+/** Maximum number of records to consume from RMQ for each writer thread
+ *  before writing them */
+#define PCAP_CONSUME_BATCH 32
+
 /** Halt all ongoing pcap outputs and close their respective files.
  *
- *  @param pstate           The state for the pcap output thread
+ *  @param writer           The writer thread that owns the outputs
  */
-static void halt_pcap_outputs(pcap_thread_state_t *pstate) {
+static void halt_pcap_outputs(pcap_writer_t *writer) {
 
     active_pcap_output_t *out, *tmp;
 
-    HASH_ITER(hh, pstate->active, out, tmp) {
-        HASH_DELETE(hh, pstate->active, out);
+    HASH_ITER(hh, writer->active, out, tmp) {
+        HASH_DELETE(hh, writer->active, out);
         free(out->liid);
         trace_destroy_output(out->out);
         free(out);
@@ -89,7 +103,6 @@ static char *stradd(const char *str, char *bufp, char *buflim) {
 /** Constructs the pcap filename URI for an output file.
  *
  *  @param state            The LEA send thread state for this pcap thread
- *  @param pstate           The pcap specific state for this pcap thread
  *  @param urispace         The string that the URI is to be written into
  *  @param urispacelen      The number of bytes allocated for the urispace
  *                          string.
@@ -99,8 +112,7 @@ static char *stradd(const char *str, char *bufp, char *buflim) {
  *          otherwise.
  */
 
-static int populate_pcap_uri(lea_thread_state_t *state,
-        pcap_thread_state_t *pstate, char *urispace,
+static int populate_pcap_uri(lea_thread_state_t *state, char *urispace,
         int urispacelen, active_pcap_output_t *act) {
 
     char *ptr = state->pcap_outtemplate;
@@ -194,14 +206,14 @@ static int deregister_unconfirmed_pcap_liids(liid_map_entry_t *m, void *arg) {
 
 /** Opens a pcap output file using libtrace, named after the current time.
  *
- *  @param state            The LEA thread state for this thread
- *  @param pstate           The pcap-specific state for the pcap output thread
+ *  @param state            The LEA thread state for the pcap thread
+ *  @param writer           The writer thread that owns the output
  *  @param act              The intercept that requires a new pcap file
  *
  *  @return -1 if an error occurs, 0 otherwise.
  */
 static int open_pcap_output_file(lea_thread_state_t *state,
-        pcap_thread_state_t *pstate, active_pcap_output_t *act) {
+        pcap_writer_t *writer, active_pcap_output_t *act) {
 
     char uri[4096];
     int compressmethod = TRACE_OPTION_COMPRESSTYPE_ZLIB;
@@ -210,10 +222,10 @@ static int open_pcap_output_file(lea_thread_state_t *state,
 
     /* Make sure the user configured a directory for us to put files into */
     if (state->pcap_dir == NULL) {
-        if (!pstate->dirwarned) {
+        if (!writer->dirwarned) {
             logger(LOG_INFO,
                     "OpenLI Mediator: pcap directory is not configured so will not write any pcap files.");
-            pstate->dirwarned = 1;
+            writer->dirwarned = 1;
         }
         return -1;
     }
@@ -240,7 +252,7 @@ static int open_pcap_output_file(lea_thread_state_t *state,
                 state->pcap_dir, act->liid, tv.tv_sec);
         }
     } else {
-        if (populate_pcap_uri(state, pstate, uri, 4096, act) == 0) {
+        if (populate_pcap_uri(state, uri, 4096, act) == 0) {
             logger(LOG_INFO,
                     "OpenLI Mediator: unable to create pcap output file name from template '%s'",
                     state->pcap_outtemplate);
@@ -309,20 +321,19 @@ pcaptraceerr:
 
 /** Start a new pcap output for a particular LIID
  *
- *  @param state            The LEA thread state for this thread
- *  @param pstate           The pcap-specific state for the pcap output thread
+ *  @param state            The LEA thread state for the pcap thread
+ *  @param writer           The writer thread that is responsible for the LIID
  *  @param liid             The LIID to create a pcap output for, as a string.
  *
  *  @return a pointer to a new pcap output structure, or NULL if an error
  *          occurred.
  */
 static active_pcap_output_t *create_new_pcap_output(
-        lea_thread_state_t *state, pcap_thread_state_t *pstate,
-        char *liid) {
+        lea_thread_state_t *state, pcap_writer_t *writer, char *liid) {
 
     active_pcap_output_t *act;
 
-    HASH_FIND(hh, pstate->active, liid, strlen(liid), act);
+    HASH_FIND(hh, writer->active, liid, strlen(liid), act);
     if (act) {
         return act;
     }
@@ -330,12 +341,12 @@ static active_pcap_output_t *create_new_pcap_output(
     act = (active_pcap_output_t *)malloc(sizeof(active_pcap_output_t));
     act->liid = strdup(liid);
 
-    if (open_pcap_output_file(state, pstate, act) == -1) {
+    if (open_pcap_output_file(state, writer, act) == -1) {
         free(act->liid);
         free(act);
         return NULL;
     }
-    HASH_ADD_KEYPTR(hh, pstate->active, act->liid, strlen(act->liid), act);
+    HASH_ADD_KEYPTR(hh, writer->active, act->liid, strlen(act->liid), act);
     return act;
 }
 
@@ -343,15 +354,14 @@ static active_pcap_output_t *create_new_pcap_output(
  *  to the appropriate pcap output file.
  *
  *  @param nextrec          Pointer to the start of the raw IP packet record
- *  @param bufrem           The amount of readable bytes in the buffer where
- *                          the raw IP packet record is stored
- *  @param pstate           The pcap-specific state for this thread
+ *  @param bufrem           The length of the raw IP packet record
+ *  @param writer           The writer thread that is writing the record
  *
  *  @return the number of bytes to advance the buffer to move past the
  *          raw IP packet record that we just wrote to disk.
  */
 static uint32_t write_rawip_to_pcap(uint8_t *nextrec, uint64_t bufrem,
-        pcap_thread_state_t *pstate) {
+        pcap_writer_t *writer) {
 
     active_pcap_output_t *pcapout;
     uint32_t pdulen;
@@ -382,26 +392,26 @@ static uint32_t write_rawip_to_pcap(uint8_t *nextrec, uint64_t bufrem,
         logger(LOG_INFO, "OpenLI Mediator: raw IP packet is too large to write as a pcap packet, possibly corrupt");
         return pdulen + sizeof(uint32_t);
     }
-    HASH_FIND(hh, pstate->active, liidspace,
+    HASH_FIND(hh, writer->active, liidspace,
             strlen((const char *)liidspace), pcapout);
 
     /* Hopefully, we already know about this LIID and have a pcap output
      * handle all set up and ready for it. If not, let's just skip past it.
      */
     if (pcapout && pcapout->out) {
-        if (!pstate->packet) {
-            pstate->packet = trace_create_packet();
+        if (!writer->packet) {
+            writer->packet = trace_create_packet();
         }
 
         /* Thankfully, libtrace will let us "construct" a packet object
          * from a buffer containing the raw packet contents.
          */
-        trace_construct_packet(pstate->packet, TRACE_TYPE_NONE,
+        trace_construct_packet(writer->packet, TRACE_TYPE_NONE,
                 (const void *)nextrec,
                 (uint16_t)(pdulen - liidlen - sizeof(uint32_t)));
 
         /* Now we can have libtrace write the packet using the pcap format */
-        if (trace_write_packet(pcapout->out, pstate->packet) < 0) {
+        if (trace_write_packet(pcapout->out, writer->packet) < 0) {
             libtrace_err_t err = trace_get_err_output(pcapout->out);
             logger(LOG_INFO, "OpenLI Mediator: failed to write raw IP to pcap for LIID %s: %s", liidspace, err.problem);
             trace_destroy_output(pcapout->out);
@@ -415,13 +425,44 @@ static uint32_t write_rawip_to_pcap(uint8_t *nextrec, uint64_t bufrem,
 }
 
 
+/** Writes an intercepted IP packet to the pcap output for its LIID.
+ *
+ *  @param writer           The writer thread that owns the pcap output
+ *  @param pcapout          The pcap output to write to
+ *  @param rawip            Pointer to the start of the IP packet
+ *  @param cclen            The length of the IP packet
+ */
+static void write_ip_packet_to_pcap(pcap_writer_t *writer,
+        active_pcap_output_t *pcapout, uint8_t *rawip, uint32_t cclen) {
+
+    if (cclen > 65535) {
+        logger(LOG_INFO, "OpenLI Mediator: ETSI CC record is too large to write as a pcap packet, possibly corrupt");
+        return;
+    }
+
+    if (!writer->packet) {
+        writer->packet = trace_create_packet();
+    }
+
+    trace_construct_packet(writer->packet, TRACE_TYPE_NONE,
+            (const void *)rawip, (uint16_t)cclen);
+
+    if (trace_write_packet(pcapout->out, writer->packet) < 0) {
+        libtrace_err_t err = trace_get_err_output(pcapout->out);
+        logger(LOG_INFO, "OpenLI Mediator: failed to write ETSI CC to pcap for LIID %s: %s", pcapout->liid, err.problem);
+        trace_destroy_output(pcapout->out);
+        pcapout->out = NULL;
+    } else {
+        pcapout->pktwritten += 1;
+    }
+}
+
 /** Converts a ETSI CC record into a libtrace packet and writes it
  *  to the appropriate pcap output file.
  *
  *  @param nextrec          Pointer to the start of the ETSI CC record
- *  @param bufrem           The amount of readable bytes in the buffer where
- *                          the ETSI CC record is stored
- *  @param pstate           The pcap-specific state for this thread
+ *  @param bufrem           The length of the ETSI CC record
+ *  @param writer           The writer thread that is writing the record
  *
  *  @return the number of bytes to advance the buffer to move past the
  *          ETSI CC record that we just wrote to disk. Returns 0 if there
@@ -429,33 +470,46 @@ static uint32_t write_rawip_to_pcap(uint8_t *nextrec, uint64_t bufrem,
  *          being written to disk.
  */
 static uint32_t write_etsicc_to_pcap(uint8_t *nextrec, uint64_t bufrem,
-        pcap_thread_state_t *pstate) {
+        pcap_writer_t *writer) {
 
     active_pcap_output_t *pcapout;
     uint32_t pdulen;
     unsigned char liidspace[2048];
+    openli_etsicc_fields_t fields;
 
-    if (pstate->decoder == NULL) {
-        pstate->decoder = wandder_create_etsili_decoder();
+    /* Nearly every record will be an IPCC from an OpenLI collector, so
+     * try to pull out the fields we need without a full decode first.
+     */
+    if (openli_extract_etsi_ipcc_fields(nextrec, bufrem, &fields)) {
+        HASH_FIND(hh, writer->active, fields.liid, fields.liidlen, pcapout);
+        if (pcapout && pcapout->out) {
+            write_ip_packet_to_pcap(writer, pcapout, fields.ipcontent,
+                    fields.iplen);
+        }
+        return fields.pdulen;
+    }
+
+    if (writer->decoder == NULL) {
+        writer->decoder = wandder_create_etsili_decoder();
     }
 
     /* Using the ETSI decoder, grab the record length and the LIID from
      * within the record itself
      */
-    wandder_attach_etsili_buffer(pstate->decoder, nextrec, bufrem, false);
-    pdulen = wandder_etsili_get_pdu_length(pstate->decoder);
+    wandder_attach_etsili_buffer(writer->decoder, nextrec, bufrem, false);
+    pdulen = wandder_etsili_get_pdu_length(writer->decoder);
 
     if (pdulen == 0 || pdulen > bufrem) {
         logger(LOG_INFO, "OpenLI Mediator: pcap thread received an incomplete ETSI CC");
         return 0;
     }
 
-    if (wandder_etsili_get_liid(pstate->decoder, (char *)liidspace,
+    if (wandder_etsili_get_liid(writer->decoder, (char *)liidspace,
             2048) == NULL) {
         logger(LOG_INFO, "OpenLI Mediator: unable to find LIID in ETSI CC received by pcap thread");
         return 0;
     }
-    HASH_FIND(hh, pstate->active, liidspace, strlen((const char *)liidspace),
+    HASH_FIND(hh, writer->active, liidspace, strlen((const char *)liidspace),
             pcapout);
 
     /* Hopefully, we already know about this LIID and have a pcap output
@@ -466,43 +520,448 @@ static uint32_t write_etsicc_to_pcap(uint8_t *nextrec, uint64_t bufrem,
         uint32_t cclen;
         char ccname[128];
 
-        if (!pstate->packet) {
-            pstate->packet = trace_create_packet();
-        }
-
         /* Convert CC to pcap and write to trace file using libtrace.
          * We don't need the ETSI headers, so we can jump straight to the
          * the CC contents using libwandder
          */
-        rawip = wandder_etsili_get_cc_contents(pstate->decoder, &cclen,
+        rawip = wandder_etsili_get_cc_contents(writer->decoder, &cclen,
                 ccname, 128);
 
         if (rawip == NULL) {
             logger(LOG_INFO, "OpenLI Mediator: unable to find CC contents from ETSI CC seen by pcap thread for LIID %s", liidspace);
-            goto exitpcapwrite;
-        }
-        if (cclen > 65535) {
-            logger(LOG_INFO, "OpenLI Mediator: ETSI CC record is too large to write as a pcap packet, possibly corrupt");
-            goto exitpcapwrite;
+            return pdulen;
         }
+        write_ip_packet_to_pcap(writer, pcapout, rawip, cclen);
+    }
 
-        trace_construct_packet(pstate->packet, TRACE_TYPE_NONE,
-                (const void *)rawip, (uint16_t)cclen);
+    return pdulen;
+}
 
-        if (trace_write_packet(pcapout->out, pstate->packet) < 0) {
+/** Flush any outstanding packets for each active pcap output.
+ *
+ *  Regular libtrace writes may buffer captured packets for quite some
+ *  time before actually writing them to disk, which can lead users to think
+ *  that the intercept is not working. Therefore, we regularly trigger
+ *  flushing of the pcap outputs to ensure that the file on disk is more
+ *  representative of what has been intercepted thus far.
+ *
+ *  @param writer           The writer thread that owns the outputs
+ */
+static void pcap_flush_traces(pcap_writer_t *writer) {
+    active_pcap_output_t *pcapout, *tmp;
+
+    HASH_ITER(hh, writer->active, pcapout, tmp) {
+        /* if pktwritten is zero, then no packets have been added since the
+         * last flush so no need to bother with an explicit flush call.
+         */
+        if (pcapout->out && pcapout->pktwritten &&
+                trace_flush_output(pcapout->out) < 0) {
             libtrace_err_t err = trace_get_err_output(pcapout->out);
-            logger(LOG_INFO, "OpenLI Mediator: failed to write ETSI CC to pcap for LIID %s: %s", liidspace, err.problem);
+            logger(LOG_INFO,
+                    "OpenLI Mediator: error while flushing pcap trace file: %s",
+                    err.problem);
             trace_destroy_output(pcapout->out);
             pcapout->out = NULL;
-        } else {
-            pcapout->pktwritten += 1;
+            HASH_DELETE(hh, writer->active, pcapout);
+            free(pcapout->liid);
+            free(pcapout);
+            continue;
         }
+        pcapout->pktwritten = 0;
     }
+}
+
+/** Rotate the output files being used by each pcap output.
+ *
+ *  This is done regularly to ensure that there are complete pcap files
+ *  (i.e. with no half-written packets and proper footers) available for the
+ *  user to hand over to LEAs, if they accept pcap output.
+ *
+ *  @param state            The LEA thread state for the pcap thread
+ *  @param writer           The writer thread that owns the outputs
+ */
+static void pcap_rotate_traces(lea_thread_state_t *state,
+        pcap_writer_t *writer) {
+    active_pcap_output_t *pcapout, *tmp;
+
+    HASH_ITER(hh, writer->active, pcapout, tmp) {
+        /* Close the existing output file -- this will also flush any
+         * remaining output and append any appropriate footer to the file.
+         */
+        trace_destroy_output(pcapout->out);
+        pcapout->out = NULL;
+
+        /* Open a new file, which will be named using the current time */
+        if (open_pcap_output_file(state, writer, pcapout) == -1) {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: error while rotating pcap trace file");
 
-exitpcapwrite:
+            if (pcapout->out) {
+                trace_destroy_output(pcapout->out);
+                pcapout->out = NULL;
+            }
+            HASH_DELETE(hh, writer->active, pcapout);
+            free(pcapout->liid);
+            free(pcapout);
+        }
+    }
+}
+
+/** Disables pcap output for a particular LIID, closing any existing open
+ *  file handle.
+ *
+ *  @param writer           The writer thread that is responsible for the LIID
+ *  @param liid             The LIID to disable pcap output for
+ */
+static void pcap_disable_liid(pcap_writer_t *writer, char *liid) {
+
+    active_pcap_output_t *pcapout;
+
+    HASH_FIND(hh, writer->active, liid, strlen(liid), pcapout);
+    if (!pcapout) {
+        return;
+    }
+    logger(LOG_INFO, "OpenLI Mediator: disabling pcap output for LIID '%s'",
+            liid);
+
+    if (pcapout->out) {
+        trace_destroy_output(pcapout->out);
+        pcapout->out = NULL;
+    }
+    HASH_DELETE(hh, writer->active, pcapout);
+    free(pcapout->liid);
+    free(pcapout);
+}
+
+/** Performs all of the jobs that have been given to a writer thread for
+ *  the current round.
+ *
+ *  @param writer           The writer thread
+ */
+static void run_pcap_writer_jobs(pcap_writer_t *writer) {
+
+    lea_thread_state_t *state = writer->owner->leastate;
+    pcap_writer_job_t *job;
+    int i;
+
+    for (i = 0; i < writer->jobcount; i++) {
+        job = &(writer->jobs[i]);
+
+        switch(job->type) {
+            case PCAP_WRITER_JOB_ETSICC:
+                write_etsicc_to_pcap(job->rec, job->reclen, writer);
+                break;
+            case PCAP_WRITER_JOB_RAWIP:
+                write_rawip_to_pcap(job->rec, job->reclen, writer);
+                break;
+            case PCAP_WRITER_JOB_ADD_LIID:
+                if (create_new_pcap_output(state, writer, (char *)job->rec)
+                        == NULL) {
+                    logger(LOG_INFO, "OpenLI Mediator: failed to create new pcap output entity for LIID %s", (char *)job->rec);
+                }
+                break;
+            case PCAP_WRITER_JOB_DISABLE_LIID:
+                pcap_disable_liid(writer, (char *)job->rec);
+                break;
+            case PCAP_WRITER_JOB_FLUSH:
+                pcap_flush_traces(writer);
+                break;
+            case PCAP_WRITER_JOB_ROTATE:
+                pcap_rotate_traces(state, writer);
+                break;
+        }
+    }
+    writer->jobcount = 0;
+}
+
+/** The "main" method for a pcap writer thread.
+ *
+ *  @param params           The writer state for this thread
+ *
+ *  @return NULL when the thread exits (via pthread_join())
+ */
+static void *run_pcap_writer(void *params) {
+
+    pcap_writer_t *writer = (pcap_writer_t *)params;
+    pcap_thread_state_t *pstate = writer->owner;
+    uint64_t round = 0;
+
+    while (1) {
+        pthread_mutex_lock(&(pstate->poolmutex));
+        while (pstate->poolround == round && !pstate->poolhalt) {
+            pthread_cond_wait(&(pstate->poolstart), &(pstate->poolmutex));
+        }
+        if (pstate->poolhalt) {
+            pthread_mutex_unlock(&(pstate->poolmutex));
+            break;
+        }
+        round = pstate->poolround;
+        pthread_mutex_unlock(&(pstate->poolmutex));
+
+        run_pcap_writer_jobs(writer);
+
+        pthread_mutex_lock(&(pstate->poolmutex));
+        pstate->poolbusy --;
+        if (pstate->poolbusy == 0) {
+            pthread_cond_signal(&(pstate->pooldone));
+        }
+        pthread_mutex_unlock(&(pstate->poolmutex));
+    }
+
+    halt_pcap_outputs(writer);
+    if (writer->decoder) {
+        wandder_free_etsili_decoder(writer->decoder);
+    }
+    if (writer->packet) {
+        trace_destroy_packet(writer->packet);
+    }
+    pthread_exit(NULL);
+}
+
+/** Starts the pool of pcap writer threads.
+ *
+ *  @param pstate           The pcap-specific state for the pcap thread
+ *  @param count            The number of writer threads to start
+ */
+static void start_pcap_writers(pcap_thread_state_t *pstate, uint32_t count) {
+
+    int i;
+
+    if (count == 0) {
+        count = 1;
+    }
+
+    pthread_mutex_init(&(pstate->poolmutex), NULL);
+    pthread_cond_init(&(pstate->poolstart), NULL);
+    pthread_cond_init(&(pstate->pooldone), NULL);
+    pstate->poolround = 0;
+    pstate->poolbusy = 0;
+    pstate->poolhalt = 0;
+    pstate->jobsqueued = 0;
+
+    pstate->writers = (pcap_writer_t *)calloc(count, sizeof(pcap_writer_t));
+    pstate->writercount = count;
+
+    for (i = 0; i < pstate->writercount; i++) {
+        pstate->writers[i].writerid = i;
+        pstate->writers[i].owner = pstate;
+        pthread_create(&(pstate->writers[i].tid), NULL, run_pcap_writer,
+                &(pstate->writers[i]));
+    }
+    logger(LOG_INFO, "OpenLI Mediator: started %d pcap writer thread(s)",
+            pstate->writercount);
+}
+
+/** Stops the pool of pcap writer threads, closing all open pcap files.
+ *
+ *  @param pstate           The pcap-specific state for the pcap thread
+ */
+static void stop_pcap_writers(pcap_thread_state_t *pstate) {
+
+    int i;
+
+    if (pstate->writers == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&(pstate->poolmutex));
+    pstate->poolhalt = 1;
+    pthread_cond_broadcast(&(pstate->poolstart));
+    pthread_mutex_unlock(&(pstate->poolmutex));
+
+    for (i = 0; i < pstate->writercount; i++) {
+        pthread_join(pstate->writers[i].tid, NULL);
+        if (pstate->writers[i].jobs) {
+            free(pstate->writers[i].jobs);
+        }
+    }
+    free(pstate->writers);
+    pstate->writers = NULL;
+
+    pthread_mutex_destroy(&(pstate->poolmutex));
+    pthread_cond_destroy(&(pstate->poolstart));
+    pthread_cond_destroy(&(pstate->pooldone));
+}
+
+/** Finds the writer thread that is responsible for a given LIID.
+ *
+ *  @param pstate           The pcap-specific state for the pcap thread
+ *  @param liid             The LIID
+ *  @param liidlen          The length of the LIID
+ *
+ *  @return the writer that must handle all records for the LIID
+ */
+static pcap_writer_t *pcap_writer_for_liid(pcap_thread_state_t *pstate,
+        const char *liid, size_t liidlen) {
+
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < liidlen; i++) {
+        hash ^= (uint8_t)liid[i];
+        hash *= 16777619u;
+    }
+    return &(pstate->writers[hash % pstate->writercount]);
+}
+
+/** Adds a job to the list of work that a writer thread must do in the
+ *  next round.
+ *
+ *  @param pstate           The pcap-specific state for the pcap thread
+ *  @param writer           The writer to give the job to
+ *  @param type             The type of job
+ *  @param rec              The record (or LIID) that the job applies to
+ *  @param reclen           The length of the record
+ */
+static void queue_pcap_writer_job(pcap_thread_state_t *pstate,
+        pcap_writer_t *writer, pcap_writer_job_type_t type, uint8_t *rec,
+        uint64_t reclen) {
+
+    pcap_writer_job_t *job;
+
+    if (writer->jobcount == writer->jobsalloced) {
+        writer->jobsalloced = writer->jobsalloced ?
+                writer->jobsalloced * 2 : PCAP_CONSUME_BATCH;
+        writer->jobs = (pcap_writer_job_t *)realloc(writer->jobs,
+                writer->jobsalloced * sizeof(pcap_writer_job_t));
+    }
+
+    job = &(writer->jobs[writer->jobcount]);
+    job->type = type;
+    job->rec = rec;
+    job->reclen = reclen;
+    writer->jobcount ++;
+    pstate->jobsqueued ++;
+}
+
+/** Gives every writer thread the same job for the next round.
+ *
+ *  @param pstate           The pcap-specific state for the pcap thread
+ *  @param type             The type of job
+ */
+static void queue_pcap_writer_job_all(pcap_thread_state_t *pstate,
+        pcap_writer_job_type_t type) {
+
+    int i;
+
+    for (i = 0; i < pstate->writercount; i++) {
+        queue_pcap_writer_job(pstate, &(pstate->writers[i]), type, NULL, 0);
+    }
+}
+
+/** Has the writer threads perform all of their queued jobs, and waits for
+ *  them all to finish.
+ *
+ *  @param pstate           The pcap-specific state for the pcap thread
+ */
+static void run_pcap_writer_round(pcap_thread_state_t *pstate) {
+
+    if (pstate->jobsqueued == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&(pstate->poolmutex));
+    pstate->poolbusy = pstate->writercount;
+    pstate->poolround ++;
+    pthread_cond_broadcast(&(pstate->poolstart));
+    while (pstate->poolbusy > 0) {
+        pthread_cond_wait(&(pstate->pooldone), &(pstate->poolmutex));
+    }
+    pthread_mutex_unlock(&(pstate->poolmutex));
+    pstate->jobsqueued = 0;
+}
+
+/** Finds the LIID and length of an ETSI CC record and gives it to the
+ *  writer thread that is responsible for that LIID.
+ *
+ *  @param nextrec          Pointer to the start of the ETSI CC record
+ *  @param bufrem           The amount of readable bytes in the buffer where
+ *                          the ETSI CC record is stored
+ *  @param pstate           The pcap-specific state for this thread
+ *
+ *  @return the length of the ETSI CC record, or 0 if there is a problem
+ *          with the record that prevents it from being written to disk.
+ */
+static uint32_t assign_etsicc_to_writer(uint8_t *nextrec, uint64_t bufrem,
+        pcap_thread_state_t *pstate) {
+
+    uint32_t pdulen;
+    char liidspace[2048];
+    openli_etsicc_fields_t fields;
+
+    if (openli_extract_etsi_ipcc_fields(nextrec, bufrem, &fields)) {
+        queue_pcap_writer_job(pstate, pcap_writer_for_liid(pstate,
+                (const char *)fields.liid, fields.liidlen),
+                PCAP_WRITER_JOB_ETSICC, nextrec, fields.pdulen);
+        return fields.pdulen;
+    }
+
+    if (pstate->decoder == NULL) {
+        pstate->decoder = wandder_create_etsili_decoder();
+    }
+
+    wandder_attach_etsili_buffer(pstate->decoder, nextrec, bufrem, false);
+    pdulen = wandder_etsili_get_pdu_length(pstate->decoder);
+
+    if (pdulen == 0 || pdulen > bufrem) {
+        logger(LOG_INFO, "OpenLI Mediator: pcap thread received an incomplete ETSI CC");
+        return 0;
+    }
+
+    if (wandder_etsili_get_liid(pstate->decoder, liidspace, 2048) == NULL) {
+        logger(LOG_INFO, "OpenLI Mediator: unable to find LIID in ETSI CC received by pcap thread");
+        return 0;
+    }
+
+    queue_pcap_writer_job(pstate,
+            pcap_writer_for_liid(pstate, liidspace, strlen(liidspace)),
+            PCAP_WRITER_JOB_ETSICC, nextrec, pdulen);
     return pdulen;
 }
 
+/** Finds the LIID and length of a raw IP packet record and gives it to the
+ *  writer thread that is responsible for that LIID.
+ *
+ *  @param nextrec          Pointer to the start of the raw IP packet record
+ *  @param bufrem           The amount of readable bytes in the buffer where
+ *                          the raw IP packet record is stored
+ *  @param pstate           The pcap-specific state for this thread
+ *
+ *  @return the number of bytes to advance the buffer to move past the
+ *          raw IP packet record, or 0 if the record is incomplete.
+ */
+static uint32_t assign_rawip_to_writer(uint8_t *nextrec, uint64_t bufrem,
+        pcap_thread_state_t *pstate) {
+
+    uint32_t pdulen;
+    unsigned char liidspace[2048];
+    uint16_t liidlen;
+
+    /* The raw IP packet record begins with a four-byte size field, which is
+     * the size of the record (not including the size field itself)
+     */
+    pdulen = *(uint32_t *)nextrec;
+
+    if (pdulen == 0) {
+        return sizeof(uint32_t);
+    }
+
+    if (pdulen + sizeof(uint32_t) > bufrem) {
+        logger(LOG_INFO, "OpenLI Mediator: pcap thread received an incomplete raw IP packet");
+        return 0;
+    }
+
+    extract_liid_from_exported_msg(nextrec + sizeof(uint32_t), pdulen,
+            liidspace, 2048, &liidlen);
+
+    queue_pcap_writer_job(pstate,
+            pcap_writer_for_liid(pstate, (const char *)liidspace,
+                    strlen((const char *)liidspace)),
+            PCAP_WRITER_JOB_RAWIP, nextrec, pdulen + sizeof(uint32_t));
+    return pdulen + sizeof(uint32_t);
+}
+
 /** Reads intercept records from the export buffer, converts them into the
  *  pcap format and writes them into their corresponding pcap output file(s).
  *
@@ -516,36 +975,44 @@ exitpcapwrite:
  */
 static int write_pcap_from_buffered_rmq(handover_t *ho,
         lea_thread_state_t *state, pcap_thread_state_t *pstate) {
-    uint64_t bufrem;
-    uint8_t *nextrec = NULL;
+    uint64_t bufrem, offset = 0;
+    uint8_t *head = NULL;
     uint32_t advance = 0;
-    static int tally = 0;
+    int ret = 0;
 
-    bufrem = get_buffered_amount(&(ho->ho_state->buf));
-    while ((nextrec = get_buffered_head(&(ho->ho_state->buf), &bufrem))) {
-        /* TODO consider limiting the number of records written, so we
-         * don't get stuck in here for a long time?
-         */
-        tally ++;
+    /* Hand each record to the writer for its LIID -- the records stay in
+     * the export buffer until every writer has finished with them.
+     */
+    head = get_buffered_head(&(ho->ho_state->buf), &bufrem);
+    while (head && offset < bufrem) {
         if (ho->handover_type == HANDOVER_HI3) {
-            if ((advance = write_etsicc_to_pcap(nextrec, bufrem, pstate))
-                    == 0) {
-                return -1;
-            }
+            advance = assign_etsicc_to_writer(head + offset, bufrem - offset,
+                    pstate);
         } else if (ho->handover_type == HANDOVER_HI2) {
             /* TODO */
             assert(0);
         } else if (ho->handover_type == HANDOVER_RAWIP) {
-            if ((advance = write_rawip_to_pcap(nextrec, bufrem, pstate))
-                    == 0) {
-                return -1;
-            }
+            advance = assign_rawip_to_writer(head + offset, bufrem - offset,
+                    pstate);
         } else {
             logger(LOG_INFO, "OpenLI Mediator: handover is corrupted in pcap thread");
-            return -1;
+            advance = 0;
         }
 
-        advance_export_buffer_head(&(ho->ho_state->buf), advance);
+        if (advance == 0) {
+            ret = -1;
+            break;
+        }
+        offset += advance;
+    }
+
+    run_pcap_writer_round(pstate);
+    if (offset > 0) {
+        advance_export_buffer_head(&(ho->ho_state->buf), offset);
+    }
+
+    if (ret < 0) {
+        return ret;
     }
 
     if (!ho->ho_state->valid_rmq_ack) {
@@ -582,6 +1049,7 @@ static int consume_pcap_packets(handover_t *ho, lea_thread_state_t *state,
         pcap_thread_state_t *pstate) {
 
     int r;
+    int batch = PCAP_CONSUME_BATCH * pstate->writercount;
 
     if ((r = write_pcap_from_buffered_rmq(ho, state, pstate)) == 1) {
         return 0;
@@ -596,13 +1064,15 @@ static int consume_pcap_packets(handover_t *ho, lea_thread_state_t *state,
     /* if we get here, the buffer is empty so read more messages from RMQ */
     if (ho->handover_type == HANDOVER_HI3) {
         r = consume_mediator_cc_messages(ho->rmq_consumer,
-                &(ho->ho_state->buf), 32, &(ho->ho_state->next_rmq_ack));
+                &(ho->ho_state->buf), batch, &(ho->ho_state->next_rmq_ack),
+                NULL);
     } else if (ho->handover_type == HANDOVER_RAWIP) {
         r = consume_mediator_rawip_messages(ho->rmq_consumer,
-                &(ho->ho_state->buf), 32, &(ho->ho_state->next_rmq_ack));
+                &(ho->ho_state->buf), batch, &(ho->ho_state->next_rmq_ack));
     } else if (ho->handover_type == HANDOVER_HI2) {
         r = consume_mediator_iri_messages(ho->rmq_consumer,
-                &(ho->ho_state->buf), 32, &(ho->ho_state->next_rmq_ack));
+                &(ho->ho_state->buf), batch, &(ho->ho_state->next_rmq_ack),
+                NULL);
     } else {
         reset_handover_rmq(ho);
         return 0;
@@ -626,101 +1096,6 @@ static int consume_pcap_packets(handover_t *ho, lea_thread_state_t *state,
 
 }
 
-/** Flush any outstanding packets for each active pcap output.
- *
- *  Regular libtrace writes may buffer captured packets for quite some
- *  time before actually writing them to disk, which can lead users to think
- *  that the intercept is not working. Therefore, we regularly trigger
- *  flushing of the pcap outputs to ensure that the file on disk is more
- *  representative of what has been intercepted thus far.
- *
- *  @param pstate           The pcap-specific state for the thread
- */
-static void pcap_flush_traces(pcap_thread_state_t *pstate) {
-    active_pcap_output_t *pcapout, *tmp;
-
-    HASH_ITER(hh, pstate->active, pcapout, tmp) {
-        /* if pktwritten is zero, then no packets have been added since the
-         * last flush so no need to bother with an explicit flush call.
-         */
-        if (pcapout->out && pcapout->pktwritten &&
-                trace_flush_output(pcapout->out) < 0) {
-            libtrace_err_t err = trace_get_err_output(pcapout->out);
-            logger(LOG_INFO,
-                    "OpenLI Mediator: error while flushing pcap trace file: %s",
-                    err.problem);
-            trace_destroy_output(pcapout->out);
-            pcapout->out = NULL;
-            HASH_DELETE(hh, pstate->active, pcapout);
-            free(pcapout->liid);
-            free(pcapout);
-        }
-        pcapout->pktwritten = 0;
-    }
-}
-
-/** Rotate the output files being used by each pcap output.
- *
- *  This is done regularly to ensure that there are complete pcap files
- *  (i.e. with no half-written packets and proper footers) available for the
- *  user to hand over to LEAs, if they accept pcap output.
- *
- *  @param state            The LEA thread state for this thread
- *  @param pstate           The pcap-specific state for the pcap output thread
- */
-static void pcap_rotate_traces(lea_thread_state_t *state,
-        pcap_thread_state_t *pstate) {
-    active_pcap_output_t *pcapout, *tmp;
-
-    HASH_ITER(hh, pstate->active, pcapout, tmp) {
-        /* Close the existing output file -- this will also flush any
-         * remaining output and append any appropriate footer to the file.
-         */
-        trace_destroy_output(pcapout->out);
-        pcapout->out = NULL;
-
-        /* Open a new file, which will be named using the current time */
-        if (open_pcap_output_file(state, pstate, pcapout) == -1) {
-            logger(LOG_INFO,
-                    "OpenLI Mediator: error while rotating pcap trace file");
-
-            if (pcapout->out) {
-                trace_destroy_output(pcapout->out);
-                pcapout->out = NULL;
-            }
-            HASH_DELETE(hh, pstate->active, pcapout);
-            free(pcapout->liid);
-            free(pcapout);
-        }
-    }
-}
-
-/** Disables pcap output for a particular LIID, closing any existing open
- *  file handle.
- *
- *  @param pstate           The pcap-specific state for the thread
- *  @param liid             The LIID to disable pcap output for
- */
-static void pcap_disable_liid(pcap_thread_state_t *pstate, char *liid) {
-
-    active_pcap_output_t *pcapout;
-
-    HASH_FIND(hh, pstate->active, liid, strlen(liid), pcapout);
-    if (!pcapout) {
-        return;
-    }
-    logger(LOG_INFO, "OpenLI Mediator: disabling pcap output for LIID '%s'",
-            liid);
-
-    if (pcapout->out) {
-        trace_destroy_output(pcapout->out);
-        pcapout->out = NULL;
-    }
-    HASH_DELETE(hh, pstate->active, pcapout);
-    free(pcapout->liid);
-    free(pcapout);
-}
-
 /** Flush the pcap output file handle for all active pcap intercepts. If
  *  the files are due to be rotated, then do the rotation instead.
  *
@@ -735,10 +1110,11 @@ static void flush_pcap_outputs(lea_thread_state_t *state,
     gettimeofday(&tv, NULL);
     if (tv.tv_sec % (60 * state->pcap_rotate_frequency) < 60) {
         /* Rotation is due */
-        pcap_rotate_traces(state, pstate);
-        return;
+        queue_pcap_writer_job_all(pstate, PCAP_WRITER_JOB_ROTATE);
+    } else {
+        queue_pcap_writer_job_all(pstate, PCAP_WRITER_JOB_FLUSH);
     }
-    pcap_flush_traces(pstate);
+    run_pcap_writer_round(pstate);
 
 }
 
@@ -758,7 +1134,11 @@ static void add_new_pcapdisk_liid(lea_thread_state_t *state,
     if (strcmp(added->agencyid, state->agencyid) != 0) {
         /* This LIID has switched to another agency, so close any
          * existing pcap output and disable the pcap-specific RMQs */
-        pcap_disable_liid(pstate, added->liid);
+        queue_pcap_writer_job(pstate,
+                pcap_writer_for_liid(pstate, added->liid,
+                    strlen(added->liid)),
+                PCAP_WRITER_JOB_DISABLE_LIID, (uint8_t *)added->liid, 0);
+        run_pcap_writer_round(pstate);
         if (purge_lea_liid_mapping(state, added->liid) > 0) {
             if (deregister_mediator_rawip_RMQ_consumer(
                         pstate->rawip_handover->rmq_consumer,
@@ -780,10 +1160,11 @@ static void add_new_pcapdisk_liid(lea_thread_state_t *state,
                         added->liid);
             }
         }
-        if (create_new_pcap_output(state, pstate, added->liid)
-                == NULL) {
-            logger(LOG_INFO, "OpenLI Mediator: failed to create new pcap output entity for LIID %s", added->liid);
-        }
+        queue_pcap_writer_job(pstate,
+                pcap_writer_for_liid(pstate, added->liid,
+                    strlen(added->liid)),
+                PCAP_WRITER_JOB_ADD_LIID, (uint8_t *)added->liid, 0);
+        run_pcap_writer_round(pstate);
     }
 
     free(added->liid);
@@ -953,11 +1334,11 @@ static void *run_pcap_thread(void *params) {
     read_parent_config(state);
 
     /* Initialise pcap-specific state for this thread */
-    pstate.active = NULL;
-    pstate.dirwarned = 0;
     pstate.inqueue = (libtrace_message_queue_t *)params;
+    pstate.leastate = state;
     pstate.decoder = NULL;
-    pstate.packet = NULL;
+    pstate.writers = NULL;
+    start_pcap_writers(&pstate, state->pcap_writers);
     pstate.rawip_handover = create_new_handover(state->epoll_fd, NULL, NULL,
             HANDOVER_RAWIP, 0, 0);
 
@@ -1050,13 +1431,10 @@ static void *run_pcap_thread(void *params) {
     }
 
 threadexit:
-    halt_pcap_outputs(&pstate);
+    stop_pcap_writers(&pstate);
     if (pstate.decoder) {
         wandder_free_etsili_decoder(pstate.decoder);
     }
-    if (pstate.packet) {
-        trace_destroy_packet(pstate.packet);
-    }
     if (pstate.rawip_handover) {
         free_handover(pstate.rawip_handover);
     }
@@ -1094,16 +1472,18 @@ static inline void init_pcapdisk_agency(mediator_agency_t *agency,
  *  main mediator thread.
  *
  *  @param medleas          The list of LEA send threads for the mediator
+ *  @param writers          The number of pcap writer threads to start
  *
  *  @return 1 always.
  */
-int mediator_start_pcap_thread(mediator_lea_t *medleas) {
+int mediator_start_pcap_thread(mediator_lea_t *medleas, uint32_t writers) {
     lea_thread_state_t *pcap = NULL;
     mediator_lea_config_t *config = &(medleas->config);
 
     pcap = (lea_thread_state_t *)calloc(1, sizeof(lea_thread_state_t));
     pcap->parentconfig = config;
     pcap->epoll_fd = epoll_create1(0);
+    pcap->pcap_writers = writers;
 
     /* probably unnecessary, but doesn't hurt */
     pcap->handover_id = medleas->next_handover_id;
@@ -49,25 +49,84 @@ typedef struct active_pcap_output {
     UT_hash_handle hh;
 } active_pcap_output_t;
 
-/** Pcap-specific state for the pcap thread */
-typedef struct pcap_thread_state {
+/** Types of work that can be given to a pcap writer thread */
+typedef enum {
+    /** Write an ETSI CC record to the pcap file for its LIID */
+    PCAP_WRITER_JOB_ETSICC,
+    /** Write a raw IP packet record to the pcap file for its LIID */
+    PCAP_WRITER_JOB_RAWIP,
+    /** Start writing pcap output for an LIID */
+    PCAP_WRITER_JOB_ADD_LIID,
+    /** Stop writing pcap output for an LIID */
+    PCAP_WRITER_JOB_DISABLE_LIID,
+    /** Flush all open pcap files */
+    PCAP_WRITER_JOB_FLUSH,
+    /** Close all open pcap files and start new ones */
+    PCAP_WRITER_JOB_ROTATE,
+} pcap_writer_job_type_t;
+
+/** A single unit of work for a pcap writer thread */
+typedef struct pcap_writer_job {
+    /** The type of work to be done */
+    pcap_writer_job_type_t type;
+
+    /** The record to write, or the LIID (as a string) for LIID jobs */
+    uint8_t *rec;
+
+    /** The length of the record, in bytes */
+    uint64_t reclen;
+} pcap_writer_job_t;
+
+typedef struct pcap_thread_state pcap_thread_state_t;
+
+/** State for a pcap writer thread.
+ *
+ *  Each writer is responsible for the pcap outputs for a subset of the
+ *  LIIDs, so all records for a given LIID are written (and compressed) by
+ *  the same writer, in the order that they were consumed.
+ */
+typedef struct pcap_writer {
+    /** The pthread id number for the writer thread */
+    pthread_t tid;
 
-    /** The queue which this thread will receive messages from the mediator */
-    libtrace_message_queue_t *inqueue;
+    /** The index of this writer within the writer pool */
+    int writerid;
 
-    /** A libtrace packet used to convert raw IP blobs into a usable packet */
-    libtrace_packet_t *packet;
+    /** The pcap thread that owns this writer */
+    pcap_thread_state_t *owner;
+
+    /** Work assigned to this writer for the current round */
+    pcap_writer_job_t *jobs;
+    int jobcount;
+    int jobsalloced;
 
     /** A map of open pcap outputs, one per LIID */
     active_pcap_output_t *active;
 
+    /** A libtrace packet used to convert raw IP blobs into a usable packet */
+    libtrace_packet_t *packet;
+
+    /** A libwandder decoder for extracting the CC contents from ETSI
+     *  records */
+    wandder_etsispec_t *decoder;
+
     /** A flag that indicates whether we have logged an error due to there
      *  being no valid directory configured to write pcaps into
      */
     int dirwarned;
+} pcap_writer_t;
+
+/** Pcap-specific state for the pcap thread */
+struct pcap_thread_state {
 
-    /** A libwandder decoder for converting ETSI-encoded packets into pcap
-     *  formatted packets.
+    /** The queue which this thread will receive messages from the mediator */
+    libtrace_message_queue_t *inqueue;
+
+    /** The LEA send thread state for the pcap thread */
+    lea_thread_state_t *leastate;
+
+    /** A libwandder decoder for finding the LIID and length of each ETSI
+     *  record, so it can be handed to the right writer.
      */
     wandder_etsispec_t *decoder;
 
@@ -76,7 +135,24 @@ typedef struct pcap_thread_state {
      */
     handover_t *rawip_handover;
 
-} pcap_thread_state_t;
+    /** The pool of writer threads, indexed by LIID hash */
+    pcap_writer_t *writers;
+    int writercount;
+
+    /** The total number of jobs queued for the next round */
+    int jobsqueued;
+
+    /** Synchronisation for running a round of jobs on the writer pool --
+     *  the pcap thread waits for every writer to finish the round, so
+     *  writers can safely read the pcap thread's config while they work.
+     */
+    pthread_mutex_t poolmutex;
+    pthread_cond_t poolstart;
+    pthread_cond_t pooldone;
+    uint64_t poolround;
+    int poolbusy;
+    uint8_t poolhalt;
+};
 
 /** Creates and starts the pcap output thread for an OpenLI mediator.
  *
@@ -85,10 +161,11 @@ typedef struct pcap_thread_state {
  *  main mediator thread.
  *
  *  @param medleas          The list of LEA send threads for the mediator
+ *  @param writers          The number of pcap writer threads to start
  *
  *  @return 1 always.
  */
-int mediator_start_pcap_thread(mediator_lea_t *medleas);
+int mediator_start_pcap_thread(mediator_lea_t *medleas, uint32_t writers);
 #endif
 
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -66,9 +66,21 @@ net_buffer_t *create_net_buffer(net_buffer_type_t buftype, int fd, SSL *ssl) {
     nb->fd = fd;
     nb->buftype = buftype;
     nb->ssl = ssl;
+    nb->allow_extlen = 0;
     return nb;
 }
 
+/** Allows a receive buffer to accept records that use the extended length
+ *  header. Should only be called once we have announced
+ *  OPENLI_PROTO_FRAMING_EXTLEN support to the peer -- until then, any such
+ *  record is treated as a bad message.
+ */
+void net_buffer_allow_extlen(net_buffer_t *nb) {
+    if (nb) {
+        nb->allow_extlen = 1;
+    }
+}
+
 void destroy_net_buffer(net_buffer_t *nb) {
     if (nb == NULL) {
         return;
@@ -158,7 +170,7 @@ int construct_netcomm_protocol_header(ii_header_t *newhdr,
         uint32_t contentlen,
         uint16_t msgtype, uint64_t internalid, uint32_t *hdrlen) {
 
-    if (contentlen > 65535) {
+    if (contentlen > OPENLI_PROTO_MAX_BODYLEN) {
         logger(LOG_INFO,
                 "Content of size %u cannot fit in a single netcomm PDU.",
                 contentlen);
@@ -1395,6 +1407,58 @@ int push_ssl_required(net_buffer_t *nb) {
             sizeof(ii_header_t));
 }
 
+/* Framing capabilities are sent by a mediator to each collector that
+ * connects to it (see transmit_framing_caps()). The capability flags are
+ * carried in the internalid field, so the message has no body -- collectors
+ * that predate this message never read from the socket and therefore
+ * never see it.
+ */
+void encode_framing_caps(ii_header_t *hdr, uint64_t caps) {
+    populate_header(hdr, OPENLI_PROTO_FRAMING_CAPS, 0, caps);
+}
+
+int decode_framing_caps(uint8_t *buf, uint32_t len, uint64_t *caps) {
+    ii_header_t *hdr = (ii_header_t *)buf;
+
+    if (len < sizeof(ii_header_t)) {
+        return -1;
+    }
+
+    if (ntohl(hdr->magic) != OPENLI_PROTO_MAGIC ||
+            ntohs(hdr->intercepttype) != OPENLI_PROTO_FRAMING_CAPS) {
+        return -1;
+    }
+
+    *caps = bswap_be_to_host64(hdr->internalid);
+    return 0;
+}
+
+/* Collectors send this message as soon as the mediator has told them its
+ * framing capabilities (so after any TLS handshake), so that the mediator
+ * can tell which of the collector's connections is which (see
+ * transmit_collector_stream()). The stream index and the total number of
+ * streams are carried in the internalid field.
+ */
+int decode_collector_stream(uint8_t *buf, uint32_t len, uint16_t *streamid,
+        uint16_t *streamcount) {
+    ii_header_t *hdr = (ii_header_t *)buf;
+    uint64_t intid;
+
+    if (len < sizeof(ii_header_t)) {
+        return -1;
+    }
+
+    if (ntohl(hdr->magic) != OPENLI_PROTO_MAGIC ||
+            ntohs(hdr->intercepttype) != OPENLI_PROTO_COLLECTOR_STREAM) {
+        return -1;
+    }
+
+    intid = bswap_be_to_host64(hdr->internalid);
+    *streamid = (uint16_t)((intid >> 16) & 0xffff);
+    *streamcount = (uint16_t)(intid & 0xffff);
+    return 0;
+}
+
 
 
 int transmit_net_buffer(net_buffer_t *nb, openli_proto_msgtype_t *err) {
@@ -1456,10 +1520,12 @@ int transmit_net_buffer(net_buffer_t *nb, openli_proto_msgtype_t *err) {
 }
 
 static openli_proto_msgtype_t parse_received_message(net_buffer_t *nb,
-        uint8_t **msgbody, uint16_t *msglen, uint64_t *intid) {
+        uint8_t **msgbody, uint32_t *msglen, uint64_t *intid) {
 
     ii_header_t *hdr;
     openli_proto_msgtype_t rettype;
+    uint32_t hdrlen = sizeof(ii_header_t);
+    uint32_t bodylen;
 
     if (NETBUF_CONTENT_SIZE(nb) < sizeof(ii_header_t)) {
         return OPENLI_PROTO_NO_MESSAGE;
@@ -1467,26 +1533,103 @@ static openli_proto_msgtype_t parse_received_message(net_buffer_t *nb,
 
     hdr = (ii_header_t *)(nb->actptr);
 
-    if (ntohl(hdr->magic) != OPENLI_PROTO_MAGIC) {
+    if (ntohl(hdr->magic) == OPENLI_PROTO_MAGIC) {
+        bodylen = ntohs(hdr->bodylen);
+    } else if (nb->allow_extlen &&
+            ntohl(hdr->magic) == OPENLI_PROTO_MAGIC_EXTLEN) {
+        /* 32 bit body length follows the standard header */
+        hdrlen += sizeof(uint32_t);
+        if (NETBUF_CONTENT_SIZE(nb) < hdrlen) {
+            return OPENLI_PROTO_NO_MESSAGE;
+        }
+        bodylen = ntohl(*(uint32_t *)(nb->actptr + sizeof(ii_header_t)));
+        if (bodylen > OPENLI_PROTO_MAX_EXT_BODYLEN) {
+            dump_buffer_contents((uint8_t *)nb->actptr, 64);
+            return OPENLI_PROTO_INVALID_MESSAGE;
+        }
+    } else {
         dump_buffer_contents((uint8_t *)nb->actptr, 64);
         return OPENLI_PROTO_INVALID_MESSAGE;
     }
 
-    if (NETBUF_CONTENT_SIZE(nb) < sizeof(ii_header_t) + ntohs(hdr->bodylen)) {
+    if (NETBUF_CONTENT_SIZE(nb) < hdrlen + bodylen) {
         return OPENLI_PROTO_NO_MESSAGE;
     }
 
     /* Got a complete message */
-    *msgbody = ((uint8_t *)(nb->actptr)) + sizeof(ii_header_t);
-    *msglen = ntohs(hdr->bodylen);
+    *msgbody = ((uint8_t *)(nb->actptr)) + hdrlen;
+    *msglen = bodylen;
     *intid = bswap_be_to_host64(hdr->internalid);
     rettype = ntohs(hdr->intercepttype);
 
-    nb->actptr += ((*msglen) + sizeof(ii_header_t));
+    nb->actptr += (bodylen + hdrlen);
 
     return rettype;
 }
 
+/** Returns the number of bytes required to hold the incomplete message at
+ *  the front of a receive buffer, or zero if this is not yet known.
+ */
+static uint32_t pending_message_size(net_buffer_t *nb) {
+
+    ii_header_t *hdr = (ii_header_t *)(nb->actptr);
+
+    if (NETBUF_CONTENT_SIZE(nb) < sizeof(ii_header_t)) {
+        return 0;
+    }
+
+    if (nb->allow_extlen && ntohl(hdr->magic) == OPENLI_PROTO_MAGIC_EXTLEN) {
+        if (NETBUF_CONTENT_SIZE(nb) < sizeof(ii_header_t) + sizeof(uint32_t)) {
+            return 0;
+        }
+        return sizeof(ii_header_t) + sizeof(uint32_t) +
+                ntohl(*(uint32_t *)(nb->actptr + sizeof(ii_header_t)));
+    }
+    return sizeof(ii_header_t) + ntohs(hdr->bodylen);
+}
+
+/** Makes room at the end of a receive buffer for the next read.
+ *
+ *  Complete messages are parsed in place, so the only data that ever
+ *  needs to be moved is the tail of a partially received message -- and
+ *  that only happens once we run short of space at the end of the buffer,
+ *  rather than on every read.
+ *
+ *  @return -1 if the buffer could not be grown, 0 otherwise.
+ */
+static int prepare_receive_space(net_buffer_t *nb) {
+
+    int contsize = NETBUF_CONTENT_SIZE(nb);
+    uint32_t needed;
+
+    if (contsize == 0) {
+        /* Everything has been consumed, so just start again from the front */
+        nb->actptr = nb->buf;
+        nb->appendptr = nb->buf;
+    }
+
+    if (NETBUF_SPACE_REM(nb) >= NETBUF_MIN_READ) {
+        needed = pending_message_size(nb);
+        if (nb->actptr + needed <= nb->buf + nb->alloced) {
+            return 0;
+        }
+    }
+
+    if (NETBUF_FRONT_FREE(nb) > 0) {
+        memmove(nb->buf, nb->actptr, contsize);
+        nb->actptr = nb->buf;
+        nb->appendptr = nb->buf + contsize;
+    }
+
+    needed = pending_message_size(nb);
+    while (NETBUF_SPACE_REM(nb) < NETBUF_MIN_READ || needed > nb->alloced) {
+        if (extend_net_buffer(nb, NETBUF_MIN_READ) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 static int decode_tlv(uint8_t *start, uint8_t *end,
         openli_proto_fieldtype_t *t, uint16_t *l, uint8_t **v) {
 
@@ -2259,7 +2402,7 @@ int decode_cease_mediation(uint8_t *msgbody, uint16_t len, char **liid) {
 
 
 openli_proto_msgtype_t receive_net_buffer(net_buffer_t *nb, uint8_t **msgbody,
-        uint16_t *msglen, uint64_t *intid) {
+        uint32_t *msglen, uint64_t *intid) {
 
     openli_proto_msgtype_t rettype;
     int ret;
@@ -2277,11 +2420,12 @@ openli_proto_msgtype_t receive_net_buffer(net_buffer_t *nb, uint8_t **msgbody,
         return rettype;
     }
 
-    /* Not enough data in the buffer for a complete message, read some more. */
-    if (NETBUF_SPACE_REM(nb) < NETBUF_ALLOC_SIZE) {
-        if (extend_net_buffer(nb, NETBUF_ALLOC_SIZE) == -1) {
-            return OPENLI_PROTO_BUFFER_TOO_FULL;
-        }
+    /* Not enough data in the buffer for a complete message, read some more.
+     * Each read fills as much of the buffer as we can, so that a single
+     * call can pull in many records at once.
+     */
+    if (prepare_receive_space(nb) == -1) {
+        return OPENLI_PROTO_BUFFER_TOO_FULL;
     }
 
     if (nb->ssl != NULL){
@@ -2313,7 +2457,7 @@ openli_proto_msgtype_t receive_net_buffer(net_buffer_t *nb, uint8_t **msgbody,
 //inside the netbuffer 
 openli_proto_msgtype_t receive_RMQ_buffer(net_buffer_t *nb, 
         amqp_connection_state_t amqp_state, 
-        uint8_t **msgbody, uint16_t *msglen, uint64_t *intid) {
+        uint8_t **msgbody, uint32_t *msglen, uint64_t *intid) {
 
     amqp_frame_t frame;
     amqp_rpc_reply_t ret;
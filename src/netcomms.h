@@ -36,7 +36,24 @@
 
 #define NETBUF_ALLOC_SIZE (10 * 1024 * 1024)
 
+/* Minimum amount of free space to have at the end of a receive buffer
+ * before reading from the socket */
+#define NETBUF_MIN_READ (1024 * 1024)
+
 #define OPENLI_PROTO_MAGIC 0x5c4c6c5c
+
+/* Records with bodies that are too large for the 16 bit length field in
+ * ii_header_t are sent with this magic instead, a zero bodylen and a 32 bit
+ * body length immediately after the header. Only peers that have announced
+ * OPENLI_PROTO_FRAMING_EXTLEN support will be sent these.
+ */
+#define OPENLI_PROTO_MAGIC_EXTLEN 0x5c4c6c5d
+#define OPENLI_PROTO_MAX_BODYLEN 65535
+#define OPENLI_PROTO_MAX_EXT_BODYLEN (64 * 1024 * 1024)
+
+/* Capabilities that a mediator can advertise to a collector using an
+ * OPENLI_PROTO_FRAMING_CAPS message (in the internalid field) */
+#define OPENLI_PROTO_FRAMING_EXTLEN 0x01
 #define OPENLI_COLLECTOR_MAGIC 0x00180014202042a8
 #define OPENLI_MEDIATOR_MAGIC 0x01153200d6f12905
 
@@ -115,6 +132,8 @@ typedef enum {
     OPENLI_PROTO_ANNOUNCE_EMAIL_TARGET,
     OPENLI_PROTO_WITHDRAW_EMAIL_TARGET,
     OPENLI_PROTO_ANNOUNCE_DEFAULT_EMAIL_COMPRESSION,
+    OPENLI_PROTO_FRAMING_CAPS,
+    OPENLI_PROTO_COLLECTOR_STREAM,
 } openli_proto_msgtype_t;
 
 typedef struct net_buffer {
@@ -125,6 +144,10 @@ typedef struct net_buffer {
     int alloced;
     net_buffer_type_t buftype;
     SSL *ssl;
+    /* Set if the peer may send us records with the extended length header,
+     * i.e. we have told it that we support them. Otherwise, a single bogus
+     * length could make us allocate 64MB for each connection. */
+    uint8_t allow_extlen;
 } net_buffer_t;
 
 typedef enum {
@@ -171,6 +194,7 @@ net_buffer_t *create_net_buffer(net_buffer_type_t buftype, int fd, SSL *ssl);
 int fd_set_nonblock(int fd);
 int fd_set_block(int fd);
 void destroy_net_buffer(net_buffer_t *nb);
+void net_buffer_allow_extlen(net_buffer_t *nb);
 
 int construct_netcomm_protocol_header(ii_header_t *hdr, uint32_t contentlen,
         uint16_t msgtype, uint64_t internalid, uint32_t *hdrlen);
@@ -214,6 +238,10 @@ int push_sip_target_withdrawal_onto_net_buffer(net_buffer_t *nb,
         openli_sip_identity_t *sipid, voipintercept_t *vint);
 int push_nomore_intercepts(net_buffer_t *nb);
 int push_ssl_required(net_buffer_t *nb);
+void encode_framing_caps(ii_header_t *hdr, uint64_t caps);
+int decode_framing_caps(uint8_t *buf, uint32_t len, uint64_t *caps);
+int decode_collector_stream(uint8_t *buf, uint32_t len, uint16_t *streamid,
+        uint16_t *streamcount);
 int transmit_net_buffer(net_buffer_t *nb, openli_proto_msgtype_t *err);
 int push_static_ipranges_removal_onto_net_buffer(net_buffer_t *nb,
         ipintercept_t *ipint, static_ipranges_t *ipr);
@@ -230,9 +258,9 @@ int push_email_target_withdrawal_onto_net_buffer(net_buffer_t *nb,
 
 openli_proto_msgtype_t receive_RMQ_buffer(net_buffer_t *nb,
         amqp_connection_state_t amqp_state, uint8_t **msgbody,
-        uint16_t *msglen, uint64_t *intid);
+        uint32_t *msglen, uint64_t *intid);
 openli_proto_msgtype_t receive_net_buffer(net_buffer_t *nb, uint8_t **msgbody,
-        uint16_t *msglen, uint64_t *intid);
+        uint32_t *msglen, uint64_t *intid);
 int decode_default_email_compression_announcement(uint8_t *msgbody,
         uint16_t len, uint8_t *result);
 int decode_default_radius_announcement(uint8_t *msgbody, uint16_t len,
@@ -0,0 +1,568 @@
+/*
+ *
+ * Copyright (c) 2018 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <microhttpd.h>
+
+#include "openli_metrics.h"
+#include "logger.h"
+#include "util.h"
+
+#if MHD_VERSION < 0x0097002
+#define MHD_RESULT int
+#else
+#define MHD_RESULT enum MHD_Result
+#endif
+
+struct openli_metric_family {
+    char *name;
+    char *help;
+    openli_metric_type_t type;
+
+    double bounds[OPENLI_METRIC_MAX_BUCKETS];
+    int boundcount;
+
+    openli_metric_t *metrics;
+    openli_metric_family_t *next;
+};
+
+typedef struct openli_metrics_refresher {
+    openli_metrics_refresh_cb cb;
+    void *data;
+} openli_metrics_refresher_t;
+
+typedef struct openli_metrics_registry {
+    pthread_mutex_t mutex;
+    uint8_t running;
+
+    openli_metric_family_t *families;
+    openli_metric_family_t *lastfamily;
+
+    openli_metrics_refresher_t refreshers[OPENLI_METRIC_MAX_REFRESHERS];
+    int refreshercount;
+
+    int sockfd;
+    struct MHD_Daemon *daemon;
+} openli_metrics_registry_t;
+
+/* There is only ever one registry per process, so that any thread can
+ * register metrics without needing a handle passed down to it.
+ */
+static openli_metrics_registry_t registry = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .running = 0,
+    .families = NULL,
+    .lastfamily = NULL,
+    .refreshercount = 0,
+    .sockfd = -1,
+    .daemon = NULL,
+};
+
+typedef struct metrics_output {
+    char *buf;
+    size_t used;
+    size_t alloced;
+} metrics_output_t;
+
+const double openli_latency_buckets[OPENLI_LATENCY_BUCKET_COUNT] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+    0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0
+};
+
+static void append_output(metrics_output_t *out, const char *fmt, ...) {
+    va_list ap;
+    int needed;
+
+    while (1) {
+        va_start(ap, fmt);
+        needed = vsnprintf(out->buf + out->used, out->alloced - out->used,
+                fmt, ap);
+        va_end(ap);
+
+        if (needed < 0) {
+            return;
+        }
+        if (out->used + needed < out->alloced) {
+            out->used += needed;
+            return;
+        }
+
+        out->alloced = (out->alloced * 2) + needed;
+        out->buf = realloc(out->buf, out->alloced);
+    }
+}
+
+static void render_metric(metrics_output_t *out, openli_metric_family_t *fam,
+        openli_metric_t *m) {
+
+    int i;
+    uint64_t cumulative = 0;
+    const char *sep = (m->labels && m->labels[0] != '\0') ? "," : "";
+    const char *labels = m->labels ? m->labels : "";
+
+    pthread_mutex_lock(&(m->mutex));
+    if (fam->type != OPENLI_METRIC_HISTOGRAM) {
+        if (labels[0] != '\0') {
+            append_output(out, "%s{%s} %.17g\n", fam->name, labels,
+                    m->value);
+        } else {
+            append_output(out, "%s %.17g\n", fam->name, m->value);
+        }
+        pthread_mutex_unlock(&(m->mutex));
+        return;
+    }
+
+    for (i = 0; i < fam->boundcount; i++) {
+        cumulative += m->buckets[i];
+        append_output(out, "%s_bucket{%s%sle=\"%g\"} %lu\n", fam->name,
+                labels, sep, fam->bounds[i], cumulative);
+    }
+    cumulative += m->buckets[fam->boundcount];
+    append_output(out, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", fam->name,
+            labels, sep, cumulative);
+
+    if (labels[0] != '\0') {
+        append_output(out, "%s_sum{%s} %.17g\n", fam->name, labels, m->sum);
+        append_output(out, "%s_count{%s} %lu\n", fam->name, labels,
+                m->count);
+    } else {
+        append_output(out, "%s_sum %.17g\n", fam->name, m->sum);
+        append_output(out, "%s_count %lu\n", fam->name, m->count);
+    }
+    pthread_mutex_unlock(&(m->mutex));
+}
+
+static char *render_all_metrics(size_t *len) {
+    metrics_output_t out;
+    openli_metric_family_t *fam;
+    openli_metric_t *m;
+    int i;
+    const char *typestr;
+
+    out.alloced = 16384;
+    out.used = 0;
+    out.buf = malloc(out.alloced);
+    out.buf[0] = '\0';
+
+    pthread_mutex_lock(&(registry.mutex));
+    for (i = 0; i < registry.refreshercount; i++) {
+        registry.refreshers[i].cb(registry.refreshers[i].data);
+    }
+
+    for (fam = registry.families; fam != NULL; fam = fam->next) {
+        if (fam->metrics == NULL) {
+            continue;
+        }
+        switch(fam->type) {
+            case OPENLI_METRIC_COUNTER:
+                typestr = "counter";
+                break;
+            case OPENLI_METRIC_GAUGE:
+                typestr = "gauge";
+                break;
+            default:
+                typestr = "histogram";
+                break;
+        }
+
+        append_output(&out, "# HELP %s %s\n", fam->name, fam->help);
+        append_output(&out, "# TYPE %s %s\n", fam->name, typestr);
+        for (m = fam->metrics; m != NULL; m = m->next) {
+            render_metric(&out, fam, m);
+        }
+    }
+    pthread_mutex_unlock(&(registry.mutex));
+
+    *len = out.used;
+    return out.buf;
+}
+
+static MHD_RESULT handle_metrics_request(void *cls,
+        struct MHD_Connection *conn, const char *url, const char *method,
+        const char *version, const char *upload_data,
+        size_t *upload_data_size, void **con_cls) {
+
+    struct MHD_Response *resp;
+    MHD_RESULT ret;
+    char *page;
+    size_t len;
+    static const char *notfound = "Not found\n";
+
+    if (strcmp(method, "GET") != 0) {
+        return MHD_NO;
+    }
+
+    if (strcmp(url, "/metrics") != 0 && strcmp(url, "/") != 0) {
+        resp = MHD_create_response_from_buffer(strlen(notfound),
+                (void *)notfound, MHD_RESPMEM_PERSISTENT);
+        ret = MHD_queue_response(conn, MHD_HTTP_NOT_FOUND, resp);
+        MHD_destroy_response(resp);
+        return ret;
+    }
+
+    page = render_all_metrics(&len);
+    resp = MHD_create_response_from_buffer(len, (void *)page,
+            MHD_RESPMEM_MUST_FREE);
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE,
+            "text/plain; version=0.0.4");
+    ret = MHD_queue_response(conn, MHD_HTTP_OK, resp);
+    MHD_destroy_response(resp);
+    return ret;
+}
+
+int openli_metrics_start(char *addr, char *port) {
+
+    if (registry.running) {
+        return 0;
+    }
+
+    registry.sockfd = create_listener(addr, port, "metrics");
+    if (registry.sockfd == -1) {
+        logger(LOG_INFO, "OpenLI: unable to create listening socket for metrics server on %s:%s",
+                addr ? addr : "*", port);
+        return -1;
+    }
+
+    registry.daemon = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY,
+            0, NULL, NULL, &handle_metrics_request, NULL,
+            MHD_OPTION_LISTEN_SOCKET, registry.sockfd,
+            MHD_OPTION_END);
+
+    if (registry.daemon == NULL) {
+        logger(LOG_INFO, "OpenLI: unable to start metrics server on %s:%s",
+                addr ? addr : "*", port);
+        close(registry.sockfd);
+        registry.sockfd = -1;
+        return -1;
+    }
+
+    pthread_mutex_lock(&(registry.mutex));
+    registry.running = 1;
+    pthread_mutex_unlock(&(registry.mutex));
+
+    logger(LOG_INFO, "OpenLI: metrics are available at http://%s:%s/metrics",
+            addr ? addr : "*", port);
+    return 0;
+}
+
+static void free_metric(openli_metric_t *m) {
+    pthread_mutex_destroy(&(m->mutex));
+    if (m->labels) {
+        free(m->labels);
+    }
+    free(m);
+}
+
+void openli_metrics_stop(void) {
+    openli_metric_family_t *fam, *nextfam;
+    openli_metric_t *m, *nextm;
+
+    if (registry.daemon) {
+        MHD_stop_daemon(registry.daemon);
+        registry.daemon = NULL;
+    }
+    if (registry.sockfd != -1) {
+        close(registry.sockfd);
+        registry.sockfd = -1;
+    }
+
+    pthread_mutex_lock(&(registry.mutex));
+    registry.running = 0;
+    fam = registry.families;
+    while (fam) {
+        nextfam = fam->next;
+        m = fam->metrics;
+        while (m) {
+            nextm = m->next;
+            free_metric(m);
+            m = nextm;
+        }
+        free(fam->name);
+        free(fam->help);
+        free(fam);
+        fam = nextfam;
+    }
+    registry.families = NULL;
+    registry.lastfamily = NULL;
+    registry.refreshercount = 0;
+    pthread_mutex_unlock(&(registry.mutex));
+}
+
+int openli_metrics_enabled(void) {
+    return registry.running;
+}
+
+static char *format_metric_labels(va_list ap) {
+    metrics_output_t out;
+    const char *lname, *lval, *c;
+
+    out.alloced = 128;
+    out.used = 0;
+    out.buf = malloc(out.alloced);
+    out.buf[0] = '\0';
+
+    while ((lname = va_arg(ap, const char *)) != NULL) {
+        lval = va_arg(ap, const char *);
+        if (lval == NULL) {
+            lval = "";
+        }
+
+        append_output(&out, "%s%s=\"", out.used > 0 ? "," : "", lname);
+        for (c = lval; *c != '\0'; c++) {
+            if (*c == '"' || *c == '\\') {
+                append_output(&out, "\\%c", *c);
+            } else if (*c == '\n') {
+                append_output(&out, "\\n");
+            } else {
+                append_output(&out, "%c", *c);
+            }
+        }
+        append_output(&out, "\"");
+    }
+    return out.buf;
+}
+
+static openli_metric_t *add_metric_to_family(openli_metric_type_t type,
+        const char *name, const char *help, const double *bounds,
+        int boundcount, char *labels) {
+
+    openli_metric_family_t *fam;
+    openli_metric_t *m, *last;
+    int i;
+
+    pthread_mutex_lock(&(registry.mutex));
+    if (!registry.running) {
+        pthread_mutex_unlock(&(registry.mutex));
+        free(labels);
+        return NULL;
+    }
+
+    for (fam = registry.families; fam != NULL; fam = fam->next) {
+        if (strcmp(fam->name, name) == 0) {
+            break;
+        }
+    }
+
+    if (fam == NULL) {
+        fam = calloc(1, sizeof(openli_metric_family_t));
+        fam->name = strdup(name);
+        fam->help = strdup(help);
+        fam->type = type;
+        for (i = 0; i < boundcount; i++) {
+            fam->bounds[i] = bounds[i];
+        }
+        fam->boundcount = boundcount;
+
+        if (registry.lastfamily) {
+            registry.lastfamily->next = fam;
+        } else {
+            registry.families = fam;
+        }
+        registry.lastfamily = fam;
+    } else if (fam->type != type) {
+        logger(LOG_INFO, "OpenLI: metric %s has already been registered with a different type", name);
+        pthread_mutex_unlock(&(registry.mutex));
+        free(labels);
+        return NULL;
+    }
+
+    m = calloc(1, sizeof(openli_metric_t));
+    m->family = fam;
+    m->labels = labels;
+    pthread_mutex_init(&(m->mutex), NULL);
+
+    /* Append, so that series are output in registration order */
+    if (fam->metrics == NULL) {
+        fam->metrics = m;
+    } else {
+        last = fam->metrics;
+        while (last->next) {
+            last = last->next;
+        }
+        last->next = m;
+    }
+    pthread_mutex_unlock(&(registry.mutex));
+    return m;
+}
+
+openli_metric_t *openli_metrics_register(openli_metric_type_t type,
+        const char *name, const char *help, ...) {
+
+    va_list ap;
+    char *labels;
+
+    if (!registry.running || type == OPENLI_METRIC_HISTOGRAM) {
+        return NULL;
+    }
+
+    va_start(ap, help);
+    labels = format_metric_labels(ap);
+    va_end(ap);
+
+    return add_metric_to_family(type, name, help, NULL, 0, labels);
+}
+
+openli_metric_t *openli_metrics_register_histogram(const char *name,
+        const char *help, const double *bounds, int boundcount, ...) {
+
+    va_list ap;
+    char *labels;
+
+    if (!registry.running) {
+        return NULL;
+    }
+
+    if (boundcount > OPENLI_METRIC_MAX_BUCKETS) {
+        boundcount = OPENLI_METRIC_MAX_BUCKETS;
+    }
+
+    va_start(ap, boundcount);
+    labels = format_metric_labels(ap);
+    va_end(ap);
+
+    return add_metric_to_family(OPENLI_METRIC_HISTOGRAM, name, help, bounds,
+            boundcount, labels);
+}
+
+void openli_metrics_deregister(openli_metric_t *metric) {
+    openli_metric_family_t *fam;
+    openli_metric_t *m, *prev = NULL;
+
+    if (metric == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&(registry.mutex));
+    fam = metric->family;
+    for (m = fam->metrics; m != NULL; m = m->next) {
+        if (m == metric) {
+            if (prev) {
+                prev->next = m->next;
+            } else {
+                fam->metrics = m->next;
+            }
+            break;
+        }
+        prev = m;
+    }
+    pthread_mutex_unlock(&(registry.mutex));
+
+    free_metric(metric);
+}
+
+int openli_metrics_add_refresher(openli_metrics_refresh_cb cb, void *data) {
+    int ret = 0;
+
+    pthread_mutex_lock(&(registry.mutex));
+    if (registry.refreshercount >= OPENLI_METRIC_MAX_REFRESHERS) {
+        ret = -1;
+    } else {
+        registry.refreshers[registry.refreshercount].cb = cb;
+        registry.refreshers[registry.refreshercount].data = data;
+        registry.refreshercount ++;
+    }
+    pthread_mutex_unlock(&(registry.mutex));
+    return ret;
+}
+
+void openli_metrics_remove_refresher(void *data) {
+    int i, j;
+
+    pthread_mutex_lock(&(registry.mutex));
+    for (i = 0; i < registry.refreshercount; ) {
+        if (registry.refreshers[i].data != data) {
+            i++;
+            continue;
+        }
+        for (j = i + 1; j < registry.refreshercount; j++) {
+            registry.refreshers[j - 1] = registry.refreshers[j];
+        }
+        registry.refreshercount --;
+    }
+    pthread_mutex_unlock(&(registry.mutex));
+}
+
+void openli_metric_inc(openli_metric_t *metric, double amount) {
+    if (metric == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&(metric->mutex));
+    metric->value += amount;
+    pthread_mutex_unlock(&(metric->mutex));
+}
+
+void openli_metric_set(openli_metric_t *metric, double value) {
+    if (metric == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&(metric->mutex));
+    metric->value = value;
+    pthread_mutex_unlock(&(metric->mutex));
+}
+
+void openli_metric_observe(openli_metric_t *metric, double value) {
+    openli_metric_family_t *fam;
+    int i;
+
+    if (metric == NULL) {
+        return;
+    }
+
+    /* bounds never change once the family exists, so no need to hold the
+     * registry lock to read them */
+    fam = metric->family;
+    for (i = 0; i < fam->boundcount; i++) {
+        if (value <= fam->bounds[i]) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&(metric->mutex));
+    metric->buckets[i] ++;
+    metric->count ++;
+    metric->sum += value;
+    pthread_mutex_unlock(&(metric->mutex));
+}
+
+void openli_metric_observe_latency(openli_metric_t *metric, uint64_t startus,
+        uint64_t endus) {
+
+    if (metric == NULL) {
+        return;
+    }
+    if (endus <= startus) {
+        openli_metric_observe(metric, 0.0);
+    } else {
+        openli_metric_observe(metric, (endus - startus) / 1000000.0);
+    }
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,166 @@
+/*
+ *
+ * Copyright (c) 2018 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef OPENLI_METRICS_H_
+#define OPENLI_METRICS_H_
+
+/* Process-wide registry of counters, gauges and histograms that can be
+ * scraped over HTTP in the Prometheus text exposition format.
+ *
+ * Threads register the metrics that they own and then update them
+ * directly. If the metrics server has not been enabled, registration
+ * returns NULL and every update function becomes a no-op, so callers do
+ * not need to check whether metrics are enabled.
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+
+/** Maximum number of upper bounds that a histogram can have (not including
+ *  the implicit +Inf bucket).
+ */
+#define OPENLI_METRIC_MAX_BUCKETS 20
+
+/** Number of upper bounds in openli_latency_buckets */
+#define OPENLI_LATENCY_BUCKET_COUNT 16
+
+/** Standard histogram bucket bounds (in seconds) for latency metrics,
+ *  ranging from 100us to 10s.
+ */
+extern const double openli_latency_buckets[OPENLI_LATENCY_BUCKET_COUNT];
+
+/** Maximum number of refresh callbacks that can be registered */
+#define OPENLI_METRIC_MAX_REFRESHERS 8
+
+typedef enum {
+    OPENLI_METRIC_COUNTER,
+    OPENLI_METRIC_GAUGE,
+    OPENLI_METRIC_HISTOGRAM,
+} openli_metric_type_t;
+
+typedef struct openli_metric_family openli_metric_family_t;
+typedef struct openli_metric openli_metric_t;
+
+/** A single time series, i.e. a metric name plus a specific set of
+ *  label values.
+ */
+struct openli_metric {
+    openli_metric_family_t *family;
+
+    /** Pre-formatted label set, e.g. 'input="eth0",thread="1"' */
+    char *labels;
+
+    pthread_mutex_t mutex;
+
+    /** Current value for counters and gauges */
+    double value;
+
+    /** Histogram state */
+    uint64_t buckets[OPENLI_METRIC_MAX_BUCKETS + 1];
+    uint64_t count;
+    double sum;
+
+    openli_metric_t *next;
+};
+
+/** Callback that is run immediately before each scrape, so that values
+ *  which are cheaper to sample than to track can be updated. Callbacks
+ *  must not register or deregister metrics.
+ */
+typedef void (*openli_metrics_refresh_cb)(void *data);
+
+/** Starts the metrics HTTP server and enables metric registration.
+ *
+ *  @param addr         The address to listen on (NULL for all addresses).
+ *  @param port         The port to listen on.
+ *
+ *  @return -1 if the server could not be started, 0 otherwise.
+ */
+int openli_metrics_start(char *addr, char *port);
+
+/** Stops the metrics HTTP server and frees all registered metrics. */
+void openli_metrics_stop(void);
+
+/** Indicates whether the metrics server is running.
+ *
+ *  @return 1 if metrics are enabled, 0 otherwise.
+ */
+int openli_metrics_enabled(void);
+
+/** Registers a new counter or gauge.
+ *
+ *  The label set is given as a NULL-terminated list of name, value string
+ *  pairs.
+ *
+ *  @param type         Either OPENLI_METRIC_COUNTER or OPENLI_METRIC_GAUGE.
+ *  @param name         The name of the metric.
+ *  @param help         A short description of the metric.
+ *
+ *  @return the new metric, or NULL if metrics are not enabled.
+ */
+openli_metric_t *openli_metrics_register(openli_metric_type_t type,
+        const char *name, const char *help, ...);
+
+/** Registers a new histogram.
+ *
+ *  @param name         The name of the metric.
+ *  @param help         A short description of the metric.
+ *  @param bounds       The upper bounds of each bucket, in ascending order.
+ *  @param boundcount   The number of entries in the bounds array.
+ *
+ *  The label set follows as a NULL-terminated list of name, value pairs.
+ *
+ *  @return the new metric, or NULL if metrics are not enabled.
+ */
+openli_metric_t *openli_metrics_register_histogram(const char *name,
+        const char *help, const double *bounds, int boundcount, ...);
+
+/** Removes a metric from the registry and frees it. The metric must not be
+ *  used again by the caller.
+ */
+void openli_metrics_deregister(openli_metric_t *metric);
+
+/** Adds a callback to be run before each scrape.
+ *
+ *  @return -1 if there is no room for another callback, 0 otherwise.
+ */
+int openli_metrics_add_refresher(openli_metrics_refresh_cb cb, void *data);
+
+/** Removes all refresh callbacks that use the given data pointer. */
+void openli_metrics_remove_refresher(void *data);
+
+void openli_metric_inc(openli_metric_t *metric, double amount);
+void openli_metric_set(openli_metric_t *metric, double value);
+void openli_metric_observe(openli_metric_t *metric, double value);
+
+/** Adds the time between two microsecond timestamps to a latency
+ *  histogram, in seconds. Negative latencies are recorded as zero.
+ */
+void openli_metric_observe_latency(openli_metric_t *metric, uint64_t startus,
+        uint64_t endus);
+
+#endif
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -83,6 +83,10 @@ SSL_CTX * ssl_init(const char *cacertfile, const char *certfile, const char *key
     /* Enforce use of TLSv1_2 */
     SSL_CTX_set_options(ctx, SSL_OP_ALL | SSL_OP_NO_TLSv1 | SSL_OP_NO_TLSv1_1);
 
+    /* Writes that can't complete immediately are retried later from the
+     * export buffer, which may have been reallocated in the meantime */
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
     if (SSL_CTX_load_verify_locations(ctx, cacertfile, "./") != 1){ //TODO this might want to be changed
         logger(LOG_INFO, "OpenLI: SSL CA cert loading {%s} failed", cacertfile);
         SSL_CTX_free(ctx);
@@ -117,12 +121,29 @@ SSL_CTX * ssl_init(const char *cacertfile, const char *certfile, const char *key
     return ctx;
 }
 
+/* Asks OpenSSL to install the negotiated keys into the kernel once a
+ * handshake completes, so that the kernel performs the record encryption.
+ * If the kernel or cipher suite can't support this, OpenSSL silently keeps
+ * doing the encryption in userspace, so no other fallback is needed.
+ */
+static void enable_ssl_ktls(SSL_CTX *ctx) {
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    logger(LOG_INFO, "OpenLI: kernel TLS offload will be used where supported");
+#else
+    logger(LOG_INFO, "OpenLI: kernel TLS offload is not supported by this version of OpenSSL, using userspace TLS instead");
+#endif
+}
+
 int create_ssl_context(openli_ssl_config_t *sslconf) {
 
     if (sslconf->certfile && sslconf->keyfile && sslconf->cacertfile) {
         sslconf->ctx = ssl_init(sslconf->cacertfile, sslconf->certfile,
                 sslconf->keyfile);
         logger(LOG_INFO, "OpenLI: creating new SSL context for TLS sessions");
+        if (sslconf->ctx && sslconf->ktls) {
+            enable_ssl_ktls(sslconf->ctx);
+        }
         return 0;
     }
 
@@ -186,6 +207,49 @@ int listen_ssl_socket(openli_ssl_config_t *sslconf, SSL **ssl, int newfd) {
 
     return OPENLI_SSL_CONNECT_FAILED;
 }
+/** Checks whether record encryption for data sent on a TLS connection has
+ *  been handed over to the kernel. If so, plaintext can be written directly
+ *  to the underlying socket instead of going through SSL_write().
+ *
+ *  @param ssl      The TLS connection to check (must have completed its
+ *                  handshake).
+ *
+ *  @return 1 if kernel TLS is being used for sending, 0 otherwise.
+ */
+int openli_ssl_ktls_send_active(SSL *ssl) {
+#ifdef BIO_get_ktls_send
+    if (ssl == NULL) {
+        return 0;
+    }
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) ? 1 : 0;
+#else
+    return 0;
+#endif
+}
+
+/** Logs whether a newly established TLS connection is using kernel TLS,
+ *  so that operators can tell whether offload actually took effect.
+ *
+ *  @param ssl      The TLS connection that has completed its handshake.
+ *  @param peerdesc A description of the remote peer, for logging.
+ */
+void log_ssl_ktls_state(SSL *ssl, const char *peerdesc) {
+#ifdef SSL_OP_ENABLE_KTLS
+    int rx = 0;
+
+    if (ssl == NULL ||
+            (SSL_get_options(ssl) & SSL_OP_ENABLE_KTLS) == 0) {
+        return;
+    }
+#ifdef BIO_get_ktls_recv
+    rx = BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? 1 : 0;
+#endif
+    logger(LOG_INFO, "OpenLI: TLS connection with %s is using %s encryption for sending and %s encryption for receiving (%s)",
+            peerdesc, openli_ssl_ktls_send_active(ssl) ? "kernel" : "userspace",
+            rx ? "kernel" : "userspace", SSL_get_cipher(ssl));
+#endif
+}
+
 int reload_ssl_config(openli_ssl_config_t *current,
         openli_ssl_config_t *newconf) {
 
@@ -242,6 +306,11 @@ int reload_ssl_config(openli_ssl_config_t *current,
         }
     }
 
+    if (current->ktls != newconf->ktls) {
+        current->ktls = newconf->ktls;
+        changestate = 1;
+    }
+
     if (!changestate) {
         logger(LOG_INFO, "OpenLI: TLS configuration is unchanged.");
         return 0;
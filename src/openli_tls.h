@@ -37,6 +37,9 @@ typedef struct openli_ssl_config {
     char *cacertfile;
     char *certfile;
     SSL_CTX *ctx;
+    /** If non-zero, ask OpenSSL to hand record encryption over to the
+     *  kernel (kTLS) for connections created with this context */
+    uint8_t ktls;
 } openli_ssl_config_t;
 
 enum {
@@ -62,6 +65,8 @@ void free_ssl_config(openli_ssl_config_t *sslconf);
 int reload_ssl_config(openli_ssl_config_t *current,
         openli_ssl_config_t *newconf);
 int listen_ssl_socket(openli_ssl_config_t *sslconf, SSL **ssl, int newfd);
+int openli_ssl_ktls_send_active(SSL *ssl);
+void log_ssl_ktls_state(SSL *ssl, const char *peerdesc);
 
 int load_pem_into_memory(char *pemfile, char **memspace);
 #endif
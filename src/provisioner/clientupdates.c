@@ -177,7 +177,8 @@ int compare_sip_targets(provision_state_t *currstate,
         }
 
 #define SEND_ALL_COLLECTORS_END \
-        if (enable_epoll_write(state, col->client->commev) == -1) { \
+        if (state->holdclientupdates == 0 && \
+                enable_epoll_write(state, col->client->commev) == -1) { \
             if (sock->log_allowed) { \
                 logger(LOG_INFO, \
                         "OpenLI: unable to enable epoll write event for collector %s -- %s", \
@@ -201,7 +202,8 @@ int compare_sip_targets(provision_state_t *currstate,
         }
 
 #define SEND_ALL_MEDIATORS_END \
-        if (enable_epoll_write(state, med->client->commev) == -1) { \
+        if (state->holdclientupdates == 0 && \
+                enable_epoll_write(state, med->client->commev) == -1) { \
             if (sock->log_allowed) { \
                 logger(LOG_INFO, \
                         "OpenLI: unable to enable epoll write event for mediator %u -- %s", \
@@ -213,6 +215,38 @@ int compare_sip_targets(provision_state_t *currstate,
     }
 
 
+/* While client updates are being held, any announcements are still
+ * appended to the outgoing buffer for each client but the write event for
+ * the client socket is not enabled until release_client_updates() is
+ * called. This allows a large set of changes (e.g. a bulk update via the
+ * REST API) to be sent to each client in as few writes as possible, rather
+ * than one message at a time.
+ */
+void hold_client_updates(provision_state_t *state) {
+    state->holdclientupdates = 1;
+}
+
+void release_client_updates(provision_state_t *state) {
+
+    state->holdclientupdates = 0;
+
+    {
+        SEND_ALL_COLLECTORS_BEGIN
+            if (NETBUF_CONTENT_SIZE(sock->outgoing) == 0) {
+                continue;
+            }
+        SEND_ALL_COLLECTORS_END
+    }
+
+    {
+        SEND_ALL_MEDIATORS_BEGIN
+            if (NETBUF_CONTENT_SIZE(sock->outgoing) == 0) {
+                continue;
+            }
+        SEND_ALL_MEDIATORS_END
+    }
+}
+
 int announce_lea_to_mediators(provision_state_t *state,
         prov_agency_t *lea) {
 
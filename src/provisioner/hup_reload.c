@@ -929,6 +929,7 @@ static inline int reload_push_socket_config(provision_state_t *currstate,
     /* TODO this will trigger on a whitespace change */
 
     if (strcmp(newstate->pushport, currstate->pushport) != 0 ||
+            currstate->restapithreads != newstate->restapithreads ||
             (currstate->pushaddr == NULL && newstate->pushaddr != NULL) ||
             (currstate->pushaddr != NULL && newstate->pushaddr == NULL) ||
             (currstate->pushaddr && newstate->pushaddr &&
@@ -952,6 +953,7 @@ static inline int reload_push_socket_config(provision_state_t *currstate,
         }
         currstate->pushport = newstate->pushport;
         newstate->pushport = NULL;
+        currstate->restapithreads = newstate->restapithreads;
         changed = 1;
     }
 
@@ -993,6 +995,7 @@ int reload_provisioner_config(provision_state_t *currstate) {
     int tlschanged = 0;
     int voipoptschanged = 0;
     int restauthchanged = 0;
+    int ret;
     char *target_info;
 
     if (init_prov_state(&newstate, currstate->conffile) == -1) {
@@ -1089,8 +1092,15 @@ int reload_provisioner_config(provision_state_t *currstate) {
         }
     }
 
-    if (reload_intercept_config(currstate, mediatorchanged, clientchanged) < 0)
-    {
+    ret = reload_intercept_config(currstate, mediatorchanged, clientchanged);
+
+    /* Any cached REST API responses may no longer reflect the running
+     * intercept config, even if the reload was only partially successful */
+    pthread_mutex_lock(&(currstate->interceptconf.safelock));
+    currstate->confgeneration ++;
+    pthread_mutex_unlock(&(currstate->interceptconf.safelock));
+
+    if (ret < 0) {
         clear_prov_state(&newstate);
         return -1;
     }
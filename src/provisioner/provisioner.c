@@ -35,6 +35,7 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <sys/epoll.h>
+#include <sys/time.h>
 #include <errno.h>
 #include <libtrace/linked_list.h>
 #include <unistd.h>
@@ -82,9 +83,25 @@ void start_mhd_daemon(provision_state_t *state) {
 
     int fd, off, len;
     char rndseed[8];
+    unsigned int mhdflags = MHD_USE_SELECT_INTERNALLY;
+    unsigned int poolsize = 0;
 
     assert(state->updatesockfd >= 0);
 
+    /* A single select-based thread is plenty for occasional updates, but
+     * if the REST API is being polled regularly by multiple systems then
+     * a pool of epoll-based threads will scale better.
+     */
+    if (state->restapithreads > 1) {
+        if (MHD_is_feature_supported(MHD_FEATURE_EPOLL) == MHD_YES) {
+            mhdflags = OPENLI_MHD_USE_EPOLL;
+        }
+        poolsize = state->restapithreads;
+        logger(LOG_INFO,
+                "OpenLI provisioner: using %u threads for the update socket",
+                poolsize);
+    }
+
     fd = open("/dev/urandom", O_RDONLY);
     if (fd == -1) {
         if (state->restauthenabled == 1) {
@@ -116,7 +133,7 @@ void start_mhd_daemon(provision_state_t *state) {
         }
 
         state->updatedaemon = MHD_start_daemon(
-                MHD_USE_SELECT_INTERNALLY | MHD_USE_SSL,
+                mhdflags | MHD_USE_SSL,
                 0,
                 NULL,
                 NULL,
@@ -124,6 +141,8 @@ void start_mhd_daemon(provision_state_t *state) {
                 state,
                 MHD_OPTION_LISTEN_SOCKET,
                 state->updatesockfd,
+                MHD_OPTION_THREAD_POOL_SIZE,
+                poolsize,
                 MHD_OPTION_NOTIFY_COMPLETED,
                 &complete_update_request,
                 state,
@@ -140,7 +159,7 @@ void start_mhd_daemon(provision_state_t *state) {
     }
 
 startnotls:
-    state->updatedaemon = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY,
+    state->updatedaemon = MHD_start_daemon(mhdflags,
             0,
             NULL,
             NULL,
@@ -148,6 +167,8 @@ startnotls:
             state,
             MHD_OPTION_LISTEN_SOCKET,
             state->updatesockfd,
+            MHD_OPTION_THREAD_POOL_SIZE,
+            poolsize,
             MHD_OPTION_NOTIFY_COMPLETED,
             &complete_update_request,
             state,
@@ -254,6 +275,7 @@ void free_openli_mediator(openli_mediator_t *med) {
 int init_prov_state(provision_state_t *state, char *configfile) {
 
     sigset_t sigmask;
+    struct timeval tv;
 
     state->conffile = configfile;
     state->interceptconffile = NULL;
@@ -284,6 +306,7 @@ int init_prov_state(provision_state_t *state, char *configfile) {
     state->sslconf.keyfile = NULL;
     state->sslconf.cacertfile = NULL;
     state->sslconf.ctx = NULL;
+    state->sslconf.ktls = 0;
 
     state->key_pem = NULL;
     state->cert_pem = NULL;
@@ -293,6 +316,27 @@ int init_prov_state(provision_state_t *state, char *configfile) {
     state->restauthdbfile = NULL;
     state->restauthkey = NULL;
     state->authdb = NULL;
+    state->holdclientupdates = 0;
+    state->restapithreads = 1;
+    state->confgeneration = 0;
+    gettimeofday(&tv, NULL);
+    state->bootid = (((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec) ^
+            (((uint64_t)getpid()) << 48);
+    state->restcache = NULL;
+    state->restcachegen = 0;
+    pthread_mutex_init(&(state->restcachelock), NULL);
+    state->metricsaddr = NULL;
+    state->metricsport = NULL;
+    state->metric_collectors = NULL;
+    state->metric_mediators = NULL;
+    state->metric_agencies = NULL;
+    state->metric_ipintercepts = NULL;
+    state->metric_voipintercepts = NULL;
+    state->metric_emailintercepts = NULL;
+    state->metric_rest_get = NULL;
+    state->metric_rest_post = NULL;
+    state->metric_rest_delete = NULL;
+    state->metric_rest_other = NULL;
 
     init_intercept_config(&(state->interceptconf));
 
@@ -678,6 +722,8 @@ void clear_prov_state(provision_state_t *state) {
 
     close(state->epoll_fd);
     close_restauth_db(state);
+    free_rest_cache(state);
+    pthread_mutex_destroy(&(state->restcachelock));
 
     if (state->clientfd) {
         close(state->clientfd->fd);
@@ -704,6 +750,12 @@ void clear_prov_state(provision_state_t *state) {
     if (state->pushaddr) {
         free(state->pushaddr);
     }
+    if (state->metricsport) {
+        free(state->metricsport);
+    }
+    if (state->metricsaddr) {
+        free(state->metricsaddr);
+    }
     if (state->listenport) {
         free(state->listenport);
     }
@@ -1140,7 +1192,7 @@ static int receive_collector(provision_state_t *state, prov_epoll_ev_t *pev) {
 
     prov_sock_state_t *cs = (prov_sock_state_t *)(pev->client->state);
     uint8_t *msgbody;
-    uint16_t msglen;
+    uint32_t msglen;
     uint64_t internalid;
     openli_proto_msgtype_t msgtype;
     uint8_t justauthed = 0;
@@ -1208,7 +1260,7 @@ static int receive_collector(provision_state_t *state, prov_epoll_ev_t *pev) {
 static int receive_mediator(provision_state_t *state, prov_epoll_ev_t *pev) {
     prov_sock_state_t *cs = (prov_sock_state_t *)(pev->client->state);
     uint8_t *msgbody;
-    uint16_t msglen;
+    uint32_t msglen;
     uint64_t internalid;
     openli_proto_msgtype_t msgtype;
     uint8_t justauthed = 0;
@@ -1785,6 +1837,94 @@ static int check_epoll_fd(provision_state_t *state, struct epoll_event *ev) {
 
 }
 
+static void register_provisioner_metrics(provision_state_t *state) {
+
+    if (!openli_metrics_enabled()) {
+        return;
+    }
+
+    state->metric_collectors = openli_metrics_register(OPENLI_METRIC_GAUGE,
+            "openli_provisioner_connected_clients",
+            "Clients that are currently connected to the provisioner",
+            "role", "collector", NULL);
+    state->metric_mediators = openli_metrics_register(OPENLI_METRIC_GAUGE,
+            "openli_provisioner_connected_clients",
+            "Clients that are currently connected to the provisioner",
+            "role", "mediator", NULL);
+    state->metric_agencies = openli_metrics_register(OPENLI_METRIC_GAUGE,
+            "openli_provisioner_agencies",
+            "Agencies in the running intercept configuration", NULL);
+    state->metric_ipintercepts = openli_metrics_register(OPENLI_METRIC_GAUGE,
+            "openli_provisioner_intercepts",
+            "Intercepts in the running intercept configuration",
+            "type", "ip", NULL);
+    state->metric_voipintercepts = openli_metrics_register(
+            OPENLI_METRIC_GAUGE, "openli_provisioner_intercepts",
+            "Intercepts in the running intercept configuration",
+            "type", "voip", NULL);
+    state->metric_emailintercepts = openli_metrics_register(
+            OPENLI_METRIC_GAUGE, "openli_provisioner_intercepts",
+            "Intercepts in the running intercept configuration",
+            "type", "email", NULL);
+    state->metric_rest_get = openli_metrics_register(OPENLI_METRIC_COUNTER,
+            "openli_provisioner_rest_requests_total",
+            "Requests received by the REST API, by HTTP method",
+            "method", "GET", NULL);
+    state->metric_rest_post = openli_metrics_register(OPENLI_METRIC_COUNTER,
+            "openli_provisioner_rest_requests_total",
+            "Requests received by the REST API, by HTTP method",
+            "method", "POST", NULL);
+    state->metric_rest_delete = openli_metrics_register(
+            OPENLI_METRIC_COUNTER, "openli_provisioner_rest_requests_total",
+            "Requests received by the REST API, by HTTP method",
+            "method", "DELETE", NULL);
+    state->metric_rest_other = openli_metrics_register(
+            OPENLI_METRIC_COUNTER, "openli_provisioner_rest_requests_total",
+            "Requests received by the REST API, by HTTP method",
+            "method", "other", NULL);
+}
+
+static inline int is_connected_client(prov_client_t *client) {
+    if (client == NULL || client->commev == NULL) {
+        return 0;
+    }
+    return (client->commev->fd != -1);
+}
+
+static void update_provisioner_metrics(provision_state_t *state) {
+
+    prov_collector_t *col, *coltmp;
+    prov_mediator_t *med, *medtmp;
+    int count;
+
+    if (!openli_metrics_enabled()) {
+        return;
+    }
+
+    count = 0;
+    HASH_ITER(hh, state->collectors, col, coltmp) {
+        count += is_connected_client(col->client);
+    }
+    openli_metric_set(state->metric_collectors, count);
+
+    count = 0;
+    HASH_ITER(hh, state->mediators, med, medtmp) {
+        count += is_connected_client(med->client);
+    }
+    openli_metric_set(state->metric_mediators, count);
+
+    pthread_mutex_lock(&(state->interceptconf.safelock));
+    openli_metric_set(state->metric_agencies,
+            HASH_CNT(hh, state->interceptconf.leas));
+    openli_metric_set(state->metric_ipintercepts,
+            HASH_CNT(hh_liid, state->interceptconf.ipintercepts));
+    openli_metric_set(state->metric_voipintercepts,
+            HASH_CNT(hh_liid, state->interceptconf.voipintercepts));
+    openli_metric_set(state->metric_emailintercepts,
+            HASH_CNT(hh_liid, state->interceptconf.emailintercepts));
+    pthread_mutex_unlock(&(state->interceptconf.safelock));
+}
+
 static void run(provision_state_t *state) {
 
     int i, nfds;
@@ -1850,10 +1990,13 @@ static void run(provision_state_t *state) {
 
         close(timerfd);
         state->timerfd->fd = -1;
+
+        update_provisioner_metrics(state);
     }
 
     if (state->updatedaemon) {
         MHD_stop_daemon(state->updatedaemon);
+        state->updatedaemon = NULL;
     }
 
 }
@@ -2010,8 +2153,26 @@ int main(int argc, char *argv[]) {
         logger(LOG_INFO, "OpenLI: warning, update microhttpd server is disabled. Will not be able to receive live updates via REST API.");
     }
 
+    if (provstate.metricsport) {
+        if (openli_metrics_start(provstate.metricsaddr,
+                    provstate.metricsport) < 0) {
+            logger(LOG_INFO, "OpenLI: warning, provisioner metrics will not be available.");
+        } else {
+            register_provisioner_metrics(&provstate);
+        }
+    }
+
     run(&provstate);
 
+    /* run() can return early without stopping the REST API, so make sure
+     * that its threads are gone before the metrics that they update are
+     * freed */
+    if (provstate.updatedaemon) {
+        MHD_stop_daemon(provstate.updatedaemon);
+        provstate.updatedaemon = NULL;
+    }
+    openli_metrics_stop();
+
     remove_all_intercept_timers(provstate.epoll_fd, &(provstate.interceptconf));
     clear_prov_state(&provstate);
 
@@ -40,6 +40,7 @@
 #include "netcomms.h"
 #include "util.h"
 #include "openli_tls.h"
+#include "openli_metrics.h"
 
 #define DEFAULT_INTERCEPT_CONFIG_FILE "/etc/openli/running-intercept-config.yaml"
 
@@ -316,6 +317,51 @@ typedef struct prov_state {
     /** The SSL configuration, including the SSL context pointer */
     openli_ssl_config_t sslconf;
 
+    /** A flag indicating whether announcements to clients are being held
+     *  back until a batch of updates has been applied.
+     */
+    uint8_t holdclientupdates;
+
+    /** The number of threads to use for serving the REST API */
+    int restapithreads;
+
+    /** Incremented whenever the running intercept config is changed, so
+     *  that cached REST API responses can be recognised as stale.
+     */
+    uint64_t confgeneration;
+
+    /** Identifies this run of the provisioner, so that REST API ETags from
+     *  before a restart are not mistaken for ones that were issued after
+     *  confgeneration was reset.
+     */
+    uint64_t bootid;
+
+    /** Serialised responses to recent REST API GET requests */
+    void *restcache;
+
+    /** The value of confgeneration when the REST cache was last valid */
+    uint64_t restcachegen;
+
+    /** A mutex to protect the REST response cache */
+    pthread_mutex_t restcachelock;
+
+    /** The IP address to serve metrics on */
+    char *metricsaddr;
+    /** The port to serve metrics on. If NULL, metrics are disabled */
+    char *metricsport;
+
+    /** Exported metrics (NULL if metrics are disabled) */
+    openli_metric_t *metric_collectors;
+    openli_metric_t *metric_mediators;
+    openli_metric_t *metric_agencies;
+    openli_metric_t *metric_ipintercepts;
+    openli_metric_t *metric_voipintercepts;
+    openli_metric_t *metric_emailintercepts;
+    openli_metric_t *metric_rest_get;
+    openli_metric_t *metric_rest_post;
+    openli_metric_t *metric_rest_delete;
+    openli_metric_t *metric_rest_other;
+
 } provision_state_t;
 
 /** Socket state information for a single client */
@@ -364,6 +410,8 @@ int map_intercepts_to_leas(prov_intercept_conf_t *conf);
 int emit_intercept_config(char *configfile, prov_intercept_conf_t *conf);
 
 /* Implemented in clientupdates.c */
+void hold_client_updates(provision_state_t *state);
+void release_client_updates(provision_state_t *state);
 int compare_sip_targets(provision_state_t *currstate,
         voipintercept_t *existing, voipintercept_t *reload);
 int compare_email_targets(provision_state_t *currstate,
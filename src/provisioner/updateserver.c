@@ -151,6 +151,24 @@ static int send_http_page(struct MHD_Connection *connection, const char *page,
     return ret;
 }
 
+static int send_method_not_allowed(struct MHD_Connection *connection,
+        const char *allowed) {
+
+    int ret;
+    struct MHD_Response *resp;
+
+    resp = MHD_create_response_from_buffer(strlen(unsupported_operation),
+            (void *)unsupported_operation, MHD_RESPMEM_PERSISTENT);
+    if (!resp) {
+        return MHD_NO;
+    }
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, "text/html");
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_ALLOW, allowed);
+    ret = MHD_queue_response(connection, MHD_HTTP_METHOD_NOT_ALLOWED, resp);
+    MHD_destroy_response(resp);
+    return ret;
+}
+
 static int send_json_object(struct MHD_Connection *connection,
         json_object *jobj) {
 
@@ -233,27 +251,11 @@ static inline int extract_target_from_url(update_con_info_t *cinfo,
     return 1;
 }
 
-static int update_configuration_delete(update_con_info_t *cinfo,
-        provision_state_t *state, const char *url) {
+static int apply_configuration_delete(update_con_info_t *cinfo,
+        provision_state_t *state, const char *target) {
 
     int ret = 0;
-    char *urlcopy = strdup(url);
-    char target[4096];
-
-    if ((ret = extract_target_from_url(cinfo, urlcopy, target, 4096, "DELETE"))
-             < 0) {
-        free(urlcopy);
-        return -1;
-    }
-
-    if (ret == 0) {
-        /* no target specified, just return quietly? */
-        free(urlcopy);
-        return ret;
-    }
-    ret = 0;
 
-    pthread_mutex_lock(&(state->interceptconf.safelock));
     switch(cinfo->target) {
         case TARGET_AGENCY:
             ret = remove_agency(cinfo, state, target);
@@ -301,6 +303,31 @@ static int update_configuration_delete(update_con_info_t *cinfo,
             /* deleting this is not sensible either */
             break;
     }
+    return ret;
+}
+
+static int update_configuration_delete(update_con_info_t *cinfo,
+        provision_state_t *state, const char *url) {
+
+    int ret = 0;
+    char *urlcopy = strdup(url);
+    char target[4096];
+
+    if ((ret = extract_target_from_url(cinfo, urlcopy, target, 4096, "DELETE"))
+             < 0) {
+        free(urlcopy);
+        return -1;
+    }
+
+    if (ret == 0) {
+        /* no target specified, just return quietly? */
+        free(urlcopy);
+        return ret;
+    }
+
+    pthread_mutex_lock(&(state->interceptconf.safelock));
+    ret = apply_configuration_delete(cinfo, state, target);
+    state->confgeneration ++;
 
     /* Safe to unlock before emitting, since all accesses should be reads
      * anyway... */
@@ -311,7 +338,7 @@ static int update_configuration_delete(update_con_info_t *cinfo,
 }
 
 static json_object *create_get_response(update_con_info_t *cinfo,
-        provision_state_t *state, const char *url) {
+        provision_state_t *state, const char *url, uint64_t *generation) {
 
     json_object *jobj = NULL;
     int ret = 0;
@@ -331,6 +358,7 @@ static json_object *create_get_response(update_con_info_t *cinfo,
     ret = 0;
 
     pthread_mutex_lock(&(state->interceptconf.safelock));
+    *generation = state->confgeneration;
     switch(cinfo->target) {
         case TARGET_AGENCY:
             jobj = get_agency(cinfo, state, tgtptr);
@@ -382,21 +410,183 @@ static json_object *create_get_response(update_con_info_t *cinfo,
 }
 
 
-static int update_configuration_post(update_con_info_t *cinfo,
-        provision_state_t *state, const char *method) {
+/* Upper bound on the number of distinct URLs that we will cache responses
+ * for, so that requests for many different resources cannot consume
+ * unbounded memory.
+ */
+#define REST_CACHE_MAX_ENTRIES 10000
 
-    int ret = 0;
+/** A serialised response to a previous GET request, which can be re-used
+ *  until the running intercept config changes.
+ */
+typedef struct rest_cache_entry {
+    char *url;
+    char *response;
+    size_t resplen;
+    UT_hash_handle hh;
+} rest_cache_entry_t;
+
+/* Must be called while holding the REST cache lock */
+static void purge_rest_cache(provision_state_t *state) {
+    rest_cache_entry_t *cache = (rest_cache_entry_t *)(state->restcache);
+    rest_cache_entry_t *ent, *tmp;
+
+    HASH_ITER(hh, cache, ent, tmp) {
+        HASH_DELETE(hh, cache, ent);
+        free(ent->url);
+        free(ent->response);
+        free(ent);
+    }
+    state->restcache = NULL;
+}
 
-    if (cinfo->content_type == NULL || strcasecmp(cinfo->content_type,
-                "application/json") != 0) {
-        return -1;
+void free_rest_cache(provision_state_t *state) {
+    pthread_mutex_lock(&(state->restcachelock));
+    purge_rest_cache(state);
+    pthread_mutex_unlock(&(state->restcachelock));
+}
+
+static void add_rest_cache_entry(provision_state_t *state, const char *url,
+        const char *response, uint64_t generation) {
+
+    rest_cache_entry_t *cache, *ent;
+
+    pthread_mutex_lock(&(state->restcachelock));
+    if (generation > state->restcachegen) {
+        purge_rest_cache(state);
+        state->restcachegen = generation;
+    } else if (generation < state->restcachegen) {
+        /* config has changed since this response was created */
+        pthread_mutex_unlock(&(state->restcachelock));
+        return;
     }
 
-    if (!cinfo->jsonbuffer) {
-        return -1;
+    cache = (rest_cache_entry_t *)(state->restcache);
+    HASH_FIND(hh, cache, url, strlen(url), ent);
+    if (ent || HASH_COUNT(cache) >= REST_CACHE_MAX_ENTRIES) {
+        pthread_mutex_unlock(&(state->restcachelock));
+        return;
     }
 
+    ent = calloc(1, sizeof(rest_cache_entry_t));
+    ent->url = strdup(url);
+    ent->response = strdup(response);
+    ent->resplen = strlen(response);
+    HASH_ADD_KEYPTR(hh, cache, ent->url, strlen(ent->url), ent);
+    state->restcache = cache;
+    pthread_mutex_unlock(&(state->restcachelock));
+}
+
+static int send_json_string(struct MHD_Connection *connection,
+        const char *jsonstr, size_t jsonlen, const char *etag) {
+
+    int ret;
+    struct MHD_Response *resp;
+
+    resp = MHD_create_response_from_buffer(jsonlen, (void *)jsonstr,
+            MHD_RESPMEM_MUST_COPY);
+    if (!resp) {
+        return MHD_NO;
+    }
+
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE,
+            "application/json");
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_ETAG, etag);
+    ret = MHD_queue_response(connection, MHD_HTTP_OK, resp);
+    MHD_destroy_response(resp);
+    return ret;
+}
+
+static int send_not_modified(struct MHD_Connection *connection,
+        const char *etag) {
+
+    int ret;
+    struct MHD_Response *resp;
+
+    resp = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_PERSISTENT);
+    if (!resp) {
+        return MHD_NO;
+    }
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_ETAG, etag);
+    ret = MHD_queue_response(connection, MHD_HTTP_NOT_MODIFIED, resp);
+    MHD_destroy_response(resp);
+    return ret;
+}
+
+/* Responses to GET requests are cached (keyed by URL) until the next change
+ * to the running intercept config, so that frequent polling of large
+ * intercept lists does not require the config to be walked and
+ * re-serialised for every request. The config generation (qualified by
+ * an ID for this run of the provisioner, as the generation starts again
+ * from zero after a restart) is also exposed as an ETag so that clients
+ * can avoid fetching unchanged config at all.
+ */
+static inline void format_config_etag(provision_state_t *state,
+        uint64_t generation, char *etag, size_t len) {
+    snprintf(etag, len, "\"%lx-%lu\"", (unsigned long)state->bootid,
+            (unsigned long)generation);
+}
+
+static int respond_to_get_request(struct MHD_Connection *conn,
+        update_con_info_t *cinfo, provision_state_t *state, const char *url) {
+
+    rest_cache_entry_t *cache, *ent;
+    json_object *respjson;
+    const char *jsonstr, *ifnonematch;
+    uint64_t generation;
+    char etag[64];
+    int ret;
+
     pthread_mutex_lock(&(state->interceptconf.safelock));
+    generation = state->confgeneration;
+    pthread_mutex_unlock(&(state->interceptconf.safelock));
+
+    format_config_etag(state, generation, etag, sizeof(etag));
+
+    pthread_mutex_lock(&(state->restcachelock));
+    if (state->restcachegen != generation) {
+        purge_rest_cache(state);
+        state->restcachegen = generation;
+    }
+
+    cache = (rest_cache_entry_t *)(state->restcache);
+    HASH_FIND(hh, cache, url, strlen(url), ent);
+    if (ent) {
+        ifnonematch = MHD_lookup_connection_value(conn, MHD_HEADER_KIND,
+                MHD_HTTP_HEADER_IF_NONE_MATCH);
+        if (ifnonematch && strcmp(ifnonematch, etag) == 0) {
+            ret = send_not_modified(conn, etag);
+        } else {
+            ret = send_json_string(conn, ent->response, ent->resplen, etag);
+        }
+        pthread_mutex_unlock(&(state->restcachelock));
+        return ret;
+    }
+    pthread_mutex_unlock(&(state->restcachelock));
+
+    respjson = create_get_response(cinfo, state, url, &generation);
+    if (respjson == NULL) {
+        return send_json_object(conn, NULL);
+    }
+
+    jsonstr = json_object_to_json_string(respjson);
+    if (!jsonstr) {
+        json_object_put(respjson);
+        return MHD_NO;
+    }
+
+    format_config_etag(state, generation, etag, sizeof(etag));
+    add_rest_cache_entry(state, url, jsonstr, generation);
+    ret = send_json_string(conn, jsonstr, strlen(jsonstr), etag);
+    json_object_put(respjson);
+    return ret;
+}
+
+static int apply_configuration_post(update_con_info_t *cinfo,
+        provision_state_t *state, const char *method) {
+
+    int ret = 0;
+
     switch(cinfo->target) {
         case TARGET_AGENCY:
             if (strcmp(method, "POST") == 0) {
@@ -454,7 +644,505 @@ static int update_configuration_post(update_con_info_t *cinfo,
         case TARGET_OPENLIVERSION:
             break;
     }
+    return ret;
+}
+
+static const char *bulk_target_names[] = {
+    [TARGET_AGENCY] = "agency",
+    [TARGET_SIPSERVER] = "sipserver",
+    [TARGET_RADIUSSERVER] = "radiusserver",
+    [TARGET_IPINTERCEPT] = "ipintercept",
+    [TARGET_VOIPINTERCEPT] = "voipintercept",
+    [TARGET_GTPSERVER] = "gtpserver",
+    [TARGET_DEFAULTRADIUS] = "defaultradius",
+    [TARGET_EMAILINTERCEPT] = "emailintercept",
+    [TARGET_SMTPSERVER] = "smtpserver",
+    [TARGET_IMAPSERVER] = "imapserver",
+    [TARGET_POP3SERVER] = "pop3server",
+    [TARGET_OPTIONS] = "options",
+    [TARGET_OPENLIVERSION] = NULL,
+    [TARGET_BULK] = NULL,
+};
+
+enum {
+    BULK_ACTION_ADD,
+    BULK_ACTION_MODIFY,
+    BULK_ACTION_DELETE,
+};
+
+/** A single operation within a bulk update request */
+typedef struct bulk_update_op {
+    /** The type of operation, e.g. add, modify or delete */
+    int action;
+    /** The type of configuration object that is being changed */
+    int target;
+    /** The identifier (e.g. LIID or agency ID) of the object being changed,
+     *  if the target type has one. Owned by the parsed JSON object. */
+    const char *key;
+    /** The serialised JSON for an add or modify operation */
+    char *jsonbuffer;
+    int jsonlen;
+} bulk_update_op_t;
+
+/** Tracks the state of an intercept or agency part way through a bulk
+ *  update, i.e. once all of the preceding operations in the request have
+ *  been applied, so that each operation can be validated against the
+ *  config that it will actually be applied to.
+ */
+typedef struct bulk_view_entry {
+    /** The LIID or agency ID. Owned by the parsed JSON object. */
+    const char *key;
+    /** Whether the object exists at this point in the request */
+    uint8_t exists;
+    /** The payload encryption method of the intercept at this point */
+    payload_encryption_method_t encrypt;
+    UT_hash_handle hh;
+} bulk_view_entry_t;
+
+static int lookup_bulk_target(const char *name) {
+    int i;
+
+    for (i = 0; i < (int)(sizeof(bulk_target_names) / sizeof(const char *));
+            i++) {
+        if (bulk_target_names[i] && strcmp(name, bulk_target_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static inline int bulk_target_is_intercept(int target) {
+    return (target == TARGET_IPINTERCEPT || target == TARGET_VOIPINTERCEPT ||
+            target == TARGET_EMAILINTERCEPT);
+}
+
+static void free_bulk_operations(bulk_update_op_t *ops, int opcount) {
+    int i;
+
+    if (ops == NULL) {
+        return;
+    }
+    for (i = 0; i < opcount; i++) {
+        if (ops[i].jsonbuffer) {
+            free(ops[i].jsonbuffer);
+        }
+    }
+    free(ops);
+}
+
+static void free_bulk_view(bulk_view_entry_t **view) {
+    bulk_view_entry_t *ent, *tmp;
+
+    HASH_ITER(hh, *view, ent, tmp) {
+        HASH_DELETE(hh, *view, ent);
+        free(ent);
+    }
+}
+
+#define BULK_PARSE_ERROR(idx, ...) \
+    do { \
+        logger(LOG_INFO, \
+                "OpenLI: invalid operation %d in bulk update request", idx); \
+        snprintf(errstr, sizeof(errstr), __VA_ARGS__); \
+        snprintf(cinfo->answerstring, 4096, \
+                "%s <p>Operation %d in bulk update request is invalid: %s %s", \
+                update_failure_page_start, idx, errstr, \
+                update_failure_page_end); \
+        goto bulkparseerr; \
+    } while (0)
+
+static int parse_bulk_operations(update_con_info_t *cinfo,
+        struct json_object *parsed, bulk_update_op_t **opsptr) {
+
+    struct json_object *oplist, *jobj, *action, *target, *data, *id, *key;
+    bulk_update_op_t *ops = NULL, *op;
+    const char *actstr, *tgtstr, *datastr;
+    char errstr[1024];
+    int i, opcount;
+
+    if (!json_object_object_get_ex(parsed, "operations", &oplist) ||
+            json_object_get_type(oplist) != json_type_array) {
+        logger(LOG_INFO, "OpenLI: bulk update requests must include an 'operations' array");
+        snprintf(cinfo->answerstring, 4096,
+                "%s <p>Bulk update requests must include an 'operations' array. %s",
+                update_failure_page_start, update_failure_page_end);
+        return -1;
+    }
+
+    opcount = json_object_array_length(oplist);
+    if (opcount == 0) {
+        *opsptr = NULL;
+        return 0;
+    }
+
+    ops = calloc(opcount, sizeof(bulk_update_op_t));
+    if (ops == NULL) {
+        snprintf(cinfo->answerstring, 4096, "%s %s",
+                update_failure_page_start, update_failure_page_end);
+        cinfo->answercode = MHD_HTTP_INTERNAL_SERVER_ERROR;
+        return -1;
+    }
+
+    for (i = 0; i < opcount; i++) {
+        jobj = json_object_array_get_idx(oplist, i);
+        op = &(ops[i]);
+        key = NULL;
+        data = NULL;
+
+        if (json_object_get_type(jobj) != json_type_object) {
+            BULK_PARSE_ERROR(i, "each operation must be a JSON object.");
+        }
+
+        if (!json_object_object_get_ex(jobj, "action", &action) ||
+                (actstr = json_object_get_string(action)) == NULL) {
+            BULK_PARSE_ERROR(i, "missing 'action'.");
+        }
+
+        if (strcmp(actstr, "add") == 0) {
+            op->action = BULK_ACTION_ADD;
+        } else if (strcmp(actstr, "modify") == 0) {
+            op->action = BULK_ACTION_MODIFY;
+        } else if (strcmp(actstr, "delete") == 0) {
+            op->action = BULK_ACTION_DELETE;
+        } else {
+            BULK_PARSE_ERROR(i, "unknown action '%s'.", actstr);
+        }
+
+        if (!json_object_object_get_ex(jobj, "target", &target) ||
+                (tgtstr = json_object_get_string(target)) == NULL) {
+            BULK_PARSE_ERROR(i, "missing 'target'.");
+        }
+
+        if ((op->target = lookup_bulk_target(tgtstr)) < 0) {
+            BULK_PARSE_ERROR(i, "unsupported target '%s'.", tgtstr);
+        }
+
+        if (op->action == BULK_ACTION_DELETE) {
+            if (op->target == TARGET_OPTIONS) {
+                BULK_PARSE_ERROR(i, "cannot delete '%s'.", tgtstr);
+            }
+            if (!json_object_object_get_ex(jobj, "id", &id) ||
+                    json_object_get_string(id) == NULL) {
+                BULK_PARSE_ERROR(i, "delete operations must include an 'id'.");
+            }
+            key = id;
+        } else {
+            if (!json_object_object_get_ex(jobj, "data", &data) ||
+                    json_object_get_type(data) != json_type_object) {
+                BULK_PARSE_ERROR(i, "%s operations must include a 'data' object.",
+                        actstr);
+            }
+            if (bulk_target_is_intercept(op->target)) {
+                json_object_object_get_ex(data, "liid", &key);
+            } else if (op->target == TARGET_AGENCY) {
+                json_object_object_get_ex(data, "agencyid", &key);
+            }
+
+            datastr = json_object_to_json_string(data);
+            op->jsonbuffer = strdup(datastr);
+            op->jsonlen = strlen(datastr);
+        }
+
+        if (key) {
+            op->key = json_object_get_string(key);
+        }
+
+        if ((bulk_target_is_intercept(op->target) ||
+                op->target == TARGET_AGENCY) && op->key == NULL) {
+            BULK_PARSE_ERROR(i, "missing identifier for %s.", tgtstr);
+        }
+    }
+
+    *opsptr = ops;
+    return opcount;
+
+bulkparseerr:
+    free_bulk_operations(ops, opcount);
+    return -1;
+}
+
+/* Finds the entry for an intercept or agency in the view of the config
+ * partway through a bulk update, creating it from the running config if
+ * no earlier operation in the request has touched that object. Must be
+ * called while holding the intercept config lock.
+ */
+static bulk_view_entry_t *lookup_bulk_view(provision_state_t *state,
+        bulk_view_entry_t **view, int target, const char *key) {
+
+    bulk_view_entry_t *ent = NULL;
+    intercept_common_t *common = NULL;
+    prov_agency_t *lea = NULL;
+
+    HASH_FIND(hh, *view, key, strlen(key), ent);
+    if (ent) {
+        return ent;
+    }
+
+    ent = calloc(1, sizeof(bulk_view_entry_t));
+    ent->key = key;
+    ent->encrypt = OPENLI_PAYLOAD_ENCRYPTION_NONE;
+
+    switch(target) {
+        case TARGET_IPINTERCEPT: {
+            ipintercept_t *ipint;
+            HASH_FIND(hh_liid, state->interceptconf.ipintercepts, key,
+                    strlen(key), ipint);
+            if (ipint) {
+                common = &(ipint->common);
+            }
+            break;
+        }
+        case TARGET_VOIPINTERCEPT: {
+            voipintercept_t *vint;
+            HASH_FIND(hh_liid, state->interceptconf.voipintercepts, key,
+                    strlen(key), vint);
+            if (vint) {
+                common = &(vint->common);
+            }
+            break;
+        }
+        case TARGET_EMAILINTERCEPT: {
+            emailintercept_t *mailint;
+            HASH_FIND(hh_liid, state->interceptconf.emailintercepts, key,
+                    strlen(key), mailint);
+            if (mailint) {
+                common = &(mailint->common);
+            }
+            break;
+        }
+        case TARGET_AGENCY:
+            HASH_FIND(hh, state->interceptconf.leas, key, strlen(key), lea);
+            ent->exists = (lea != NULL);
+            break;
+    }
+
+    if (common) {
+        ent->exists = 1;
+        ent->encrypt = common->encrypt;
+    }
 
+    HASH_ADD_KEYPTR(hh, *view, ent->key, strlen(ent->key), ent);
+    return ent;
+}
+
+static void init_bulk_op_info(update_con_info_t *opinfo,
+        update_con_info_t *cinfo, bulk_update_op_t *op) {
+
+    memset(opinfo, 0, sizeof(update_con_info_t));
+    opinfo->connectiontype = cinfo->connectiontype;
+    opinfo->answercode = MHD_HTTP_OK;
+    opinfo->content_type = cinfo->content_type;
+    opinfo->target = op->target;
+    opinfo->jsonbuffer = op->jsonbuffer;
+    opinfo->jsonlen = op->jsonlen;
+}
+
+/* Strips the page header from an operation's error so that we can embed it
+ * in the response for the whole bulk update.
+ */
+static const char *bulk_error_detail(update_con_info_t *opinfo) {
+    const char *detail = opinfo->answerstring;
+
+    if (strncmp(detail, update_failure_page_start,
+                strlen(update_failure_page_start)) == 0) {
+        return detail + strlen(update_failure_page_start);
+    }
+    return update_failure_page_end;
+}
+
+/* Validates an operation in full, including its JSON, against the view of
+ * the config once all preceding operations in the request have been
+ * applied, and then updates that view to include the operation. Conflicts
+ * (e.g. adding an intercept that already exists) and malformed objects are
+ * therefore caught before any part of the request has been applied. Must
+ * be called while holding the intercept config lock.
+ */
+static int validate_bulk_operation(update_con_info_t *cinfo,
+        provision_state_t *state, bulk_update_op_t *op, int idx,
+        bulk_view_entry_t **views) {
+
+    bulk_view_entry_t *ent = NULL;
+    update_con_info_t opinfo;
+    payload_encryption_method_t encrypt = OPENLI_PAYLOAD_ENCRYPTION_NONE;
+    bool is_new;
+
+    if (bulk_target_is_intercept(op->target) || op->target == TARGET_AGENCY) {
+        ent = lookup_bulk_view(state, &(views[op->target]), op->target,
+                op->key);
+        encrypt = ent->encrypt;
+    }
+
+    /* adding an existing agency just replaces it */
+    if (ent && op->action == BULK_ACTION_ADD && ent->exists &&
+            op->target != TARGET_AGENCY) {
+        snprintf(cinfo->answerstring, 4096,
+                "%s <p>Operation %d in bulk update request adds '%s', which already exists. No changes have been applied. %s",
+                update_failure_page_start, idx, op->key,
+                update_failure_page_end);
+        return -1;
+    }
+
+    if (ent && op->action == BULK_ACTION_DELETE && !ent->exists) {
+        snprintf(cinfo->answerstring, 4096,
+                "%s <p>Operation %d in bulk update request deletes '%s', which does not exist. No changes have been applied. %s",
+                update_failure_page_start, idx, op->key,
+                update_failure_page_end);
+        return -1;
+    }
+
+    if (op->action != BULK_ACTION_DELETE) {
+        /* modifying an object that does not exist will add it instead */
+        is_new = (op->action == BULK_ACTION_ADD || (ent && !ent->exists));
+
+        init_bulk_op_info(&opinfo, cinfo, op);
+        if (validate_update_json(&opinfo, state, op->target, is_new,
+                    &encrypt) < 0) {
+            logger(LOG_INFO,
+                    "OpenLI: invalid operation %d in bulk update request",
+                    idx);
+            snprintf(cinfo->answerstring, 4096,
+                    "%s <p>Operation %d in bulk update request is invalid. No changes have been applied. %s",
+                    update_failure_page_start, idx,
+                    bulk_error_detail(&opinfo));
+            return -1;
+        }
+    }
+
+    if (ent) {
+        ent->exists = (op->action != BULK_ACTION_DELETE);
+        ent->encrypt = encrypt;
+    }
+    return 0;
+}
+
+/* Applies a set of changes to the running intercept config as a single
+ * unit. Every operation is validated in full before any of them are
+ * applied, so an invalid or conflicting operation causes the whole request
+ * to be rejected without changing anything. The config lock is held for the whole batch so no
+ * other update can be interleaved with it, announcements to the collectors
+ * and mediators are flushed once the whole batch has been applied, and
+ * the running config file is only written out once.
+ */
+static int update_configuration_bulk(update_con_info_t *cinfo,
+        provision_state_t *state) {
+
+    struct json_tokener *tknr;
+    struct json_object *parsed = NULL;
+    bulk_update_op_t *ops = NULL;
+    bulk_view_entry_t *views[TARGET_BULK + 1];
+    update_con_info_t opinfo;
+    int opcount, i, ret = 0;
+
+    tknr = json_tokener_new();
+    parsed = json_tokener_parse_ex(tknr, cinfo->jsonbuffer, cinfo->jsonlen);
+    if (parsed == NULL) {
+        logger(LOG_INFO,
+                "OpenLI: unable to parse JSON received over update socket: %s",
+                json_tokener_error_desc(json_tokener_get_error(tknr)));
+        snprintf(cinfo->answerstring, 4096,
+                "%s <p>OpenLI provisioner was unable to parse JSON received over update socket: %s. %s",
+                update_failure_page_start,
+                json_tokener_error_desc(json_tokener_get_error(tknr)),
+                update_failure_page_end);
+        json_tokener_free(tknr);
+        return -1;
+    }
+
+    if ((opcount = parse_bulk_operations(cinfo, parsed, &ops)) <= 0) {
+        json_object_put(parsed);
+        json_tokener_free(tknr);
+        return opcount;
+    }
+
+    memset(views, 0, sizeof(views));
+    pthread_mutex_lock(&(state->interceptconf.safelock));
+    for (i = 0; i < opcount; i++) {
+        if (validate_bulk_operation(cinfo, state, &(ops[i]), i, views) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    for (i = 0; i <= TARGET_BULK; i++) {
+        free_bulk_view(&(views[i]));
+    }
+
+    if (ret < 0) {
+        pthread_mutex_unlock(&(state->interceptconf.safelock));
+        free_bulk_operations(ops, opcount);
+        json_object_put(parsed);
+        json_tokener_free(tknr);
+        return -1;
+    }
+
+    hold_client_updates(state);
+    for (i = 0; i < opcount; i++) {
+        init_bulk_op_info(&opinfo, cinfo, &(ops[i]));
+
+        if (ops[i].action == BULK_ACTION_DELETE) {
+            ret = apply_configuration_delete(&opinfo, state, ops[i].key);
+        } else {
+            ret = apply_configuration_post(&opinfo, state,
+                    ops[i].action == BULK_ACTION_ADD ? "POST" : "PUT");
+        }
+
+        if (ret < 0) {
+            /* Only possible if we have run out of resources (e.g. could
+             * not create an intercept timer), as the operation has
+             * already been validated. Earlier operations cannot be
+             * rolled back, so report exactly how far we got.
+             */
+            logger(LOG_INFO,
+                    "OpenLI: bulk update halted at operation %d -- %d of %d operations were applied",
+                    i, i, opcount);
+            snprintf(cinfo->answerstring, 4096,
+                    "%s <p>Bulk update halted at operation %d (%d of %d operations were applied). %s",
+                    update_failure_page_start, i, i, opcount,
+                    bulk_error_detail(&opinfo));
+            break;
+        }
+    }
+    release_client_updates(state);
+    state->confgeneration ++;
+
+    if (ret >= 0) {
+        logger(LOG_INFO, "OpenLI: applied %d operations via bulk update",
+                opcount);
+        ret = 0;
+    }
+
+    /* Safe to unlock before emitting, since all accesses should be reads
+     * anyway... */
+    pthread_mutex_unlock(&(state->interceptconf.safelock));
+    emit_intercept_config(state->interceptconffile, &(state->interceptconf));
+
+    free_bulk_operations(ops, opcount);
+    json_object_put(parsed);
+    json_tokener_free(tknr);
+    return ret;
+}
+
+static int update_configuration_post(update_con_info_t *cinfo,
+        provision_state_t *state, const char *method) {
+
+    int ret = 0;
+
+    if (cinfo->content_type == NULL || strcasecmp(cinfo->content_type,
+                "application/json") != 0) {
+        return -1;
+    }
+
+    if (!cinfo->jsonbuffer) {
+        return -1;
+    }
+
+    if (cinfo->target == TARGET_BULK) {
+        return update_configuration_bulk(cinfo, state);
+    }
+
+    pthread_mutex_lock(&(state->interceptconf.safelock));
+    ret = apply_configuration_post(cinfo, state, method);
+    state->confgeneration ++;
 
     /* Safe to unlock before emitting, since all accesses should be reads
      * anyway... */
@@ -642,6 +1330,16 @@ MHD_RESULT handle_update_request(void *cls, struct MHD_Connection *conn,
     const char *realm = "provisioner@openli.nz";
 
     if (*con_cls == NULL) {
+        if (strcmp(method, "GET") == 0) {
+            openli_metric_inc(provstate->metric_rest_get, 1);
+        } else if (strcmp(method, "POST") == 0) {
+            openli_metric_inc(provstate->metric_rest_post, 1);
+        } else if (strcmp(method, "DELETE") == 0) {
+            openli_metric_inc(provstate->metric_rest_delete, 1);
+        } else {
+            openli_metric_inc(provstate->metric_rest_other, 1);
+        }
+
         if (provstate->restauthenabled) {
             ret = authenticate_request(provstate, conn, realm);
 
@@ -684,6 +1382,8 @@ MHD_RESULT handle_update_request(void *cls, struct MHD_Connection *conn,
             cinfo->target = TARGET_OPENLIVERSION;
         } else if (strncmp(url, "/options", strlen("/options")) == 0) {
             cinfo->target = TARGET_OPTIONS;
+        } else if (strncmp(url, "/bulk", 5) == 0) {
+            cinfo->target = TARGET_BULK;
         } else {
             free(cinfo);
             return MHD_NO;
@@ -709,18 +1409,16 @@ MHD_RESULT handle_update_request(void *cls, struct MHD_Connection *conn,
         return MHD_YES;
     }
 
+    cinfo = (update_con_info_t *)(*con_cls);
+    if (cinfo->target == TARGET_BULK && strcmp(method, "POST") != 0 &&
+            strcmp(method, "PUT") != 0) {
+        /* there is nothing to fetch or delete at /bulk */
+        return send_method_not_allowed(conn, "POST, PUT");
+    }
 
     if (strcmp(method, "GET") == 0) {
-        json_object *respjson = NULL;
         cinfo = (update_con_info_t *)(*con_cls);
-
-        respjson = create_get_response(cinfo, provstate, url);
-        ret = send_json_object(conn, respjson);
-
-        if (respjson) {
-            json_object_put(respjson);
-        }
-        return ret;
+        return respond_to_get_request(conn, cinfo, provstate, url);
     } else if (strcmp(method, "POST") == 0 || strcmp(method, "PUT") == 0) {
         cinfo = (update_con_info_t *)(*con_cls);
 
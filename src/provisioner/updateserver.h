@@ -37,6 +37,12 @@
 #define MHD_RESULT enum MHD_Result
 #endif
 
+#if MHD_VERSION < 0x00095300
+#define OPENLI_MHD_USE_EPOLL MHD_USE_EPOLL_INTERNALLY
+#else
+#define OPENLI_MHD_USE_EPOLL MHD_USE_EPOLL_INTERNAL_THREAD
+#endif
+
 typedef struct con_info {
     int connectiontype;
     int answercode;
@@ -63,6 +69,7 @@ enum {
     TARGET_POP3SERVER,
     TARGET_OPTIONS,
     TARGET_OPENLIVERSION,
+    TARGET_BULK,
 };
 
 extern const char *update_success_page;
@@ -85,6 +92,7 @@ void complete_update_request(void *cls, struct MHD_Connection *conn,
 
 int init_restauth_db(provision_state_t *state);
 void close_restauth_db(provision_state_t *state);
+void free_rest_cache(provision_state_t *state);
 
 int remove_agency(update_con_info_t *cinfo, provision_state_t *state,
         const char *idstr);
@@ -114,6 +122,14 @@ int modify_emailintercept(update_con_info_t *cinfo, provision_state_t *state);
 int modify_provisioner_options(update_con_info_t *cinfo,
         provision_state_t *state);
 
+/* Checks the JSON for an add (is_new) or modify operation without
+ * changing the running config. For intercepts, 'encrypt' holds the
+ * encryption method of the existing intercept (when modifying) and is
+ * set to the method the intercept will have after the operation.
+ */
+int validate_update_json(update_con_info_t *cinfo, provision_state_t *state,
+        int target, bool is_new, payload_encryption_method_t *encrypt);
+
 struct json_object *get_agency(update_con_info_t *cinfo,
         provision_state_t *state, char *target);
 struct json_object *get_coreservers(update_con_info_t *cinfo,
@@ -347,7 +347,8 @@ static int parse_intercept_common_json(struct json_intercept *jsonp,
         }
 
         /* If we are new, we can just go ahead and add any timers that
-         * we need for this intercept.
+         * we need for this intercept (unless we are only validating the
+         * JSON, in which case epoll_fd will be negative).
          */
         if (timers && (common->tostart_time > 0 || common->toend_time > 0)) {
             gettimeofday(&tv, NULL);
@@ -358,7 +359,8 @@ static int parse_intercept_common_json(struct json_intercept *jsonp,
                 return -1;
             }
 
-            if (common->tostart_time > 0 && common->tostart_time > tv.tv_sec) {
+            if (epoll_fd >= 0 && common->tostart_time > 0 &&
+                    common->tostart_time > tv.tv_sec) {
                 if (add_intercept_timer(epoll_fd, common->tostart_time,
                         tv.tv_sec, timers, PROV_EPOLL_INTERCEPT_START) < 0) {
                     snprintf(cinfo->answerstring, 4096, "unable to create a 'intercept start' timer for intercept %s", common->liid);
@@ -366,7 +368,8 @@ static int parse_intercept_common_json(struct json_intercept *jsonp,
                 }
 
             }
-            if (common->toend_time > 0 && common->toend_time > tv.tv_sec) {
+            if (epoll_fd >= 0 && common->toend_time > 0 &&
+                    common->toend_time > tv.tv_sec) {
                 if (add_intercept_timer(epoll_fd, common->toend_time,
                         tv.tv_sec, timers, PROV_EPOLL_INTERCEPT_HALT) < 0) {
                     snprintf(cinfo->answerstring, 4096, "unable to create a 'intercept end' timer for intercept %s", common->liid);
@@ -2107,5 +2110,288 @@ agencyerr:
     return -1;
 }
 
+static int validate_intercept_json(update_con_info_t *cinfo,
+        provision_state_t *state, struct json_object *parsed, int target,
+        bool is_new, payload_encryption_method_t *encrypt) {
+
+    struct json_intercept ceptjson;
+    ipintercept_t *ipint = NULL;
+    voipintercept_t *vint = NULL;
+    emailintercept_t *mailint = NULL;
+    intercept_common_t *common;
+    payload_encryption_method_t enc;
+    const char *cepttype;
+    int parseerr = 0, r = 0, ret = -1;
+
+    extract_intercept_json_objects(&ceptjson, parsed);
+
+    if (target == TARGET_IPINTERCEPT) {
+        ipint = calloc(1, sizeof(ipintercept_t));
+        ipint->awaitingconfirm = 1;
+        common = &(ipint->common);
+        cepttype = "IP intercept";
+    } else if (target == TARGET_VOIPINTERCEPT) {
+        vint = calloc(1, sizeof(voipintercept_t));
+        vint->awaitingconfirm = 1;
+        vint->targets = libtrace_list_init(sizeof(openli_sip_identity_t *));
+        common = &(vint->common);
+        cepttype = "VOIP intercept";
+    } else {
+        mailint = calloc(1, sizeof(emailintercept_t));
+        mailint->awaitingconfirm = 1;
+        common = &(mailint->common);
+        cepttype = "Email intercept";
+    }
+
+    if (parse_intercept_common_json(&ceptjson, common, cepttype, cinfo,
+            is_new, -1) < 0) {
+        goto validerr;
+    }
+
+    /* Same check as update_intercept_common(), for modifications */
+    if (is_new || common->encrypt != OPENLI_PAYLOAD_ENCRYPTION_NOT_SPECIFIED) {
+        enc = common->encrypt;
+    } else {
+        enc = *encrypt;
+    }
+
+    if (!is_new && enc != OPENLI_PAYLOAD_ENCRYPTION_NONE) {
+        if (common->encryptkey == NULL || strlen(common->encryptkey) == 0) {
+            snprintf(cinfo->answerstring, 4096,
+                    "'encryptionkey' parameter must be set if 'payloadencryption' is set to anything other than 'none'");
+            goto validerr;
+        }
+    }
+
+    if (ipint) {
+        EXTRACT_JSON_STRING_PARAM("user", cepttype, ceptjson.user,
+                ipint->username, &parseerr, is_new);
+        if (parseerr) {
+            goto validerr;
+        }
+        /* ipint is still awaiting confirmation, so no ranges will be
+         * announced to the collectors */
+        if (ceptjson.staticips != NULL && parse_ipintercept_staticips(state,
+                ipint, ceptjson.staticips, cinfo) < 0) {
+            goto validerr;
+        }
+    } else if (vint) {
+        if (ceptjson.siptargets != NULL && (r =
+                parse_voipintercept_siptargets(state, vint,
+                ceptjson.siptargets, cinfo)) < 0) {
+            goto validerr;
+        }
+        if (is_new && r == 0) {
+            snprintf(cinfo->answerstring, 4096,
+                    "%s <p>VOIP intercept %s has been specified without valid SIP targets. %s",
+                    update_failure_page_start, common->liid,
+                    update_failure_page_end);
+            goto validerr;
+        }
+    } else {
+        if (ceptjson.emailtargets != NULL && (r =
+                parse_emailintercept_targets(state, mailint,
+                ceptjson.emailtargets, cinfo)) < 0) {
+            goto validerr;
+        }
+        if (is_new && r == 0) {
+            snprintf(cinfo->answerstring, 4096,
+                    "%s <p>Email intercept %s has been specified without valid target addresses. %s",
+                    update_failure_page_start, common->liid,
+                    update_failure_page_end);
+            goto validerr;
+        }
+    }
+
+    *encrypt = enc;
+    ret = 0;
+
+validerr:
+    free_prov_intercept_data(common, -1);
+    if (ipint) {
+        free_single_ipintercept(ipint);
+    }
+    if (vint) {
+        free_single_voipintercept(vint);
+    }
+    if (mailint) {
+        free_single_emailintercept(mailint);
+    }
+    return ret;
+}
+
+static int validate_agency_json(update_con_info_t *cinfo,
+        struct json_object *parsed, bool is_new) {
+
+    struct json_object *agencyid = NULL;
+    struct json_agency agjson;
+    liagency_t ag;
+    int parseerr = 0;
+
+    memset(&agjson, 0, sizeof(struct json_agency));
+    memset(&ag, 0, sizeof(liagency_t));
+
+    if (!json_object_object_get_ex(parsed, "agencyid", &agencyid) ||
+            json_object_get_string(agencyid) == NULL) {
+        snprintf(cinfo->answerstring, 4096,
+                "%s <p>Agency update socket messages must include an 'agencyid'! %s",
+                update_failure_page_start, update_failure_page_end);
+        return -1;
+    }
+
+    extract_agency_json_objects(&agjson, parsed);
+    EXTRACT_JSON_STRING_PARAM("hi3address", "agency", agjson.hi3addr,
+            ag.hi3_ipstr, &parseerr, is_new);
+    EXTRACT_JSON_STRING_PARAM("hi2address", "agency", agjson.hi2addr,
+            ag.hi2_ipstr, &parseerr, is_new);
+    EXTRACT_JSON_STRING_PARAM("hi3port", "agency", agjson.hi3port,
+            ag.hi3_portstr, &parseerr, is_new);
+    EXTRACT_JSON_STRING_PARAM("hi2port", "agency", agjson.hi2port,
+            ag.hi2_portstr, &parseerr, is_new);
+
+    if (ag.hi3_ipstr) {
+        free(ag.hi3_ipstr);
+    }
+    if (ag.hi2_ipstr) {
+        free(ag.hi2_ipstr);
+    }
+    if (ag.hi3_portstr) {
+        free(ag.hi3_portstr);
+    }
+    if (ag.hi2_portstr) {
+        free(ag.hi2_portstr);
+    }
+    return parseerr ? -1 : 0;
+}
+
+static int validate_coreserver_json(update_con_info_t *cinfo,
+        struct json_object *parsed, uint8_t srvtype) {
+
+    struct json_object *ipaddr = NULL;
+    struct json_object *port = NULL;
+    coreserver_t *cs;
+    char srvstring[1024];
+    int parseerr = 0, ret = 0;
+
+    cs = (coreserver_t *)calloc(1, sizeof(coreserver_t));
+    cs->servertype = srvtype;
+
+    json_object_object_get_ex(parsed, "ipaddress", &(ipaddr));
+    json_object_object_get_ex(parsed, "port", &(port));
+
+    snprintf(srvstring, 1024, "%s server",
+            coreserver_type_to_string(srvtype));
+
+    EXTRACT_JSON_STRING_PARAM("ipaddress", srvstring, ipaddr,
+            cs->ipstr, &parseerr, true);
+    EXTRACT_JSON_STRING_PARAM("port", srvstring, port,
+            cs->portstr, &parseerr, true);
+
+    if (parseerr) {
+        ret = -1;
+    } else if (construct_coreserver_key(cs) == NULL) {
+        snprintf(cinfo->answerstring, 4096,
+                "%s <p>Unable to create %s entity from JSON record provided over update socket. %s",
+                update_failure_page_start, srvstring, update_failure_page_end);
+        ret = -1;
+    }
+
+    free_single_coreserver(cs);
+    return ret;
+}
+
+int validate_update_json(update_con_info_t *cinfo, provision_state_t *state,
+        int target, bool is_new, payload_encryption_method_t *encrypt) {
+
+    struct json_tokener *tknr;
+    struct json_object *parsed = NULL;
+    struct json_object *username = NULL;
+    struct json_prov_options optsjson;
+    char *str = NULL;
+    int parseerr = 0, ret = 0;
+    uint8_t delivcompress;
+
+    tknr = json_tokener_new();
+    parsed = json_tokener_parse_ex(tknr, cinfo->jsonbuffer, cinfo->jsonlen);
+    if (parsed == NULL) {
+        snprintf(cinfo->answerstring, 4096,
+                "%s <p>OpenLI provisioner was unable to parse JSON received over update socket: %s. %s",
+                update_failure_page_start,
+                json_tokener_error_desc(json_tokener_get_error(tknr)),
+                update_failure_page_end);
+        json_tokener_free(tknr);
+        return -1;
+    }
+
+    switch(target) {
+        case TARGET_IPINTERCEPT:
+        case TARGET_VOIPINTERCEPT:
+        case TARGET_EMAILINTERCEPT:
+            ret = validate_intercept_json(cinfo, state, parsed, target,
+                    is_new, encrypt);
+            break;
+        case TARGET_AGENCY:
+            ret = validate_agency_json(cinfo, parsed, is_new);
+            break;
+        case TARGET_SIPSERVER:
+            ret = validate_coreserver_json(cinfo, parsed,
+                    OPENLI_CORE_SERVER_SIP);
+            break;
+        case TARGET_RADIUSSERVER:
+            ret = validate_coreserver_json(cinfo, parsed,
+                    OPENLI_CORE_SERVER_RADIUS);
+            break;
+        case TARGET_GTPSERVER:
+            ret = validate_coreserver_json(cinfo, parsed,
+                    OPENLI_CORE_SERVER_GTP);
+            break;
+        case TARGET_SMTPSERVER:
+            ret = validate_coreserver_json(cinfo, parsed,
+                    OPENLI_CORE_SERVER_SMTP);
+            break;
+        case TARGET_IMAPSERVER:
+            ret = validate_coreserver_json(cinfo, parsed,
+                    OPENLI_CORE_SERVER_IMAP);
+            break;
+        case TARGET_POP3SERVER:
+            ret = validate_coreserver_json(cinfo, parsed,
+                    OPENLI_CORE_SERVER_POP3);
+            break;
+        case TARGET_DEFAULTRADIUS:
+            json_object_object_get_ex(parsed, "username", &(username));
+            EXTRACT_JSON_STRING_PARAM("username", "default RADIUS username",
+                    username, str, &parseerr, true);
+            ret = parseerr ? -1 : 0;
+            break;
+        case TARGET_OPTIONS:
+            memset(&optsjson, 0, sizeof(optsjson));
+            extract_provisioner_options_json_objects(&optsjson, parsed);
+            EXTRACT_JSON_STRING_PARAM("email-defaultdelivercompressed",
+                    "provisioner options", optsjson.defaultemailcompress,
+                    str, &parseerr, false);
+            if (str == NULL) {
+                break;
+            }
+            delivcompress = map_email_decompress_option_string(str);
+            if (delivcompress == OPENLI_EMAILINT_DELIVER_COMPRESSED_NOT_SET ||
+                    delivcompress ==
+                    OPENLI_EMAILINT_DELIVER_COMPRESSED_DEFAULT) {
+                snprintf(cinfo->answerstring, 4096,
+                        "%s <p>Invalid value provided for 'email-defaultemailcompressed' option: %s. %s",
+                        update_failure_page_start, str,
+                        update_failure_page_end);
+                ret = -1;
+            }
+            break;
+    }
+
+    if (str) {
+        free(str);
+    }
+    json_object_put(parsed);
+    json_tokener_free(tknr);
+    return ret;
+}
+
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
 
@@ -37,6 +37,7 @@
 #include <netinet/tcp.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include "logger.h"
 #include "util.h"
@@ -444,6 +445,20 @@ struct addrinfo *populate_addrinfo(char *ipstr, char *portstr,
     return res;
 }
 
+/** Returns the current value of the monotonic clock, in microseconds.
+ *
+ *  Intended for measuring elapsed time (e.g. latencies) rather than
+ *  for timestamping records.
+ */
+uint64_t fetch_current_time_us(void) {
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+        return 0;
+    }
+    return (((uint64_t)ts.tv_sec) * 1000000) + (ts.tv_nsec / 1000);
+}
+
 uint32_t hash_liid(char *liid) {
     return hashlittle(liid, strlen(liid), 1572869);
 }
@@ -528,7 +543,7 @@ char *parse_iprange_string(char *ipr_str) {
  *  @return a pointer to the first character of the extracted LIID.
  */
 char *extract_liid_from_exported_msg(uint8_t *etsimsg,
-        uint16_t msglen, unsigned char *space, int maxspace,
+        uint32_t msglen, unsigned char *space, int maxspace,
         uint16_t *liidlen) {
 
     uint16_t l;
@@ -56,10 +56,11 @@ char *parse_iprange_string(char *ipr_str);
 void openli_copy_ipcontent(libtrace_packet_t *pkt, uint8_t **ipc,
         uint16_t *iplen);
 char *extract_liid_from_exported_msg(uint8_t *etsimsg,
-        uint16_t msglen, unsigned char *space, int maxspace,
+        uint32_t msglen, unsigned char *space, int maxspace,
         uint16_t *liidlen);
 
 uint32_t hash_liid(char *liid);
+uint64_t fetch_current_time_us(void);
 uint32_t hashlittle( const void *key, size_t length, uint32_t initval);
 #endif
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :